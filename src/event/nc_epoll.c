@@ -214,6 +214,7 @@ event_wait(struct evbase *evb, int timeout)
 
     for (;;) {
         nsd = epoll_wait(ep, event, nevent, timeout);
+        nc_msec_update();
         if (nsd > 0) {
             for (i = 0; i < nsd; i++) {
                 struct epoll_event *ev = &evb->event[i];
@@ -279,4 +280,39 @@ event_add_st(struct evbase *evb, int fd)
     return status;
 }
 
+/*
+ * Wait on fd, added by event_add_st, to be writable instead of readable
+ */
+int
+event_add_st_out(struct evbase *evb, int fd)
+{
+    int status;
+    struct epoll_event ev;
+
+    ev.data.fd = fd;
+    ev.events = EPOLLOUT;
+
+    status = epoll_ctl(evb->ep, EPOLL_CTL_MOD, fd, &ev);
+    if (status < 0) {
+        log_error("epoll ctl on e %d sd %d failed: %s", evb->ep, fd,
+                  strerror(errno));
+    }
+
+    return status;
+}
+
+int
+event_del_st(struct evbase *evb, int fd)
+{
+    int status;
+
+    status = epoll_ctl(evb->ep, EPOLL_CTL_DEL, fd, NULL);
+    if (status < 0) {
+        log_error("epoll ctl on e %d sd %d failed: %s", evb->ep, fd,
+                  strerror(errno));
+    }
+
+    return status;
+}
+
 #endif /* NC_HAVE_EPOLL */
@@ -56,5 +56,7 @@ int event_add_conn(struct evbase *evb, struct conn *c);
 int event_del_conn(struct evbase *evb, struct conn *c);
 int event_wait(struct evbase *evb, int timeout);
 int event_add_st(struct evbase *evb, int fd);
+int event_add_st_out(struct evbase *evb, int fd);
+int event_del_st(struct evbase *evb, int fd);
 
 #endif /* _NC_EVENT_H */
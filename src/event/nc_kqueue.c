@@ -222,6 +222,7 @@ event_wait(struct evbase *evb, int timeout)
         evb->n_returned = kevent(kq, evb->changes, evb->n_changes, evb->kevents,
                                  evb->nevent, &ts);
         evb->n_changes = 0;
+        nc_msec_update();
         if (evb->n_returned > 0) {
             for (evb->n_processed = 0; evb->n_processed < evb->n_returned;
                 evb->n_processed++) {
@@ -295,4 +296,54 @@ event_add_st(struct evbase *evb, int fd)
     return 0;
 }
 
+/*
+ * Wait on fd, added by event_add_st, to be writable instead of readable.
+ * The change is made at once, not batched, as any number of descriptors
+ * may switch before the next event_wait; a read filter still batched is
+ * left to wake the loop for nothing
+ */
+int
+event_add_st_out(struct evbase *evb, int fd)
+{
+    struct kevent ev[2], res[2];
+
+    EV_SET(&ev[0], fd, EVFILT_READ, EV_DELETE | EV_RECEIPT, 0, 0, NULL);
+    EV_SET(&ev[1], fd, EVFILT_WRITE, EV_ADD | EV_CLEAR | EV_RECEIPT, 0, 0,
+           NULL);
+
+    if (kevent(evb->kq, ev, 2, res, 2, NULL) < 0) {
+        log_error("kevent on kq %d sd %d failed: %s", evb->kq, fd,
+                  strerror(errno));
+        return -1;
+    }
+
+    /* with EV_RECEIPT, data holds the error of each change, or 0 */
+    if (res[1].data != 0) {
+        errno = (int)res[1].data;
+        log_error("kevent on kq %d sd %d failed: %s", evb->kq, fd,
+                  strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+int
+event_del_st(struct evbase *evb, int fd)
+{
+    struct kevent ev[2], res[2];
+
+    /* fd waits on one of the filters; the error for the other is ignored */
+    EV_SET(&ev[0], fd, EVFILT_READ, EV_DELETE | EV_RECEIPT, 0, 0, NULL);
+    EV_SET(&ev[1], fd, EVFILT_WRITE, EV_DELETE | EV_RECEIPT, 0, 0, NULL);
+
+    if (kevent(evb->kq, ev, 2, res, 2, NULL) < 0) {
+        log_error("kevent on kq %d sd %d failed: %s", evb->kq, fd,
+                  strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
 #endif /* NC_HAVE_KQUEUE */
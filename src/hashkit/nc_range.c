@@ -185,6 +185,71 @@ range_update(struct server_pool *pool)
     return NC_OK;
 }
 
+/*
+ * Return the server c picked for a request on a partition, or, for a read
+ * with replica_max_lag that picked a stale replica, a random one of the
+ * servers that are not stale. Those with the local tag come first, then
+ * those of each failover tag in turn. Reads stay on c when all servers of
+ * the partition are stale
+ */
+static struct continuum *
+range_pick(struct server_pool *pool, struct array *tagged_continuum,
+           struct continuum *c)
+{
+    struct continuum *fresh;
+    struct array *p;
+    struct server *server;
+    uint32_t i, nserver, nfresh, pick;
+    int fo, tag_idx;
+
+    if (pool->replica_max_lag == 0 ||
+        pool->partition_continuum != &pool->r_partition_continuum) {
+        return c;
+    }
+
+    server = array_get(&pool->server, c->index);
+    if (!server->stale) {
+        return c;
+    }
+
+    for (fo = -1; fo < MAX_FAILOVER_TAGS; fo++) {
+        tag_idx = fo < 0 ? pool->tag_idx : pool->fo_tag_idx[fo];
+        if (tag_idx < 0) {
+            continue;
+        }
+
+        p = array_get(tagged_continuum, (uint32_t)tag_idx);
+        nserver = array_n(p);
+
+        nfresh = 0;
+        for (i = 0; i < nserver; i++) {
+            fresh = array_get(p, i);
+            server = array_get(&pool->server, fresh->index);
+            if (!server->stale) {
+                nfresh++;
+            }
+        }
+        if (nfresh == 0) {
+            continue;
+        }
+
+        pick = (uint32_t)random() % nfresh;
+        for (i = 0; i < nserver; i++) {
+            fresh = array_get(p, i);
+            server = array_get(&pool->server, fresh->index);
+            if (server->stale) {
+                continue;
+            }
+            if (pick == 0) {
+                return fresh;
+            }
+            pick--;
+        }
+    }
+
+    return c;
+}
+
 int
 range_dispatch(struct server_pool *pool, struct continuum *continuum, uint32_t ncontinuum, uint32_t hash)
 {
@@ -251,10 +316,11 @@ range_dispatch(struct server_pool *pool, struct continuum *continuum, uint32_t n
 
     /* Random load balancing */
     if (nserver > 1) {
-        c = array_get(p, random() % array_n(p));
+        c = array_get(p, (uint32_t)random() % nserver);
     } else {
         c = array_get(p, 0);
     }
+    c = range_pick(pool, tagged_continuum, c);
 
     log_debug(LOG_VVERB, "dispatch hash %"PRIu32" to index %"PRIu32,
               hash, c->index);
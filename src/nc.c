@@ -38,6 +38,7 @@
 #define NC_STATS_PORT       STATS_PORT
 #define NC_STATS_ADDR       STATS_ADDR
 #define NC_STATS_INTERVAL   STATS_INTERVAL
+#define NC_METRICS_PORT     STATS_METRICS_PORT
 
 #define NC_PID_FILE         NULL
 
@@ -50,6 +51,7 @@ static int show_version;
 static int test_conf;
 static int daemonize;
 static int describe_stats;
+static int bench_msg;
 
 static struct option long_options[] = {
     { "help",           no_argument,        NULL,   'h' },
@@ -63,14 +65,16 @@ static struct option long_options[] = {
     { "stats-port",     required_argument,  NULL,   's' },
     { "stats-interval", required_argument,  NULL,   'i' },
     { "stats-addr",     required_argument,  NULL,   'a' },
+    { "metrics-port",   required_argument,  NULL,   'P' },
     { "pid-file",       required_argument,  NULL,   'p' },
     { "mbuf-size",      required_argument,  NULL,   'm' },
     { "local-tag",      required_argument,  NULL,   'l' },
     { "failover-tags",  required_argument,  NULL,   'f' },
+    { "bench-msg",      required_argument,  NULL,   'B' },
     { NULL,             0,                  NULL,    0  }
 };
 
-static char short_options[] = "hVtdDv:o:c:s:i:a:p:m:l:f:";
+static char short_options[] = "hVtdDv:o:c:s:i:a:P:p:m:l:f:B:";
 
 static rstatus_t
 nc_daemonize(int dump_core)
@@ -196,7 +200,8 @@ nc_show_usage(void)
     log_stderr(
         "Usage: nutcracker [-?hVdDt] [-v verbosity level] [-o output file]" CRLF
         "                  [-c conf file] [-s stats port] [-a stats addr]" CRLF
-        "                  [-i stats interval] [-p pid file] [-m mbuf size]" CRLF
+        "                  [-i stats interval] [-P metrics port]" CRLF
+        "                  [-p pid file] [-m mbuf size] [-B # msgs]" CRLF
         "");
     log_stderr(
         "Options:" CRLF
@@ -212,15 +217,17 @@ nc_show_usage(void)
         "  -s, --stats-port=N     : set stats monitoring port (default: %d)" CRLF
         "  -a, --stats-addr=S     : set stats monitoring ip (default: %s)" CRLF
         "  -i, --stats-interval=N : set stats aggregation interval in msec (default: %d msec)" CRLF
+        "  -P, --metrics-port=N   : set openmetrics port (default: %d)" CRLF
         "  -p, --pid-file=S       : set pid file (default: %s)" CRLF
         "  -m, --mbuf-size=N      : set size of mbuf chunk in bytes (default: %d bytes)" CRLF
         "  -l, --local-tag=S      : set local tag" CRLF
         "  -f, --failover-tags=S  : set failover tags" CRLF
+        "  -B, --bench-msg=N      : time N msg_get/msg_put cycles and exit" CRLF
         "",
         NC_LOG_DEFAULT, NC_LOG_MIN, NC_LOG_MAX,
         NC_LOG_PATH != NULL ? NC_LOG_PATH : "stderr",
         NC_CONF_PATH,
-        NC_STATS_PORT, NC_STATS_ADDR, NC_STATS_INTERVAL,
+        NC_STATS_PORT, NC_STATS_ADDR, NC_STATS_INTERVAL, NC_METRICS_PORT,
         NC_PID_FILE != NULL ? NC_PID_FILE : "off",
         NC_MBUF_SIZE);
 }
@@ -288,6 +295,7 @@ nc_set_default_options(struct instance *nci)
     nci->stats_port = NC_STATS_PORT;
     nci->stats_addr = NC_STATS_ADDR;
     nci->stats_interval = NC_STATS_INTERVAL;
+    nci->metrics_port = NC_METRICS_PORT;
 
     status = nc_gethostname(nci->hostname, NC_MAXHOSTNAMELEN);
     if (status < 0) {
@@ -381,6 +389,21 @@ nc_get_options(int argc, char **argv, struct instance *nci)
             nci->stats_port = (uint16_t)value;
             break;
 
+        case 'P':
+            value = nc_atoi(optarg, strlen(optarg));
+            if (value < 0) {
+                log_stderr("nutcracker: option -P requires a number");
+                return NC_ERROR;
+            }
+            if (value != 0 && !nc_valid_port(value)) {
+                log_stderr("nutcracker: option -P value %d is not a valid "
+                           "port", value);
+                return NC_ERROR;
+            }
+
+            nci->metrics_port = (uint16_t)value;
+            break;
+
         case 'i':
             value = nc_atoi(optarg, strlen(optarg));
             if (value < 0) {
@@ -391,6 +414,16 @@ nc_get_options(int argc, char **argv, struct instance *nci)
             nci->stats_interval = value;
             break;
 
+        case 'B':
+            value = nc_atoi(optarg, strlen(optarg));
+            if (value <= 0) {
+                log_stderr("nutcracker: option -B requires a non-zero number");
+                return NC_ERROR;
+            }
+
+            bench_msg = value;
+            break;
+
         case 'a':
             nci->stats_addr = optarg;
             break;
@@ -428,6 +461,8 @@ nc_get_options(int argc, char **argv, struct instance *nci)
             case 'v':
             case 's':
             case 'i':
+            case 'P':
+            case 'B':
                 log_stderr("nutcracker: option -%c requires a number", optopt);
                 break;
 
@@ -582,6 +617,13 @@ main(int argc, char **argv)
         exit(0);
     }
 
+    if (bench_msg) {
+        msg_init();
+        msg_bench((uint32_t)bench_msg);
+        msg_deinit();
+        exit(0);
+    }
+
     status = nc_pre_run(&nci);
     if (status != NC_OK) {
         nc_post_run(&nci);
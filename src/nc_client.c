@@ -39,6 +39,11 @@ client_ref(struct conn *conn, void *owner)
     pool->nc_conn_q++;
     TAILQ_INSERT_TAIL(&pool->c_conn_q, conn, conn_tqe);
 
+    /* a paused client moving to a downstream pool is resumed from there */
+    if (conn->paused) {
+        pool->npaused++;
+    }
+
     /* owner of the client connection is the server pool */
     conn->owner = owner;
 
@@ -61,6 +66,11 @@ client_unref(struct conn *conn)
     pool->nc_conn_q--;
     TAILQ_REMOVE(&pool->c_conn_q, conn, conn_tqe);
 
+    if (conn->paused) {
+        ASSERT(pool->npaused != 0);
+        pool->npaused--;
+    }
+
     log_debug(LOG_VVERB, "unref conn %p owner %p from pool '%.*s'", conn,
               pool, pool->name.len, pool->name.data);
 }
@@ -124,13 +134,14 @@ client_close(struct context *ctx, struct conn *conn)
 {
     rstatus_t status;
     struct msg *msg, *nmsg; /* current and next message */
+    struct server_pool *pool;
 
     ASSERT(conn->client && !conn->proxy);
 
     client_close_stats(ctx, conn->owner, conn->err, conn->eof);
 
     if (conn->sd < 0) {
-        conn->unref(conn);
+        conn->ops->unref(conn);
         conn_put(conn);
         return;
     }
@@ -152,11 +163,16 @@ client_close(struct context *ctx, struct conn *conn)
     ASSERT(conn->smsg == NULL);
     ASSERT(TAILQ_EMPTY(&conn->imsg_q));
 
+    if (conn->ndelay > 0) {
+        pool = conn->owner;
+        ratelimit_cancel(ctx, pool->ratelimit, conn);
+    }
+
     for (msg = TAILQ_FIRST(&conn->omsg_q); msg != NULL; msg = nmsg) {
         nmsg = TAILQ_NEXT(msg, c_tqe);
 
         /* dequeue the message (request) from client outq */
-        conn->dequeue_outq(ctx, conn, msg);
+        conn->ops->dequeue_outq(ctx, conn, msg);
 
         if (msg->done) {
             log_debug(LOG_INFO, "close c %d discarding %s req %"PRIu64" len "
@@ -177,7 +193,7 @@ client_close(struct context *ctx, struct conn *conn)
     }
     ASSERT(TAILQ_EMPTY(&conn->omsg_q));
 
-    conn->unref(conn);
+    conn->ops->unref(conn);
 
     status = close(conn->sd);
     if (status < 0) {
@@ -42,6 +42,13 @@ static struct string dist_strings[] = {
 };
 #undef DEFINE_ACTION
 
+#define DEFINE_ACTION(_action, _name) string(#_name),
+static struct string ratelimit_action_strings[] = {
+    RATELIMIT_ACTION_CODEC( DEFINE_ACTION )
+    null_string
+};
+#undef DEFINE_ACTION
+
 static struct command conf_commands[] = {
     { string("listen"),
       conf_set_listen,
@@ -63,6 +70,10 @@ static struct command conf_commands[] = {
       conf_set_num,
       offsetof(struct conf_pool, timeout) },
 
+    { string("timeout_close"),
+      conf_set_bool,
+      offsetof(struct conf_pool, timeout_close) },
+
     { string("backlog"),
       conf_set_num,
       offsetof(struct conf_pool, backlog) },
@@ -119,6 +130,14 @@ static struct command conf_commands[] = {
       conf_set_bool,
       offsetof(struct conf_pool, auto_warmup) },
 
+    { string("memcache_meta"),
+      conf_set_bool,
+      offsetof(struct conf_pool, memcache_meta) },
+
+    { string("memcache_binary"),
+      conf_set_bool,
+      offsetof(struct conf_pool, memcache_binary) },
+
     { string("virtual"),
       conf_set_bool,
       offsetof(struct conf_pool, virtual) },
@@ -139,10 +158,130 @@ static struct command conf_commands[] = {
       conf_set_num,
       offsetof(struct conf_pool, burst) },
 
+    { string("client_rate"),
+      conf_set_num,
+      offsetof(struct conf_pool, client_rate) },
+
+    { string("client_burst"),
+      conf_set_num,
+      offsetof(struct conf_pool, client_burst) },
+
+    { string("client_prefix"),
+      conf_set_num,
+      offsetof(struct conf_pool, client_prefix) },
+
+    { string("client_prefix6"),
+      conf_set_num,
+      offsetof(struct conf_pool, client_prefix6) },
+
+    { string("write_cost"),
+      conf_set_num,
+      offsetof(struct conf_pool, write_cost) },
+
+    { string("ratelimit_action"),
+      conf_set_ratelimit_action,
+      offsetof(struct conf_pool, ratelimit_action) },
+
+    { string("ratelimit_queue"),
+      conf_set_num,
+      offsetof(struct conf_pool, ratelimit_queue) },
+
+    { string("max_inflight"),
+      conf_set_num,
+      offsetof(struct conf_pool, max_inflight) },
+
+    { string("max_inflight_bytes"),
+      conf_set_num,
+      offsetof(struct conf_pool, max_inflight_bytes) },
+
+    { string("server_max_inflight"),
+      conf_set_num,
+      offsetof(struct conf_pool, server_max_inflight) },
+
+    { string("server_max_inflight_bytes"),
+      conf_set_num,
+      offsetof(struct conf_pool, server_max_inflight_bytes) },
+
+    { string("backpressure_reject"),
+      conf_set_bool,
+      offsetof(struct conf_pool, backpressure_reject) },
+
+    { string("outlier_interval"),
+      conf_set_num,
+      offsetof(struct conf_pool, outlier_interval) },
+
+    { string("outlier_latency_ratio"),
+      conf_set_num,
+      offsetof(struct conf_pool, outlier_latency_ratio) },
+
+    { string("outlier_error_rate"),
+      conf_set_num,
+      offsetof(struct conf_pool, outlier_error_rate) },
+
+    { string("outlier_min_requests"),
+      conf_set_num,
+      offsetof(struct conf_pool, outlier_min_requests) },
+
+    { string("outlier_max_ejection"),
+      conf_set_num,
+      offsetof(struct conf_pool, outlier_max_ejection) },
+
     { string("message_queue"),
       conf_set_string,
       offsetof(struct conf_pool, message_queue) },
 
+    { string("near_cache_size"),
+      conf_set_num,
+      offsetof(struct conf_pool, near_cache_size) },
+
+    { string("near_cache_ttl"),
+      conf_set_num,
+      offsetof(struct conf_pool, near_cache_ttl) },
+
+    { string("collapse_gets"),
+      conf_set_bool,
+      offsetof(struct conf_pool, collapse_gets) },
+
+    { string("hot_key_sample"),
+      conf_set_num,
+      offsetof(struct conf_pool, hot_key_sample) },
+
+    { string("warmup_rate"),
+      conf_set_num,
+      offsetof(struct conf_pool, warmup_rate) },
+
+    { string("warmup_queue"),
+      conf_set_num,
+      offsetof(struct conf_pool, warmup_queue) },
+
+    { string("warmup_keys"),
+      conf_set_num,
+      offsetof(struct conf_pool, warmup_keys) },
+
+    { string("warmup_bandwidth"),
+      conf_set_num,
+      offsetof(struct conf_pool, warmup_bandwidth) },
+
+    { string("replica_max_lag"),
+      conf_set_num,
+      offsetof(struct conf_pool, replica_max_lag) },
+
+    { string("notify_async"),
+      conf_set_bool,
+      offsetof(struct conf_pool, notify_async) },
+
+    { string("notify_buffer"),
+      conf_set_num,
+      offsetof(struct conf_pool, notify_buffer) },
+
+    { string("notify_journal"),
+      conf_set_string,
+      offsetof(struct conf_pool, notify_journal) },
+
+    { string("notify_journal_size"),
+      conf_set_num,
+      offsetof(struct conf_pool, notify_journal_size) },
+
     null_command
 };
 
@@ -204,8 +343,12 @@ conf_server_each_transform(void *elem, void *data)
     s->range_end = cs->end;
 
     s->next_probe = 0LL;
+
+    s->inflight = 0;
+    s->inflight_bytes = 0;
     
     s->stats = NULL;
+    s->stale = 0;
     
     log_debug(LOG_VERB, "transform to server %"PRIu32" '%.*s'",
               s->idx, s->pname.len, s->pname.data);
@@ -231,6 +374,7 @@ conf_pool_init(struct conf_pool *cp, struct string *name)
     cp->distribution = CONF_UNSET_DIST;
 
     cp->timeout = CONF_UNSET_NUM;
+    cp->timeout_close = CONF_UNSET_NUM;
     cp->backlog = CONF_UNSET_NUM;
 
     cp->client_connections = CONF_UNSET_NUM;
@@ -245,6 +389,8 @@ conf_pool_init(struct conf_pool *cp, struct string *name)
     cp->auto_probe_hosts = CONF_UNSET_NUM;
     cp->virtual = CONF_UNSET_NUM;
     cp->auto_warmup = CONF_UNSET_NUM;
+    cp->memcache_meta = CONF_UNSET_NUM;
+    cp->memcache_binary = CONF_UNSET_NUM;
 
     array_null(&cp->server);
     array_null(&cp->downstreams);
@@ -255,9 +401,42 @@ conf_pool_init(struct conf_pool *cp, struct string *name)
     string_init(&cp->peer);
     string_init(&cp->namespace);
     string_init(&cp->message_queue);
+    string_init(&cp->notify_journal);
 
     cp->rate = CONF_UNSET_NUM;
     cp->burst = CONF_UNSET_NUM;
+    cp->client_rate = CONF_UNSET_NUM;
+    cp->client_burst = CONF_UNSET_NUM;
+    cp->client_prefix = CONF_UNSET_NUM;
+    cp->client_prefix6 = CONF_UNSET_NUM;
+    cp->write_cost = CONF_UNSET_NUM;
+    cp->ratelimit_action = CONF_UNSET_RATELIMIT_ACTION;
+    cp->ratelimit_queue = CONF_UNSET_NUM;
+
+    cp->max_inflight = CONF_UNSET_NUM;
+    cp->max_inflight_bytes = CONF_UNSET_NUM;
+    cp->server_max_inflight = CONF_UNSET_NUM;
+    cp->server_max_inflight_bytes = CONF_UNSET_NUM;
+    cp->backpressure_reject = CONF_UNSET_NUM;
+
+    cp->outlier_interval = CONF_UNSET_NUM;
+    cp->outlier_latency_ratio = CONF_UNSET_NUM;
+    cp->outlier_error_rate = CONF_UNSET_NUM;
+    cp->outlier_min_requests = CONF_UNSET_NUM;
+    cp->outlier_max_ejection = CONF_UNSET_NUM;
+
+    cp->near_cache_size = CONF_UNSET_NUM;
+    cp->near_cache_ttl = CONF_UNSET_NUM;
+    cp->collapse_gets = CONF_UNSET_NUM;
+    cp->hot_key_sample = CONF_UNSET_NUM;
+    cp->warmup_rate = CONF_UNSET_NUM;
+    cp->warmup_queue = CONF_UNSET_NUM;
+    cp->warmup_keys = CONF_UNSET_NUM;
+    cp->warmup_bandwidth = CONF_UNSET_NUM;
+    cp->replica_max_lag = CONF_UNSET_NUM;
+    cp->notify_async = CONF_UNSET_NUM;
+    cp->notify_buffer = CONF_UNSET_NUM;
+    cp->notify_journal_size = CONF_UNSET_NUM;
     
     status = string_duplicate(&cp->name, name);
     if (status != NC_OK) {
@@ -301,6 +480,7 @@ conf_pool_deinit(struct conf_pool *cp)
     string_deinit(&cp->peer);
     string_deinit(&cp->namespace);
     string_deinit(&cp->message_queue);
+    string_deinit(&cp->notify_journal);
 
     while (array_n(&cp->downstreams) != 0) {
         conf_downstream_deinit(array_pop(&cp->downstreams));
@@ -358,6 +538,7 @@ conf_pool_each_transform(void *elem, void *data)
 
     sp->redis = cp->redis ? 1 : 0;
     sp->timeout = cp->timeout;
+    sp->timeout_close = cp->timeout_close ? 1 : 0;
     sp->backlog = cp->backlog;
 
     sp->client_connections = (uint32_t)cp->client_connections;
@@ -374,6 +555,9 @@ conf_pool_each_transform(void *elem, void *data)
 
     sp->auto_warmup = cp->auto_warmup ? 1 : 0;
 
+    sp->memcache_meta = cp->memcache_meta ? 1 : 0;
+    sp->memcache_binary = cp->memcache_binary ? 1 : 0;
+
     sp->gutter_name = cp->gutter;
     sp->gutter = NULL;
 
@@ -386,12 +570,85 @@ conf_pool_each_transform(void *elem, void *data)
     sp->virtual = cp->virtual ? 1 : 0;
     sp->namespace = cp->namespace;
 
-    sp->rate = cp->rate;
-    sp->burst = cp->burst;
-    sp->count = 0;
-    
+    /* the pool bucket takes both rate and burst, as it always did */
+    sp->ratelimit = NULL;
+    if ((cp->rate > 0 && cp->burst > 0) || cp->client_rate > 0) {
+        sp->ratelimit = ratelimit_create(sp, cp->ratelimit_action,
+                                         cp->burst > 0 ? (uint32_t)cp->rate : 0,
+                                         (uint32_t)cp->burst,
+                                         (uint32_t)cp->client_rate,
+                                         (uint32_t)cp->client_burst,
+                                         (uint32_t)cp->client_prefix,
+                                         (uint32_t)cp->client_prefix6,
+                                         (uint32_t)cp->write_cost,
+                                         (uint32_t)cp->ratelimit_queue);
+        if (sp->ratelimit == NULL) {
+            log_error("conf: failed to init ratelimit");
+            return NC_ENOMEM;
+        }
+    }
+
+    sp->max_inflight = (uint32_t)cp->max_inflight;
+    sp->max_inflight_bytes = (size_t)cp->max_inflight_bytes;
+    sp->server_max_inflight = (uint32_t)cp->server_max_inflight;
+    sp->server_max_inflight_bytes = (size_t)cp->server_max_inflight_bytes;
+    sp->backpressure_reject = cp->backpressure_reject ? 1 : 0;
+    sp->inflight = 0;
+    sp->inflight_bytes = 0;
+    sp->npaused = 0;
+
+    sp->outlier = NULL;
+    if (cp->outlier_interval > 0) {
+        sp->outlier = outlier_create(sp, array_n(&cp->server),
+                                     (uint32_t)cp->outlier_interval,
+                                     (uint32_t)cp->outlier_latency_ratio,
+                                     (uint32_t)cp->outlier_error_rate,
+                                     (uint32_t)cp->outlier_min_requests,
+                                     (uint32_t)cp->outlier_max_ejection);
+        if (sp->outlier == NULL) {
+            log_error("conf: failed to init outlier detection");
+            return NC_ENOMEM;
+        }
+    }
+
     sp->message_queue_name = cp->message_queue;
     sp->message_queue = NULL;
+    sp->notify_async = cp->notify_async ? 1 : 0;
+    sp->notify_buffer = (uint32_t)cp->notify_buffer;
+    sp->notify_journal = cp->notify_journal;
+    sp->notify_journal_size = (uint32_t)cp->notify_journal_size;
+    sp->notify = NULL;
+
+    sp->near_cache = NULL;
+    if (cp->near_cache_size > 0) {
+        sp->near_cache = nearcache_create(sp->key_hash,
+                                          (size_t)cp->near_cache_size,
+                                          cp->near_cache_ttl);
+        if (sp->near_cache == NULL) {
+            log_error("conf: failed to init near cache");
+            return NC_ENOMEM;
+        }
+    }
+
+    sp->collapse_gets = cp->collapse_gets ? 1 : 0;
+
+    sp->hot_key_sample = (uint32_t)cp->hot_key_sample;
+    sp->hot_key_countdown = sp->hot_key_sample;
+
+    sp->replica_max_lag = (uint32_t)cp->replica_max_lag;
+
+    /* only probed pools have cold servers to warm up */
+    sp->warmup = NULL;
+    if (sp->auto_probe_hosts && !sp->memcache_binary) {
+        sp->warmup = warmup_create(sp, (uint32_t)cp->warmup_rate,
+                                   (uint32_t)cp->warmup_queue,
+                                   (uint32_t)cp->warmup_keys,
+                                   (uint32_t)cp->warmup_bandwidth);
+        if (sp->warmup == NULL) {
+            log_error("conf: failed to init warmup");
+            return NC_ENOMEM;
+        }
+    }
 
     array_init(&sp->tags, CONF_DEFAULT_TAGS, sizeof(struct string));
 
@@ -460,6 +717,7 @@ conf_dump(struct conf *cf)
         log_debug(LOG_VVERB, "  listen: %.*s",
                   cp->listen.pname.len, cp->listen.pname.data);
         log_debug(LOG_VVERB, "  timeout: %d", cp->timeout);
+        log_debug(LOG_VVERB, "  timeout_close: %d", cp->timeout_close);
         log_debug(LOG_VVERB, "  backlog: %d", cp->backlog);
         log_debug(LOG_VVERB, "  hash: %d", cp->hash);
         log_debug(LOG_VVERB, "  hash_tag: \"%.*s\"", cp->hash_tag.len,
@@ -480,8 +738,50 @@ conf_dump(struct conf *cf)
                   cp->server_failure_interval);
         log_debug(LOG_VVERB, "  rate: %d", cp->rate);
         log_debug(LOG_VVERB, "  burst: %d", cp->burst);
+        log_debug(LOG_VVERB, "  client_rate: %d", cp->client_rate);
+        log_debug(LOG_VVERB, "  client_burst: %d", cp->client_burst);
+        log_debug(LOG_VVERB, "  client_prefix: %d", cp->client_prefix);
+        log_debug(LOG_VVERB, "  client_prefix6: %d", cp->client_prefix6);
+        log_debug(LOG_VVERB, "  write_cost: %d", cp->write_cost);
+        log_debug(LOG_VVERB, "  ratelimit_action: %d", cp->ratelimit_action);
+        log_debug(LOG_VVERB, "  ratelimit_queue: %d", cp->ratelimit_queue);
+        log_debug(LOG_VVERB, "  max_inflight: %d", cp->max_inflight);
+        log_debug(LOG_VVERB, "  max_inflight_bytes: %d",
+                  cp->max_inflight_bytes);
+        log_debug(LOG_VVERB, "  server_max_inflight: %d",
+                  cp->server_max_inflight);
+        log_debug(LOG_VVERB, "  server_max_inflight_bytes: %d",
+                  cp->server_max_inflight_bytes);
+        log_debug(LOG_VVERB, "  backpressure_reject: %d",
+                  cp->backpressure_reject);
+        log_debug(LOG_VVERB, "  outlier_interval: %d", cp->outlier_interval);
+        log_debug(LOG_VVERB, "  outlier_latency_ratio: %d",
+                  cp->outlier_latency_ratio);
+        log_debug(LOG_VVERB, "  outlier_error_rate: %d",
+                  cp->outlier_error_rate);
+        log_debug(LOG_VVERB, "  outlier_min_requests: %d",
+                  cp->outlier_min_requests);
+        log_debug(LOG_VVERB, "  outlier_max_ejection: %d",
+                  cp->outlier_max_ejection);
         log_debug(LOG_VVERB, "  auto_probe_hosts: %d", cp->auto_probe_hosts);
         log_debug(LOG_VVERB, "  auto_warmup: %d", cp->auto_warmup);
+        log_debug(LOG_VVERB, "  memcache_meta: %d", cp->memcache_meta);
+        log_debug(LOG_VVERB, "  memcache_binary: %d", cp->memcache_binary);
+        log_debug(LOG_VVERB, "  near_cache_size: %d", cp->near_cache_size);
+        log_debug(LOG_VVERB, "  near_cache_ttl: %d", cp->near_cache_ttl);
+        log_debug(LOG_VVERB, "  collapse_gets: %d", cp->collapse_gets);
+        log_debug(LOG_VVERB, "  hot_key_sample: %d", cp->hot_key_sample);
+        log_debug(LOG_VVERB, "  warmup_rate: %d", cp->warmup_rate);
+        log_debug(LOG_VVERB, "  warmup_queue: %d", cp->warmup_queue);
+        log_debug(LOG_VVERB, "  warmup_keys: %d", cp->warmup_keys);
+        log_debug(LOG_VVERB, "  warmup_bandwidth: %d", cp->warmup_bandwidth);
+        log_debug(LOG_VVERB, "  replica_max_lag: %d", cp->replica_max_lag);
+        log_debug(LOG_VVERB, "  notify_async: %d", cp->notify_async);
+        log_debug(LOG_VVERB, "  notify_buffer: %d", cp->notify_buffer);
+        log_debug(LOG_VVERB, "  notify_journal: \"%.*s\"",
+                  cp->notify_journal.len, cp->notify_journal.data);
+        log_debug(LOG_VVERB, "  notify_journal_size: %d",
+                  cp->notify_journal_size);
         log_debug(LOG_VVERB, "  gutter: \"%.*s\"", cp->gutter.len, cp->gutter.data);
         log_debug(LOG_VVERB, "  peer: \"%.*s\"", cp->peer.len, cp->peer.data);
         log_debug(LOG_VVERB, "  message_queue: \"%.*s\"", cp->message_queue.len,
@@ -1396,6 +1696,10 @@ conf_validate_pool(struct conf *cf, struct conf_pool *cp)
         cp->timeout = CONF_DEFAULT_TIMEOUT;
     }
 
+    if (cp->timeout_close == CONF_UNSET_NUM) {
+        cp->timeout_close = CONF_DEFAULT_TIMEOUT_CLOSE;
+    }
+
     if (cp->backlog == CONF_UNSET_NUM) {
         cp->backlog = CONF_DEFAULT_LISTEN_BACKLOG;
     }
@@ -1440,6 +1744,25 @@ conf_validate_pool(struct conf *cf, struct conf_pool *cp)
     if (cp->auto_warmup == CONF_UNSET_NUM) {
         cp->auto_warmup = CONF_DEFAULT_AUTO_WARMUP;
     }
+
+    if (cp->memcache_meta == CONF_UNSET_NUM) {
+        cp->memcache_meta = CONF_DEFAULT_MEMCACHE_META;
+    }
+
+    if (cp->memcache_binary == CONF_UNSET_NUM) {
+        cp->memcache_binary = CONF_DEFAULT_MEMCACHE_BINARY;
+    } else if (cp->memcache_binary && cp->redis) {
+        log_error("conf: directive \"memcache_binary:\" cannot be used "
+                  "with \"redis:\"");
+        return NC_ERROR;
+    }
+
+    /* the server probe is an ascii 'stats' */
+    if (cp->memcache_binary && cp->auto_probe_hosts) {
+        log_error("conf: directive \"memcache_binary:\" cannot be used "
+                  "with \"auto_probe_hosts:\"");
+        return NC_ERROR;
+    }
     
     if (cp->virtual == CONF_UNSET_NUM) {
         cp->virtual = CONF_DEFAULT_VIRTUAL;
@@ -1453,6 +1776,197 @@ conf_validate_pool(struct conf *cf, struct conf_pool *cp)
         cp->burst = CONF_DEFAULT_BURST;
     }
 
+    if (cp->client_rate == CONF_UNSET_NUM) {
+        cp->client_rate = CONF_DEFAULT_CLIENT_RATE;
+    }
+
+    if (cp->client_burst == CONF_UNSET_NUM) {
+        cp->client_burst = cp->client_rate;
+    }
+
+    if (cp->client_prefix == CONF_UNSET_NUM) {
+        cp->client_prefix = CONF_DEFAULT_CLIENT_PREFIX;
+    } else if (cp->client_prefix > 32) {
+        log_error("conf: directive \"client_prefix:\" cannot be more than 32");
+        return NC_ERROR;
+    }
+
+    if (cp->client_prefix6 == CONF_UNSET_NUM) {
+        cp->client_prefix6 = CONF_DEFAULT_CLIENT_PREFIX6;
+    } else if (cp->client_prefix6 > 128) {
+        log_error("conf: directive \"client_prefix6:\" cannot be more than "
+                  "128");
+        return NC_ERROR;
+    }
+
+    if (cp->write_cost == CONF_UNSET_NUM) {
+        cp->write_cost = CONF_DEFAULT_WRITE_COST;
+    }
+
+    /* delayed requests wait in the queue of the pool they arrived at */
+    if (cp->ratelimit_action == CONF_UNSET_RATELIMIT_ACTION) {
+        cp->ratelimit_action = CONF_DEFAULT_RATELIMIT_ACTION;
+    } else if (cp->ratelimit_action == RATELIMIT_DELAY && cp->virtual) {
+        log_error("conf: directive \"ratelimit_action:\" cannot delay "
+                  "with \"virtual:\"");
+        return NC_ERROR;
+    }
+
+    if (cp->ratelimit_queue == CONF_UNSET_NUM) {
+        cp->ratelimit_queue = CONF_DEFAULT_RATELIMIT_QUEUE;
+    }
+
+    if (cp->max_inflight == CONF_UNSET_NUM) {
+        cp->max_inflight = CONF_DEFAULT_MAX_INFLIGHT;
+    }
+
+    if (cp->max_inflight_bytes == CONF_UNSET_NUM) {
+        cp->max_inflight_bytes = CONF_DEFAULT_MAX_INFLIGHT_BYTES;
+    }
+
+    if (cp->server_max_inflight == CONF_UNSET_NUM) {
+        cp->server_max_inflight = CONF_DEFAULT_MAX_INFLIGHT;
+    }
+
+    if (cp->server_max_inflight_bytes == CONF_UNSET_NUM) {
+        cp->server_max_inflight_bytes = CONF_DEFAULT_MAX_INFLIGHT_BYTES;
+    }
+
+    if (cp->backpressure_reject == CONF_UNSET_NUM) {
+        cp->backpressure_reject = CONF_DEFAULT_BACKPRESSURE_REJECT;
+    }
+
+    /* outliers are ejected the way failing servers are */
+    if (cp->outlier_interval == CONF_UNSET_NUM) {
+        cp->outlier_interval = CONF_DEFAULT_OUTLIER_INTERVAL;
+    } else if (cp->outlier_interval > 0 &&
+               (!cp->auto_eject_hosts || cp->virtual)) {
+        log_error("conf: directive \"outlier_interval:\" requires "
+                  "\"auto_eject_hosts:\" and cannot be used with "
+                  "\"virtual:\"");
+        return NC_ERROR;
+    }
+
+    if (cp->outlier_latency_ratio == CONF_UNSET_NUM) {
+        cp->outlier_latency_ratio = CONF_DEFAULT_OUTLIER_LATENCY_RATIO;
+    } else if (cp->outlier_latency_ratio < 2) {
+        log_error("conf: directive \"outlier_latency_ratio:\" cannot be "
+                  "less than 2");
+        return NC_ERROR;
+    }
+
+    if (cp->outlier_error_rate == CONF_UNSET_NUM) {
+        cp->outlier_error_rate = CONF_DEFAULT_OUTLIER_ERROR_RATE;
+    } else if (cp->outlier_error_rate > 100) {
+        log_error("conf: directive \"outlier_error_rate:\" cannot be more "
+                  "than 100");
+        return NC_ERROR;
+    }
+
+    if (cp->outlier_min_requests == CONF_UNSET_NUM) {
+        cp->outlier_min_requests = CONF_DEFAULT_OUTLIER_MIN_REQUESTS;
+    }
+
+    if (cp->outlier_max_ejection == CONF_UNSET_NUM) {
+        cp->outlier_max_ejection = CONF_DEFAULT_OUTLIER_MAX_EJECTION;
+    } else if (cp->outlier_max_ejection > 100) {
+        log_error("conf: directive \"outlier_max_ejection:\" cannot be "
+                  "more than 100");
+        return NC_ERROR;
+    }
+
+    if (cp->near_cache_size == CONF_UNSET_NUM) {
+        cp->near_cache_size = CONF_DEFAULT_NEAR_CACHE_SIZE;
+    } else if (cp->near_cache_size > 0 &&
+               (cp->redis || cp->memcache_binary)) {
+        log_error("conf: directive \"near_cache_size:\" cannot be used "
+                  "with \"redis:\" or \"memcache_binary:\"");
+        return NC_ERROR;
+    }
+
+    if (cp->near_cache_ttl == CONF_UNSET_NUM) {
+        cp->near_cache_ttl = CONF_DEFAULT_NEAR_CACHE_TTL;
+    } else if (cp->near_cache_ttl == 0) {
+        log_error("conf: directive \"near_cache_ttl:\" cannot be 0");
+        return NC_ERROR;
+    }
+
+    if (cp->collapse_gets == CONF_UNSET_NUM) {
+        cp->collapse_gets = CONF_DEFAULT_COLLAPSE_GETS;
+    } else if (cp->collapse_gets && (cp->redis || cp->memcache_binary)) {
+        log_error("conf: directive \"collapse_gets:\" cannot be used "
+                  "with \"redis:\" or \"memcache_binary:\"");
+        return NC_ERROR;
+    }
+
+    if (cp->hot_key_sample == CONF_UNSET_NUM) {
+        cp->hot_key_sample = CONF_DEFAULT_HOT_KEY_SAMPLE;
+    }
+
+    if (cp->warmup_rate == CONF_UNSET_NUM) {
+        cp->warmup_rate = CONF_DEFAULT_WARMUP_RATE;
+    } else if (cp->warmup_rate > 0 && cp->memcache_binary) {
+        log_error("conf: directive \"warmup_rate:\" cannot be used "
+                  "with \"memcache_binary:\"");
+        return NC_ERROR;
+    }
+
+    if (cp->warmup_queue == CONF_UNSET_NUM) {
+        cp->warmup_queue = CONF_DEFAULT_WARMUP_QUEUE;
+    }
+
+    if (cp->warmup_keys == CONF_UNSET_NUM) {
+        cp->warmup_keys = CONF_DEFAULT_WARMUP_KEYS;
+    } else if (cp->warmup_keys > 0 && string_empty(&cp->peer)) {
+        log_error("conf: directive \"warmup_keys:\" requires \"peer:\"");
+        return NC_ERROR;
+    } else if (cp->warmup_keys > 0 && (cp->redis || cp->memcache_binary)) {
+        log_error("conf: directive \"warmup_keys:\" cannot be used "
+                  "with \"redis:\" or \"memcache_binary:\"");
+        return NC_ERROR;
+    }
+
+    if (cp->warmup_bandwidth == CONF_UNSET_NUM) {
+        cp->warmup_bandwidth = CONF_DEFAULT_WARMUP_BANDWIDTH;
+    }
+
+    /* replica health comes from the 'info' probe */
+    if (cp->replica_max_lag == CONF_UNSET_NUM) {
+        cp->replica_max_lag = CONF_DEFAULT_REPLICA_MAX_LAG;
+    } else if (cp->replica_max_lag > 0 &&
+               (!cp->redis || !cp->auto_probe_hosts)) {
+        log_error("conf: directive \"replica_max_lag:\" requires \"redis:\" "
+                  "and \"auto_probe_hosts:\"");
+        return NC_ERROR;
+    }
+
+    if (cp->notify_async == CONF_UNSET_NUM) {
+        cp->notify_async = CONF_DEFAULT_NOTIFY_ASYNC;
+    } else if (cp->notify_async && string_empty(&cp->message_queue)) {
+        log_error("conf: directive \"notify_async:\" requires "
+                  "\"message_queue:\"");
+        return NC_ERROR;
+    }
+
+    if (cp->notify_buffer == CONF_UNSET_NUM) {
+        cp->notify_buffer = CONF_DEFAULT_NOTIFY_BUFFER;
+    }
+
+    if (!string_empty(&cp->notify_journal) &&
+        string_empty(&cp->message_queue)) {
+        log_error("conf: directive \"notify_journal:\" requires "
+                  "\"message_queue:\"");
+        return NC_ERROR;
+    }
+
+    if (cp->notify_journal_size == CONF_UNSET_NUM) {
+        cp->notify_journal_size = CONF_DEFAULT_NOTIFY_JOURNAL_SIZE;
+    } else if (cp->notify_journal_size < JOURNAL_MIN_SIZE) {
+        log_error("conf: directive \"notify_journal_size:\" cannot be less "
+                  "than %d", JOURNAL_MIN_SIZE);
+        return NC_ERROR;
+    }
+
     status = conf_validate_server(cf, cp);
     if (status != NC_OK) {
         return status;
@@ -1885,6 +2399,35 @@ conf_set_distribution(struct conf *cf, struct command *cmd, void *conf)
     return "is not a valid distribution";
 }
 
+char *
+conf_set_ratelimit_action(struct conf *cf, struct command *cmd, void *conf)
+{
+    uint8_t *p;
+    ratelimit_action_t *ap;
+    struct string *value, *action;
+
+    p = conf;
+    ap = (ratelimit_action_t *)(p + cmd->offset);
+
+    if (*ap != CONF_UNSET_RATELIMIT_ACTION) {
+        return "is a duplicate";
+    }
+
+    value = array_top(&cf->arg);
+
+    for (action = ratelimit_action_strings; action->len != 0; action++) {
+        if (string_compare(value, action) != 0) {
+            continue;
+        }
+
+        *ap = (ratelimit_action_t)(action - ratelimit_action_strings);
+
+        return CONF_OK;
+    }
+
+    return "is not a valid ratelimit action";
+}
+
 char *
 conf_set_hashtag(struct conf *cf, struct command *cmd, void *conf)
 {
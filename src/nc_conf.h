@@ -44,10 +44,12 @@
 #define CONF_UNSET_PTR  NULL
 #define CONF_UNSET_HASH (hash_type_t) -1
 #define CONF_UNSET_DIST (dist_type_t) -1
+#define CONF_UNSET_RATELIMIT_ACTION (ratelimit_action_t) -1
 
 #define CONF_DEFAULT_HASH                    HASH_FNV1A_64
 #define CONF_DEFAULT_DIST                    DIST_KETAMA
 #define CONF_DEFAULT_TIMEOUT                 -1
+#define CONF_DEFAULT_TIMEOUT_CLOSE           true
 #define CONF_DEFAULT_LISTEN_BACKLOG          512
 #define CONF_DEFAULT_CLIENT_CONNECTIONS      0
 #define CONF_DEFAULT_REDIS                   false
@@ -63,7 +65,35 @@
 #define CONF_DEFAULT_VIRTUAL                 false
 #define CONF_DEFAULT_RATE                    0
 #define CONF_DEFAULT_BURST                   0
+#define CONF_DEFAULT_CLIENT_RATE             0
+#define CONF_DEFAULT_CLIENT_PREFIX           32
+#define CONF_DEFAULT_CLIENT_PREFIX6          128
+#define CONF_DEFAULT_WRITE_COST              1
+#define CONF_DEFAULT_RATELIMIT_ACTION        RATELIMIT_REJECT
+#define CONF_DEFAULT_RATELIMIT_QUEUE         1024
+#define CONF_DEFAULT_MAX_INFLIGHT            0
+#define CONF_DEFAULT_MAX_INFLIGHT_BYTES      0
+#define CONF_DEFAULT_BACKPRESSURE_REJECT     false
+#define CONF_DEFAULT_OUTLIER_INTERVAL        0 /* in msec */
+#define CONF_DEFAULT_OUTLIER_LATENCY_RATIO   5
+#define CONF_DEFAULT_OUTLIER_ERROR_RATE      20 /* in percent */
+#define CONF_DEFAULT_OUTLIER_MIN_REQUESTS    20
+#define CONF_DEFAULT_OUTLIER_MAX_EJECTION    10 /* in percent */
 #define CONF_DEFAULT_AUTO_WARMUP             0
+#define CONF_DEFAULT_MEMCACHE_META           false
+#define CONF_DEFAULT_MEMCACHE_BINARY         false
+#define CONF_DEFAULT_NEAR_CACHE_SIZE         0
+#define CONF_DEFAULT_NEAR_CACHE_TTL          1000 /* in msec */
+#define CONF_DEFAULT_COLLAPSE_GETS           false
+#define CONF_DEFAULT_HOT_KEY_SAMPLE          0
+#define CONF_DEFAULT_WARMUP_RATE             0
+#define CONF_DEFAULT_WARMUP_QUEUE            1024
+#define CONF_DEFAULT_WARMUP_KEYS             0
+#define CONF_DEFAULT_WARMUP_BANDWIDTH        0
+#define CONF_DEFAULT_REPLICA_MAX_LAG         0
+#define CONF_DEFAULT_NOTIFY_ASYNC            false
+#define CONF_DEFAULT_NOTIFY_BUFFER           (1 << 20) /* in bytes */
+#define CONF_DEFAULT_NOTIFY_JOURNAL_SIZE     (64 << 20) /* in bytes */
 
 struct conf_listen {
     struct string   pname;   /* listen: as "name:port" */
@@ -99,6 +129,7 @@ struct conf_pool {
     struct string      hash_tag;                /* hash_tag: */
     dist_type_t        distribution;            /* distribution: */
     int                timeout;                 /* timeout: */
+    int                timeout_close;           /* timeout_close: */
     int                backlog;                 /* backlog: */
     int                client_connections;      /* client_connections: */
     int                redis;                   /* redis: */
@@ -119,10 +150,43 @@ struct conf_pool {
     
     int                rate;                    /* # of requests per second */
     int                burst;                   /* max bursts of requests */
+    int                client_rate;             /* client_rate: per second */
+    int                client_burst;            /* client_burst: */
+    int                client_prefix;           /* client_prefix: ipv4 bits */
+    int                client_prefix6;          /* client_prefix6: ipv6 bits */
+    int                write_cost;              /* write_cost: # tokens */
+    ratelimit_action_t ratelimit_action;        /* ratelimit_action: */
+    int                ratelimit_queue;         /* ratelimit_queue: */
+    int                max_inflight;            /* max_inflight: # requests */
+    int                max_inflight_bytes;      /* max_inflight_bytes: */
+    int                server_max_inflight;     /* server_max_inflight: */
+    int                server_max_inflight_bytes; /* in bytes */
+    int                backpressure_reject;     /* backpressure_reject: */
+    int                outlier_interval;        /* outlier_interval: in msec */
+    int                outlier_latency_ratio;   /* outlier_latency_ratio: */
+    int                outlier_error_rate;      /* outlier_error_rate: in % */
+    int                outlier_min_requests;    /* outlier_min_requests: */
+    int                outlier_max_ejection;    /* outlier_max_ejection: in % */
     
     int                auto_warmup;             /* auto warmup */
+    int                memcache_meta;           /* memcache_meta: */
+    int                memcache_binary;         /* memcache_binary: */
 
     struct string      message_queue;           /* message queue */
+
+    int                near_cache_size;         /* near_cache_size: in bytes */
+    int                near_cache_ttl;          /* near_cache_ttl: in msec */
+    int                collapse_gets;           /* collapse_gets: */
+    int                hot_key_sample;          /* hot_key_sample: 1 in n */
+    int                warmup_rate;             /* warmup_rate: per second */
+    int                warmup_queue;            /* warmup_queue: # warmups */
+    int                warmup_keys;             /* warmup_keys: # logged keys */
+    int                warmup_bandwidth;        /* warmup_bandwidth: in bytes */
+    int                replica_max_lag;         /* replica_max_lag: in sec */
+    int                notify_async;            /* notify_async: */
+    int                notify_buffer;           /* notify_buffer: in bytes */
+    struct string      notify_journal;          /* notify_journal: path */
+    int                notify_journal_size;     /* notify_journal_size: */
 };
 
 struct conf {
@@ -158,6 +222,8 @@ char *conf_set_num(struct conf *cf, struct command *cmd, void *conf);
 char *conf_set_bool(struct conf *cf, struct command *cmd, void *conf);
 char *conf_set_hash(struct conf *cf, struct command *cmd, void *conf);
 char *conf_set_distribution(struct conf *cf, struct command *cmd, void *conf);
+char *conf_set_ratelimit_action(struct conf *cf, struct command *cmd,
+                                void *conf);
 char *conf_set_hashtag(struct conf *cf, struct command *cmd, void *conf);
 char *conf_add_string(struct conf *cf, struct command *cmd, void *conf);
 char *conf_add_downstream(struct conf *cf, struct command *cmd, void *conf);
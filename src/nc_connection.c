@@ -82,6 +82,66 @@
  *
  */
 
+/*
+ * client receives a request, possibly parsing it, and sends a response
+ * downstream.
+ */
+static const struct conn_ops client_ops = {
+    msg_recv,                   /* recv */
+    req_recv_next,              /* recv_next */
+    req_recv_done,              /* recv_done */
+    msg_send,                   /* send */
+    rsp_send_next,              /* send_next */
+    rsp_send_done,              /* send_done */
+    client_close,               /* close */
+    client_active,              /* active */
+    client_ref,                 /* ref */
+    client_unref,               /* unref */
+    NULL,                       /* enqueue_inq */
+    NULL,                       /* dequeue_inq */
+    req_client_enqueue_omsgq,   /* enqueue_outq */
+    req_client_dequeue_omsgq,   /* dequeue_outq */
+};
+
+/*
+ * server receives a response, possibly parsing it, and sends a request
+ * upstream.
+ */
+static const struct conn_ops server_ops = {
+    msg_recv,                   /* recv */
+    rsp_recv_next,              /* recv_next */
+    rsp_recv_done,              /* recv_done */
+    msg_send,                   /* send */
+    req_send_next,              /* send_next */
+    req_send_done,              /* send_done */
+    server_close,               /* close */
+    server_active,              /* active */
+    server_ref,                 /* ref */
+    server_unref,               /* unref */
+    req_server_enqueue_imsgq,   /* enqueue_inq */
+    req_server_dequeue_imsgq,   /* dequeue_inq */
+    req_server_enqueue_omsgq,   /* enqueue_outq */
+    req_server_dequeue_omsgq,   /* dequeue_outq */
+};
+
+/* proxy only accepts connections */
+static const struct conn_ops proxy_ops = {
+    proxy_recv,                 /* recv */
+    NULL,                       /* recv_next */
+    NULL,                       /* recv_done */
+    NULL,                       /* send */
+    NULL,                       /* send_next */
+    NULL,                       /* send_done */
+    proxy_close,                /* close */
+    NULL,                       /* active */
+    proxy_ref,                  /* ref */
+    proxy_unref,                /* unref */
+    NULL,                       /* enqueue_inq */
+    NULL,                       /* dequeue_inq */
+    NULL,                       /* enqueue_outq */
+    NULL,                       /* dequeue_outq */
+};
+
 static uint32_t nfree_connq;       /* # free conn q */
 static struct conn_tqh free_connq; /* free conn q */
 
@@ -113,15 +173,15 @@ _conn_get(void)
     conn->rmsg = NULL;
     conn->smsg = NULL;
 
-    /*
-     * Callbacks {recv, recv_next, recv_done}, {send, send_next, send_done},
-     * {close, active}, parse, {ref, unref}, {enqueue_inq, dequeue_inq} and
-     * {enqueue_outq, dequeue_outq} are initialized by the wrapper.
-     */
+    /* role handlers (ops) are initialized by the wrapper */
 
     conn->send_bytes = 0;
     conn->recv_bytes = 0;
 
+    conn->bucket = NULL;
+    conn->ndelay = 0;
+    conn->paused_by = NULL;
+
     conn->events = 0;
     conn->err = 0;
     conn->recv_active = 0;
@@ -136,6 +196,8 @@ _conn_get(void)
     conn->eof = 0;
     conn->done = 0;
     conn->redis = 0;
+    conn->binary = 0;
+    conn->paused = 0;
 
     return conn;
 }
@@ -155,55 +217,9 @@ conn_get(void *owner, bool client, bool redis)
 
     conn->client = client ? 1 : 0;
 
-    if (conn->client) {
-        /*
-         * client receives a request, possibly parsing it, and sends a
-         * response downstream.
-         */
-        conn->recv = msg_recv;
-        conn->recv_next = req_recv_next;
-        conn->recv_done = req_recv_done;
-
-        conn->send = msg_send;
-        conn->send_next = rsp_send_next;
-        conn->send_done = rsp_send_done;
-
-        conn->close = client_close;
-        conn->active = client_active;
-
-        conn->ref = client_ref;
-        conn->unref = client_unref;
-
-        conn->enqueue_inq = NULL;
-        conn->dequeue_inq = NULL;
-        conn->enqueue_outq = req_client_enqueue_omsgq;
-        conn->dequeue_outq = req_client_dequeue_omsgq;
-    } else {
-        /*
-         * server receives a response, possibly parsing it, and sends a
-         * request upstream.
-         */
-        conn->recv = msg_recv;
-        conn->recv_next = rsp_recv_next;
-        conn->recv_done = rsp_recv_done;
-
-        conn->send = msg_send;
-        conn->send_next = req_send_next;
-        conn->send_done = req_send_done;
-
-        conn->close = server_close;
-        conn->active = server_active;
-
-        conn->ref = server_ref;
-        conn->unref = server_unref;
-
-        conn->enqueue_inq = req_server_enqueue_imsgq;
-        conn->dequeue_inq = req_server_dequeue_imsgq;
-        conn->enqueue_outq = req_server_enqueue_omsgq;
-        conn->dequeue_outq = req_server_dequeue_omsgq;
-    }
+    conn->ops = conn->client ? &client_ops : &server_ops;
 
-    conn->ref(conn, owner);
+    conn->ops->ref(conn, owner);
 
     log_debug(LOG_VVERB, "get conn %p client %d", conn, conn->client);
 
@@ -222,29 +238,13 @@ conn_get_proxy(void *owner)
     }
 
     conn->redis = pool->redis;
+    conn->binary = pool->memcache_binary;
 
     conn->proxy = 1;
 
-    conn->recv = proxy_recv;
-    conn->recv_next = NULL;
-    conn->recv_done = NULL;
-
-    conn->send = NULL;
-    conn->send_next = NULL;
-    conn->send_done = NULL;
-
-    conn->close = proxy_close;
-    conn->active = NULL;
-
-    conn->ref = proxy_ref;
-    conn->unref = proxy_unref;
-
-    conn->enqueue_inq = NULL;
-    conn->dequeue_inq = NULL;
-    conn->enqueue_outq = NULL;
-    conn->dequeue_outq = NULL;
+    conn->ops = &proxy_ops;
 
-    conn->ref(conn, owner);
+    conn->ops->ref(conn, owner);
 
     log_debug(LOG_VVERB, "get conn %p proxy %d", conn, conn->proxy);
 
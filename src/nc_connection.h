@@ -36,20 +36,11 @@ typedef void (*conn_unref_t)(struct conn *);
 
 typedef void (*conn_msgq_t)(struct context *, struct conn *, struct msg *);
 
-struct conn {
-    TAILQ_ENTRY(conn)  conn_tqe;      /* link in server_pool / server / free q */
-    void               *owner;        /* connection owner - server_pool / server */
-
-    int                sd;            /* socket descriptor */
-    int                family;        /* socket address family */
-    socklen_t          addrlen;       /* socket length */
-    struct sockaddr    *addr;         /* socket address (ref in server or server_pool) */
-
-    struct msg_tqh     imsg_q;        /* incoming request Q */
-    struct msg_tqh     omsg_q;        /* outstanding request Q */
-    struct msg         *rmsg;         /* current message being rcvd */
-    struct msg         *smsg;         /* current message being sent */
-
+/*
+ * Connection handlers; one shared, read-only table per connection role
+ * (client, server and proxy)
+ */
+struct conn_ops {
     conn_recv_t        recv;          /* recv (read) handler */
     conn_recv_next_t   recv_next;     /* recv next message handler */
     conn_recv_done_t   recv_done;     /* read done handler */
@@ -66,10 +57,31 @@ struct conn {
     conn_msgq_t        dequeue_inq;   /* connection inq msg dequeue handler */
     conn_msgq_t        enqueue_outq;  /* connection outq msg enqueue handler */
     conn_msgq_t        dequeue_outq;  /* connection outq msg dequeue handler */
+};
+
+struct conn {
+    TAILQ_ENTRY(conn)  conn_tqe;      /* link in server_pool / server / free q */
+    void               *owner;        /* connection owner - server_pool / server */
+
+    int                sd;            /* socket descriptor */
+    int                family;        /* socket address family */
+    socklen_t          addrlen;       /* socket length */
+    struct sockaddr    *addr;         /* socket address (ref in server or server_pool) */
+
+    struct msg_tqh     imsg_q;        /* incoming request Q */
+    struct msg_tqh     omsg_q;        /* outstanding request Q */
+    struct msg         *rmsg;         /* current message being rcvd */
+    struct msg         *smsg;         /* current message being sent */
+
+    const struct conn_ops *ops;       /* role handlers */
 
     size_t             recv_bytes;    /* received (read) bytes */
     size_t             send_bytes;    /* sent (written) bytes */
 
+    struct ratelimit_bucket *bucket;  /* client rate limit bucket, if any */
+    uint32_t           ndelay;        /* # requests waiting for rate limits */
+    struct server      *paused_by;    /* server whose backlog paused reads */
+
     uint32_t           events;        /* connection io events */
     err_t              err;           /* connection errno */
     unsigned           recv_active:1; /* recv active? */
@@ -84,6 +96,8 @@ struct conn {
     unsigned           eof:1;         /* eof? aka passive close? */
     unsigned           done:1;        /* done? aka close? */
     unsigned           redis:1;       /* redis? */
+    unsigned           binary:1;      /* memcache binary protocol? */
+    unsigned           paused:1;      /* reads paused by a backlog? */
 };
 
 TAILQ_HEAD(conn_tqh, conn);
@@ -77,6 +77,7 @@ core_ctx_create(struct instance *nci)
     ctx->id = ++ctx_id;
     ctx->cf = NULL;
     ctx->stats = NULL;
+    ctx->stats_shard = NULL;
     ctx->evb = NULL;
     array_null(&ctx->pool);
     ctx->max_timeout = nci->stats_interval;
@@ -114,13 +115,23 @@ core_ctx_create(struct instance *nci)
     /* create stats per server pool */
     if (npool != 0) {
         ctx->stats = stats_create(nci->stats_port, nci->stats_addr, nci->stats_interval,
-                                  nci->local_tag, nci->hostname, &ctx->pool);
+                                  nci->metrics_port, nci->local_tag,
+                                  nci->hostname, &ctx->pool);
         if (ctx->stats == NULL) {
             server_pool_deinit(&ctx->pool);
             conf_destroy(ctx->cf);
             nc_free(ctx);
             return NULL;
         }
+
+        ctx->stats_shard = stats_add_shard(ctx->stats);
+        if (ctx->stats_shard == NULL) {
+            stats_destroy(ctx->stats);
+            server_pool_deinit(&ctx->pool);
+            conf_destroy(ctx->cf);
+            nc_free(ctx);
+            return NULL;
+        }
     }
 
     /* initialize event handling for client, proxy and server */
@@ -216,7 +227,7 @@ core_recv(struct context *ctx, struct conn *conn)
 {
     rstatus_t status;
 
-    status = conn->recv(ctx, conn);
+    status = conn->ops->recv(ctx, conn);
     if (status != NC_OK) {
         log_debug(LOG_INFO, "recv on %c %d failed: %s",
                   conn->client ? 'c' : (conn->proxy ? 'p' : 's'), conn->sd,
@@ -231,7 +242,7 @@ core_send(struct context *ctx, struct conn *conn)
 {
     rstatus_t status;
 
-    status = conn->send(ctx, conn);
+    status = conn->ops->send(ctx, conn);
     if (status != NC_OK) {
         log_debug(LOG_INFO, "send on %c %d failed: %s",
                   conn->client ? 'c' : (conn->proxy ? 'p' : 's'), conn->sd,
@@ -267,7 +278,24 @@ core_close(struct context *ctx, struct conn *conn)
                  type, conn->sd, strerror(errno));
     }
 
-    conn->close(ctx, conn);
+    conn->ops->close(ctx, conn);
+}
+
+/*
+ * Read what a client left unread while paused; with edge triggered events
+ * no new event comes for data that already arrived
+ */
+void
+core_resume(struct context *ctx, struct conn *conn)
+{
+    rstatus_t status;
+
+    ASSERT(conn->client && !conn->paused);
+
+    status = core_recv(ctx, conn);
+    if (status != NC_OK || conn->done || conn->err) {
+        core_close(ctx, conn);
+    }
 }
 
 static void
@@ -289,10 +317,14 @@ core_error(struct context *ctx, struct conn *conn)
 static void
 core_timeout(struct context *ctx)
 {
+    int64_t now;
+
+    now = nc_msec_now();
+
     for (;;) {
         struct msg *msg;
         struct conn *conn;
-        int64_t now, then;
+        int64_t then;
 
         msg = msg_tmo_min();
         if (msg == NULL) {
@@ -312,10 +344,9 @@ core_timeout(struct context *ctx)
          * out server
          */
 
-        conn = msg->tmo_rbe.data;
-        then = msg->tmo_rbe.key;
+        conn = msg->tmo_conn;
+        then = msg->tmo_expiry;
 
-        now = nc_msec_now();
         if (now < then) {
             int delta = (int)(then - now);
             ctx->timeout = MIN(delta, ctx->max_timeout);
@@ -325,6 +356,11 @@ core_timeout(struct context *ctx)
         log_debug(LOG_INFO, "req %"PRIu64" on s %d timedout", msg->id, conn->sd);
 
         msg_tmo_delete(msg);
+
+        if (req_timedout(ctx, conn, msg) == NC_OK) {
+            continue;
+        }
+
         conn->err = ETIMEDOUT;
 
         core_close(ctx, conn);
@@ -385,6 +421,14 @@ core_tick(struct context *ctx)
     
     server_pool_update_quota(ctx);
 
+    server_pool_backpressure(ctx);
+
+    server_pool_outlier(ctx);
+
+    server_pool_warmup(ctx);
+
+    server_pool_notify(ctx);
+
     server_pool_probe(ctx);
 }
 
@@ -394,7 +438,7 @@ core_loop(struct context *ctx)
     int nsd, delta;
     int64_t now;
 
-    now = nc_msec_now();
+    now = nc_msec_update();
     while (now >= ctx->next_tick) {
         core_tick(ctx);
         ctx->next_tick += NC_TICK_INTERVAL;
@@ -413,7 +457,7 @@ core_loop(struct context *ctx)
     
     core_timeout(ctx);
     
-    stats_swap(ctx->stats);
+    stats_swap(ctx->stats_shard);
 
     return NC_OK;
 }
@@ -79,6 +79,7 @@ struct mbuf;
 struct mhdr;
 struct conf;
 struct stats;
+struct stats_shard;
 struct instance;
 
 #include <stddef.h>
@@ -109,6 +110,12 @@ struct instance;
 #include <nc_mbuf.h>
 #include <nc_message.h>
 #include <nc_connection.h>
+#include <nc_nearcache.h>
+#include <nc_warmup.h>
+#include <nc_journal.h>
+#include <nc_notify.h>
+#include <nc_ratelimit.h>
+#include <nc_outlier.h>
 
 #define NC_TICK_INTERVAL (1 * 100) /* in msecs */
 
@@ -116,6 +123,7 @@ struct context {
     uint32_t           id;
     struct conf        *cf;
     struct stats       *stats;
+    struct stats_shard *stats_shard; /* stats written by this loop */
 
     struct array       pool;
     struct evbase      *evb;
@@ -134,6 +142,7 @@ struct instance {
     char            *conf_filename;              /* configuration filename */
     uint16_t        stats_port;                  /* stats monitoring port */
     int             stats_interval;              /* stats aggregation interval */
+    uint16_t        metrics_port;                /* openmetrics port, or 0 */
     char            *stats_addr;                 /* stats monitoring addr */
     char            hostname[NC_MAXHOSTNAMELEN]; /* hostname */
     size_t          mbuf_chunk_size;             /* mbuf chunk size */
@@ -147,5 +156,6 @@ struct instance {
 struct context *core_start(struct instance *nci);
 void core_stop(struct context *ctx);
 rstatus_t core_loop(struct context *ctx);
+void core_resume(struct context *ctx, struct conn *conn);
 
 #endif
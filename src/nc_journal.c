@@ -0,0 +1,300 @@
+/*
+ * twemproxy - A fast and lightweight proxy for memcached protocol.
+ * Copyright (C) 2011 Twitter, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <nc_core.h>
+#include <nc_journal.h>
+#include <nc_hashkit.h>
+
+#define JOURNAL_REC_HDR         offsetof(struct journal_rec, data)
+
+static uint32_t
+journal_rec_size(uint32_t len)
+{
+    return (uint32_t)NC_ALIGN(JOURNAL_REC_HDR + len, JOURNAL_ALIGN);
+}
+
+/*
+ * Cut the log at the first record that is torn or does not match its
+ * checksum, as left behind by a crash before the mapping was synced
+ */
+static void
+journal_check(struct journal *jn)
+{
+    struct journal_hdr *hdr = jn->hdr;
+    struct journal_rec *rec;
+    uint32_t pos, nrec;
+
+    for (pos = hdr->head, nrec = 0; pos < hdr->tail; nrec++) {
+        rec = (struct journal_rec *)(jn->base + pos);
+
+        if (hdr->tail - pos < JOURNAL_REC_HDR ||
+            rec->len > hdr->tail - pos - JOURNAL_REC_HDR ||
+            rec->crc != hash_crc32a((char *)rec->data, rec->len)) {
+            log_warn("journal cut at record %"PRIu32", dropping %"PRIu32
+                     " bytes", nrec, hdr->tail - pos);
+            hdr->tail = pos;
+            break;
+        }
+
+        pos += journal_rec_size(rec->len);
+    }
+
+    log_debug(LOG_NOTICE, "journal holds %"PRIu32" records of %"PRIu32
+              " bytes", nrec, hdr->tail - hdr->head);
+}
+
+/*
+ * Open the journal at path, creating it with room for size bytes if it
+ * does not exist. An existing journal keeps its records, and its size if
+ * it is larger
+ */
+struct journal *
+journal_open(char *path, uint32_t size)
+{
+    struct journal *jn;
+    struct journal_hdr hdr;
+    struct stat st;
+    uint8_t *base;
+    int fd;
+
+    ASSERT(size >= JOURNAL_MIN_SIZE);
+
+    fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        log_error("open journal '%s' failed: %s", path, strerror(errno));
+        return NULL;
+    }
+
+    if (fstat(fd, &st) < 0) {
+        log_error("stat journal '%s' failed: %s", path, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    if (st.st_size >= JOURNAL_HDR_SIZE &&
+        pread(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) &&
+        hdr.magic == JOURNAL_MAGIC && hdr.size == st.st_size) {
+        size = MAX(size, hdr.size);
+    }
+
+    if (st.st_size < size && ftruncate(fd, size) < 0) {
+        log_error("size journal '%s' to %"PRIu32" failed: %s", path, size,
+                  strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        log_error("mmap journal '%s' failed: %s", path, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    jn = nc_alloc(sizeof(*jn));
+    if (jn == NULL) {
+        munmap(base, size);
+        close(fd);
+        return NULL;
+    }
+
+    jn->fd = fd;
+    jn->base = base;
+    jn->hdr = (struct journal_hdr *)base;
+    jn->nbyte = 0;
+    jn->ntick = 0;
+    jn->dirty = 0;
+
+    if (jn->hdr->magic != JOURNAL_MAGIC || jn->hdr->size > size ||
+        jn->hdr->head < JOURNAL_HDR_SIZE || jn->hdr->head > jn->hdr->tail ||
+        jn->hdr->tail > jn->hdr->size) {
+        jn->hdr->magic = JOURNAL_MAGIC;
+        jn->hdr->head = JOURNAL_HDR_SIZE;
+        jn->hdr->tail = JOURNAL_HDR_SIZE;
+    } else {
+        journal_check(jn);
+    }
+
+    jn->hdr->size = size;
+    jn->cursor = jn->hdr->head;
+    jn->dirty = 1;
+
+    return jn;
+}
+
+void
+journal_close(struct journal *jn)
+{
+    if (jn == NULL) {
+        return;
+    }
+
+    if (msync(jn->base, jn->hdr->size, MS_SYNC) < 0) {
+        log_error("msync journal failed: %s", strerror(errno));
+    }
+    munmap(jn->base, jn->hdr->size);
+    close(jn->fd);
+    nc_free(jn);
+}
+
+/*
+ * Write the mapping back to disk and wait for it
+ */
+static void
+journal_flush(struct journal *jn)
+{
+    jn->nbyte = 0;
+    jn->ntick = 0;
+
+    if (msync(jn->base, jn->hdr->size, MS_SYNC) < 0) {
+        log_error("msync journal failed: %s", strerror(errno));
+        return;
+    }
+
+    jn->dirty = 0;
+}
+
+/*
+ * Move the records still in the log down to the top of the file, giving
+ * back the room of the committed ones before them
+ */
+static void
+journal_compact(struct journal *jn)
+{
+    struct journal_hdr *hdr = jn->hdr;
+    uint32_t nbyte;
+
+    ASSERT(hdr->head > JOURNAL_HDR_SIZE);
+    ASSERT(jn->cursor >= hdr->head);
+
+    nbyte = hdr->tail - hdr->head;
+    nc_memmove(jn->base + JOURNAL_HDR_SIZE, jn->base + hdr->head, nbyte);
+
+    jn->cursor = JOURNAL_HDR_SIZE + (jn->cursor - hdr->head);
+    hdr->head = JOURNAL_HDR_SIZE;
+    hdr->tail = JOURNAL_HDR_SIZE + nbyte;
+
+    log_debug(LOG_VERB, "journal compacted to %"PRIu32" bytes", nbyte);
+
+    /* the moved records are at risk until their new place is on disk */
+    journal_flush(jn);
+}
+
+/*
+ * Append a record of len bytes at data, or fail if the journal is full
+ */
+rstatus_t
+journal_append(struct journal *jn, uint8_t *data, uint32_t len)
+{
+    struct journal_hdr *hdr = jn->hdr;
+    struct journal_rec *rec;
+    uint32_t need;
+
+    need = journal_rec_size(len);
+    if (need > hdr->size - hdr->tail) {
+        if (hdr->head == JOURNAL_HDR_SIZE ||
+            need > hdr->size - hdr->tail + (hdr->head - JOURNAL_HDR_SIZE)) {
+            return NC_ERROR;
+        }
+        journal_compact(jn);
+    }
+
+    rec = (struct journal_rec *)(jn->base + hdr->tail);
+    rec->len = len;
+    rec->crc = hash_crc32a((char *)data, len);
+    nc_memcpy(rec->data, data, len);
+
+    hdr->tail += need;
+    jn->nbyte += need;
+    jn->dirty = 1;
+
+    if (jn->nbyte >= JOURNAL_SYNC_BYTES) {
+        journal_flush(jn);
+    }
+
+    return NC_OK;
+}
+
+/*
+ * Return the data of the next record not read yet and set len to its
+ * length, or return NULL if every record was read
+ */
+uint8_t *
+journal_read(struct journal *jn, uint32_t *len)
+{
+    struct journal_rec *rec;
+
+    if (jn->cursor == jn->hdr->tail) {
+        return NULL;
+    }
+
+    rec = (struct journal_rec *)(jn->base + jn->cursor);
+    jn->cursor += journal_rec_size(rec->len);
+    *len = rec->len;
+
+    return rec->data;
+}
+
+/*
+ * Drop the records read so far, starting the log over if none is left
+ */
+void
+journal_commit(struct journal *jn)
+{
+    struct journal_hdr *hdr = jn->hdr;
+
+    hdr->head = jn->cursor;
+    if (hdr->head == hdr->tail) {
+        hdr->head = JOURNAL_HDR_SIZE;
+        hdr->tail = JOURNAL_HDR_SIZE;
+        jn->cursor = JOURNAL_HDR_SIZE;
+    }
+
+    jn->dirty = 1;
+}
+
+/*
+ * Read again the records read since the last commit
+ */
+void
+journal_rewind(struct journal *jn)
+{
+    jn->cursor = jn->hdr->head;
+}
+
+/*
+ * Called once every tick, sync the journal if it has had changes for
+ * JOURNAL_SYNC_TICKS ticks
+ */
+void
+journal_sync(struct journal *jn)
+{
+    if (!jn->dirty) {
+        return;
+    }
+
+    if (++jn->ntick < JOURNAL_SYNC_TICKS) {
+        return;
+    }
+
+    journal_flush(jn);
+}
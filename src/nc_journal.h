@@ -0,0 +1,93 @@
+/*
+ * twemproxy - A fast and lightweight proxy for memcached protocol.
+ * Copyright (C) 2011 Twitter, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _NC_JOURNAL_H_
+#define _NC_JOURNAL_H_
+
+#include <nc_core.h>
+
+/*
+ * Journal: an append-only log of records in a memory-mapped local file
+ * of fixed size. Records are read back in order from the oldest one, and
+ * dropped only once committed, so a reader can rewind and read again
+ * what it failed to deliver. Once every record is committed the log
+ * starts over from the top of the file; an append that finds no room
+ * past the newest record first moves the records left down to the top.
+ *
+ * Appends only touch the mapping, which is synced to disk with msync
+ * MS_SYNC. journal_sync is called once every tick and syncs once every
+ * JOURNAL_SYNC_TICKS ticks with changes, and journal_append syncs as soon
+ * as JOURNAL_SYNC_BYTES bytes were appended since the last sync. A crash
+ * thus loses at most the records appended in the last JOURNAL_SYNC_TICKS
+ * ticks, and no more than about JOURNAL_SYNC_BYTES bytes of them, plus
+ * the ones a compaction was moving at the time. journal_close syncs the
+ * rest. Records are checksummed, and on open the log is cut at the first
+ * bad one.
+ */
+
+#define JOURNAL_MAGIC           0x314a434e /* "NCJ1" */
+#define JOURNAL_HDR_SIZE        4096       /* bytes before the first record */
+#define JOURNAL_ALIGN           sizeof(uint64_t) /* record alignment */
+#define JOURNAL_MIN_SIZE        (64 * 1024)
+#define JOURNAL_SYNC_TICKS      10         /* max ticks between syncs */
+#define JOURNAL_SYNC_BYTES      (64 * 1024) /* max bytes appended unsynced */
+
+struct journal_hdr {
+    uint32_t magic;         /* JOURNAL_MAGIC */
+    uint32_t size;          /* file size */
+    uint32_t head;          /* offset of the oldest record */
+    uint32_t tail;          /* offset past the newest record */
+};
+
+struct journal_rec {
+    uint32_t len;           /* data length */
+    uint32_t crc;           /* data crc32 */
+    uint8_t  data[1];       /* data */
+};
+
+struct journal {
+    int                fd;      /* file descriptor */
+    uint8_t            *base;   /* mapping */
+    struct journal_hdr *hdr;    /* header at the top of the mapping */
+    uint32_t           cursor;  /* offset of the next record to read */
+    uint32_t           nbyte;   /* # bytes appended since last sync */
+    uint32_t           ntick;   /* # ticks dirty since last sync */
+    unsigned           dirty:1; /* appended or committed since last sync? */
+};
+
+struct journal *journal_open(char *path, uint32_t size);
+void journal_close(struct journal *jn);
+
+rstatus_t journal_append(struct journal *jn, uint8_t *data, uint32_t len);
+uint8_t *journal_read(struct journal *jn, uint32_t *len);
+void journal_commit(struct journal *jn);
+void journal_rewind(struct journal *jn);
+void journal_sync(struct journal *jn);
+
+static inline bool
+journal_empty(struct journal *jn)
+{
+    return jn->hdr->head == jn->hdr->tail;
+}
+
+static inline uint32_t
+journal_nbyte(struct journal *jn)
+{
+    return jn->hdr->tail - jn->hdr->head;
+}
+
+#endif
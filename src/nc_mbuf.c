@@ -23,6 +23,9 @@
 static uint32_t nfree_mbufq;   /* # free mbuf */
 static struct mhdr free_mbufq; /* free mbuf q */
 
+static uint32_t nfree_viewq;   /* # free view */
+static struct mhdr free_viewq; /* free view q */
+
 static size_t mbuf_chunk_size; /* mbuf chunk size - header + data (const) */
 static size_t mbuf_offset;     /* mbuf offset in chunk (const) */
 
@@ -95,6 +98,8 @@ mbuf_get(void)
 
     mbuf->pos = mbuf->start;
     mbuf->last = mbuf->start;
+    mbuf->refcount = 1;
+    mbuf->shared = NULL;
 
     log_debug(LOG_VVERB, "get mbuf %p", mbuf);
 
@@ -115,16 +120,89 @@ mbuf_free(struct mbuf *mbuf)
     nc_free(buf);
 }
 
+/*
+ * Get a view on bytes [pos, last) of mbuf src. A view is a bare mbuf
+ * header whose data stays in the owner chunk; the owner is recycled only
+ * after itself and all of its views have been put. Views are read-only:
+ * they are always full, so nothing ever appends to one, and the owner's
+ * bytes are never rewritten once a message is complete.
+ */
+struct mbuf *
+mbuf_get_ref(struct mbuf *src, uint8_t *pos, uint8_t *last)
+{
+    struct mbuf *mbuf, *owner;
+
+    owner = src->shared != NULL ? src->shared : src;
+
+    ASSERT(owner->magic == MBUF_MAGIC && owner->refcount > 0);
+    ASSERT(pos >= owner->start && pos <= last && last <= owner->end);
+
+    if (!STAILQ_EMPTY(&free_viewq)) {
+        ASSERT(nfree_viewq > 0);
+
+        mbuf = STAILQ_FIRST(&free_viewq);
+        nfree_viewq--;
+        STAILQ_REMOVE_HEAD(&free_viewq, next);
+
+        ASSERT(mbuf->magic == MBUF_MAGIC);
+    } else {
+        mbuf = nc_alloc(MBUF_HSIZE);
+        if (mbuf == NULL) {
+            return NULL;
+        }
+        mbuf->magic = MBUF_MAGIC;
+    }
+
+    STAILQ_NEXT(mbuf, next) = NULL;
+    mbuf->pos = pos;
+    mbuf->last = last;
+    mbuf->start = pos;
+    mbuf->end = last;
+    mbuf->refcount = 0;
+    mbuf->shared = owner;
+
+    owner->refcount++;
+
+    log_debug(LOG_VVERB, "get view %p on mbuf %p len %d refcount %"PRIu32,
+              mbuf, owner, last - pos, owner->refcount);
+
+    return mbuf;
+}
+
+static void
+mbuf_unref(struct mbuf *mbuf)
+{
+    ASSERT(mbuf->shared == NULL && mbuf->refcount > 0);
+
+    if (--mbuf->refcount > 0) {
+        return;
+    }
+
+    nfree_mbufq++;
+    STAILQ_INSERT_HEAD(&free_mbufq, mbuf, next);
+}
+
 void
 mbuf_put(struct mbuf *mbuf)
 {
+    struct mbuf *owner;
+
     log_debug(LOG_VVERB, "put mbuf %p len %d", mbuf, mbuf->last - mbuf->pos);
 
     ASSERT(STAILQ_NEXT(mbuf, next) == NULL);
     ASSERT(mbuf->magic == MBUF_MAGIC);
 
-    nfree_mbufq++;
-    STAILQ_INSERT_HEAD(&free_mbufq, mbuf, next);
+    owner = mbuf->shared;
+    if (owner == NULL) {
+        mbuf_unref(mbuf);
+        return;
+    }
+
+    mbuf->shared = NULL;
+    nfree_viewq++;
+    STAILQ_INSERT_HEAD(&free_viewq, mbuf, next);
+
+    mbuf_unref(owner);
 }
 
 /*
@@ -159,6 +237,10 @@ mbuf_size(struct mbuf *mbuf)
 {
     ASSERT(mbuf->end >= mbuf->last);
 
+    if (mbuf->shared != NULL) {
+        return 0;
+    }
+
     return (uint32_t)(mbuf->end - mbuf->last);
 }
 
@@ -259,12 +341,45 @@ mbuf_split(struct mhdr *h, uint8_t *pos, mbuf_copy_t cb, void *cbarg)
     return nbuf;
 }
 
+/*
+ * Append n bytes at pos of mbuf src to the tail of mhdr h without
+ * copying them: the span becomes a view on src. Short spans that fit in
+ * the tail mbuf of h are copied there instead.
+ *
+ * Return the address of the first appended byte, or NULL on ENOMEM.
+ */
+uint8_t *
+mbuf_share(struct mhdr *h, struct mbuf *src, uint8_t *pos, size_t n)
+{
+    struct mbuf *mbuf;
+
+    ASSERT(n > 0);
+    ASSERT(pos >= src->pos && pos + n <= src->last);
+
+    mbuf = STAILQ_LAST(h, mbuf, next);
+    if (n < MBUF_SHARE_MIN_SIZE && mbuf != NULL && n <= mbuf_size(mbuf)) {
+        mbuf_copy(mbuf, pos, n);
+        return mbuf->last - n;
+    }
+
+    mbuf = mbuf_get_ref(src, pos, pos + n);
+    if (mbuf == NULL) {
+        return NULL;
+    }
+    mbuf_insert(h, mbuf);
+
+    return mbuf->pos;
+}
+
 void
 mbuf_init(struct instance *nci)
 {
     nfree_mbufq = 0;
     STAILQ_INIT(&free_mbufq);
 
+    nfree_viewq = 0;
+    STAILQ_INIT(&free_viewq);
+
     mbuf_chunk_size = nci->mbuf_chunk_size;
     mbuf_offset = mbuf_chunk_size - MBUF_HSIZE;
 
@@ -282,4 +397,12 @@ mbuf_deinit(void)
         nfree_mbufq--;
     }
     ASSERT(nfree_mbufq == 0);
+
+    while (!STAILQ_EMPTY(&free_viewq)) {
+        struct mbuf *mbuf = STAILQ_FIRST(&free_viewq);
+        mbuf_remove(&free_viewq, mbuf);
+        nc_free(mbuf);
+        nfree_viewq--;
+    }
+    ASSERT(nfree_viewq == 0);
 }
@@ -23,12 +23,14 @@
 typedef void (*mbuf_copy_t)(struct mbuf *, void *);
 
 struct mbuf {
-    uint32_t           magic;   /* mbuf magic (const) */
-    STAILQ_ENTRY(mbuf) next;    /* next mbuf */
-    uint8_t            *pos;    /* read marker */
-    uint8_t            *last;   /* write marker */
-    uint8_t            *start;  /* start of buffer (const) */
-    uint8_t            *end;    /* end of buffer (const) */
+    uint32_t           magic;    /* mbuf magic (const) */
+    uint32_t           refcount; /* # holders of the data, owner only */
+    STAILQ_ENTRY(mbuf) next;     /* next mbuf */
+    uint8_t            *pos;     /* read marker */
+    uint8_t            *last;    /* write marker */
+    uint8_t            *start;   /* start of buffer (const) */
+    uint8_t            *end;     /* end of buffer (const) */
+    struct mbuf        *shared;  /* owner of the data, if a view */
 };
 
 STAILQ_HEAD(mhdr, mbuf);
@@ -39,21 +41,29 @@ STAILQ_HEAD(mhdr, mbuf);
 #define MBUF_SIZE       16384
 #define MBUF_HSIZE      sizeof(struct mbuf)
 
+/*
+ * Spans shorter than this are copied by mbuf_share instead of being
+ * referenced, as a view costs more than copying a few hundred bytes
+ */
+#define MBUF_SHARE_MIN_SIZE 512
+
 static inline bool
 mbuf_empty(struct mbuf *mbuf)
 {
     return mbuf->pos == mbuf->last ? true : false;
 }
 
+/* A view never takes new data, its bytes belong to another mbuf */
 static inline bool
 mbuf_full(struct mbuf *mbuf)
 {
-    return mbuf->last == mbuf->end ? true : false;
+    return (mbuf->last == mbuf->end || mbuf->shared != NULL) ? true : false;
 }
 
 void mbuf_init(struct instance *nci);
 void mbuf_deinit(void);
 struct mbuf *mbuf_get(void);
+struct mbuf *mbuf_get_ref(struct mbuf *src, uint8_t *pos, uint8_t *last);
 void mbuf_put(struct mbuf *mbuf);
 void mbuf_rewind(struct mbuf *mbuf);
 uint32_t mbuf_length(struct mbuf *mbuf);
@@ -63,5 +73,6 @@ void mbuf_insert(struct mhdr *mhdr, struct mbuf *mbuf);
 void mbuf_remove(struct mhdr *mhdr, struct mbuf *mbuf);
 void mbuf_copy(struct mbuf *mbuf, uint8_t *pos, size_t n);
 struct mbuf *mbuf_split(struct mhdr *h, uint8_t *pos, mbuf_copy_t cb, void *cbarg);
+uint8_t *mbuf_share(struct mhdr *h, struct mbuf *src, uint8_t *pos, size_t n);
 
 #endif
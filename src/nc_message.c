@@ -22,6 +22,7 @@
 
 #include <nc_core.h>
 #include <nc_server.h>
+#include <hashkit/nc_hashkit.h>
 #include <proto/nc_proto.h>
 
 #if (IOV_MAX > 128)
@@ -113,80 +114,452 @@ static uint64_t msg_id;          /* message id counter */
 static uint64_t frag_id;         /* fragment id counter */
 static uint32_t nfree_msgq;      /* # free msg q */
 static struct msg_tqh free_msgq; /* free msg q */
-static struct rbtree tmo_rbt;    /* timeout rbtree */
-static struct rbnode tmo_rbs;    /* timeout rbtree sentinel */
+static struct array tmo_qs;     /* timeout q, one per timeout value */
 
-static struct msg *
-msg_from_rbe(struct rbnode *node)
+#define DEFINE_ACTION(_name) string(#_name),
+static struct string msg_type_strings[] = {
+    MSG_TYPE_CODEC( DEFINE_ACTION )
+    null_string
+};
+#undef DEFINE_ACTION
+
+/*
+ * Keep the fields every message touches within the first two cache lines
+ * and the message itself within five on 64-bit builds; see struct msg.
+ * Queue tracing in assert enabled builds grows every link, so the check
+ * only holds without it
+ */
+#define MSG_HOT_SIZE    128
+#define MSG_MAX_SIZE    320
+
+#ifndef QUEUE_MACRO_TRACE
+NC_STATIC_ASSERT(offsetof(struct msg, state) <= MSG_HOT_SIZE, msg_hot_size);
+NC_STATIC_ASSERT(sizeof(struct msg) <= MSG_MAX_SIZE, msg_max_size);
+#endif
+
+/*
+ * Protocol handlers by protocol and role. Request and response tables
+ * only carry the handlers invoked on a message of that role
+ */
+static const struct msg_ops memcache_req_ops = {
+    memcache_parse_req,             /* parser */
+    memcache_pre_splitcopy,         /* pre_splitcopy */
+    memcache_post_splitcopy,        /* post_splitcopy */
+    NULL,                           /* pre_coalesce */
+    memcache_post_coalesce,         /* post_coalesce */
+    memcache_pre_req_forward,       /* pre_req_forward */
+    memcache_routing,               /* routing */
+    memcache_post_routing,          /* post_routing */
+    NULL,                           /* pre_rsp_forward */
+    memcache_build_probe,           /* build_probe */
+    memcache_reply,                 /* reply */
+    memcache_cacheable,             /* cacheable */
+};
+
+static const struct msg_ops memcache_rsp_ops = {
+    memcache_parse_rsp,             /* parser */
+    NULL,                           /* pre_splitcopy */
+    NULL,                           /* post_splitcopy */
+    memcache_pre_coalesce,          /* pre_coalesce */
+    NULL,                           /* post_coalesce */
+    NULL,                           /* pre_req_forward */
+    NULL,                           /* routing */
+    NULL,                           /* post_routing */
+    memcache_pre_rsp_forward,       /* pre_rsp_forward */
+    NULL,                           /* build_probe */
+    NULL,                           /* reply */
+    memcache_cacheable,             /* cacheable */
+};
+
+static const struct msg_ops memcache_binary_req_ops = {
+    memcache_binary_parse_req,      /* parser */
+    NULL,                           /* pre_splitcopy */
+    memcache_binary_post_splitcopy, /* post_splitcopy */
+    NULL,                           /* pre_coalesce */
+    memcache_binary_post_coalesce,  /* post_coalesce */
+    memcache_pre_req_forward,       /* pre_req_forward */
+    memcache_routing,               /* routing */
+    memcache_post_routing,          /* post_routing */
+    NULL,                           /* pre_rsp_forward */
+    NULL,                           /* build_probe */
+    memcache_binary_reply,          /* reply */
+    NULL,                           /* cacheable */
+};
+
+static const struct msg_ops memcache_binary_rsp_ops = {
+    memcache_binary_parse_rsp,      /* parser */
+    NULL,                           /* pre_splitcopy */
+    NULL,                           /* post_splitcopy */
+    memcache_binary_pre_coalesce,   /* pre_coalesce */
+    NULL,                           /* post_coalesce */
+    NULL,                           /* pre_req_forward */
+    NULL,                           /* routing */
+    NULL,                           /* post_routing */
+    NULL,                           /* pre_rsp_forward */
+    NULL,                           /* build_probe */
+    NULL,                           /* reply */
+    NULL,                           /* cacheable */
+};
+
+static const struct msg_ops redis_req_ops = {
+    redis_parse_req,                /* parser */
+    redis_pre_splitcopy,            /* pre_splitcopy */
+    redis_post_splitcopy,           /* post_splitcopy */
+    NULL,                           /* pre_coalesce */
+    redis_post_coalesce,            /* post_coalesce */
+    NULL,                           /* pre_req_forward */
+    redis_routing,                  /* routing */
+    NULL,                           /* post_routing */
+    NULL,                           /* pre_rsp_forward */
+    redis_build_probe,              /* build_probe */
+    NULL,                           /* reply */
+    NULL,                           /* cacheable */
+};
+
+static const struct msg_ops redis_rsp_ops = {
+    redis_parse_rsp,                /* parser */
+    NULL,                           /* pre_splitcopy */
+    NULL,                           /* post_splitcopy */
+    redis_pre_coalesce,             /* pre_coalesce */
+    NULL,                           /* post_coalesce */
+    NULL,                           /* pre_req_forward */
+    NULL,                           /* routing */
+    NULL,                           /* post_routing */
+    redis_pre_rsp_forward,          /* pre_rsp_forward */
+    NULL,                           /* build_probe */
+    NULL,                           /* reply */
+    NULL,                           /* cacheable */
+};
+
+/*
+ * Request timeouts are indexed by one fifo q per distinct timeout value.
+ * Pools configure only a handful of fixed timeouts, and every request
+ * inserted with the same timeout expires no earlier than the one before
+ * it, so each q stays sorted by expiry without any rebalancing; insert
+ * and delete are O(1) and the earliest expiry is the earliest head
+ */
+#define MSG_TMO_NQ  4
+
+struct msg_tmoq {
+    int            timeout;  /* timeout in msec */
+    struct msg_tqh msgq;     /* requests sorted by expiry */
+};
+
+static struct msg_tmoq *
+msg_tmoq_get(int timeout)
 {
-    struct msg *msg;
-    int offset;
+    rstatus_t status;
+    struct msg_tmoq **qp, *q;
+    uint32_t i, nq;
 
-    offset = offsetof(struct msg, tmo_rbe);
-    msg = (struct msg *)((char *)node - offset);
+    for (i = 0, nq = array_n(&tmo_qs); i < nq; i++) {
+        q = *(struct msg_tmoq **)array_get(&tmo_qs, i);
+        if (q->timeout == timeout) {
+            return q;
+        }
+    }
 
-    return msg;
+    if (tmo_qs.elem == NULL) {
+        status = array_init(&tmo_qs, MSG_TMO_NQ, sizeof(struct msg_tmoq *));
+        if (status != NC_OK) {
+            return NULL;
+        }
+    }
+
+    q = nc_alloc(sizeof(*q));
+    if (q == NULL) {
+        return NULL;
+    }
+
+    qp = array_push(&tmo_qs);
+    if (qp == NULL) {
+        nc_free(q);
+        return NULL;
+    }
+
+    q->timeout = timeout;
+    TAILQ_INIT(&q->msgq);
+    *qp = q;
+
+    return q;
 }
 
 struct msg *
 msg_tmo_min(void)
 {
-    struct rbnode *node;
-
-    node = rbtree_min(&tmo_rbt);
-    if (node == NULL) {
-        return NULL;
+    struct msg *msg, *min;
+    struct msg_tmoq *q;
+    uint32_t i, nq;
+
+    min = NULL;
+    for (i = 0, nq = array_n(&tmo_qs); i < nq; i++) {
+        q = *(struct msg_tmoq **)array_get(&tmo_qs, i);
+        msg = TAILQ_FIRST(&q->msgq);
+        if (msg != NULL && (min == NULL || msg->tmo_expiry < min->tmo_expiry)) {
+            min = msg;
+        }
     }
 
-    return msg_from_rbe(node);
+    return min;
 }
 
 void
 msg_tmo_insert(struct msg *msg, struct conn *conn)
 {
-    struct rbnode *node;
+    struct msg_tmoq *q;
     int timeout;
 
     ASSERT(msg->request);
     ASSERT(!msg->quit && !msg->noreply);
+    ASSERT(msg->tmo_q == NULL);
 
     timeout = server_timeout(conn);
     if (timeout <= 0) {
         return;
     }
 
-    node = &msg->tmo_rbe;
-    node->key = nc_msec_now() + timeout;
-    node->data = conn;
+    q = msg_tmoq_get(timeout);
+    if (q == NULL) {
+        log_error("insert msg %"PRIu64" into tmo q failed: %s", msg->id,
+                  strerror(ENOMEM));
+        return;
+    }
 
-    rbtree_insert(&tmo_rbt, node);
+    msg->tmo_q = q;
+    msg->tmo_expiry = nc_msec_now() + timeout;
+    msg->tmo_conn = conn;
+    TAILQ_INSERT_TAIL(&q->msgq, msg, t_tqe);
 
-    log_debug(LOG_VERB, "insert msg %"PRIu64" into tmo rbt with expiry of "
+    log_debug(LOG_VERB, "insert msg %"PRIu64" into tmo q with expiry of "
               "%d msec", msg->id, timeout);
 }
 
 void
 msg_tmo_delete(struct msg *msg)
 {
-    struct rbnode *node;
+    /* already deleted */
 
-    node = &msg->tmo_rbe;
+    if (msg->tmo_q == NULL) {
+        return;
+    }
 
-    /* already deleted */
+    TAILQ_REMOVE(&msg->tmo_q->msgq, msg, t_tqe);
+    msg->tmo_q = NULL;
+    msg->tmo_conn = NULL;
+
+    log_debug(LOG_VERB, "delete msg %"PRIu64" from tmo q", msg->id);
+}
+
+/*
+ * Identical retrievals in flight, hashed by key. A request forwarded to a
+ * server leads a flight; identical requests from clients of the same pool
+ * join it until the leader lands, waiting on the flight through their
+ * s_tqe, which is unused as they are never forwarded. A write to the key
+ * detaches the flight, which then only lands the requests it already has
+ */
+#define MSG_FLIGHT_NBUCKET  1024
+
+struct msg_flight {
+    TAILQ_ENTRY(msg_flight) f_tqe;    /* link in hash bucket / free q */
+    struct msg              *leader;  /* request in flight */
+    struct server_pool      *pool;    /* pool the leader came from */
+    uint32_t                hash;     /* key hash */
+    struct msg_tqh          waitq;    /* requests waiting on the leader */
+    unsigned                detached:1; /* key written since it led? */
+};
+
+TAILQ_HEAD(msg_flight_tqh, msg_flight);
+
+static struct msg_flight_tqh *flight_bucket; /* flight hash buckets */
+static struct msg_flight_tqh free_flightq;   /* free flight q */
+
+static uint32_t
+msg_flight_hash(struct msg *msg)
+{
+    return hash_fnv1a_32((char *)msg->key_start,
+                         (size_t)(msg->key_end - msg->key_start));
+}
+
+static bool
+msg_flight_key(struct msg_flight *flight, struct msg *msg, uint32_t hash)
+{
+    struct msg *leader = flight->leader;
+    size_t nkey;
+
+    nkey = (size_t)(msg->key_end - msg->key_start);
+
+    return flight->hash == hash &&
+           (size_t)(leader->key_end - leader->key_start) == nkey &&
+           memcmp(leader->key_start, msg->key_start, nkey) == 0;
+}
+
+static struct msg_flight *
+msg_flight_find(struct server_pool *pool, struct msg *msg, uint32_t hash)
+{
+    struct msg_flight *flight;
+
+    if (flight_bucket == NULL) {
+        return NULL;
+    }
+
+    TAILQ_FOREACH(flight, &flight_bucket[hash % MSG_FLIGHT_NBUCKET], f_tqe) {
+        if (!flight->detached && flight->pool == pool &&
+            flight->leader->type == msg->type &&
+            msg_flight_key(flight, msg, hash)) {
+            return flight;
+        }
+    }
+
+    return NULL;
+}
 
-    if (node->data == NULL) {
+/*
+ * Make msg, just forwarded from a client of pool, the leader of a flight
+ * for its key, unless one is already in flight
+ */
+rstatus_t
+msg_flight_lead(struct server_pool *pool, struct msg *msg)
+{
+    struct msg_flight *flight;
+    uint32_t i, hash;
+
+    ASSERT(msg->request && !msg->flight && !msg->collapsed);
+    ASSERT(msg->key_start != NULL && msg->key_end > msg->key_start);
+
+    if (flight_bucket == NULL) {
+        flight_bucket = nc_alloc(sizeof(*flight_bucket) * MSG_FLIGHT_NBUCKET);
+        if (flight_bucket == NULL) {
+            return NC_ENOMEM;
+        }
+        for (i = 0; i < MSG_FLIGHT_NBUCKET; i++) {
+            TAILQ_INIT(&flight_bucket[i]);
+        }
+    }
+
+    hash = msg_flight_hash(msg);
+    if (msg_flight_find(pool, msg, hash) != NULL) {
+        return NC_OK;
+    }
+
+    if (!TAILQ_EMPTY(&free_flightq)) {
+        flight = TAILQ_FIRST(&free_flightq);
+        TAILQ_REMOVE(&free_flightq, flight, f_tqe);
+    } else {
+        flight = nc_alloc(sizeof(*flight));
+        if (flight == NULL) {
+            return NC_ENOMEM;
+        }
+    }
+
+    flight->leader = msg;
+    flight->pool = pool;
+    flight->hash = hash;
+    TAILQ_INIT(&flight->waitq);
+    flight->detached = 0;
+    TAILQ_INSERT_HEAD(&flight_bucket[hash % MSG_FLIGHT_NBUCKET], flight, f_tqe);
+
+    msg->flight = 1;
+
+    log_debug(LOG_VERB, "req %"PRIu64" leads flight", msg->id);
+
+    return NC_OK;
+}
+
+/*
+ * Have msg from a client of pool wait on an identical request in flight.
+ * Returns false if there is none
+ */
+bool
+msg_flight_join(struct server_pool *pool, struct msg *msg)
+{
+    struct msg_flight *flight;
+
+    ASSERT(msg->request && !msg->flight && !msg->collapsed);
+    ASSERT(msg->key_start != NULL && msg->key_end > msg->key_start);
+
+    flight = msg_flight_find(pool, msg, msg_flight_hash(msg));
+    if (flight == NULL) {
+        return false;
+    }
+
+    TAILQ_INSERT_TAIL(&flight->waitq, msg, s_tqe);
+    msg->collapsed = 1;
+
+    log_debug(LOG_VERB, "req %"PRIu64" waits on req %"PRIu64" in flight",
+              msg->id, flight->leader->id);
+
+    return true;
+}
+
+/*
+ * Detach the flights for the key of msg, a write from a client of any
+ * pool, so that reads after it lead a flight of their own rather than
+ * land with a value read before it
+ */
+void
+msg_flight_detach(struct msg *msg)
+{
+    struct msg_flight *flight;
+    uint32_t hash;
+
+    ASSERT(msg->request);
+    ASSERT(msg->key_start != NULL && msg->key_end > msg->key_start);
+
+    if (flight_bucket == NULL) {
         return;
     }
 
-    rbtree_delete(&tmo_rbt, node);
+    hash = msg_flight_hash(msg);
+
+    TAILQ_FOREACH(flight, &flight_bucket[hash % MSG_FLIGHT_NBUCKET], f_tqe) {
+        if (!flight->detached && msg_flight_key(flight, msg, hash)) {
+            flight->detached = 1;
+
+            log_debug(LOG_VERB, "req %"PRIu64" detaches flight of req %"PRIu64,
+                      msg->id, flight->leader->id);
+        }
+    }
+}
+
+/*
+ * End the flight led by leader, moving its waiting requests to waitq
+ */
+void
+msg_flight_end(struct msg *leader, struct msg_tqh *waitq)
+{
+    struct msg_flight *flight;
+    struct msg *msg;
+    uint32_t hash;
+
+    ASSERT(leader->request && leader->flight);
+
+    hash = msg_flight_hash(leader);
+
+    TAILQ_FOREACH(flight, &flight_bucket[hash % MSG_FLIGHT_NBUCKET], f_tqe) {
+        if (flight->leader == leader) {
+            break;
+        }
+    }
+    ASSERT(flight != NULL);
+
+    TAILQ_REMOVE(&flight_bucket[hash % MSG_FLIGHT_NBUCKET], flight, f_tqe);
+
+    while (!TAILQ_EMPTY(&flight->waitq)) {
+        msg = TAILQ_FIRST(&flight->waitq);
+        TAILQ_REMOVE(&flight->waitq, msg, s_tqe);
+        msg->collapsed = 0;
+        TAILQ_INSERT_TAIL(waitq, msg, s_tqe);
+    }
+
+    flight->leader = NULL;
+    TAILQ_INSERT_HEAD(&free_flightq, flight, f_tqe);
 
-    log_debug(LOG_VERB, "delete msg %"PRIu64" from tmo rbt", msg->id);
+    leader->flight = 0;
 }
 
 static struct msg *
 _msg_get(void)
 {
-    rstatus_t status;
     struct msg *msg;
 
     if (!TAILQ_EMPTY(&free_msgq)) {
@@ -203,59 +576,19 @@ _msg_get(void)
         return NULL;
     }
 
-    status = array_init(&msg->keys, DEFAULT_STATS_NUM, sizeof(struct string));
-    if (status != NC_OK) {
-        return NULL;
-    }
-    status = array_init(&msg->vals, DEFAULT_STATS_NUM, sizeof(struct string));
-    if (status != NC_OK) {
-        return NULL;
-    }
 done:
     /* c_tqe, s_tqe, and m_tqe are left uninitialized */
     msg->id = ++msg_id;
     msg->peer = NULL;
     msg->owner = NULL;
-    msg->origin = NULL;
-
-    rbtree_node_init(&msg->tmo_rbe);
+    msg->ops = NULL;
 
     STAILQ_INIT(&msg->mhdr);
     msg->mlen = 0;
-
-    msg->state = 0;
-    msg->pos = NULL;
-    msg->token = NULL;
-
-    msg->parser = NULL;
-    msg->result = MSG_PARSE_OK;
-
-    msg->pre_splitcopy = NULL;
-    msg->post_splitcopy = NULL;
-    msg->pre_coalesce = NULL;
-    msg->post_coalesce = NULL;
-
     msg->type = MSG_UNKNOWN;
 
     msg->key_start = NULL;
     msg->key_end = NULL;
-    
-    msg->val_start = NULL;
-    msg->val_end = NULL;
-        
-    msg->vlen = 0;
-    msg->end = NULL;
-
-    msg->frag_owner = NULL;
-    msg->nfrag = 0;
-    msg->frag_id = 0;
-
-    msg->narg_start = NULL;
-    msg->narg_end = NULL;
-    msg->narg = 0;
-    msg->rnarg = 0;
-    msg->rlen = 0;
-    msg->integer = 0;
 
     msg->err = 0;
     msg->error = 0;
@@ -269,11 +602,48 @@ done:
     msg->last_fragment = 0;
     msg->swallow = 0;
     msg->redis = 0;
+    msg->quiet = 0;
+    msg->noforward = 0;
+    msg->ttl = 0;
+    msg->waiting = 0;
+    msg->partial = 0;
+    msg->sent = 0;
+    msg->flight = 0;
+    msg->collapsed = 0;
+    msg->hotkey = 0;
 
+    msg->state = 0;
+    msg->result = MSG_PARSE_OK;
+    msg->pos = NULL;
+    msg->token = NULL;
+    msg->end = NULL;
+    msg->rlen = 0;
+    msg->cache_gen = 0;
+
+    /* redis parser fields share storage with these */
+    msg->val_start = NULL;
+    msg->val_end = NULL;
+    msg->flags_start = NULL;
+    msg->flags_end = NULL;
+    msg->expire = 0;
+    msg->vlen = 0;
+    msg->opaque = 0;
+    msg->opcode = 0;
+
+    msg->tmo_q = NULL;
+    msg->tmo_expiry = 0;
+    msg->tmo_conn = NULL;
+    msg->deadline = 0;
+
+    msg->frag_owner = NULL;
+    msg->frag_id = 0;
+    msg->fwd_usec = 0;
+    msg->nfrag = 0;
+
+    msg->origin = NULL;
+    msg->hooks = NULL;
     msg->notify_owner = NULL;
-    msg->waiting = 0;
-    msg->pre_swallow = NULL;
-    msg->pre_req_put = NULL;
+    msg->kv = NULL;
 
     return msg;
 }
@@ -294,35 +664,12 @@ msg_get(struct conn *conn, bool request, bool redis)
     msg->redis = redis ? 1 : 0;
 
     if (redis) {
-        if (request) {
-            msg->parser = redis_parse_req;
-        } else {
-            msg->parser = redis_parse_rsp;
-        }
-        msg->pre_splitcopy = redis_pre_splitcopy;
-        msg->post_splitcopy = redis_post_splitcopy;
-        msg->pre_coalesce = redis_pre_coalesce;
-        msg->post_coalesce = redis_post_coalesce;
-        msg->pre_req_forward = NULL;
-        msg->routing = redis_routing;
-        msg->post_routing = NULL;
-        msg->pre_rsp_forward = redis_pre_rsp_forward;
-        msg->build_probe = redis_build_probe;
+        msg->ops = request ? &redis_req_ops : &redis_rsp_ops;
+    } else if (conn != NULL && conn->binary) {
+        msg->ops = request ? &memcache_binary_req_ops :
+                             &memcache_binary_rsp_ops;
     } else {
-        if (request) {
-            msg->parser = memcache_parse_req;
-        } else {
-            msg->parser = memcache_parse_rsp;
-        }
-        msg->pre_splitcopy = memcache_pre_splitcopy;
-        msg->post_splitcopy = memcache_post_splitcopy;
-        msg->pre_coalesce = memcache_pre_coalesce;
-        msg->post_coalesce = memcache_post_coalesce;
-        msg->pre_req_forward = memcache_pre_req_forward;
-        msg->routing = memcache_routing;
-        msg->post_routing = memcache_post_routing;
-        msg->pre_rsp_forward = memcache_pre_rsp_forward;
-        msg->build_probe = memcache_build_probe;
+        msg->ops = request ? &memcache_req_ops : &memcache_rsp_ops;
     }
 
     log_debug(LOG_VVERB, "get msg %p id %"PRIu64" request %d owner sd %d",
@@ -335,7 +682,8 @@ struct msg *
 msg_clone(struct msg *msg)
 {
     struct msg *clone;
-    struct mbuf *src, *dst;
+    struct mbuf *src;
+    uint8_t *pos;
     
     /* Clone message structure */
     clone = msg_get(msg->owner, msg->request, msg->redis);
@@ -343,16 +691,21 @@ msg_clone(struct msg *msg)
         return NULL;
     }
 
-    /* Clone mbufs */
+    /* Share mbufs rather than copy them, along with the end marker */
     STAILQ_FOREACH(src, &msg->mhdr, next) {
-        dst = mbuf_get();
-        if (dst == NULL) {
+        if (mbuf_empty(src)) {
+            continue;
+        }
+
+        pos = mbuf_share(&clone->mhdr, src, src->pos, mbuf_length(src));
+        if (pos == NULL) {
             msg_put(clone);
             return NULL;
         }
 
-        mbuf_copy(dst, src->pos, mbuf_length(src));
-        mbuf_insert(&clone->mhdr, dst);
+        if (msg->end >= src->pos && msg->end < src->last) {
+            clone->end = pos + (msg->end - src->pos);
+        }
     }
     
     clone->type = msg->type;
@@ -361,10 +714,17 @@ msg_clone(struct msg *msg)
     clone->noreply = msg->noreply;
     clone->swallow = msg->swallow;
     clone->mlen = msg->mlen;
+    clone->deadline = msg->deadline;
     
     return clone;
 }
 
+struct string *
+msg_type_string(msg_type_t type)
+{
+    return &msg_type_strings[type];
+}
+
 struct msg *
 msg_get_error(bool redis, err_t err)
 {
@@ -401,15 +761,66 @@ msg_get_error(bool redis, err_t err)
     return msg;
 }
 
+/*
+ * Return the stat key/value pairs of msg, attaching them on first use
+ */
+struct msg_kv *
+msg_kv_get(struct msg *msg)
+{
+    rstatus_t status;
+    struct msg_kv *kv;
+
+    if (msg->kv != NULL) {
+        return msg->kv;
+    }
+
+    kv = nc_alloc(sizeof(*kv));
+    if (kv == NULL) {
+        return NULL;
+    }
+
+    status = array_init(&kv->keys, DEFAULT_STATS_NUM, sizeof(struct string));
+    if (status != NC_OK) {
+        nc_free(kv);
+        return NULL;
+    }
+
+    status = array_init(&kv->vals, DEFAULT_STATS_NUM, sizeof(struct string));
+    if (status != NC_OK) {
+        array_deinit(&kv->keys);
+        nc_free(kv);
+        return NULL;
+    }
+
+    msg->kv = kv;
+
+    return kv;
+}
+
+static void
+msg_kv_put(struct msg *msg)
+{
+    struct msg_kv *kv = msg->kv;
+
+    ASSERT(kv != NULL);
+
+    /* key and val strings point into the mbufs, so no element is freed */
+    array_rewind(&kv->keys);
+    array_rewind(&kv->vals);
+    array_deinit(&kv->keys);
+    array_deinit(&kv->vals);
+    nc_free(kv);
+
+    msg->kv = NULL;
+}
+
 static void
 msg_free(struct msg *msg)
 {
     ASSERT(STAILQ_EMPTY(&msg->mhdr));
+    ASSERT(msg->kv == NULL);
 
     log_debug(LOG_VVERB, "free msg %p id %"PRIu64"", msg, msg->id);
-    
-    array_deinit(&msg->keys);
-    array_deinit(&msg->vals);
 
     nc_free(msg);
 }
@@ -419,14 +830,17 @@ msg_put(struct msg *msg)
 {
     log_debug(LOG_VVERB, "put msg %p id %"PRIu64"", msg, msg->id);
 
+    ASSERT(!msg->flight && !msg->collapsed);
+
     while (!STAILQ_EMPTY(&msg->mhdr)) {
         struct mbuf *mbuf = STAILQ_FIRST(&msg->mhdr);
         mbuf_remove(&msg->mhdr, mbuf);
         mbuf_put(mbuf);
     }
-    
-    array_rewind(&msg->keys);
-    array_rewind(&msg->vals);
+
+    if (msg->kv != NULL) {
+        msg_kv_put(msg);
+    }
 
     nfree_msgq++;
     TAILQ_INSERT_HEAD(&free_msgq, msg, m_tqe);
@@ -461,7 +875,9 @@ msg_init(void)
     frag_id = 0;
     nfree_msgq = 0;
     TAILQ_INIT(&free_msgq);
-    rbtree_init(&tmo_rbt, &tmo_rbs);
+    array_null(&tmo_qs);
+    flight_bucket = NULL;
+    TAILQ_INIT(&free_flightq);
 }
 
 void
@@ -477,6 +893,69 @@ msg_deinit(void)
         msg_free(msg);
     }
     ASSERT(nfree_msgq == 0);
+
+    while (array_n(&tmo_qs) != 0) {
+        struct msg_tmoq *q = *(struct msg_tmoq **)array_pop(&tmo_qs);
+
+        ASSERT(TAILQ_EMPTY(&q->msgq));
+        nc_free(q);
+    }
+    array_deinit(&tmo_qs);
+
+    while (!TAILQ_EMPTY(&free_flightq)) {
+        struct msg_flight *flight = TAILQ_FIRST(&free_flightq);
+
+        TAILQ_REMOVE(&free_flightq, flight, f_tqe);
+        nc_free(flight);
+    }
+    if (flight_bucket != NULL) {
+        nc_free(flight_bucket);
+        flight_bucket = NULL;
+    }
+}
+
+/*
+ * Time n msg_get and msg_put cycles, MSG_BENCH_BATCH messages in flight at
+ * a time, and print the rate. Only the message header and free q are
+ * exercised; no mbufs are attached
+ */
+#define MSG_BENCH_BATCH 64
+
+void
+msg_bench(uint32_t n)
+{
+    struct msg *msgs[MSG_BENCH_BATCH];
+    int64_t start, usec;
+    uint32_t i, j, nmsg;
+
+    nmsg = 0;
+    start = nc_usec_now();
+
+    for (i = 0; i < n; i += MSG_BENCH_BATCH) {
+        for (j = 0; j < MSG_BENCH_BATCH; j++) {
+            msgs[j] = msg_get(NULL, true, false);
+            if (msgs[j] == NULL) {
+                log_stderr("nutcracker: msg bench failed: %s",
+                           strerror(ENOMEM));
+                while (j > 0) {
+                    msg_put(msgs[--j]);
+                }
+                return;
+            }
+        }
+
+        for (j = 0; j < MSG_BENCH_BATCH; j++) {
+            msg_put(msgs[j]);
+        }
+
+        nmsg += MSG_BENCH_BATCH;
+    }
+
+    usec = MAX(nc_usec_now() - start, 1);
+
+    log_stderr("msg_get/msg_put: %"PRIu32" msgs in %"PRId64" usec, "
+               "%.0f msgs/sec, msg size %zu bytes", nmsg, usec,
+               (double)nmsg * 1000000 / (double)usec, sizeof(struct msg));
 }
 
 bool
@@ -485,6 +964,26 @@ msg_empty(struct msg *msg)
     return msg->mlen == 0 ? true : false;
 }
 
+/*
+ * The deadline of a client request starts ticking on the arrival of its
+ * first bytes, not on the allocation of msg, which may sit idle on the
+ * client conn for long
+ */
+static void
+msg_deadline_start(struct conn *conn, struct msg *msg)
+{
+    struct server_pool *pool;
+
+    if (!conn->client || msg->deadline != 0) {
+        return;
+    }
+
+    pool = conn->owner;
+    if (pool->timeout > 0) {
+        msg->deadline = nc_msec_now() + pool->timeout;
+    }
+}
+
 static rstatus_t
 msg_parsed(struct context *ctx, struct conn *conn, struct msg *msg)
 {
@@ -494,7 +993,7 @@ msg_parsed(struct context *ctx, struct conn *conn, struct msg *msg)
     mbuf = STAILQ_LAST(&msg->mhdr, mbuf, next);
     if (msg->pos == mbuf->last) {
         /* no more data to parse */
-        conn->recv_done(ctx, conn, msg, NULL);
+        conn->ops->recv_done(ctx, conn, msg, NULL);
         return NC_OK;
     }
 
@@ -516,12 +1015,13 @@ msg_parsed(struct context *ctx, struct conn *conn, struct msg *msg)
     }
     mbuf_insert(&nmsg->mhdr, nbuf);
     nmsg->pos = nbuf->pos;
+    msg_deadline_start(conn, nmsg);
 
     /* update length of current (msg) and new message (nmsg) */
     nmsg->mlen = mbuf_length(nbuf);
     msg->mlen -= nmsg->mlen;
 
-    conn->recv_done(ctx, conn, msg, nmsg);
+    conn->ops->recv_done(ctx, conn, msg, nmsg);
 
     return NC_OK;
 }
@@ -536,12 +1036,12 @@ msg_fragment(struct context *ctx, struct conn *conn, struct msg *msg)
     ASSERT(conn->client && !conn->proxy);
     ASSERT(msg->request);
 
-    nbuf = mbuf_split(&msg->mhdr, msg->pos, msg->pre_splitcopy, msg);
+    nbuf = mbuf_split(&msg->mhdr, msg->pos, msg->ops->pre_splitcopy, msg);
     if (nbuf == NULL) {
         return NC_ENOMEM;
     }
 
-    status = msg->post_splitcopy(msg);
+    status = msg->ops->post_splitcopy(msg);
     if (status != NC_OK) {
         mbuf_put(nbuf);
         return status;
@@ -554,6 +1054,7 @@ msg_fragment(struct context *ctx, struct conn *conn, struct msg *msg)
     }
     mbuf_insert(&nmsg->mhdr, nbuf);
     nmsg->pos = nbuf->pos;
+    nmsg->deadline = msg->deadline;
 
     /* update length of current (msg) and new message (nmsg) */
     nmsg->mlen = mbuf_length(nbuf);
@@ -616,7 +1117,7 @@ msg_fragment(struct context *ctx, struct conn *conn, struct msg *msg)
     log_debug(LOG_VERB, "fragment msg into %"PRIu64" and %"PRIu64" frag id "
               "%"PRIu64"", msg->id, nmsg->id, msg->frag_id);
 
-    conn->recv_done(ctx, conn, msg, nmsg);
+    conn->ops->recv_done(ctx, conn, msg, nmsg);
 
     return NC_OK;
 }
@@ -643,11 +1144,11 @@ msg_parse(struct context *ctx, struct conn *conn, struct msg *msg)
 
     if (msg_empty(msg)) {
         /* no data to parse */
-        conn->recv_done(ctx, conn, msg, NULL);
+        conn->ops->recv_done(ctx, conn, msg, NULL);
         return NC_OK;
     }
 
-    msg->parser(msg);
+    msg->ops->parser(msg);
 
     switch (msg->result) {
     case MSG_PARSE_OK:
@@ -709,6 +1210,7 @@ msg_recv_chain(struct context *ctx, struct conn *conn, struct msg *msg)
     ASSERT((mbuf->last + n) <= mbuf->end);
     mbuf->last += n;
     msg->mlen += (uint32_t)n;
+    msg_deadline_start(conn, msg);
 
     for (;;) {
         status = msg_parse(ctx, conn, msg);
@@ -717,7 +1219,7 @@ msg_recv_chain(struct context *ctx, struct conn *conn, struct msg *msg)
         }
 
         /* get next message to parse */
-        nmsg = conn->recv_next(ctx, conn, false);
+        nmsg = conn->ops->recv_next(ctx, conn, false);
         if (nmsg == NULL || nmsg == msg) {
             /* no more data to parse */
             break;
@@ -740,7 +1242,7 @@ msg_build_probe(bool redis)
         return NULL;
     }
     
-    status = msg->build_probe(msg);
+    status = msg->ops->build_probe(msg);
     if (status != NC_OK) {
         msg_put(msg);
         return NULL;
@@ -759,7 +1261,7 @@ msg_recv(struct context *ctx, struct conn *conn)
 
     conn->recv_ready = 1;
     do {
-        msg = conn->recv_next(ctx, conn, true);
+        msg = conn->ops->recv_next(ctx, conn, true);
         if (msg == NULL) {
             return NC_OK;
         }
@@ -830,16 +1332,30 @@ msg_send_chain(struct context *ctx, struct conn *conn, struct msg *msg)
             break;
         }
 
-        msg = conn->send_next(ctx, conn);
+        msg = conn->ops->send_next(ctx, conn);
         if (msg == NULL) {
             break;
         }
     }
 
-    ASSERT(!TAILQ_EMPTY(&send_msgq) && nsend != 0);
+    ASSERT(!TAILQ_EMPTY(&send_msgq));
 
     conn->smsg = NULL;
 
+    /*
+     * Chain may consist solely of empty responses, e.g. the ones swallowed
+     * on behalf of a quiet mode client; finalize those without a syscall
+     */
+    if (nsend == 0) {
+        for (msg = TAILQ_FIRST(&send_msgq); msg != NULL; msg = nmsg) {
+            nmsg = TAILQ_NEXT(msg, m_tqe);
+            TAILQ_REMOVE(&send_msgq, msg, m_tqe);
+            ASSERT(msg->mlen == 0);
+            conn->ops->send_done(ctx, conn, msg);
+        }
+        return NC_OK;
+    }
+
     n = conn_sendv(conn, &sendv, nsend);
 
     nsent = n > 0 ? (size_t)n : 0;
@@ -853,7 +1369,7 @@ msg_send_chain(struct context *ctx, struct conn *conn, struct msg *msg)
 
         if (nsent == 0) {
             if (msg->mlen == 0) {
-                conn->send_done(ctx, conn, msg);
+                conn->ops->send_done(ctx, conn, msg);
             }
             continue;
         }
@@ -872,6 +1388,7 @@ msg_send_chain(struct context *ctx, struct conn *conn, struct msg *msg)
                 mbuf->pos += nsent;
                 ASSERT(mbuf->pos < mbuf->last);
                 nsent = 0;
+                msg->partial = 1;
                 break;
             }
 
@@ -882,7 +1399,7 @@ msg_send_chain(struct context *ctx, struct conn *conn, struct msg *msg)
 
         /* message has been sent completely, finalize it */
         if (mbuf == NULL) {
-            conn->send_done(ctx, conn, msg);
+            conn->ops->send_done(ctx, conn, msg);
         }
     }
 
@@ -905,7 +1422,7 @@ msg_send(struct context *ctx, struct conn *conn)
 
     conn->send_ready = 1;
     do {
-        msg = conn->send_next(ctx, conn);
+        msg = conn->ops->send_next(ctx, conn);
         if (msg == NULL) {
             /* nothing to send */
             return NC_OK;
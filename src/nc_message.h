@@ -25,6 +25,7 @@ typedef rstatus_t (*msg_post_splitcopy_t)(struct msg *);
 typedef void (*msg_coalesce_t)(struct msg *r);
 typedef rstatus_t (*msg_build_probe_t)(struct msg *);
 typedef void (*msg_handle_t)(struct msg *);
+typedef rstatus_t (*msg_reply_t)(struct msg *);
 
 
 typedef struct conn *(*msg_routing_t)(struct context *, struct server_pool *, struct msg *, struct string *);
@@ -38,140 +39,178 @@ typedef enum msg_parse_result {
     MSG_PARSE_AGAIN,                      /* incomplete -> parse again */
 } msg_parse_result_t;
 
+typedef enum msg_cache {
+    MSG_CACHE_NONE,                       /* bypasses the near cache */
+    MSG_CACHE_READ,                       /* cacheable read or its value */
+    MSG_CACHE_WRITE,                      /* write invalidating near cache */
+} msg_cache_t;
+
+typedef msg_cache_t (*msg_cacheable_t)(struct msg *);
+
+#define MSG_TYPE_CODEC(ACTION)                                                                      \
+    ACTION( UNKNOWN )                                                                               \
+    ACTION( REQ_MC_GET )                      /* memcache retrieval requests */                     \
+    ACTION( REQ_MC_GETS )                                                                           \
+    ACTION( REQ_MC_GETEX )                    /* extended */                                        \
+    ACTION( REQ_MC_DELETE )                   /* memcache delete request */                         \
+    ACTION( REQ_MC_CAS )                      /* memcache cas request and storage request */        \
+    ACTION( REQ_MC_SET )                      /* memcache storage request */                        \
+    ACTION( REQ_MC_ADD )                                                                            \
+    ACTION( REQ_MC_REPLACE )                                                                        \
+    ACTION( REQ_MC_APPEND )                                                                         \
+    ACTION( REQ_MC_PREPEND )                                                                        \
+    ACTION( REQ_MC_INCR )                     /* memcache arithmetic request */                     \
+    ACTION( REQ_MC_DECR )                                                                           \
+    ACTION( REQ_MC_QUIT )                     /* memcache quit request */                           \
+    ACTION( REQ_MC_STATS )                    /* memcache stats request */                          \
+    ACTION( REQ_MC_MG )                       /* memcache meta requests */                          \
+    ACTION( REQ_MC_MS )                                                                             \
+    ACTION( REQ_MC_MD )                                                                             \
+    ACTION( REQ_MC_MN )                                                                             \
+    ACTION( RSP_MC_NUM )                      /* memcache arithmetic response */                    \
+    ACTION( RSP_MC_STORED )                   /* memcache cas and storage response */               \
+    ACTION( RSP_MC_NOT_STORED )                                                                     \
+    ACTION( RSP_MC_EXISTS )                                                                         \
+    ACTION( RSP_MC_NOT_FOUND )                                                                      \
+    ACTION( RSP_MC_END )                                                                            \
+    ACTION( RSP_MC_VALUE )                                                                          \
+    ACTION( RSP_MC_DELETED )                  /* memcache delete response */                        \
+    ACTION( RSP_MC_ERROR )                    /* memcache error responses */                        \
+    ACTION( RSP_MC_CLIENT_ERROR )                                                                   \
+    ACTION( RSP_MC_SERVER_ERROR )                                                                   \
+    ACTION( RSP_MC_STATS )                    /* memcache stats response */                         \
+    ACTION( RSP_MC_VA )                       /* memcache meta responses */                         \
+    ACTION( RSP_MC_HD )                                                                             \
+    ACTION( RSP_MC_EN )                                                                             \
+    ACTION( RSP_MC_NF )                                                                             \
+    ACTION( RSP_MC_NS )                                                                             \
+    ACTION( RSP_MC_EX )                                                                             \
+    ACTION( RSP_MC_MN )                                                                             \
+    /* redis write request below */                                                                 \
+    ACTION( REQ_REDIS_WRITEREQ_START )                                                              \
+    ACTION( REQ_REDIS_DEL )                   /* redis commands - keys */                           \
+    ACTION( REQ_REDIS_EXPIRE )                                                                      \
+    ACTION( REQ_REDIS_EXPIREAT )                                                                    \
+    ACTION( REQ_REDIS_PEXPIRE )                                                                     \
+    ACTION( REQ_REDIS_PEXPIREAT )                                                                   \
+    ACTION( REQ_REDIS_PERSIST )                                                                     \
+    ACTION( REQ_REDIS_APPEND )                /* redis requests - string */                         \
+    ACTION( REQ_REDIS_DUMP )                                                                        \
+    ACTION( REQ_REDIS_DECR )                                                                        \
+    ACTION( REQ_REDIS_DECRBY )                                                                      \
+    ACTION( REQ_REDIS_INCR )                                                                        \
+    ACTION( REQ_REDIS_INCRBY )                                                                      \
+    ACTION( REQ_REDIS_INCRBYFLOAT )                                                                 \
+    ACTION( REQ_REDIS_PSETEX )                                                                      \
+    ACTION( REQ_REDIS_RESTORE )                                                                     \
+    ACTION( REQ_REDIS_SET )                                                                         \
+    ACTION( REQ_REDIS_SETBIT )                                                                      \
+    ACTION( REQ_REDIS_SETEX )                                                                       \
+    ACTION( REQ_REDIS_SETNX )                                                                       \
+    ACTION( REQ_REDIS_SETRANGE )                                                                    \
+    ACTION( REQ_REDIS_HDEL )                  /* redis requests - hashes */                         \
+    ACTION( REQ_REDIS_HINCRBY )                                                                     \
+    ACTION( REQ_REDIS_HINCRBYFLOAT )                                                                \
+    ACTION( REQ_REDIS_HMSET )                                                                       \
+    ACTION( REQ_REDIS_HSET )                                                                        \
+    ACTION( REQ_REDIS_HSETNX )                                                                      \
+    ACTION( REQ_REDIS_LINSERT )                                                                     \
+    ACTION( REQ_REDIS_LPOP )                                                                        \
+    ACTION( REQ_REDIS_LPUSH )                                                                       \
+    ACTION( REQ_REDIS_LPUSHX )                                                                      \
+    ACTION( REQ_REDIS_LREM )                                                                        \
+    ACTION( REQ_REDIS_LSET )                                                                        \
+    ACTION( REQ_REDIS_LTRIM )                                                                       \
+    ACTION( REQ_REDIS_RPOP )                                                                        \
+    ACTION( REQ_REDIS_RPOPLPUSH )                                                                   \
+    ACTION( REQ_REDIS_RPUSH )                                                                       \
+    ACTION( REQ_REDIS_RPUSHX )                                                                      \
+    ACTION( REQ_REDIS_SADD )                  /* redis requests - sets */                           \
+    ACTION( REQ_REDIS_SMOVE )                                                                       \
+    ACTION( REQ_REDIS_SPOP )                                                                        \
+    ACTION( REQ_REDIS_SREM )                                                                        \
+    ACTION( REQ_REDIS_ZADD )                  /* redis requests - sorted sets */                    \
+    ACTION( REQ_REDIS_ZINCRBY )                                                                     \
+    ACTION( REQ_REDIS_ZINTERSTORE )                                                                 \
+    ACTION( REQ_REDIS_ZREM )                                                                        \
+    ACTION( REQ_REDIS_ZREMRANGEBYRANK )                                                             \
+    ACTION( REQ_REDIS_ZREMRANGEBYSCORE )                                                            \
+    ACTION( REQ_REDIS_EVAL )                  /* redis requests - eval */                           \
+    ACTION( REQ_REDIS_EVALSHA )                                                                     \
+    ACTION( REQ_REDIS_INFO )                  /* redis info request */                              \
+    ACTION( RSP_REDIS_ERROR )                                                                       \
+    ACTION( RSP_REDIS_BULK )                                                                        \
+    ACTION( RSP_REDIS_MULTIBULK )                                                                   \
+    ACTION( RSP_REDIS_INFO )                  /* redis info response */                             \
+    ACTION( REQ_REDIS_GETSET )                                                                      \
+    ACTION( REQ_REDIS_SDIFFSTORE )                                                                  \
+    ACTION( REQ_REDIS_SINTERSTORE )                                                                 \
+    ACTION( REQ_REDIS_SUNIONSTORE )                                                                 \
+    ACTION( REQ_REDIS_ZUNIONSTORE )                                                                 \
+    /* read request below */                                                                        \
+    ACTION( REQ_REDIS_READREQ_START )                                                               \
+    ACTION( REQ_REDIS_EXISTS )                                                                      \
+    ACTION( REQ_REDIS_PTTL )                                                                        \
+    ACTION( REQ_REDIS_TTL )                                                                         \
+    ACTION( REQ_REDIS_TYPE )                                                                        \
+    ACTION( REQ_REDIS_BITCOUNT )                                                                    \
+    ACTION( REQ_REDIS_GET )                                                                         \
+    ACTION( REQ_REDIS_GETBIT )                                                                      \
+    ACTION( REQ_REDIS_GETRANGE )                                                                    \
+    ACTION( REQ_REDIS_MGET )                                                                        \
+    ACTION( REQ_REDIS_STRLEN )                                                                      \
+    ACTION( REQ_REDIS_HEXISTS )                                                                     \
+    ACTION( REQ_REDIS_HGET )                                                                        \
+    ACTION( REQ_REDIS_HGETALL )                                                                     \
+    ACTION( REQ_REDIS_HKEYS )                                                                       \
+    ACTION( REQ_REDIS_HLEN )                                                                        \
+    ACTION( REQ_REDIS_HMGET )                                                                       \
+    ACTION( REQ_REDIS_HVALS )                                                                       \
+    ACTION( REQ_REDIS_LINDEX )                /* redis requests - lists */                          \
+    ACTION( REQ_REDIS_LLEN )                                                                        \
+    ACTION( REQ_REDIS_LRANGE )                                                                      \
+    ACTION( REQ_REDIS_SCARD )                                                                       \
+    ACTION( REQ_REDIS_SDIFF )                                                                       \
+    ACTION( REQ_REDIS_SINTER )                                                                      \
+    ACTION( REQ_REDIS_SISMEMBER )                                                                   \
+    ACTION( REQ_REDIS_SMEMBERS )                                                                    \
+    ACTION( REQ_REDIS_SRANDMEMBER )                                                                 \
+    ACTION( REQ_REDIS_SUNION )                                                                      \
+    ACTION( REQ_REDIS_ZCARD )                                                                       \
+    ACTION( REQ_REDIS_ZCOUNT )                                                                      \
+    ACTION( REQ_REDIS_ZRANGE )                                                                      \
+    ACTION( REQ_REDIS_ZRANGEBYSCORE )                                                               \
+    ACTION( REQ_REDIS_ZRANK )                                                                       \
+    ACTION( REQ_REDIS_ZREVRANGE )                                                                   \
+    ACTION( REQ_REDIS_ZREVRANGEBYSCORE )                                                            \
+    ACTION( REQ_REDIS_ZREVRANK )                                                                    \
+    ACTION( REQ_REDIS_ZSCORE )                                                                      \
+    ACTION( RSP_REDIS_STATUS )                /* redis response */                                  \
+    ACTION( RSP_REDIS_INTEGER )                                                                     \
+
+#define DEFINE_ACTION(_name) MSG_##_name,
 typedef enum msg_type {
-    MSG_UNKNOWN,
-    MSG_REQ_MC_GET,                       /* memcache retrieval requests */
-    MSG_REQ_MC_GETS,
-    MSG_REQ_MC_GETEX,                     /* extended */
-    MSG_REQ_MC_DELETE,                    /* memcache delete request */
-    MSG_REQ_MC_CAS,                       /* memcache cas request and storage request */
-    MSG_REQ_MC_SET,                       /* memcache storage request */
-    MSG_REQ_MC_ADD,
-    MSG_REQ_MC_REPLACE,
-    MSG_REQ_MC_APPEND,
-    MSG_REQ_MC_PREPEND,
-    MSG_REQ_MC_INCR,                      /* memcache arithmetic request */
-    MSG_REQ_MC_DECR,
-    MSG_REQ_MC_QUIT,                      /* memcache quit request */
-    MSG_REQ_MC_STATS,                     /* memcache stats request */
-    MSG_RSP_MC_NUM,                       /* memcache arithmetic response */
-    MSG_RSP_MC_STORED,                    /* memcache cas and storage response */
-    MSG_RSP_MC_NOT_STORED,
-    MSG_RSP_MC_EXISTS,
-    MSG_RSP_MC_NOT_FOUND,
-    MSG_RSP_MC_END,
-    MSG_RSP_MC_VALUE,
-    MSG_RSP_MC_DELETED,                   /* memcache delete response */
-    MSG_RSP_MC_ERROR,                     /* memcache error responses */
-    MSG_RSP_MC_CLIENT_ERROR,
-    MSG_RSP_MC_SERVER_ERROR,
-    MSG_RSP_MC_STATS,                     /* memcache stats response 
-*/
-    /* redis write request below */
-    MSG_REQ_REDIS_WRITEREQ_START,            
-    MSG_REQ_REDIS_DEL,                    /* redis commands - keys */
-    MSG_REQ_REDIS_EXPIRE,
-    MSG_REQ_REDIS_EXPIREAT,
-    MSG_REQ_REDIS_PEXPIRE,
-    MSG_REQ_REDIS_PEXPIREAT,
-    MSG_REQ_REDIS_PERSIST,
-    MSG_REQ_REDIS_APPEND,                 /* redis requests - string */
-    MSG_REQ_REDIS_DUMP,
-    MSG_REQ_REDIS_DECR,
-    MSG_REQ_REDIS_DECRBY,
-    MSG_REQ_REDIS_INCR,
-    MSG_REQ_REDIS_INCRBY,
-    MSG_REQ_REDIS_INCRBYFLOAT,
-    MSG_REQ_REDIS_PSETEX,
-    MSG_REQ_REDIS_RESTORE,
-    MSG_REQ_REDIS_SET,
-    MSG_REQ_REDIS_SETBIT,
-    MSG_REQ_REDIS_SETEX,
-    MSG_REQ_REDIS_SETNX,
-    MSG_REQ_REDIS_SETRANGE,
-    MSG_REQ_REDIS_HDEL,                   /* redis requests - hashes */
-    MSG_REQ_REDIS_HINCRBY,
-    MSG_REQ_REDIS_HINCRBYFLOAT,
-    MSG_REQ_REDIS_HMSET,
-    MSG_REQ_REDIS_HSET,
-    MSG_REQ_REDIS_HSETNX,
-    MSG_REQ_REDIS_LINSERT,
-    MSG_REQ_REDIS_LPOP,
-    MSG_REQ_REDIS_LPUSH,
-    MSG_REQ_REDIS_LPUSHX,
-    MSG_REQ_REDIS_LREM,
-    MSG_REQ_REDIS_LSET,
-    MSG_REQ_REDIS_LTRIM,
-    MSG_REQ_REDIS_RPOP,
-    MSG_REQ_REDIS_RPOPLPUSH,
-    MSG_REQ_REDIS_RPUSH,
-    MSG_REQ_REDIS_RPUSHX,
-    MSG_REQ_REDIS_SADD,                   /* redis requests - sets */
-    MSG_REQ_REDIS_SMOVE,
-    MSG_REQ_REDIS_SPOP,
-    MSG_REQ_REDIS_SREM,
-    MSG_REQ_REDIS_ZADD,                   /* redis requests - sorted sets */
-    MSG_REQ_REDIS_ZINCRBY,
-    MSG_REQ_REDIS_ZINTERSTORE,
-    MSG_REQ_REDIS_ZREM,
-    MSG_REQ_REDIS_ZREMRANGEBYRANK,
-    MSG_REQ_REDIS_ZREMRANGEBYSCORE,
-    MSG_REQ_REDIS_EVAL,                   /* redis requests - eval */
-    MSG_REQ_REDIS_EVALSHA,
-    MSG_REQ_REDIS_INFO,                   /* redis info request */
-    MSG_RSP_REDIS_ERROR,
-    MSG_RSP_REDIS_BULK,
-    MSG_RSP_REDIS_MULTIBULK,
-    MSG_RSP_REDIS_INFO,                   /* redis info response */
-    MSG_REQ_REDIS_GETSET,
-    MSG_REQ_REDIS_SDIFFSTORE,
-    MSG_REQ_REDIS_SINTERSTORE,
-    MSG_REQ_REDIS_SUNIONSTORE,
-    MSG_REQ_REDIS_ZUNIONSTORE,
-
-    /* read request below */
-    MSG_REQ_REDIS_READREQ_START,          
-    MSG_REQ_REDIS_EXISTS,
-    MSG_REQ_REDIS_PTTL,
-    MSG_REQ_REDIS_TTL,
-    MSG_REQ_REDIS_TYPE,
-    MSG_REQ_REDIS_BITCOUNT,
-    MSG_REQ_REDIS_GET,
-    MSG_REQ_REDIS_GETBIT,
-    MSG_REQ_REDIS_GETRANGE,
-    MSG_REQ_REDIS_MGET,
-    MSG_REQ_REDIS_STRLEN,
-    MSG_REQ_REDIS_HEXISTS,
-    MSG_REQ_REDIS_HGET,
-    MSG_REQ_REDIS_HGETALL,
-    MSG_REQ_REDIS_HKEYS,
-    MSG_REQ_REDIS_HLEN,
-    MSG_REQ_REDIS_HMGET,
-    MSG_REQ_REDIS_HVALS,
-    MSG_REQ_REDIS_LINDEX,                 /* redis requests - lists */
-    MSG_REQ_REDIS_LLEN,
-    MSG_REQ_REDIS_LRANGE,
-    MSG_REQ_REDIS_SCARD,
-    MSG_REQ_REDIS_SDIFF,
-    MSG_REQ_REDIS_SINTER,
-    MSG_REQ_REDIS_SISMEMBER,
-    MSG_REQ_REDIS_SMEMBERS,
-    MSG_REQ_REDIS_SRANDMEMBER,
-    MSG_REQ_REDIS_SUNION,
-    MSG_REQ_REDIS_ZCARD,
-    MSG_REQ_REDIS_ZCOUNT,
-    MSG_REQ_REDIS_ZRANGE,
-    MSG_REQ_REDIS_ZRANGEBYSCORE,
-    MSG_REQ_REDIS_ZRANK,
-    MSG_REQ_REDIS_ZREVRANGE,
-    MSG_REQ_REDIS_ZREVRANGEBYSCORE,
-    MSG_REQ_REDIS_ZREVRANK,
-    MSG_REQ_REDIS_ZSCORE,
-    MSG_RSP_REDIS_STATUS,                 /* redis response */
-    MSG_RSP_REDIS_INTEGER,
+    MSG_TYPE_CODEC(DEFINE_ACTION)
     MSG_SENTINEL
 } msg_type_t;
+#undef DEFINE_ACTION
+
+/*
+ * Stat key/value pairs of a memcache stats response; attached to the
+ * response lazily by the parser, so only probe responses pay for it
+ */
+struct msg_kv {
+    struct array         keys;            /* array of stat keys */
+    struct array         vals;            /* array of stat vals */
+};
 
+/*
+ * The message header is laid out hot first: the fields touched for every
+ * message on the queueing, routing and length paths fill the first two
+ * cache lines, followed by parser state, the protocol-specific parser
+ * fields (which share storage, as a message is either memcache or redis)
+ * and finally state only a few messages ever use.
+ */
 struct msg {
     TAILQ_ENTRY(msg)     c_tqe;           /* link in client q */
     TAILQ_ENTRY(msg)     s_tqe;           /* link in server q */
@@ -180,68 +219,15 @@ struct msg {
     uint64_t             id;              /* message id */
     struct msg           *peer;           /* message peer */
     struct conn          *owner;          /* message owner - client | server */
-    struct conn          *origin;         /* message origin target connection */
-    
-    struct rbnode        tmo_rbe;         /* entry in rbtree */
+    const struct msg_ops *ops;            /* protocol handlers */
 
     struct mhdr          mhdr;            /* message mbuf header */
     uint32_t             mlen;            /* message length */
-
-    int                  state;           /* current parser state */
-    uint8_t              *pos;            /* parser position marker */
-    uint8_t              *token;          /* token marker */
-
-    msg_parse_t          parser;          /* message parser */
-    msg_parse_result_t   result;          /* message parsing result */
-
-    mbuf_copy_t          pre_splitcopy;   /* message pre-split copy */
-    msg_post_splitcopy_t post_splitcopy;  /* message post-split copy */
-    msg_coalesce_t       pre_coalesce;    /* message pre-coalesce */
-    msg_coalesce_t       post_coalesce;   /* message post-coalesce
-                                              * */
-
-    msg_forward_t        pre_req_forward; /* message pre-forward */
-    msg_routing_t        routing;         /* message routing */
-    msg_forward_t        post_routing;    /* message post-routing */
-    msg_forward_t        pre_rsp_forward; /* message post-forward */
-    msg_forward_t        pre_swallow;     /* message pre-swallow */
-    msg_handle_t         pre_req_put;    /* message pre messag */
-
-    msg_build_probe_t    build_probe;     /* message build probe */
-    
     msg_type_t           type;            /* message type */
 
     uint8_t              *key_start;      /* key start */
     uint8_t              *key_end;        /* key end */
 
-    uint8_t              *val_start;      /* value start */
-    uint8_t              *val_end;        /* value end */
-    
-    uint8_t              *flags_start;    /* flags start (memcache) */
-    uint8_t              *flags_end;      /* flags end (memcache) */
-
-    uint32_t             expire;           /* expire time */
-
-    uint32_t             vlen;            /* value length (memcache) */
-    uint8_t              *end;            /* end marker (memcache) */
-
-    struct array         keys ;           /* array of stat keys */
-    struct array         vals;            /* array of stat vals */
-    
-    uint8_t              *narg_start;     /* narg start (redis) */
-    uint8_t              *narg_end;       /* narg end (redis) */
-    uint32_t             narg;            /* # arguments (redis) */
-    uint32_t             rnarg;           /* running # arg used by parsing fsa (redis) */
-    uint32_t             rlen;            /* running length in parsing fsa (redis) */
-    uint32_t             integer;         /* integer reply value (redis) */
-
-    struct msg           *frag_owner;     /* owner of fragment message */
-    uint32_t             nfrag;           /* # fragment */
-    uint64_t             frag_id;         /* id of fragmented message */
-
-    struct msg           *notify_owner;   /* owner of notification message */
-    unsigned             waiting:1;       /* waitting for notify response? */    
-
     err_t                err;             /* errno on error? */
     unsigned             error:1;         /* error? */
     unsigned             ferror:1;        /* one or more fragments are in error? */
@@ -254,25 +240,122 @@ struct msg {
     unsigned             last_fragment:1; /* last fragment? */
     unsigned             swallow:1;       /* swallow response? */
     unsigned             redis:1;         /* redis? */
+    unsigned             quiet:1;         /* quiet mode meta request? */
+    unsigned             noforward:1;     /* answered by proxy itself? */
+    unsigned             ttl:1;           /* expire from meta response? */
+    unsigned             waiting:1;       /* waitting for notify response? */
+    unsigned             partial:1;       /* partially sent to server? */
+    unsigned             sent:1;          /* sent to server in full? */
+    unsigned             flight:1;        /* leads identical requests? */
+    unsigned             collapsed:1;     /* waits on an identical request? */
+    unsigned             hotkey:1;        /* sampled for hot keys? */
+
+    int                  state;           /* current parser state */
+    msg_parse_result_t   result;          /* message parsing result */
+    uint8_t              *pos;            /* parser position marker */
+    uint8_t              *token;          /* token marker */
+    uint8_t              *end;            /* end marker */
+    uint32_t             rlen;            /* running length in parsing fsa */
+    uint32_t             cache_gen;       /* near cache generation at lookup */
+
+    union {
+        struct {
+            uint8_t      *val_start;      /* value start (memcache) */
+            uint8_t      *val_end;        /* value end (memcache) */
+            uint8_t      *flags_start;    /* flags start (memcache) */
+            uint8_t      *flags_end;      /* flags end (memcache) */
+            uint32_t     expire;          /* expire time (memcache) */
+            uint32_t     vlen;            /* value length (memcache) */
+            uint32_t     opaque;          /* opaque (memcache binary) */
+            uint8_t      opcode;          /* opcode (memcache binary) */
+        };
+        struct {
+            uint8_t      *narg_start;     /* narg start (redis) */
+            uint8_t      *narg_end;       /* narg end (redis) */
+            uint32_t     narg;            /* # arguments (redis) */
+            uint32_t     rnarg;           /* running # arg (redis) */
+            uint32_t     integer;         /* integer reply value (redis) */
+        };
+    };
+
+    TAILQ_ENTRY(msg)     t_tqe;           /* link in timeout q */
+    struct msg_tmoq      *tmo_q;          /* timeout q or NULL */
+    int64_t              tmo_expiry;      /* timeout expiry in msec */
+    struct conn          *tmo_conn;       /* server conn timing out */
+    int64_t              deadline;        /* deadline in msec or 0 */
+
+    struct msg           *frag_owner;     /* owner of fragment message */
+    uint64_t             frag_id;         /* id of fragmented message */
+    uint32_t             nfrag;           /* # fragment */
+    uint32_t             fwd_usec;        /* forward usec time, low 32 bits */
+
+    struct conn          *origin;         /* message origin target connection */
+    const struct msg_hooks *hooks;        /* per-message hooks or NULL */
+    union {
+        struct msg       *notify_owner;   /* owner of notification message */
+        struct warmup_job *warmup_job;    /* bulk warmup of fetch message */
+        struct msg       *warmup_set;     /* warmup waiting on ttl message */
+        struct server_pool *warmup_pool;  /* cold pool of warmup message */
+        struct server_pool *notify_pool;  /* owner pool of notify batch */
+    };
+    struct msg_kv        *kv;             /* stat key/value pairs or NULL */
 };
 
 TAILQ_HEAD(msg_tqh, msg);
 
+/*
+ * Protocol handlers; one shared, read-only table per protocol and role
+ * (request or response)
+ */
+struct msg_ops {
+    msg_parse_t          parser;          /* message parser */
+
+    mbuf_copy_t          pre_splitcopy;   /* message pre-split copy */
+    msg_post_splitcopy_t post_splitcopy;  /* message post-split copy */
+    msg_coalesce_t       pre_coalesce;    /* message pre-coalesce */
+    msg_coalesce_t       post_coalesce;   /* message post-coalesce */
+
+    msg_forward_t        pre_req_forward; /* message pre-forward */
+    msg_routing_t        routing;         /* message routing */
+    msg_forward_t        post_routing;    /* message post-routing */
+    msg_forward_t        pre_rsp_forward; /* message post-forward */
+
+    msg_build_probe_t    build_probe;     /* message build probe */
+    msg_reply_t          reply;           /* message local reply */
+    msg_cacheable_t      cacheable;       /* message near cache role */
+};
+
+/*
+ * Hooks of the few messages the proxy itself originates, e.g. the
+ * notification of a delete
+ */
+struct msg_hooks {
+    msg_forward_t        pre_swallow;     /* message pre-swallow */
+    msg_handle_t         pre_req_put;     /* message pre-put */
+};
+
 struct msg *msg_tmo_min(void);
 void msg_tmo_insert(struct msg *msg, struct conn *conn);
 void msg_tmo_delete(struct msg *msg);
+rstatus_t msg_flight_lead(struct server_pool *pool, struct msg *msg);
+bool msg_flight_join(struct server_pool *pool, struct msg *msg);
+void msg_flight_detach(struct msg *msg);
+void msg_flight_end(struct msg *leader, struct msg_tqh *waitq);
 
 void msg_init(void);
 void msg_deinit(void);
 struct msg *msg_get(struct conn *conn, bool request, bool redis);
 struct msg *msg_clone(struct msg *msg);
 void msg_put(struct msg *msg);
+struct msg_kv *msg_kv_get(struct msg *msg);
 struct msg *msg_get_error(bool redis, err_t err);
+struct string *msg_type_string(msg_type_t type);
 void msg_dump(struct msg *msg);
 bool msg_empty(struct msg *msg);
 rstatus_t msg_recv(struct context *ctx, struct conn *conn);
 rstatus_t msg_send(struct context *ctx, struct conn *conn);
 struct msg *msg_build_probe(bool redis);
+void msg_bench(uint32_t n);
 
 struct msg *req_get(struct conn *conn);
 void req_put(struct msg *msg);
@@ -288,7 +371,12 @@ struct msg *req_recv_next(struct context *ctx, struct conn *conn, bool alloc);
 void req_recv_done(struct context *ctx, struct conn *conn, struct msg *msg, struct msg *nmsg);
 struct msg *req_send_next(struct context *ctx, struct conn *conn);
 void req_send_done(struct context *ctx, struct conn *conn, struct msg *msg);
+rstatus_t req_timedout(struct context *ctx, struct conn *conn, struct msg *msg);
+void req_collapse_done(struct msg *leader, struct msg *rsp);
+void req_forward_delayed(struct context *ctx, struct msg *msg, err_t err);
 rstatus_t req_enqueue(struct context *ctx, struct conn *conn, struct msg *msg);
+struct string req_route_key(struct string *hash_tag, uint8_t *start,
+                            uint8_t *end);
 struct string req_build_key(struct string *hash_tag, struct msg *msg);
 
 struct msg *rsp_get(struct conn *conn);
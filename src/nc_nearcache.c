@@ -0,0 +1,332 @@
+/*
+ * twemproxy - A fast and lightweight proxy for memcached protocol.
+ * Copyright (C) 2011 Twitter, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <nc_core.h>
+#include <nc_nearcache.h>
+
+#define NEARCACHE_END           "END\r\n"
+#define NEARCACHE_MIN_BUCKET    64
+#define NEARCACHE_ENTRY_SIZE    256  /* expected entry size, sizes the table */
+#define NEARCACHE_ENTRY_SHARE   16   /* max 1/16 of the budget per entry */
+
+struct nearcache_entry {
+    TAILQ_ENTRY(nearcache_entry) h_tqe;   /* link in hash bucket */
+    TAILQ_ENTRY(nearcache_entry) l_tqe;   /* link in lru q */
+    int64_t                      expire;  /* expiry time in msec */
+    msg_type_t                   type;    /* type of request that filled it */
+    uint32_t                     hash;    /* key hash */
+    uint32_t                     nkey;    /* key length */
+    uint32_t                     nval;    /* response length, without END */
+    uint8_t                      *key;    /* key, right after the entry */
+    uint8_t                      *val;    /* response, right after the key */
+};
+
+#define NEARCACHE_ESIZE(_nkey, _nval)                                       \
+    (sizeof(struct nearcache_entry) + (size_t)(_nkey) + (size_t)(_nval))
+
+struct nearcache *
+nearcache_create(hash_func_t hash, size_t size, int ttl)
+{
+    struct nearcache *cache;
+    uint32_t i, nbucket;
+
+    ASSERT(hash != NULL && size != 0 && ttl > 0);
+
+    cache = nc_alloc(sizeof(*cache));
+    if (cache == NULL) {
+        return NULL;
+    }
+
+    for (nbucket = NEARCACHE_MIN_BUCKET;
+         nbucket < size / NEARCACHE_ENTRY_SIZE; nbucket <<= 1);
+
+    cache->bucket = nc_alloc(sizeof(*cache->bucket) * nbucket);
+    if (cache->bucket == NULL) {
+        nc_free(cache);
+        return NULL;
+    }
+
+    for (i = 0; i < nbucket; i++) {
+        TAILQ_INIT(&cache->bucket[i]);
+    }
+
+    cache->hash = hash;
+    cache->mask = nbucket - 1;
+    TAILQ_INIT(&cache->lru_q);
+    cache->nentry = 0;
+    cache->nbyte = 0;
+    cache->size = size;
+    cache->ttl = ttl;
+    memset(cache->gen, 0, sizeof(cache->gen));
+
+    log_debug(LOG_VERB, "near cache of %zu bytes ttl %d msec with %"PRIu32
+              " buckets", size, ttl, nbucket);
+
+    return cache;
+}
+
+static void
+nearcache_unlink(struct nearcache *cache, struct nearcache_entry *entry)
+{
+    ASSERT(cache->nentry != 0);
+
+    TAILQ_REMOVE(&cache->bucket[entry->hash & cache->mask], entry, h_tqe);
+    TAILQ_REMOVE(&cache->lru_q, entry, l_tqe);
+
+    cache->nentry--;
+    cache->nbyte -= NEARCACHE_ESIZE(entry->nkey, entry->nval);
+
+    nc_free(entry);
+}
+
+void
+nearcache_destroy(struct nearcache *cache)
+{
+    if (cache == NULL) {
+        return;
+    }
+
+    while (!TAILQ_EMPTY(&cache->lru_q)) {
+        nearcache_unlink(cache, TAILQ_FIRST(&cache->lru_q));
+    }
+    ASSERT(cache->nbyte == 0);
+
+    nc_free(cache->bucket);
+    nc_free(cache);
+}
+
+static struct nearcache_entry *
+nearcache_find(struct nearcache *cache, uint8_t *key, uint32_t nkey,
+               uint32_t hash)
+{
+    struct nearcache_entry *entry;
+
+    TAILQ_FOREACH(entry, &cache->bucket[hash & cache->mask], h_tqe) {
+        if (entry->hash == hash && entry->nkey == nkey &&
+            memcmp(entry->key, key, nkey) == 0) {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Lookup the response cached for req. On a miss, req remembers the write
+ * generation of its key, so that a write racing with it can keep its
+ * response from filling the cache with a stale value
+ */
+struct nearcache_entry *
+nearcache_get(struct nearcache *cache, struct msg *req)
+{
+    struct nearcache_entry *entry;
+    uint32_t nkey, hash;
+
+    ASSERT(req->request);
+    ASSERT(req->key_start != NULL && req->key_end > req->key_start);
+
+    nkey = (uint32_t)(req->key_end - req->key_start);
+    hash = cache->hash((char *)req->key_start, nkey);
+
+    req->cache_gen = cache->gen[hash % NEARCACHE_NGEN];
+
+    entry = nearcache_find(cache, req->key_start, nkey, hash);
+    if (entry == NULL) {
+        return NULL;
+    }
+
+    if (entry->expire <= nc_msec_cached()) {
+        nearcache_unlink(cache, entry);
+        return NULL;
+    }
+
+    if (entry->type != req->type) {
+        return NULL;
+    }
+
+    TAILQ_REMOVE(&cache->lru_q, entry, l_tqe);
+    TAILQ_INSERT_HEAD(&cache->lru_q, entry, l_tqe);
+
+    return entry;
+}
+
+static rstatus_t
+nearcache_copy(struct msg *rsp, uint8_t *pos, size_t n)
+{
+    struct mbuf *mbuf;
+    size_t len;
+
+    while (n > 0) {
+        mbuf = STAILQ_LAST(&rsp->mhdr, mbuf, next);
+        if (mbuf == NULL || mbuf_full(mbuf)) {
+            mbuf = mbuf_get();
+            if (mbuf == NULL) {
+                return NC_ENOMEM;
+            }
+            mbuf_insert(&rsp->mhdr, mbuf);
+        }
+
+        len = MIN(mbuf_size(mbuf), n);
+        mbuf_copy(mbuf, pos, len);
+        rsp->mlen += (uint32_t)len;
+
+        pos += len;
+        n -= len;
+    }
+
+    return NC_OK;
+}
+
+/*
+ * Fill rsp with the response held by entry. Like the coalesced responses
+ * of a fragmented request, only the response to its last fragment carries
+ * the end marker
+ */
+rstatus_t
+nearcache_reply(struct nearcache_entry *entry, struct msg *req,
+                struct msg *rsp)
+{
+    rstatus_t status;
+
+    ASSERT(req->request && !rsp->request);
+    ASSERT(STAILQ_EMPTY(&rsp->mhdr));
+
+    status = nearcache_copy(rsp, entry->val, entry->nval);
+    if (status != NC_OK) {
+        return status;
+    }
+
+    if (req->frag_id == 0 || req->last_fragment) {
+        status = nearcache_copy(rsp, (uint8_t *)NEARCACHE_END,
+                                sizeof(NEARCACHE_END) - 1);
+        if (status != NC_OK) {
+            return status;
+        }
+    }
+
+    rsp->type = MSG_RSP_MC_VALUE;
+
+    return NC_OK;
+}
+
+/*
+ * Cache the value carried by rsp to req, unless a write to the same key
+ * went through the proxy after req looked the cache up
+ */
+void
+nearcache_put(struct nearcache *cache, struct msg *req, struct msg *rsp)
+{
+    struct nearcache_entry *entry;
+    struct mbuf *mbuf;
+    uint32_t nkey, nval, hash;
+    uint8_t *p;
+    size_t len;
+
+    ASSERT(req->request && !rsp->request);
+    ASSERT(req->key_start != NULL && req->key_end > req->key_start);
+
+    nkey = (uint32_t)(req->key_end - req->key_start);
+    hash = cache->hash((char *)req->key_start, nkey);
+
+    if (req->cache_gen != cache->gen[hash % NEARCACHE_NGEN]) {
+        return;
+    }
+
+    if (rsp->end == NULL) {
+        return;
+    }
+
+    /* the value spans up to the end marker */
+    nval = 0;
+    STAILQ_FOREACH(mbuf, &rsp->mhdr, next) {
+        if (rsp->end >= mbuf->pos && rsp->end <= mbuf->last) {
+            nval += (uint32_t)(rsp->end - mbuf->pos);
+            break;
+        }
+        nval += mbuf_length(mbuf);
+    }
+
+    if (mbuf == NULL || nval == 0 ||
+        NEARCACHE_ESIZE(nkey, nval) > cache->size / NEARCACHE_ENTRY_SHARE) {
+        return;
+    }
+
+    entry = nearcache_find(cache, req->key_start, nkey, hash);
+    if (entry != NULL) {
+        nearcache_unlink(cache, entry);
+    }
+
+    entry = nc_alloc(NEARCACHE_ESIZE(nkey, nval));
+    if (entry == NULL) {
+        return;
+    }
+
+    entry->expire = nc_msec_cached() + cache->ttl;
+    entry->type = req->type;
+    entry->hash = hash;
+    entry->nkey = nkey;
+    entry->nval = nval;
+    entry->key = (uint8_t *)(entry + 1);
+    entry->val = entry->key + nkey;
+
+    nc_memcpy(entry->key, req->key_start, nkey);
+
+    p = entry->val;
+    STAILQ_FOREACH(mbuf, &rsp->mhdr, next) {
+        len = MIN(mbuf_length(mbuf), nval - (uint32_t)(p - entry->val));
+        nc_memcpy(p, mbuf->pos, len);
+        p += len;
+        if (p == entry->val + nval) {
+            break;
+        }
+    }
+
+    TAILQ_INSERT_HEAD(&cache->bucket[hash & cache->mask], entry, h_tqe);
+    TAILQ_INSERT_HEAD(&cache->lru_q, entry, l_tqe);
+    cache->nentry++;
+    cache->nbyte += NEARCACHE_ESIZE(nkey, nval);
+
+    while (cache->nbyte > cache->size) {
+        nearcache_unlink(cache, TAILQ_LAST(&cache->lru_q, nearcache_tqh));
+    }
+}
+
+/*
+ * Drop the entry for the key written by req and bump its write generation
+ */
+void
+nearcache_invalidate(struct nearcache *cache, struct msg *req)
+{
+    struct nearcache_entry *entry;
+    uint32_t nkey, hash;
+
+    ASSERT(req->request);
+
+    if (req->key_start == NULL || req->key_end <= req->key_start) {
+        return;
+    }
+
+    nkey = (uint32_t)(req->key_end - req->key_start);
+    hash = cache->hash((char *)req->key_start, nkey);
+
+    cache->gen[hash % NEARCACHE_NGEN]++;
+
+    entry = nearcache_find(cache, req->key_start, nkey, hash);
+    if (entry != NULL) {
+        nearcache_unlink(cache, entry);
+    }
+}
@@ -0,0 +1,57 @@
+/*
+ * twemproxy - A fast and lightweight proxy for memcached protocol.
+ * Copyright (C) 2011 Twitter, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _NC_NEARCACHE_H_
+#define _NC_NEARCACHE_H_
+
+#include <nc_core.h>
+
+/*
+ * Near cache: a small per-pool cache in front of the servers holding the
+ * serialized responses of hot retrieval requests, bounded by a byte budget
+ * (lru eviction) and a short ttl. Entries are dropped by writes to the same
+ * key seen by the proxy; writes made past the proxy are only bounded by ttl.
+ */
+
+#define NEARCACHE_NGEN  256  /* # write generation stripes */
+
+struct nearcache_entry;
+
+TAILQ_HEAD(nearcache_tqh, nearcache_entry);
+
+struct nearcache {
+    hash_func_t          hash;           /* key hasher */
+    struct nearcache_tqh *bucket;        /* hash buckets */
+    uint32_t             mask;           /* hash mask */
+    struct nearcache_tqh lru_q;          /* entries, most recently used first */
+    uint32_t             nentry;         /* # entries */
+    size_t               nbyte;          /* bytes held by entries */
+    size_t               size;           /* byte budget */
+    int64_t              ttl;            /* entry ttl in msec */
+    uint32_t             gen[NEARCACHE_NGEN]; /* write generation stripes */
+};
+
+struct nearcache *nearcache_create(hash_func_t hash, size_t size, int ttl);
+void nearcache_destroy(struct nearcache *cache);
+
+struct nearcache_entry *nearcache_get(struct nearcache *cache, struct msg *req);
+rstatus_t nearcache_reply(struct nearcache_entry *entry, struct msg *req,
+                          struct msg *rsp);
+void nearcache_put(struct nearcache *cache, struct msg *req, struct msg *rsp);
+void nearcache_invalidate(struct nearcache *cache, struct msg *req);
+
+#endif
@@ -0,0 +1,704 @@
+/*
+ * twemproxy - A fast and lightweight proxy for memcached protocol.
+ * Copyright (C) 2011 Twitter, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <nc_core.h>
+#include <nc_notify.h>
+#include <nc_journal.h>
+#include <nc_server.h>
+
+/*
+ * Format the list key of the notifications of pool into buf, and return
+ * its length, or 0 if it does not fit
+ */
+uint32_t
+notify_list(struct server_pool *pool, uint8_t *buf, size_t size)
+{
+    int n;
+
+    n = nc_scnprintf(buf, size, "queue %.*s->%.*s regular todo",
+                     pool->namespace.len, pool->namespace.data,
+                     pool->namespace.len, pool->namespace.data);
+    if ((size_t)n >= size - 1) {
+        return 0;
+    }
+
+    return (uint32_t)n;
+}
+
+/*
+ * Format the notification of cmd on key through pool into buf, and return
+ * its length, or 0 if it does not fit
+ */
+uint32_t
+notify_value(struct server_pool *pool, char *cmd, uint8_t *key,
+             uint32_t keylen, uint8_t *buf, size_t size)
+{
+    int n;
+
+    n = nc_scnprintf(buf, size, "%"PRId64" %.*s %s %.*s",
+                     nc_msec_now() / 1000, pool->name.len, pool->name.data,
+                     cmd, keylen, key);
+    if ((size_t)n >= size - 1) {
+        return 0;
+    }
+
+    return (uint32_t)n;
+}
+
+/*
+ * Return the key of the notification value of vlen bytes at value, that
+ * is all past its third space
+ */
+static struct string
+notify_value_key(uint8_t *value, uint32_t vlen)
+{
+    struct string key;
+    uint8_t *p, *end;
+    int nspace;
+
+    end = value + vlen;
+    for (p = value, nspace = 0; p < end && nspace < 3; p++) {
+        if (*p == ' ') {
+            nspace++;
+        }
+    }
+
+    key.data = p;
+    key.len = (uint32_t)(end - p);
+
+    return key;
+}
+
+struct notify *
+notify_create(struct server_pool *owner, uint32_t nbuffer,
+              struct string *journal, uint32_t journal_size)
+{
+    struct notify *nt;
+    struct server_pool *mq;
+    struct notify_batch *batch;
+    uint32_t i;
+
+    mq = owner->message_queue;
+    ASSERT(mq != NULL);
+
+    nt = nc_alloc(sizeof(*nt));
+    if (nt == NULL) {
+        return NULL;
+    }
+
+    nt->nbatch = array_n(&mq->server);
+    nt->batch = nc_alloc(sizeof(*nt->batch) * nt->nbatch);
+    if (nt->batch == NULL) {
+        nc_free(nt);
+        return NULL;
+    }
+
+    for (i = 0; i < nt->nbatch; i++) {
+        batch = &nt->batch[i];
+        batch->server = array_get(&mq->server, i);
+        STAILQ_INIT(&batch->mhdr);
+        batch->nvalue = 0;
+        batch->nbyte = 0;
+    }
+
+    nt->owner = owner;
+    nt->nbyte = 0;
+    nt->nbuffer = nbuffer;
+    nt->nlist = notify_list(owner, nt->list, sizeof(nt->list));
+    if (nt->nlist == 0) {
+        nc_free(nt->batch);
+        nc_free(nt);
+        return NULL;
+    }
+
+    nt->journal = NULL;
+    nt->nreplay = 0;
+    nt->nround = 0;
+    nt->replay_failed = 0;
+    if (!string_empty(journal)) {
+        nt->journal = journal_open((char *)journal->data, journal_size);
+        if (nt->journal == NULL) {
+            nc_free(nt->batch);
+            nc_free(nt);
+            return NULL;
+        }
+    }
+
+    log_debug(LOG_VERB, "notify of %"PRIu32" bytes to %"PRIu32" servers, "
+              "journal '%.*s'", nbuffer, nt->nbatch, journal->len,
+              journal->data);
+
+    return nt;
+}
+
+static void
+notify_batch_reset(struct notify *nt, struct notify_batch *batch)
+{
+    struct mbuf *mbuf;
+
+    while (!STAILQ_EMPTY(&batch->mhdr)) {
+        mbuf = STAILQ_FIRST(&batch->mhdr);
+        mbuf_remove(&batch->mhdr, mbuf);
+        mbuf_put(mbuf);
+    }
+
+    nt->nbyte -= batch->nbyte;
+    batch->nvalue = 0;
+    batch->nbyte = 0;
+}
+
+void
+notify_destroy(struct notify *nt)
+{
+    uint32_t i;
+
+    if (nt == NULL) {
+        return;
+    }
+
+    for (i = 0; i < nt->nbatch; i++) {
+        notify_batch_reset(nt, &nt->batch[i]);
+    }
+
+    journal_close(nt->journal);
+    nc_free(nt->batch);
+    nc_free(nt);
+}
+
+/*
+ * Append n bytes at pos to the tail of mhdr, spilling over into as many
+ * new mbufs as needed
+ */
+static rstatus_t
+notify_copy(struct mhdr *mhdr, uint8_t *pos, size_t n)
+{
+    struct mbuf *mbuf;
+    size_t len;
+
+    while (n > 0) {
+        mbuf = STAILQ_LAST(mhdr, mbuf, next);
+        if (mbuf == NULL || mbuf_full(mbuf)) {
+            mbuf = mbuf_get();
+            if (mbuf == NULL) {
+                return NC_ENOMEM;
+            }
+            mbuf_insert(mhdr, mbuf);
+        }
+
+        len = MIN(mbuf_size(mbuf), n);
+        mbuf_copy(mbuf, pos, len);
+        pos += len;
+        n -= len;
+    }
+
+    return NC_OK;
+}
+
+/*
+ * Write the notification value of vlen bytes at value to the journal, or
+ * drop it if there is no journal or it is full
+ */
+static void
+notify_spill_value(struct context *ctx, struct notify *nt, uint8_t *value,
+                   uint32_t vlen)
+{
+    if (nt->journal == NULL || journal_append(nt->journal, value,
+                                              vlen) != NC_OK) {
+        log_debug(LOG_VERB, "drop notify '%.*s'", vlen, value);
+        stats_pool_incr(ctx, nt->owner, notify_dropped);
+        return;
+    }
+
+    stats_pool_incr(ctx, nt->owner, notify_spilled);
+}
+
+/*
+ * Write the notification of cmd on key to the journal, to be replayed
+ * once the message queue takes it
+ */
+void
+notify_spill(struct context *ctx, struct notify *nt, char *cmd, uint8_t *key,
+             uint32_t keylen)
+{
+    uint8_t value[NOTIFY_MAX_LEN];
+    uint32_t vlen;
+
+    vlen = notify_value(nt->owner, cmd, key, keylen, value, sizeof(value));
+    if (vlen == 0) {
+        stats_pool_incr(ctx, nt->owner, notify_dropped);
+        return;
+    }
+
+    notify_spill_value(ctx, nt, value, vlen);
+}
+
+/*
+ * Parse the bulk string at p, short of end, into data and len, and return
+ * the position past it, or NULL if it is malformed
+ */
+static uint8_t *
+notify_parse_bulk(uint8_t *p, uint8_t *end, uint8_t **data, uint32_t *len)
+{
+    uint32_t n;
+
+    if (p >= end || *p != '$') {
+        return NULL;
+    }
+
+    for (n = 0, p++; p < end && *p >= '0' && *p <= '9'; p++) {
+        n = n * 10 + (uint32_t)(*p - '0');
+    }
+
+    if ((size_t)(end - p) < CRLF_LEN + n + CRLF_LEN) {
+        return NULL;
+    }
+
+    *data = p + CRLF_LEN;
+    *len = n;
+
+    return p + CRLF_LEN + n + CRLF_LEN;
+}
+
+/*
+ * Write the values of the notify batch message msg, which did not make it
+ * to the message queue, to the journal
+ */
+static void
+notify_respill(struct context *ctx, struct notify *nt, struct msg *msg)
+{
+    struct mbuf *mbuf;
+    uint8_t *buf, *p, *end, *value;
+    uint32_t i, len, vlen, nvalue;
+
+    ASSERT(msg->narg > 2);
+
+    nvalue = msg->narg - 2;
+
+    buf = nt->journal != NULL ? nc_alloc(msg->mlen) : NULL;
+    if (buf == NULL) {
+        stats_pool_incr_by(ctx, nt->owner, notify_dropped, nvalue);
+        return;
+    }
+
+    p = buf;
+    STAILQ_FOREACH(mbuf, &msg->mhdr, next) {
+        len = mbuf_length(mbuf);
+        nc_memcpy(p, mbuf->pos, len);
+        p += len;
+    }
+    end = p;
+
+    /* past "*<narg>\r\n" come LPUSH, the list key and the values */
+    p = nc_strchr(buf, end, LF);
+    p = p != NULL ? p + 1 : end;
+
+    for (i = 0; i < msg->narg && p != NULL; i++) {
+        p = notify_parse_bulk(p, end, &value, &vlen);
+        if (p != NULL && i >= 2) {
+            notify_spill_value(ctx, nt, value, vlen);
+            nvalue--;
+        }
+    }
+
+    if (nvalue > 0) {
+        stats_pool_incr_by(ctx, nt->owner, notify_dropped, nvalue);
+    }
+
+    nc_free(buf);
+}
+
+/*
+ * Append the notification value of vlen bytes at value to batch, as a
+ * bulk string, or fail if the buffer is full
+ */
+static rstatus_t
+notify_batch_add(struct notify *nt, struct notify_batch *batch,
+                 uint8_t *value, uint32_t vlen)
+{
+    struct mbuf *last, *mbuf;
+    uint8_t *tail;
+    uint8_t bulk[NOTIFY_MAX_LEN + NC_UINT32_MAXLEN + 5];
+    uint32_t len;
+
+    len = (uint32_t)nc_scnprintf(bulk, sizeof(bulk), "$%"PRIu32"\r\n%.*s\r\n",
+                                 vlen, vlen, value);
+
+    if (nt->nbyte + len > nt->nbuffer) {
+        return NC_ERROR;
+    }
+
+    last = STAILQ_LAST(&batch->mhdr, mbuf, next);
+    tail = last != NULL ? last->last : NULL;
+
+    if (notify_copy(&batch->mhdr, bulk, len) != NC_OK) {
+        /* roll the batch back to the values before this one */
+        while ((mbuf = STAILQ_LAST(&batch->mhdr, mbuf, next)) != last) {
+            mbuf_remove(&batch->mhdr, mbuf);
+            mbuf_put(mbuf);
+        }
+        if (last != NULL) {
+            last->last = tail;
+        }
+        return NC_ENOMEM;
+    }
+
+    batch->nvalue++;
+    batch->nbyte += len;
+    nt->nbyte += len;
+
+    return NC_OK;
+}
+
+/*
+ * Buffer the notification of cmd on key for message queue server. While
+ * the journal holds notifications, or if the buffer is full, it is
+ * written to the journal instead, or dropped without one
+ */
+void
+notify_add(struct context *ctx, struct notify *nt, struct server *server,
+           char *cmd, uint8_t *key, uint32_t keylen)
+{
+    uint8_t value[NOTIFY_MAX_LEN];
+    uint32_t vlen;
+
+    ASSERT(server->idx < nt->nbatch);
+
+    vlen = notify_value(nt->owner, cmd, key, keylen, value, sizeof(value));
+    if (vlen == 0) {
+        stats_pool_incr(ctx, nt->owner, notify_dropped);
+        return;
+    }
+
+    /* keep behind the journal, to be replayed in order */
+    if (nt->journal != NULL && !journal_empty(nt->journal)) {
+        notify_spill_value(ctx, nt, value, vlen);
+        return;
+    }
+
+    if (notify_batch_add(nt, &nt->batch[server->idx], value, vlen) != NC_OK) {
+        notify_spill_value(ctx, nt, value, vlen);
+        return;
+    }
+
+    stats_pool_incr(ctx, nt->owner, notify_queued);
+}
+
+static rstatus_t
+notify_pre_swallow(struct context *ctx, struct conn *conn, struct msg *rsp)
+{
+    struct msg *req;
+    struct server_pool *pool;
+    uint32_t nvalue;
+
+    req = rsp->peer;
+    pool = req->notify_pool;
+
+    ASSERT(req->owner == NULL && pool != NULL);
+    ASSERT(req->narg > 2);
+
+    nvalue = req->narg - 2;
+
+    if (rsp->type == MSG_RSP_REDIS_ERROR) {
+        log_warn("notify of %"PRIu32" values from pool '%.*s' failed",
+                 nvalue, pool->name.len, pool->name.data);
+        notify_respill(ctx, pool->notify, req);
+    } else {
+        stats_pool_incr_by(ctx, pool, notify_sent, nvalue);
+    }
+
+    /* accounted for, whatever happens to the request from now on */
+    req->notify_pool = NULL;
+
+    return NC_OK;
+}
+
+static void
+notify_pre_req_put(struct msg *msg)
+{
+    struct server_pool *pool;
+
+    ASSERT(msg->owner == NULL);
+
+    /* a batch put before its response arrived did not make it */
+    pool = msg->notify_pool;
+    if (pool == NULL) {
+        return;
+    }
+
+    notify_respill(pool->ctx, pool->notify, msg);
+}
+
+static const struct msg_hooks notify_hooks = {
+    notify_pre_swallow,         /* pre_swallow */
+    notify_pre_req_put,         /* pre_req_put */
+};
+
+/*
+ * Account for the end of a batch of the replay round, or of the replay
+ * itself. Once the whole round is over, its records are committed if
+ * every batch was acked, or left to be read again otherwise
+ */
+static void
+notify_replay_done(struct context *ctx, struct notify *nt, bool ok)
+{
+    ASSERT(nt->nreplay > 0);
+
+    if (!ok) {
+        nt->replay_failed = 1;
+    }
+
+    if (--nt->nreplay > 0) {
+        return;
+    }
+
+    if (nt->replay_failed) {
+        journal_rewind(nt->journal);
+        return;
+    }
+
+    journal_commit(nt->journal);
+    stats_pool_incr_by(ctx, nt->owner, notify_replayed, nt->nround);
+}
+
+static rstatus_t
+notify_replay_pre_swallow(struct context *ctx, struct conn *conn,
+                          struct msg *rsp)
+{
+    struct msg *req;
+    struct server_pool *pool;
+
+    req = rsp->peer;
+    pool = req->notify_pool;
+
+    ASSERT(req->owner == NULL && pool != NULL);
+
+    notify_replay_done(ctx, pool->notify, rsp->type != MSG_RSP_REDIS_ERROR);
+    req->notify_pool = NULL;
+
+    return NC_OK;
+}
+
+static void
+notify_replay_pre_req_put(struct msg *msg)
+{
+    struct server_pool *pool;
+
+    ASSERT(msg->owner == NULL);
+
+    pool = msg->notify_pool;
+    if (pool == NULL) {
+        return;
+    }
+
+    notify_replay_done(pool->ctx, pool->notify, false);
+}
+
+static const struct msg_hooks notify_replay_hooks = {
+    notify_replay_pre_swallow,  /* pre_swallow */
+    notify_replay_pre_req_put,  /* pre_req_put */
+};
+
+/*
+ * Move the values of batch over to a new LPUSH request, leaving the
+ * batch empty
+ */
+static struct msg *
+notify_batch_msg(struct notify *nt, struct notify_batch *batch)
+{
+    struct msg *msg;
+    uint8_t hdr[NOTIFY_MAX_LEN + 2 * NC_UINT32_MAXLEN + 32];
+    int n;
+
+    msg = msg_get(NULL, true, true);
+    if (msg == NULL) {
+        return NULL;
+    }
+
+    n = nc_scnprintf(hdr, sizeof(hdr), "*%"PRIu32"\r\n$5\r\nLPUSH\r\n"
+                     "$%"PRIu32"\r\n%.*s\r\n", batch->nvalue + 2, nt->nlist,
+                     nt->nlist, nt->list);
+    if (notify_copy(&msg->mhdr, hdr, (size_t)n) != NC_OK) {
+        msg_put(msg);
+        return NULL;
+    }
+
+    STAILQ_CONCAT(&msg->mhdr, &batch->mhdr);
+
+    msg->mlen = (uint32_t)n + batch->nbyte;
+    msg->type = MSG_REQ_REDIS_LPUSH;
+    msg->narg = batch->nvalue + 2;
+
+    /* Account for the response and swallow it */
+    msg->owner = NULL;          /* Special message */
+    msg->notify_pool = nt->owner;
+    msg->swallow = 1;
+
+    notify_batch_reset(nt, batch);
+
+    return msg;
+}
+
+/*
+ * Send the LPUSH request msg to server. A request that cannot be sent is
+ * put right away, which its hooks account for as a failure
+ */
+static void
+notify_send(struct context *ctx, struct notify *nt, struct server *server,
+            struct msg *msg)
+{
+    struct conn *s_conn;
+
+    s_conn = server_conn_connect(ctx, server);
+    if (s_conn == NULL) {
+        req_put(msg);
+        return;
+    }
+
+    if (req_enqueue(ctx, s_conn, msg) != NC_OK) {
+        req_put(msg);
+        return;
+    }
+
+    stats_pool_incr(ctx, nt->owner, notify_batches);
+}
+
+/*
+ * Read the journal from the oldest record not yet committed into the
+ * batches, up to the size of the buffer, and send them as a replay round
+ */
+static void
+notify_replay(struct context *ctx, struct notify *nt)
+{
+    struct server_pool *mq = nt->owner->message_queue;
+    struct notify_batch *batch;
+    struct conn *conn;
+    struct server *server;
+    struct string key;
+    struct msg *msg;
+    uint8_t *value;
+    uint32_t i, vlen;
+    bool stop;
+
+    nt->nround = 0;
+    nt->replay_failed = 0;
+    stop = false;
+
+    while (nt->nbyte + NOTIFY_MAX_LEN + NC_UINT32_MAXLEN + 5 <= nt->nbuffer &&
+           (value = journal_read(nt->journal, &vlen)) != NULL) {
+        key = notify_value_key(value, vlen);
+        if (key.len == 0) {
+            continue;
+        }
+
+        use_writable_pool(mq);
+        conn = server_pool_conn(ctx, mq, key.data, key.len);
+        if (conn == NULL) {
+            stop = true;
+            break;
+        }
+        server = conn->owner;
+
+        if (notify_batch_add(nt, &nt->batch[server->idx], value,
+                             vlen) != NC_OK) {
+            stop = true;
+            break;
+        }
+        nt->nround++;
+    }
+
+    if (stop) {
+        /* the queue is not there yet; try again on the next tick */
+        for (i = 0; i < nt->nbatch; i++) {
+            notify_batch_reset(nt, &nt->batch[i]);
+        }
+        journal_rewind(nt->journal);
+        return;
+    }
+
+    if (nt->nround == 0) {
+        journal_commit(nt->journal);
+        return;
+    }
+
+    /* held until every batch of the round is sent */
+    nt->nreplay = 1;
+
+    for (i = 0; i < nt->nbatch; i++) {
+        batch = &nt->batch[i];
+        if (batch->nvalue == 0) {
+            continue;
+        }
+
+        msg = notify_batch_msg(nt, batch);
+        if (msg == NULL) {
+            notify_batch_reset(nt, batch);
+            nt->replay_failed = 1;
+            continue;
+        }
+
+        msg->hooks = &notify_replay_hooks;
+        nt->nreplay++;
+        notify_send(ctx, nt, batch->server, msg);
+    }
+
+    notify_replay_done(ctx, nt, true);
+}
+
+/*
+ * Send the notifications buffered for each message queue server as one
+ * LPUSH, then replay the journal if it holds any and no replay round is
+ * in flight. Called once every tick
+ */
+void
+notify_flush(struct context *ctx, struct notify *nt)
+{
+    struct notify_batch *batch;
+    struct msg *msg;
+    uint32_t i, nvalue;
+
+    for (i = 0; i < nt->nbatch; i++) {
+        batch = &nt->batch[i];
+        nvalue = batch->nvalue;
+        if (nvalue == 0) {
+            continue;
+        }
+
+        stats_pool_decr_by(ctx, nt->owner, notify_queued, nvalue);
+
+        msg = notify_batch_msg(nt, batch);
+        if (msg == NULL) {
+            notify_batch_reset(nt, batch);
+            stats_pool_incr_by(ctx, nt->owner, notify_dropped, nvalue);
+            continue;
+        }
+
+        msg->hooks = &notify_hooks;
+        notify_send(ctx, nt, batch->server, msg);
+    }
+
+    if (nt->journal == NULL) {
+        return;
+    }
+
+    if (!journal_empty(nt->journal) && nt->nreplay == 0) {
+        notify_replay(ctx, nt);
+    }
+
+    journal_sync(nt->journal);
+    stats_pool_set(ctx, nt->owner, notify_journal,
+                   journal_nbyte(nt->journal));
+}
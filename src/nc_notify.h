@@ -0,0 +1,79 @@
+/*
+ * twemproxy - A fast and lightweight proxy for memcached protocol.
+ * Copyright (C) 2011 Twitter, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _NC_NOTIFY_H_
+#define _NC_NOTIFY_H_
+
+#include <nc_core.h>
+
+/*
+ * Delete notifications: each delete through a pool with a message_queue
+ * pushes "<sec> <pool> <cmd> <key>" to the list "queue <ns>-><ns> regular
+ * todo" of the message queue server its key maps to.
+ *
+ * In strict mode, the default, every delete sends its own LPUSH and its
+ * client waits for the ack. With notify_async, clients are answered from
+ * the delete alone, and the notifications are buffered per message queue
+ * server and flushed once every tick as one multi-value LPUSH. At most
+ * notify_buffer bytes are buffered; notifications past that, or lost with
+ * a failed LPUSH, are dropped and counted.
+ *
+ * With a notify_journal, notifications that cannot be delivered in either
+ * mode are spilled to a journal on local disk instead of being dropped or
+ * failing the delete. While the journal holds any, new notifications are
+ * spilled behind them, and the journal is replayed in order, one round of
+ * up to notify_buffer bytes at a time, until the message queue acks all.
+ */
+
+#define NOTIFY_MAX_LEN          512  /* max length of a list key or value */
+
+struct notify_batch {
+    struct server       *server;    /* message queue server */
+    struct mhdr         mhdr;       /* values, as bulk strings */
+    uint32_t            nvalue;     /* # values */
+    uint32_t            nbyte;      /* # bytes of values */
+};
+
+struct notify {
+    struct server_pool  *owner;     /* owner pool */
+    struct notify_batch *batch;     /* batch per message queue server */
+    uint32_t            nbatch;     /* # batches */
+    uint32_t            nbyte;      /* # bytes buffered in all batches */
+    uint32_t            nbuffer;    /* max # bytes buffered */
+    uint8_t             list[NOTIFY_MAX_LEN]; /* list key */
+    uint32_t            nlist;      /* list key length */
+    struct journal      *journal;   /* spill journal, if any */
+    uint32_t            nreplay;    /* # replay batches in flight */
+    uint32_t            nround;     /* # values in the replay round */
+    unsigned            replay_failed:1; /* replay round failed? */
+};
+
+uint32_t notify_list(struct server_pool *pool, uint8_t *buf, size_t size);
+uint32_t notify_value(struct server_pool *pool, char *cmd, uint8_t *key,
+                      uint32_t keylen, uint8_t *buf, size_t size);
+
+struct notify *notify_create(struct server_pool *owner, uint32_t nbuffer,
+                             struct string *journal, uint32_t journal_size);
+void notify_destroy(struct notify *nt);
+
+void notify_add(struct context *ctx, struct notify *nt, struct server *server,
+                char *cmd, uint8_t *key, uint32_t keylen);
+void notify_spill(struct context *ctx, struct notify *nt, char *cmd,
+                  uint8_t *key, uint32_t keylen);
+void notify_flush(struct context *ctx, struct notify *nt);
+
+#endif
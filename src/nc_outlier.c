@@ -0,0 +1,297 @@
+/*
+ * twemproxy - A fast and lightweight proxy for memcached protocol.
+ * Copyright (C) 2011 Twitter, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+
+#include <nc_core.h>
+#include <nc_outlier.h>
+#include <nc_server.h>
+
+struct outlier *
+outlier_create(struct server_pool *owner, uint32_t nserver, uint32_t interval,
+               uint32_t latency_ratio, uint32_t error_rate,
+               uint32_t min_requests, uint32_t max_ejection)
+{
+    struct outlier *ol;
+    uint32_t i;
+
+    ASSERT(nserver > 0);
+
+    ol = nc_alloc(sizeof(*ol));
+    if (ol == NULL) {
+        return NULL;
+    }
+
+    ol->servers = nc_zalloc(sizeof(*ol->servers) * nserver);
+    ol->scratch = nc_alloc(sizeof(*ol->scratch) * nserver);
+    if (ol->servers == NULL || ol->scratch == NULL) {
+        nc_free(ol->servers);
+        nc_free(ol->scratch);
+        nc_free(ol);
+        return NULL;
+    }
+
+    for (i = 0; i < nserver; i++) {
+        ol->servers[i].latency = -1;
+        ol->servers[i].error = -1;
+    }
+
+    ol->owner = owner;
+    ol->interval = interval;
+    ol->next = 0;
+    ol->latency_ratio = latency_ratio;
+    ol->error_rate = error_rate * 10;
+    ol->min_requests = MAX(min_requests, 1);
+    ol->max_ejection = MAX(nserver * max_ejection / 100, 1);
+    ol->nserver = nserver;
+
+    log_debug(LOG_VERB, "outlier detection every %"PRIu32" msec over "
+              "%"PRIu32" servers, latency ratio %"PRIu32" error rate "
+              "%"PRIu32"%% max %"PRIu32" ejected", interval, nserver,
+              latency_ratio, error_rate, ol->max_ejection);
+
+    return ol;
+}
+
+void
+outlier_destroy(struct outlier *ol)
+{
+    if (ol == NULL) {
+        return;
+    }
+
+    nc_free(ol->servers);
+    nc_free(ol->scratch);
+    nc_free(ol);
+}
+
+/*
+ * Account a request done by server: a response after usec, or a failure
+ * if error
+ */
+void
+outlier_sample(struct outlier *ol, struct server *server, int64_t usec,
+               bool error)
+{
+    struct outlier_server *os;
+
+    ASSERT(server->idx < ol->nserver);
+
+    os = &ol->servers[server->idx];
+
+    os->nrequest++;
+    if (error) {
+        os->nerror++;
+    } else {
+        os->usec += usec;
+    }
+}
+
+static int64_t
+outlier_ewma(int64_t ewma, int64_t value)
+{
+    if (ewma < 0) {
+        return value;
+    }
+
+    return ewma + ((value - ewma) >> OUTLIER_EWMA_SHIFT);
+}
+
+/*
+ * Fold the requests of server done since it was last folded into its
+ * EWMA. A server with no response keeps its latency
+ */
+static void
+outlier_fold(struct context *ctx, struct server *server,
+             struct outlier_server *os)
+{
+    uint32_t nresponse;
+
+    nresponse = os->nrequest - os->nerror;
+    if (nresponse != 0) {
+        os->latency = outlier_ewma(os->latency, os->usec / nresponse);
+    }
+    os->error = outlier_ewma(os->error,
+                             (int64_t)os->nerror * 1000 / os->nrequest);
+
+    os->usec = 0;
+    os->nrequest = 0;
+    os->nerror = 0;
+    os->fresh = 1;
+
+    stats_server_set(ctx, server, ewma_latency, os->latency);
+    stats_server_set(ctx, server, ewma_errors, os->error);
+}
+
+static int
+outlier_cmp(const void *a, const void *b)
+{
+    const int64_t *x = a, *y = b;
+
+    return *x < *y ? -1 : (*x > *y ? 1 : 0);
+}
+
+/*
+ * Return the median of the n values in scratch, the lower one of the two
+ * middle values if n is even, so that of two servers the slower one is
+ * measured against the faster one
+ */
+static int64_t
+outlier_median(int64_t *scratch, uint32_t n)
+{
+    ASSERT(n > 0);
+
+    qsort(scratch, n, sizeof(*scratch), outlier_cmp);
+
+    return scratch[(n - 1) / 2];
+}
+
+static bool
+outlier_live(struct server *server, int64_t now)
+{
+    return server->next_retry == 0 || server->next_retry <= now;
+}
+
+/*
+ * Eject the live servers of the pool whose EWMA latency or error rate is
+ * out of line with the median of the live servers, if they were folded in
+ * this detection. Called once every tick, detects every interval
+ */
+void
+outlier_detect(struct context *ctx, struct outlier *ol)
+{
+    struct server_pool *pool = ol->owner;
+    struct outlier_server *os;
+    struct server *server;
+    int64_t now, latency, error;
+    uint32_t i, n, nejected;
+    bool ejected;
+    rstatus_t status;
+
+    ASSERT(array_n(&pool->server) == ol->nserver);
+
+    if (nc_msec_cached() < ol->next) {
+        return;
+    }
+    ol->next = nc_msec_cached() + ol->interval;
+
+    now = nc_usec_now();
+    if (now < 0) {
+        return;
+    }
+
+    nejected = 0;
+    for (i = 0; i < ol->nserver; i++) {
+        server = array_get(&pool->server, i);
+        os = &ol->servers[i];
+        os->fresh = 0;
+
+        /* what a server did on its way out is no measure of it coming back */
+        if (!outlier_live(server, now)) {
+            nejected += os->ejected;
+            os->usec = 0;
+            os->nrequest = 0;
+            os->nerror = 0;
+            continue;
+        }
+
+        if (os->ejected) {
+            os->ejected = 0;
+            os->latency = -1;
+            os->error = -1;
+        }
+
+        if (os->nrequest >= ol->min_requests) {
+            outlier_fold(ctx, server, os);
+        }
+    }
+
+    /* medians of the live servers measured so far */
+    for (i = 0, n = 0; i < ol->nserver; i++) {
+        server = array_get(&pool->server, i);
+        os = &ol->servers[i];
+        if (outlier_live(server, now) && os->error >= 0) {
+            ol->scratch[n++] = os->error;
+        }
+    }
+    if (n < 2) {
+        return;
+    }
+    error = outlier_median(ol->scratch, n) + ol->error_rate;
+
+    for (i = 0, n = 0; i < ol->nserver; i++) {
+        server = array_get(&pool->server, i);
+        os = &ol->servers[i];
+        if (outlier_live(server, now) && os->latency >= 0) {
+            ol->scratch[n++] = os->latency;
+        }
+    }
+    if (n < 2) {
+        latency = INT64_MAX;
+    } else {
+        latency = MAX(outlier_median(ol->scratch, n), OUTLIER_MIN_LATENCY) *
+                  ol->latency_ratio;
+    }
+
+    ejected = false;
+    for (i = 0; i < ol->nserver; i++) {
+        server = array_get(&pool->server, i);
+        os = &ol->servers[i];
+
+        if (!os->fresh || !outlier_live(server, now)) {
+            continue;
+        }
+
+        if (os->latency <= latency && os->error <= error) {
+            os->nejection = 0;
+            continue;
+        }
+
+        if (nejected >= ol->max_ejection) {
+            log_debug(LOG_INFO, "outlier server '%.*s' latency %"PRId64" "
+                      "error %"PRId64" kept, %"PRIu32" out already",
+                      server->pname.len, server->pname.data, os->latency,
+                      os->error, nejected);
+            continue;
+        }
+
+        os->nejection = MIN(os->nejection + 1, OUTLIER_MAX_BACKOFF);
+        os->ejected = 1;
+        server->next_retry = now + pool->server_retry_timeout * os->nejection;
+        nejected++;
+        ejected = true;
+
+        stats_pool_incr(ctx, pool, outlier_ejects);
+        stats_server_incr(ctx, server, outlier_ejects);
+
+        log_warn("eject outlier server '%.*s' of pool %"PRIu32" '%.*s' with "
+                 "latency %"PRId64" usec error %"PRId64"/1000 for %"PRId64
+                 " msec", server->pname.len, server->pname.data, pool->idx,
+                 pool->name.len, pool->name.data, os->latency, os->error,
+                 pool->server_retry_timeout * os->nejection / 1000);
+    }
+
+    if (!ejected) {
+        return;
+    }
+
+    status = server_pool_run(pool);
+    if (status != NC_OK) {
+        log_error("updating pool %"PRIu32" '%.*s' failed: %s", pool->idx,
+                  pool->name.len, pool->name.data, strerror(errno));
+    }
+}
@@ -0,0 +1,81 @@
+/*
+ * twemproxy - A fast and lightweight proxy for memcached protocol.
+ * Copyright (C) 2011 Twitter, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _NC_OUTLIER_H_
+#define _NC_OUTLIER_H_
+
+#include <nc_core.h>
+
+/*
+ * Outlier detection: ejects the servers of a pool that answer much slower
+ * or fail much more often than the others, which the connection failures
+ * counted by server_failure never catch.
+ *
+ * Every response feeds the latency and every failed request (timed out,
+ * shed or lost with its connection, or answered with an error response of
+ * either protocol) the error count of its server. Every outlier_interval
+ * msec, a server with at least outlier_min_requests done since it was last
+ * evaluated folds their mean latency and per-mille of failures into its
+ * EWMA, and is compared to the median of the live servers of its pool. It
+ * is an outlier if its latency is over outlier_latency_ratio times the
+ * median, or its error rate over the median by outlier_error_rate percent.
+ *
+ * Outliers are ejected as by server_failure, through next_retry, for the
+ * server_retry_timeout times the number of ejections in a row, up to
+ * OUTLIER_MAX_BACKOFF. At most outlier_max_ejection percent of the servers,
+ * and always at least one, are out as outliers at once.
+ */
+
+#define OUTLIER_EWMA_SHIFT      2    /* weight of a new interval is 1/4 */
+#define OUTLIER_MIN_LATENCY     1000 /* in usec, never too slow below it */
+#define OUTLIER_MAX_BACKOFF     8    /* max multiple of server_retry_timeout */
+
+struct outlier_server {
+    int64_t  usec;          /* total latency of responses not folded yet */
+    uint32_t nrequest;      /* # requests done not folded yet */
+    uint32_t nerror;        /* # requests failed not folded yet */
+    int64_t  latency;       /* ewma of latency in usec, -1 if none */
+    int64_t  error;         /* ewma of per-mille failed, -1 if none */
+    uint32_t nejection;     /* # ejections in a row */
+    unsigned fresh:1;       /* folded in this detection? */
+    unsigned ejected:1;     /* out as an outlier? */
+};
+
+struct outlier {
+    struct server_pool    *owner;           /* owner pool */
+    int64_t               interval;         /* msec between detections */
+    int64_t               next;             /* msec of the next detection */
+    uint32_t              latency_ratio;    /* latency ratio to the median */
+    uint32_t              error_rate;       /* per-mille over the median */
+    uint32_t              min_requests;     /* min # requests to fold */
+    uint32_t              max_ejection;     /* max # servers out at once */
+    uint32_t              nserver;          /* # servers */
+    struct outlier_server *servers;         /* state by server index */
+    int64_t               *scratch;         /* values to find a median in */
+};
+
+struct outlier *outlier_create(struct server_pool *owner, uint32_t nserver,
+                               uint32_t interval, uint32_t latency_ratio,
+                               uint32_t error_rate, uint32_t min_requests,
+                               uint32_t max_ejection);
+void outlier_destroy(struct outlier *ol);
+
+void outlier_sample(struct outlier *ol, struct server *server, int64_t usec,
+                    bool error);
+void outlier_detect(struct context *ctx, struct outlier *ol);
+
+#endif
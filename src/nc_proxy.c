@@ -67,7 +67,7 @@ proxy_close(struct context *ctx, struct conn *conn)
     ASSERT(!conn->client && conn->proxy);
 
     if (conn->sd < 0) {
-        conn->unref(conn);
+        conn->ops->unref(conn);
         conn_put(conn);
         return;
     }
@@ -77,7 +77,7 @@ proxy_close(struct context *ctx, struct conn *conn)
     ASSERT(TAILQ_EMPTY(&conn->imsg_q));
     ASSERT(TAILQ_EMPTY(&conn->omsg_q));
 
-    conn->unref(conn);
+    conn->ops->unref(conn);
 
     status = close(conn->sd);
     if (status < 0) {
@@ -199,7 +199,7 @@ proxy_each_init(void *elem, void *data)
 
     status = proxy_listen(pool->ctx, p);
     if (status != NC_OK) {
-        p->close(pool->ctx, p);
+        p->ops->close(pool->ctx, p);
         return status;
     }
 
@@ -239,7 +239,7 @@ proxy_each_deinit(void *elem, void *data)
 
     p = pool->p_conn;
     if (p != NULL) {
-        p->close(pool->ctx, p);
+        p->ops->close(pool->ctx, p);
     }
 
     return NC_OK;
@@ -266,6 +266,9 @@ proxy_accept(struct context *ctx, struct conn *p)
 {
     rstatus_t status;
     struct conn *c;
+    struct server_pool *pool;
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
     int sd;
 
     ASSERT(p->proxy && !p->client);
@@ -273,7 +276,8 @@ proxy_accept(struct context *ctx, struct conn *p)
     ASSERT(p->recv_active && p->recv_ready);
 
     for (;;) {
-        sd = accept(p->sd, NULL, NULL);
+        addrlen = sizeof(addr);
+        sd = accept(p->sd, (struct sockaddr *)&addr, &addrlen);
         if (sd < 0) {
             if (errno == EINTR) {
                 log_debug(LOG_VERB, "accept on p %d not ready - eintr", p->sd);
@@ -314,6 +318,13 @@ proxy_accept(struct context *ctx, struct conn *p)
         return NC_ENOMEM;
     }
     c->sd = sd;
+    c->binary = p->binary;
+
+    /* the rate limit bucket of the client goes by its address */
+    pool = c->owner;
+    if (pool->ratelimit != NULL) {
+        c->bucket = ratelimit_client(pool->ratelimit, (struct sockaddr *)&addr);
+    }
 
     stats_pool_incr(ctx, c->owner, client_connections);
 
@@ -321,7 +332,7 @@ proxy_accept(struct context *ctx, struct conn *p)
     if (status < 0) {
         log_error("set nonblock on c %d from p %d failed: %s", c->sd, p->sd,
                   strerror(errno));
-        c->close(ctx, c);
+        c->ops->close(ctx, c);
         return status;
     }
 
@@ -337,7 +348,7 @@ proxy_accept(struct context *ctx, struct conn *p)
     if (status < 0) {
         log_error("event add conn from p %d failed: %s", p->sd,
                   strerror(errno));
-        c->close(ctx, c);
+        c->ops->close(ctx, c);
         return status;
     }
 
@@ -0,0 +1,378 @@
+/*
+ * twemproxy - A fast and lightweight proxy for memcached protocol.
+ * Copyright (C) 2011 Twitter, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <nc_core.h>
+#include <nc_ratelimit.h>
+#include <nc_server.h>
+#include <nc_hashkit.h>
+#include <proto/nc_proto.h>
+
+struct ratelimit *
+ratelimit_create(struct server_pool *owner, ratelimit_action_t action,
+                 uint32_t rate, uint32_t burst,
+                 uint32_t client_rate, uint32_t client_burst,
+                 uint32_t prefix, uint32_t prefix6,
+                 uint32_t write_cost, uint32_t nqueue)
+{
+    struct ratelimit *rl;
+
+    rl = nc_alloc(sizeof(*rl));
+    if (rl == NULL) {
+        return NULL;
+    }
+
+    rl->clients = NULL;
+    if (client_rate > 0) {
+        rl->clients = nc_zalloc(sizeof(*rl->clients) * RATELIMIT_NCLIENT);
+        if (rl->clients == NULL) {
+            nc_free(rl);
+            return NULL;
+        }
+    }
+
+    /* credit per msec is tokens per sec, as a token is a thousand credit */
+    rl->owner = owner;
+    rl->action = action;
+    rl->rate = rate;
+    rl->burst = (int64_t)burst * RATELIMIT_TOKEN;
+    rl->bucket.credit = rl->burst;
+    rl->bucket.stamp = 0;
+    rl->bucket.pass = 0;
+    rl->client_rate = client_rate;
+    rl->client_burst = (int64_t)client_burst * RATELIMIT_TOKEN;
+    rl->prefix = prefix;
+    rl->prefix6 = prefix6;
+    rl->write_cost = (int64_t)write_cost * RATELIMIT_TOKEN;
+    TAILQ_INIT(&rl->delay_q);
+    rl->ndelay = 0;
+    rl->nqueue = nqueue;
+    rl->pass = 0;
+    rl->blocked = 0;
+
+    log_debug(LOG_VERB, "ratelimit of %"PRIu32" per sec burst %"PRIu32" and "
+              "%"PRIu32" per sec burst %"PRIu32" per client /%"PRIu32" or "
+              "/%"PRIu32, rate, burst, client_rate, client_burst, prefix,
+              prefix6);
+
+    return rl;
+}
+
+/*
+ * Requests still waiting in the delay q go with their client connections
+ */
+void
+ratelimit_destroy(struct ratelimit *rl)
+{
+    if (rl == NULL) {
+        return;
+    }
+
+    nc_free(rl->clients);
+    nc_free(rl);
+}
+
+/*
+ * Return the bucket of the client at addr, that of its address prefix, or
+ * NULL if clients are not limited. Unix socket clients share one bucket
+ */
+struct ratelimit_bucket *
+ratelimit_client(struct ratelimit *rl, struct sockaddr *addr)
+{
+    uint8_t key[1 + sizeof(struct in6_addr)];
+    uint8_t *src;
+    uint32_t i, len, bits, hash;
+
+    if (rl->clients == NULL) {
+        return NULL;
+    }
+
+    switch (addr->sa_family) {
+    case AF_INET:
+        src = (uint8_t *)&((struct sockaddr_in *)addr)->sin_addr;
+        len = sizeof(struct in_addr);
+        bits = rl->prefix;
+        break;
+
+    case AF_INET6:
+        src = (uint8_t *)&((struct sockaddr_in6 *)addr)->sin6_addr;
+        len = sizeof(struct in6_addr);
+        bits = rl->prefix6;
+        break;
+
+    default:
+        src = NULL;
+        len = 0;
+        bits = 0;
+        break;
+    }
+
+    key[0] = (uint8_t)addr->sa_family;
+    for (i = 0; i < len; i++) {
+        if (bits >= 8) {
+            key[1 + i] = src[i];
+            bits -= 8;
+        } else {
+            key[1 + i] = (uint8_t)(src[i] & (0xff << (8 - bits)));
+            bits = 0;
+        }
+    }
+
+    hash = hash_murmur((char *)key, 1 + len);
+
+    return &rl->clients[hash & (RATELIMIT_NCLIENT - 1)];
+}
+
+static void
+ratelimit_refill(struct ratelimit_bucket *b, int64_t rate, int64_t burst,
+                 int64_t now)
+{
+    int64_t elapsed;
+
+    elapsed = now - b->stamp;
+    if (elapsed <= 0) {
+        return;
+    }
+
+    /* a bucket idle long enough is full, whatever the credit it had left */
+    if (elapsed >= burst / rate) {
+        b->credit = burst;
+    } else {
+        b->credit = MIN(b->credit + elapsed * rate, burst);
+    }
+    b->stamp = now;
+}
+
+/*
+ * Return true if bucket b, refilled at rate up to burst, is short of the
+ * cost of a request of class cls. Shedding keeps part of the burst from
+ * the lower classes
+ */
+static bool
+ratelimit_short(struct ratelimit *rl, struct ratelimit_bucket *b,
+                int64_t rate, int64_t burst, int64_t cost,
+                ratelimit_class_t cls)
+{
+    int64_t reserve;
+
+    ratelimit_refill(b, rate, burst, nc_msec_cached());
+
+    reserve = 0;
+    if (rl->action == RATELIMIT_SHED) {
+        switch (cls) {
+        case RATELIMIT_MULTI:
+            reserve = burst / 2;
+            break;
+
+        case RATELIMIT_READ:
+            reserve = burst / 4;
+            break;
+
+        default:
+            break;
+        }
+    }
+
+    return b->credit - MIN(cost, burst) < reserve;
+}
+
+/*
+ * Draw the cost of msg from the pool bucket and from client, the bucket of
+ * its client if any, or from neither if one is short of it. Returns the
+ * bucket found short, or NULL if msg drew its cost
+ */
+static struct ratelimit_bucket *
+ratelimit_draw(struct ratelimit *rl, struct ratelimit_bucket *client,
+               struct msg *msg)
+{
+    ratelimit_class_t cls;
+    bool write;
+    int64_t cost;
+
+    if (msg->redis) {
+        write = msg->type < MSG_REQ_REDIS_READREQ_START;
+    } else {
+        write = memcache_cacheable(msg) == MSG_CACHE_WRITE;
+    }
+
+    cost = write ? rl->write_cost : RATELIMIT_TOKEN;
+
+    if (msg->frag_id != 0) {
+        cls = RATELIMIT_MULTI;
+    } else {
+        cls = write ? RATELIMIT_WRITE : RATELIMIT_READ;
+    }
+
+    if (rl->rate > 0 &&
+        ratelimit_short(rl, &rl->bucket, rl->rate, rl->burst, cost, cls)) {
+        return &rl->bucket;
+    }
+
+    if (client != NULL &&
+        ratelimit_short(rl, client, rl->client_rate, rl->client_burst, cost,
+                        cls)) {
+        return client;
+    }
+
+    if (rl->rate > 0) {
+        rl->bucket.credit -= MIN(cost, rl->burst);
+    }
+
+    if (client != NULL) {
+        client->credit -= MIN(cost, rl->client_burst);
+    }
+
+    return NULL;
+}
+
+/*
+ * Admit msg from client conn to be forwarded if it draws its cost, else
+ * deny it, or with delay, queue it for ratelimit_drain. A request of a
+ * client with requests already waiting, or arriving while the q waits on
+ * the pool bucket, waits behind them to keep the order of requests
+ */
+ratelimit_result_t
+ratelimit_admit(struct context *ctx, struct ratelimit *rl, struct conn *conn,
+                struct msg *msg)
+{
+    struct ratelimit_bucket *b;
+
+    ASSERT(conn->client && !conn->proxy);
+    ASSERT(msg->request && msg->owner == conn);
+
+    b = NULL;
+    if (conn->ndelay == 0 && !rl->blocked) {
+        b = ratelimit_draw(rl, conn->bucket, msg);
+        if (b == NULL) {
+            return RATELIMIT_PASS;
+        }
+    }
+
+    if (rl->action != RATELIMIT_DELAY || rl->ndelay >= rl->nqueue) {
+        stats_pool_incr(ctx, rl->owner, ratelimit_rejected);
+        return RATELIMIT_DENIED;
+    }
+
+    if (b == &rl->bucket) {
+        rl->blocked = 1;
+    }
+
+    TAILQ_INSERT_TAIL(&rl->delay_q, msg, s_tqe);
+    rl->ndelay++;
+    conn->ndelay++;
+
+    stats_pool_incr(ctx, rl->owner, ratelimit_delayed);
+    stats_pool_incr(ctx, rl->owner, ratelimit_queue);
+
+    log_debug(LOG_VERB, "delay req %"PRIu64" from c %d with %"PRIu32" "
+              "waiting", msg->id, conn->sd, rl->ndelay);
+
+    return RATELIMIT_DELAYED;
+}
+
+/*
+ * Drop the requests of client conn, which is closing, from the delay q
+ */
+void
+ratelimit_cancel(struct context *ctx, struct ratelimit *rl, struct conn *conn)
+{
+    struct msg *msg, *nmsg;
+
+    ASSERT(conn->client && !conn->proxy);
+
+    for (msg = TAILQ_FIRST(&rl->delay_q); msg != NULL && conn->ndelay > 0;
+         msg = nmsg) {
+        nmsg = TAILQ_NEXT(msg, s_tqe);
+
+        if (msg->owner != conn) {
+            continue;
+        }
+
+        TAILQ_REMOVE(&rl->delay_q, msg, s_tqe);
+        rl->ndelay--;
+        conn->ndelay--;
+        stats_pool_decr(ctx, rl->owner, ratelimit_queue);
+
+        if (!msg->noreply) {
+            conn->ops->dequeue_outq(ctx, conn, msg);
+        }
+
+        log_debug(LOG_INFO, "close c %d discarding delayed req %"PRIu64" len "
+                  "%"PRIu32" type %d", conn->sd, msg->id, msg->mlen,
+                  msg->type);
+
+        req_put(msg);
+    }
+
+    ASSERT(conn->ndelay == 0);
+}
+
+/*
+ * Forward the requests in the delay q that draw their cost now, in order,
+ * and fail those past their deadline. A request short of its client credit
+ * holds back the later ones of its client bucket, and one short of the
+ * pool credit all the later ones. Called once every tick
+ */
+void
+ratelimit_drain(struct context *ctx, struct ratelimit *rl)
+{
+    struct msg *msg, *nmsg;
+    struct conn *conn;
+    struct ratelimit_bucket *client, *b;
+    int64_t now;
+    err_t err;
+
+    rl->blocked = 0;
+    if (rl->ndelay == 0) {
+        return;
+    }
+
+    rl->pass++;
+    now = nc_msec_cached();
+
+    for (msg = TAILQ_FIRST(&rl->delay_q); msg != NULL; msg = nmsg) {
+        nmsg = TAILQ_NEXT(msg, s_tqe);
+
+        conn = msg->owner;
+        client = conn->bucket;
+
+        if (msg->deadline != 0 && now >= msg->deadline) {
+            err = ETIMEDOUT;
+        } else {
+            if (client != NULL && client->pass == rl->pass) {
+                continue;
+            }
+
+            b = ratelimit_draw(rl, client, msg);
+            if (b == &rl->bucket) {
+                rl->blocked = 1;
+                break;
+            }
+            if (b != NULL) {
+                b->pass = rl->pass;
+                continue;
+            }
+            err = 0;
+        }
+
+        TAILQ_REMOVE(&rl->delay_q, msg, s_tqe);
+        rl->ndelay--;
+        conn->ndelay--;
+        stats_pool_decr(ctx, rl->owner, ratelimit_queue);
+
+        req_forward_delayed(ctx, msg, err);
+    }
+}
@@ -0,0 +1,112 @@
+/*
+ * twemproxy - A fast and lightweight proxy for memcached protocol.
+ * Copyright (C) 2011 Twitter, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _NC_RATELIMIT_H_
+#define _NC_RATELIMIT_H_
+
+#include <nc_core.h>
+
+/*
+ * Rate limits: a hierarchy of token buckets a request to be forwarded
+ * draws from, first the bucket of its pool, then the bucket of its client
+ * address prefix. Buckets hold fixed-point credit and are refilled lazily
+ * from the cached clock when drawn from, so idle buckets cost nothing.
+ *
+ * What a request draws depends on its class: a read costs one token and a
+ * write write_cost tokens. A multi-key request is forwarded as one
+ * fragment per key, each drawing on its own, so it costs a token per key.
+ *
+ * Client buckets live in a fixed table indexed by the hash of the client
+ * address masked to client_prefix (or client_prefix6) bits; prefixes
+ * colliding on a slot just share a bucket.
+ *
+ * A request out of credit is rejected, or with delay, waits in a bounded
+ * queue drained every tick. With shed, lower classes are rejected before
+ * a bucket runs dry, leaving its last part to higher ones: multi-key
+ * fragments may not draw below half the burst, reads below a quarter,
+ * and writes may draw it all.
+ */
+
+#define RATELIMIT_TOKEN         1000 /* credit of one token */
+#define RATELIMIT_NCLIENT       4096 /* # client bucket slots */
+
+#define RATELIMIT_ACTION_CODEC(ACTION)      \
+    ACTION( RATELIMIT_REJECT,   reject )    \
+    ACTION( RATELIMIT_DELAY,    delay  )    \
+    ACTION( RATELIMIT_SHED,     shed   )    \
+
+#define DEFINE_ACTION(_action, _name) _action,
+typedef enum ratelimit_action {
+    RATELIMIT_ACTION_CODEC( DEFINE_ACTION )
+    RATELIMIT_SENTINEL
+} ratelimit_action_t;
+#undef DEFINE_ACTION
+
+typedef enum ratelimit_class {
+    RATELIMIT_MULTI,                /* fragment of a multi-key request */
+    RATELIMIT_READ,                 /* read */
+    RATELIMIT_WRITE,                /* write */
+} ratelimit_class_t;
+
+typedef enum ratelimit_result {
+    RATELIMIT_PASS,                 /* drew its credit, forward it */
+    RATELIMIT_DELAYED,              /* queued until there is credit */
+    RATELIMIT_DENIED,               /* out of credit, fail it */
+} ratelimit_result_t;
+
+struct ratelimit_bucket {
+    int64_t  credit;                /* credit left */
+    int64_t  stamp;                 /* msec of the last refill */
+    uint32_t pass;                  /* drain pass it last came up short in */
+};
+
+struct ratelimit {
+    struct server_pool      *owner;         /* owner pool */
+    ratelimit_action_t      action;         /* on a request out of credit */
+    int64_t                 rate;           /* pool credit per msec or 0 */
+    int64_t                 burst;          /* pool max credit */
+    struct ratelimit_bucket bucket;         /* pool bucket */
+    int64_t                 client_rate;    /* client credit per msec or 0 */
+    int64_t                 client_burst;   /* client max credit */
+    struct ratelimit_bucket *clients;       /* client buckets, if any */
+    uint32_t                prefix;         /* ipv4 client prefix in bits */
+    uint32_t                prefix6;        /* ipv6 client prefix in bits */
+    int64_t                 write_cost;     /* credit of a write */
+    struct msg_tqh          delay_q;        /* requests waiting for credit */
+    uint32_t                ndelay;         /* # requests in delay q */
+    uint32_t                nqueue;         /* max # requests in delay q */
+    uint32_t                pass;           /* # drain passes */
+    unsigned                blocked:1;      /* delay q waits on pool bucket? */
+};
+
+struct ratelimit *ratelimit_create(struct server_pool *owner,
+                                   ratelimit_action_t action,
+                                   uint32_t rate, uint32_t burst,
+                                   uint32_t client_rate, uint32_t client_burst,
+                                   uint32_t prefix, uint32_t prefix6,
+                                   uint32_t write_cost, uint32_t nqueue);
+void ratelimit_destroy(struct ratelimit *rl);
+
+struct ratelimit_bucket *ratelimit_client(struct ratelimit *rl,
+                                          struct sockaddr *addr);
+ratelimit_result_t ratelimit_admit(struct context *ctx, struct ratelimit *rl,
+                                   struct conn *conn, struct msg *msg);
+void ratelimit_cancel(struct context *ctx, struct ratelimit *rl,
+                      struct conn *conn);
+void ratelimit_drain(struct context *ctx, struct ratelimit *rl);
+
+#endif
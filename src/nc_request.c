@@ -40,8 +40,12 @@ req_put(struct msg *msg)
 
     ASSERT(msg->request);
 
-    if (msg->pre_req_put != NULL) {
-        msg->pre_req_put(msg);
+    if (msg->hooks != NULL && msg->hooks->pre_req_put != NULL) {
+        msg->hooks->pre_req_put(msg);
+    }
+
+    if (msg->flight) {
+        req_collapse_done(msg, NULL);
     }
 
     pmsg = msg->peer;
@@ -143,7 +147,7 @@ req_done(struct conn *conn, struct msg *msg)
 
     ASSERT(msg->frag_owner->nfrag == nfragment);
 
-    msg->post_coalesce(msg->frag_owner);
+    msg->ops->post_coalesce(msg->frag_owner);
 
     log_debug(LOG_DEBUG, "req from c %d with fid %"PRIu64" and %"PRIu32" "
               "fragments is done", conn->sd, id, nfragment);
@@ -171,8 +175,12 @@ req_error(struct conn *conn, struct msg *msg)
         return true;
     }
 
+    /*
+     * Fragments of a binary quiet multiget are answered one by one, so
+     * an error in one of them is not an error in the others
+     */
     id = msg->frag_id;
-    if (id == 0) {
+    if (id == 0 || conn->binary) {
         return false;
     }
 
@@ -256,6 +264,8 @@ req_server_enqueue_imsgq(struct context *ctx, struct conn *conn, struct msg *msg
 
     stats_server_incr(ctx, conn->owner, in_queue);
     stats_server_incr_by(ctx, conn->owner, in_queue_bytes, msg->mlen);
+
+    server_inflight(ctx, conn->owner, msg, true);
 }
 
 void
@@ -268,6 +278,8 @@ req_server_dequeue_imsgq(struct context *ctx, struct conn *conn, struct msg *msg
 
     stats_server_decr(ctx, conn->owner, in_queue);
     stats_server_decr_by(ctx, conn->owner, in_queue_bytes, msg->mlen);
+
+    server_inflight(ctx, conn->owner, msg, false);
 }
 
 void
@@ -290,6 +302,8 @@ req_server_enqueue_omsgq(struct context *ctx, struct conn *conn, struct msg *msg
 
     stats_server_incr(ctx, conn->owner, out_queue);
     stats_server_incr_by(ctx, conn->owner, out_queue_bytes, msg->mlen);
+
+    server_inflight(ctx, conn->owner, msg, true);
 }
 
 void
@@ -313,6 +327,8 @@ req_server_dequeue_omsgq(struct context *ctx, struct conn *conn, struct msg *msg
 
     stats_server_decr(ctx, conn->owner, out_queue);
     stats_server_decr_by(ctx, conn->owner, out_queue_bytes, msg->mlen);
+
+    server_inflight(ctx, conn->owner, msg, false);
 }
 
 struct msg *
@@ -345,13 +361,21 @@ req_recv_next(struct context *ctx, struct conn *conn, bool alloc)
          * half (by sending the second FIN) when the client has no
          * outstanding requests
          */
-        if (!conn->active(conn)) {
+        if (!conn->ops->active(conn)) {
             conn->done = 1;
             log_debug(LOG_INFO, "c %d is done", conn->sd);
         }
         return NULL;
     }
 
+    /*
+     * Stop reading from a client paused on a backlog, though what was read
+     * already is still parsed and forwarded
+     */
+    if (conn->paused && alloc) {
+        return NULL;
+    }
+
     msg = conn->rmsg;
     if (msg != NULL) {
         ASSERT(msg->request);
@@ -435,6 +459,10 @@ req_forward_stats(struct context *ctx, struct server *server, struct msg *msg)
 
     stats_server_incr(ctx, server, requests);
     stats_server_incr_by(ctx, server, request_bytes, msg->mlen);
+
+    stats_pool_command_incr_by(ctx, server->owner, msg, requests, 1);
+    stats_pool_command_incr_by(ctx, server->owner, msg, request_bytes,
+                               msg->mlen);
 }
 
 
@@ -468,13 +496,13 @@ req_enqueue(struct context *ctx, struct conn *s_conn, struct msg *msg)
         }
     }
 
-    s_conn->enqueue_inq(ctx, s_conn, msg);
+    s_conn->ops->enqueue_inq(ctx, s_conn, msg);
 
     return NC_OK;
 }
 
 struct string
-req_build_key(struct string *hash_tag, struct msg *msg)
+req_route_key(struct string *hash_tag, uint8_t *start, uint8_t *end)
 {
     struct string key = null_string;
     /*
@@ -483,23 +511,30 @@ req_build_key(struct string *hash_tag, struct msg *msg)
      * we use the full key
      */
     if (!string_empty(hash_tag)) {
-        req_hash_key(msg->key_start, msg->key_end, hash_tag, &key);
+        req_hash_key(start, end, hash_tag, &key);
     } 
 
     /* Fallback to the whole string as hash_key */
     if (string_empty(&key)) {
-        string_set(&key, msg->key_start, (msg->key_end - msg->key_start));
+        string_set(&key, start, (end - start));
     }
 
     return key;
 }
 
+struct string
+req_build_key(struct string *hash_tag, struct msg *msg)
+{
+    return req_route_key(hash_tag, msg->key_start, msg->key_end);
+}
+
 static rstatus_t
 req_forward(struct context *ctx, struct conn *c_conn, struct msg *msg)
 {
     rstatus_t status;
     struct conn *s_conn; /* fallback connection */
     struct server_pool *pool;
+    struct server *server;
     struct string key;
 
     ASSERT(c_conn->client && !c_conn->proxy);
@@ -507,25 +542,55 @@ req_forward(struct context *ctx, struct conn *c_conn, struct msg *msg)
     pool = c_conn->owner;
     key = req_build_key(&pool->hash_tag, msg);
     
-    s_conn = msg->routing(ctx, pool, msg, &key);
+    s_conn = msg->ops->routing(ctx, pool, msg, &key);
     if (s_conn == NULL) {
         return NC_ERROR;
     }
 
     ASSERT(!s_conn->client && !s_conn->proxy);
 
-    if (msg->post_routing != NULL &&
-        msg->post_routing(ctx, s_conn, msg) != NC_OK) {
+    server = s_conn->owner;
+    if (server->owner->backpressure_reject && server_congested(server)) {
+        stats_pool_incr(ctx, server->owner, inflight_denied);
+        errno = NC_ESERVICEUNAVAILABLE;
+        return NC_ERROR;
+    }
+
+    if (msg->ops->post_routing != NULL &&
+        msg->ops->post_routing(ctx, s_conn, msg) != NC_OK) {
         return NC_ERROR;
     }
 
     /* enqueue the message (request) into server inq */
+    msg->fwd_usec = (uint32_t)nc_usec_now();
     status = req_enqueue(ctx, s_conn, msg);
     if (status != NC_OK) {
         return NC_ERROR;
     }
 
     req_forward_stats(ctx, s_conn->owner, msg);
+
+    /*
+     * Stop reading from the client once its server or pool is over its
+     * in-flight limits, until server_pool_backpressure resumes it
+     */
+    if (!c_conn->paused && server_congested(server)) {
+        c_conn->paused = 1;
+        c_conn->paused_by = server;
+        pool->npaused++;
+        stats_pool_incr(ctx, server->owner, inflight_paused);
+
+        log_debug(LOG_VERB, "pause c %d on backlog of s %d with %"PRIu32" "
+                  "reqs %zu bytes in flight", c_conn->sd, s_conn->sd,
+                  server->inflight, server->inflight_bytes);
+    }
+
+    if (pool->hot_key_sample != 0 && --pool->hot_key_countdown == 0) {
+        pool->hot_key_countdown = pool->hot_key_sample;
+        msg->hotkey = 1;
+        stats_server_hotkey(ctx, s_conn->owner, msg, pool->hot_key_sample, 0);
+    }
+
     log_debug(LOG_VERB, "forward from c %d to s %d req %"PRIu64" len %"PRIu32
               " type %d with key '%.*s'", c_conn->sd, s_conn->sd, msg->id,
               msg->mlen, msg->type, key.len, key.data);
@@ -560,8 +625,8 @@ req_virtual_forward(struct context *ctx, struct conn *c_conn, struct msg *msg)
               downstream->namespace.len, downstream->namespace.data,
               downstream->name.len, downstream->name.data);
     /* Transfer this connection to the downstream pool */
-    c_conn->unref(c_conn);
-    c_conn->ref(c_conn, downstream);
+    c_conn->ops->unref(c_conn);
+    c_conn->ops->ref(c_conn, downstream);
     
     status = req_forward(ctx, c_conn, msg);
     if (status != NC_OK) {
@@ -571,26 +636,250 @@ req_virtual_forward(struct context *ctx, struct conn *c_conn, struct msg *msg)
     return NC_OK;
 }
 
+/*
+ * Attach an empty response to a request that the proxy answers itself
+ * (e.g. memcache 'mn'); the protocol reply handler fills it in
+ */
 static rstatus_t
-req_pre_forward(struct context *ctx, struct conn *conn, struct msg *msg)
+req_make_reply(struct context *ctx, struct conn *conn, struct msg *req)
+{
+    struct msg *rsp;
+
+    ASSERT(conn->client && !conn->proxy);
+    ASSERT(req->noforward && req->ops->reply != NULL);
+
+    rsp = msg_get(conn, false, conn->redis);
+    if (rsp == NULL) {
+        conn->err = errno;
+        return NC_ENOMEM;
+    }
+
+    req->peer = rsp;
+    rsp->peer = req;
+    req->done = 1;
+
+    return req->ops->reply(req);
+}
+
+/*
+ * Invalidate the near cache on a write, or answer a read from it. Returns
+ * true if req was answered, in which case it is not forwarded; any failure
+ * to build the reply just forwards req as usual
+ */
+static bool
+req_near_cache(struct context *ctx, struct conn *conn, struct msg *req)
 {
     struct server_pool *pool;
+    struct nearcache_entry *entry;
+    struct msg *rsp;
+
+    ASSERT(conn->client && !conn->proxy);
 
     pool = conn->owner;
 
-    if (server_pool_ratelimit(pool)) {
-        errno = NC_ETOOMANYREQUESTS;
-        return NC_ERROR;
+    switch (req->ops->cacheable(req)) {
+    case MSG_CACHE_WRITE:
+        nearcache_invalidate(pool->near_cache, req);
+        return false;
+
+    case MSG_CACHE_READ:
+        break;
+
+    default:
+        return false;
+    }
+
+    entry = nearcache_get(pool->near_cache, req);
+    if (entry == NULL) {
+        stats_pool_incr(ctx, pool, near_cache_misses);
+        return false;
+    }
+
+    rsp = msg_get(conn, false, conn->redis);
+    if (rsp == NULL) {
+        return false;
+    }
+
+    if (nearcache_reply(entry, req, rsp) != NC_OK) {
+        msg_put(rsp);
+        return false;
     }
 
-    if (msg->pre_req_forward != NULL &&
-        msg->pre_req_forward(ctx, conn, msg) != NC_OK) {
+    req->peer = rsp;
+    rsp->peer = req;
+    req->done = 1;
+
+    stats_pool_incr(ctx, pool, near_cache_hits);
+
+    log_debug(LOG_VERB, "c %d req %"PRIu64" served from near cache",
+              conn->sd, req->id);
+
+    if (req_done(conn, TAILQ_FIRST(&conn->omsg_q))) {
+        if (event_add_out(ctx->evb, conn) != NC_OK) {
+            conn->err = errno;
+        }
+    }
+
+    return true;
+}
+
+static rstatus_t
+req_pre_forward(struct context *ctx, struct conn *conn, struct msg *msg)
+{
+    if (msg->ops->pre_req_forward != NULL &&
+        msg->ops->pre_req_forward(ctx, conn, msg) != NC_OK) {
         return NC_ERROR;
     }
 
     return NC_OK;
 }
 
+/*
+ * Return true if msg can wait on an identical request in flight: a
+ * cacheable read, but for a getex, whose reply depends on more than its key
+ */
+static bool
+req_collapsible(struct msg *msg)
+{
+    if (msg->ops->cacheable == NULL ||
+        msg->ops->cacheable(msg) != MSG_CACHE_READ) {
+        return false;
+    }
+
+    return msg->type != MSG_REQ_MC_GETEX;
+}
+
+/*
+ * Forward msg from client conn, past the rate limits, to its server, unless
+ * it can wait on an identical get in flight instead; a get that cannot
+ * leads the flight for its key
+ */
+static void
+req_forward_admitted(struct context *ctx, struct conn *conn, struct msg *msg)
+{
+    rstatus_t status;
+    struct server_pool *pool;
+    bool lead;
+
+    pool = conn->owner;
+
+    lead = false;
+    if (pool->collapse_gets && req_collapsible(msg)) {
+        if (msg_flight_join(pool, msg)) {
+            stats_pool_incr(ctx, pool, collapsed);
+            return;
+        }
+        lead = true;
+    }
+
+    status = req_pre_forward(ctx, conn, msg);
+    if (status != NC_OK) {
+        req_forward_error(ctx, conn, msg);
+        return;
+    }
+
+    if (pool->virtual) {
+        status = req_virtual_forward(ctx, conn, msg);
+    } else {
+        status = req_forward(ctx, conn, msg);
+    }
+    if (status != NC_OK) {
+        req_forward_error(ctx, conn, msg);
+        return;
+    }
+
+    if (lead && msg_flight_lead(pool, msg) != NC_OK) {
+        log_debug(LOG_INFO, "req %"PRIu64" cannot lead flight: %s", msg->id,
+                  strerror(ENOMEM));
+    }
+}
+
+/*
+ * Forward msg held back by the rate limits, or fail it with err if err is
+ * not zero
+ */
+void
+req_forward_delayed(struct context *ctx, struct msg *msg, err_t err)
+{
+    struct conn *conn = msg->owner;
+
+    ASSERT(msg->request && !msg->done);
+
+    if (err != 0) {
+        errno = err;
+        req_forward_error(ctx, conn, msg);
+        return;
+    }
+
+    req_forward_admitted(ctx, conn, msg);
+}
+
+/*
+ * Land the flight led by leader: hand every request waiting on it a copy
+ * of rsp, the leader's response as read from the server, or fail it with
+ * the leader's error if no response is coming
+ */
+void
+req_collapse_done(struct msg *leader, struct msg *rsp)
+{
+    struct msg_tqh waitq;
+    struct msg *msg, *cmsg;
+    struct conn *c_conn;
+    struct server_pool *pool;
+
+    ASSERT(leader->request && leader->flight);
+    ASSERT(rsp == NULL || !rsp->request);
+
+    TAILQ_INIT(&waitq);
+    msg_flight_end(leader, &waitq);
+
+    while (!TAILQ_EMPTY(&waitq)) {
+        msg = TAILQ_FIRST(&waitq);
+        TAILQ_REMOVE(&waitq, msg, s_tqe);
+
+        ASSERT(msg->request && !msg->done && msg->peer == NULL);
+
+        msg->done = 1;
+
+        if (msg->swallow) {
+            req_put(msg);
+            continue;
+        }
+
+        c_conn = msg->owner;
+        pool = c_conn->owner;
+
+        cmsg = NULL;
+        if (rsp != NULL) {
+            cmsg = msg_clone(rsp);
+        }
+
+        if (cmsg != NULL) {
+            cmsg->owner = c_conn;
+            msg->peer = cmsg;
+            cmsg->peer = msg;
+            cmsg->ops->pre_coalesce(cmsg);
+        } else {
+            msg->error = 1;
+            if (rsp != NULL) {
+                msg->err = ENOMEM;
+            } else {
+                msg->err = leader->err != 0 ? leader->err : ENOTCONN;
+            }
+        }
+
+        log_debug(LOG_VERB, "req %"PRIu64" from c %d lands with req %"PRIu64
+                  "%s", msg->id, c_conn->sd, leader->id,
+                  msg->error ? " in error" : "");
+
+        if (req_done(c_conn, TAILQ_FIRST(&c_conn->omsg_q))) {
+            if (event_add_out(pool->ctx->evb, c_conn) != NC_OK) {
+                c_conn->err = errno;
+            }
+        }
+    }
+}
+
 void
 req_recv_done(struct context *ctx, struct conn *conn, struct msg *msg,
               struct msg *nmsg)
@@ -615,23 +904,179 @@ req_recv_done(struct context *ctx, struct conn *conn, struct msg *msg,
 
     /* enqueue message (request) into client outq, if response is expected */
     if (!msg->noreply) {
-        conn->enqueue_outq(ctx, conn, msg);
+        conn->ops->enqueue_outq(ctx, conn, msg);
     }
 
-    status = req_pre_forward(ctx, conn, msg);
-    if (status != NC_OK) {
-        req_forward_error(ctx, conn, msg);
+    /* a write leaves the gets in flight for its key to whoever has them */
+    if (msg->ops->cacheable != NULL &&
+        msg->ops->cacheable(msg) == MSG_CACHE_WRITE) {
+        msg_flight_detach(msg);
+    }
+
+    /*
+     * Near cache hits never reach a server, so like local replies they are
+     * not held to the rate limits; near_cache_hits counts them
+     */
+    if (pool->near_cache != NULL && msg->ops->cacheable != NULL &&
+        req_near_cache(ctx, conn, msg)) {
         return;
     }
 
-    if (pool->virtual) {
-        status = req_virtual_forward(ctx, conn, msg);
-    } else {
-        status = req_forward(ctx, conn, msg);
+    if (msg->noforward) {
+        status = req_make_reply(ctx, conn, msg);
+        if (status != NC_OK) {
+            conn->err = errno;
+            return;
+        }
+
+        if (req_done(conn, TAILQ_FIRST(&conn->omsg_q))) {
+            status = event_add_out(ctx->evb, conn);
+            if (status != NC_OK) {
+                conn->err = errno;
+            }
+        }
+        return;
     }
-    if (status != NC_OK) {
-        req_forward_error(ctx, conn, msg);
+
+    if (pool->ratelimit != NULL) {
+        switch (ratelimit_admit(ctx, pool->ratelimit, conn, msg)) {
+        case RATELIMIT_PASS:
+            break;
+
+        case RATELIMIT_DELAYED:
+            return;
+
+        default:
+            errno = NC_ETOOMANYREQUESTS;
+            req_forward_error(ctx, conn, msg);
+            return;
+        }
     }
+
+    req_forward_admitted(ctx, conn, msg);
+}
+
+/*
+ * Fail req sitting unsent in the server inq back to its client with
+ * ETIMEDOUT, without ever writing it to the server
+ */
+static void
+req_shed(struct context *ctx, struct conn *conn, struct msg *msg)
+{
+    struct conn *c_conn;
+
+    ASSERT(!conn->client && !conn->proxy);
+    ASSERT(msg->request && !msg->done);
+    ASSERT(!msg->partial && !msg->sent);
+
+    conn->ops->dequeue_inq(ctx, conn, msg);
+    msg_tmo_delete(msg);
+
+    msg->done = 1;
+    msg->error = 1;
+    msg->err = ETIMEDOUT;
+
+    if (msg->flight) {
+        req_collapse_done(msg, NULL);
+    }
+
+    stats_server_incr(ctx, conn->owner, request_shed);
+    server_outlier_sample(conn->owner, msg, 0, true);
+
+    if (msg->swallow || msg->noreply || msg->owner == NULL) {
+        log_debug(LOG_INFO, "s %d shed req %"PRIu64" len %"PRIu32" type %d",
+                  conn->sd, msg->id, msg->mlen, msg->type);
+        req_put(msg);
+        return;
+    }
+
+    c_conn = msg->owner;
+    ASSERT(c_conn->client && !c_conn->proxy);
+
+    if (req_done(c_conn, TAILQ_FIRST(&c_conn->omsg_q))) {
+        event_add_out(ctx->evb, c_conn);
+    }
+
+    log_debug(LOG_INFO, "s %d shed req %"PRIu64" len %"PRIu32" type %d from "
+              "c %d past its deadline", conn->sd, msg->id, msg->mlen,
+              msg->type, c_conn->sd);
+}
+
+/*
+ * Fail the timed out req back to its client, keeping the server conn open.
+ * A req still unsent is simply dropped from the server inq. A req already
+ * sent leaves a stand-in in its place in the server outq, that swallows
+ * the response whenever it arrives; if the stand-in times out in turn,
+ * the server conn is closed as usual.
+ *
+ * Returns NC_ERROR if the pool closes server conns on timeout or the req
+ * cannot be failed on its own, in which case the caller closes the conn
+ */
+rstatus_t
+req_timedout(struct context *ctx, struct conn *conn, struct msg *msg)
+{
+    struct server *server;
+    struct server_pool *pool;
+    struct conn *c_conn;
+    struct msg *smsg; /* stand-in message */
+
+    ASSERT(!conn->client && !conn->proxy);
+    ASSERT(msg->request);
+
+    server = conn->owner;
+    pool = server->owner;
+
+    if (pool->timeout_close || msg->done || msg->partial) {
+        return NC_ERROR;
+    }
+
+    if (!msg->sent) {
+        req_shed(ctx, conn, msg);
+        return NC_OK;
+    }
+
+    if (msg->swallow || msg->owner == NULL) {
+        return NC_ERROR;
+    }
+
+    smsg = msg_get(NULL, true, msg->redis);
+    if (smsg == NULL) {
+        return NC_ENOMEM;
+    }
+    smsg->type = msg->type;
+    smsg->swallow = 1;
+    smsg->sent = 1;
+
+    TAILQ_INSERT_BEFORE(msg, smsg, s_tqe);
+    stats_server_incr(ctx, server, out_queue);
+    server_inflight(ctx, server, smsg, true);
+    msg_tmo_insert(smsg, conn);
+
+    conn->ops->dequeue_outq(ctx, conn, msg);
+
+    msg->done = 1;
+    msg->error = 1;
+    msg->err = ETIMEDOUT;
+
+    if (msg->flight) {
+        req_collapse_done(msg, NULL);
+    }
+
+    stats_server_incr(ctx, server, request_timedout);
+    server_outlier_sample(server, msg, 0, true);
+
+    c_conn = msg->owner;
+    ASSERT(c_conn->client && !c_conn->proxy);
+
+    if (req_done(c_conn, TAILQ_FIRST(&c_conn->omsg_q))) {
+        event_add_out(ctx->evb, c_conn);
+    }
+
+    log_debug(LOG_INFO, "s %d timedout req %"PRIu64" type %d from c %d, "
+              "stand-in req %"PRIu64" swallows its rsp", conn->sd, msg->id,
+              msg->type, c_conn->sd, smsg->id);
+
+    return NC_OK;
 }
 
 struct msg *
@@ -639,6 +1084,8 @@ req_send_next(struct context *ctx, struct conn *conn)
 {
     rstatus_t status;
     struct msg *msg, *nmsg; /* current and next message */
+    struct msg *emsg;       /* expired message */
+    int64_t now;
 
     ASSERT(!conn->client && !conn->proxy);
 
@@ -663,6 +1110,31 @@ req_send_next(struct context *ctx, struct conn *conn)
         nmsg = TAILQ_NEXT(msg, s_tqe);
     }
 
+    /*
+     * Don't spend backend capacity on req whose client deadline passed
+     * while queued; a partially sent req has to be sent in full though
+     */
+    now = 0;
+    while (nmsg != NULL && nmsg->deadline != 0 && !nmsg->partial) {
+        if (now == 0) {
+            now = nc_msec_now();
+        }
+        if (now < nmsg->deadline) {
+            break;
+        }
+
+        emsg = nmsg;
+        nmsg = TAILQ_NEXT(nmsg, s_tqe);
+        req_shed(ctx, conn, emsg);
+
+        if (TAILQ_EMPTY(&conn->imsg_q)) {
+            status = event_del_out(ctx->evb, conn);
+            if (status != NC_OK) {
+                conn->err = errno;
+            }
+        }
+    }
+
     conn->smsg = nmsg;
 
     if (nmsg == NULL) {
@@ -689,7 +1161,7 @@ req_send_done(struct context *ctx, struct conn *conn, struct msg *msg)
               "s %d", msg->id, msg->mlen, msg->type, conn->sd);
 
     /* dequeue the message (request) from server inq */
-    conn->dequeue_inq(ctx, conn, msg);
+    conn->ops->dequeue_inq(ctx, conn, msg);
 
     /*
      * noreply request instructs the server not to send any response. So,
@@ -697,7 +1169,8 @@ req_send_done(struct context *ctx, struct conn *conn, struct msg *msg)
      * Otherwise, free the noreply request
      */
     if (!msg->noreply) {
-        conn->enqueue_outq(ctx, conn, msg);
+        msg->sent = 1;
+        conn->ops->enqueue_outq(ctx, conn, msg);
     } else {
         req_put(msg);
     }
@@ -17,6 +17,7 @@
 
 #include <nc_core.h>
 #include <nc_server.h>
+#include <proto/nc_proto.h>
 
 struct msg *
 rsp_get(struct conn *conn)
@@ -53,15 +54,16 @@ rsp_make_error(struct context *ctx, struct conn *conn, struct msg *msg)
     ASSERT(msg->request && req_error(conn, msg));
     ASSERT(msg->owner == conn);
 
+    /* binary fragments are in error one by one, see req_error */
     id = msg->frag_id;
-    if (id != 0) {
+    if (id != 0 && !conn->binary) {
         for (err = 0, cmsg = TAILQ_NEXT(msg, c_tqe);
              cmsg != NULL && cmsg->frag_id == id;
              cmsg = nmsg) {
             nmsg = TAILQ_NEXT(cmsg, c_tqe);
 
             /* dequeue request (error fragment) from client outq */
-            conn->dequeue_outq(ctx, conn, cmsg);
+            conn->ops->dequeue_outq(ctx, conn, cmsg);
             if (err == 0 && cmsg->err != 0) {
                 err = cmsg->err;
             }
@@ -80,6 +82,10 @@ rsp_make_error(struct context *ctx, struct conn *conn, struct msg *msg)
         rsp_put(pmsg);
     }
 
+    if (conn->binary) {
+        return memcache_binary_error(msg, err);
+    }
+
     return msg_get_error(conn->redis, err);
 }
 
@@ -115,7 +121,7 @@ rsp_recv_next(struct context *ctx, struct conn *conn, bool alloc)
          * it crashes
          */
         conn->done = 1;
-        log_error("s %d active %d is done", conn->sd, conn->active(conn));
+        log_error("s %d active %d is done", conn->sd, conn->ops->active(conn));
 
         return NULL;
     }
@@ -167,12 +173,17 @@ rsp_filter(struct context *ctx, struct conn *conn, struct msg *msg)
     msg->peer = pmsg;
     pmsg->peer = msg;
 
+    /* requests collapsed onto pmsg share its response, even if swallowed */
+    if (pmsg->flight) {
+        req_collapse_done(pmsg, msg);
+    }
+
     if (pmsg->swallow) {
-        if (pmsg->pre_swallow != NULL) {
-            pmsg->pre_swallow(ctx, conn, msg);
+        if (pmsg->hooks != NULL && pmsg->hooks->pre_swallow != NULL) {
+            pmsg->hooks->pre_swallow(ctx, conn, msg);
         }
 
-        conn->dequeue_outq(ctx, conn, pmsg);
+        conn->ops->dequeue_outq(ctx, conn, pmsg);
         pmsg->done = 1;
 
         log_debug(LOG_INFO, "swallow rsp %"PRIu64" len %"PRIu32" of req "
@@ -186,13 +197,52 @@ rsp_filter(struct context *ctx, struct conn *conn, struct msg *msg)
     return false;
 }
 
+/*
+ * Is msg an error response from the server?
+ */
+static bool
+rsp_failure(struct msg *msg)
+{
+    switch (msg->type) {
+    case MSG_RSP_MC_ERROR:
+    case MSG_RSP_MC_CLIENT_ERROR:
+    case MSG_RSP_MC_SERVER_ERROR:
+    case MSG_RSP_REDIS_ERROR:
+        return true;
+
+    default:
+        return false;
+    }
+}
+
 static void
 rsp_forward_stats(struct context *ctx, struct server *server, struct msg *msg)
 {
+    int64_t usec;
+    bool failure;
+
     ASSERT(!msg->request);
 
+    /* 32 bits of usec wrap around every ~71 minutes, plenty for a request */
+    usec = (uint32_t)nc_usec_now() - msg->peer->fwd_usec;
+    failure = rsp_failure(msg);
+
     stats_server_incr(ctx, server, responses);
     stats_server_incr_by(ctx, server, response_bytes, msg->mlen);
+
+    stats_server_latency(ctx, server, msg->peer, usec);
+    stats_pool_command_incr_by(ctx, server->owner, msg->peer, response_bytes,
+                               msg->mlen);
+    if (failure) {
+        stats_pool_command_incr_by(ctx, server->owner, msg->peer, errors, 1);
+    }
+
+    server_outlier_sample(server, msg->peer, usec, failure);
+
+    if (msg->peer->hotkey) {
+        stats_server_hotkey(ctx, server, msg->peer, 0,
+                            (int64_t)msg->mlen * server->owner->hot_key_sample);
+    }
 }
 
 static void
@@ -201,6 +251,7 @@ rsp_forward(struct context *ctx, struct conn *s_conn, struct msg *msg)
     rstatus_t status;
     struct msg *pmsg;
     struct conn *c_conn;
+    struct server_pool *pool;
 
     ASSERT(!s_conn->client && !s_conn->proxy);
 
@@ -213,19 +264,27 @@ rsp_forward(struct context *ctx, struct conn *s_conn, struct msg *msg)
      */
     pmsg = msg->peer;
 
-    s_conn->dequeue_outq(ctx, s_conn, pmsg);
+    s_conn->ops->dequeue_outq(ctx, s_conn, pmsg);
     pmsg->done = 1;
 
-    msg->pre_coalesce(msg);
+    msg->ops->pre_coalesce(msg);
 
-    if (msg->pre_rsp_forward != NULL &&
-        msg->pre_rsp_forward(ctx, s_conn, msg) != NC_OK) {
+    if (msg->ops->pre_rsp_forward != NULL &&
+        msg->ops->pre_rsp_forward(ctx, s_conn, msg) != NC_OK) {
         return;
     }
     
     c_conn = pmsg->owner;
     ASSERT(c_conn->client && !c_conn->proxy);
 
+    /* fill the near cache of the client pool with a retrieved value */
+    pool = c_conn->owner;
+    if (pool->near_cache != NULL && msg->ops->cacheable != NULL &&
+        msg->ops->cacheable(msg) == MSG_CACHE_READ &&
+        pmsg->ops->cacheable(pmsg) == MSG_CACHE_READ) {
+        nearcache_put(pool->near_cache, pmsg, msg);
+    }
+
     if (req_done(c_conn, TAILQ_FIRST(&c_conn->omsg_q))) {
         status = event_add_out(ctx->evb, c_conn);
         if (status != NC_OK) {
@@ -302,6 +361,7 @@ rsp_send_next(struct context *ctx, struct conn *conn)
         msg->peer = pmsg;
         pmsg->peer = msg;
         stats_pool_incr(ctx, conn->owner, forward_error);
+        stats_pool_command_incr_by(ctx, conn->owner, pmsg, errors, 1);
     } else {
         msg = pmsg->peer;
     }
@@ -331,7 +391,7 @@ rsp_send_done(struct context *ctx, struct conn *conn, struct msg *msg)
     ASSERT(pmsg->done && !pmsg->swallow);
 
     /* dequeue request from client outq */
-    conn->dequeue_outq(ctx, conn, pmsg);
+    conn->ops->dequeue_outq(ctx, conn, pmsg);
 
     req_put(pmsg);
 }
@@ -391,7 +391,11 @@ server_conn(struct server *server)
      */
 
     if (server->ns_conn_q < pool->server_connections) {
-        return conn_get(server, false, pool->redis);
+        conn = conn_get(server, false, pool->redis);
+        if (conn != NULL) {
+            conn->binary = pool->memcache_binary;
+        }
+        return conn;
     }
     ASSERT(server->ns_conn_q == pool->server_connections);
 
@@ -449,7 +453,7 @@ server_each_disconnect(void *elem, void *data)
         ASSERT(server->ns_conn_q > 0);
 
         conn = TAILQ_FIRST(&server->s_conn_q);
-        conn->close(pool->ctx, conn);
+        conn->ops->close(pool->ctx, conn);
     }
 
     return NC_OK;
@@ -552,7 +556,7 @@ server_close(struct context *ctx, struct conn *conn)
 
     if (conn->sd < 0) {
         server_failure(ctx, conn->owner);
-        conn->unref(conn);
+        conn->ops->unref(conn);
         conn_put(conn);
         return;
     }
@@ -561,7 +565,7 @@ server_close(struct context *ctx, struct conn *conn)
         nmsg = TAILQ_NEXT(msg, s_tqe);
 
         /* dequeue the message (request) from server inq */
-        conn->dequeue_inq(ctx, conn, msg);
+        conn->ops->dequeue_inq(ctx, conn, msg);
 
         /*
          * Don't send any error response, if
@@ -572,6 +576,10 @@ server_close(struct context *ctx, struct conn *conn)
         msg->error = 1;
         msg->err = conn->err;
 
+        if (msg->flight) {
+            req_collapse_done(msg, NULL);
+        }
+
         if (msg->swallow || msg->noreply || msg->owner == NULL) {
             log_debug(LOG_INFO, "close s %d swallow req %"PRIu64" len %"PRIu32
                       " type %d", conn->sd, msg->id, msg->mlen, msg->type);
@@ -596,12 +604,18 @@ server_close(struct context *ctx, struct conn *conn)
         nmsg = TAILQ_NEXT(msg, s_tqe);
 
         /* dequeue the message (request) from server outq */
-        conn->dequeue_outq(ctx, conn, msg);
+        conn->ops->dequeue_outq(ctx, conn, msg);
+
+        server_outlier_sample(conn->owner, msg, 0, true);
 
         msg->done = 1;
         msg->error = 1;
         msg->err = conn->err;
 
+        if (msg->flight) {
+            req_collapse_done(msg, NULL);
+        }
+
         if (msg->swallow || msg->owner == NULL) {
             log_debug(LOG_INFO, "close s %d swallow req %"PRIu64" len %"PRIu32
                       " type %d", conn->sd, msg->id, msg->mlen, msg->type);
@@ -639,7 +653,7 @@ server_close(struct context *ctx, struct conn *conn)
 
     server_failure(ctx, conn->owner);
 
-    conn->unref(conn);
+    conn->ops->unref(conn);
 
     status = close(conn->sd);
     if (status < 0) {
@@ -757,7 +771,11 @@ server_ok(struct context *ctx, struct conn *conn)
                   " to 0", server->pname.len, server->pname.data,
                   server->failure_count);
         server->failure_count = 0;
-        server->next_retry = 0LL;
+
+        /* a late response of an ejected server does not bring it back */
+        if (server->next_retry <= nc_usec_now()) {
+            server->next_retry = 0LL;
+        }
     }
 }
 
@@ -869,13 +887,37 @@ server_pool_server(struct server_pool *pool, uint8_t *key, uint32_t keylen)
     return server;
 }
 
+/*
+ * Return true if key maps to server: for range distribution, if it falls
+ * in the range of the server, whichever replica of the range would serve
+ * it, for random distribution always
+ */
+bool
+server_pool_owns(struct server_pool *pool, struct server *server,
+                 uint8_t *key, uint32_t keylen)
+{
+    int hash;
+
+    switch (pool->dist_type) {
+    case DIST_RANGE:
+        hash = (int)(server_pool_hash(pool, key, keylen) &
+                     (DIST_RANGE_MAX - 1));
+        return hash >= server->range_start && hash < server->range_end;
+
+    case DIST_RANDOM:
+        return true;
+
+    default:
+        return server_pool_server(pool, key, keylen) == server;
+    }
+}
+
 struct conn *
 server_pool_conn(struct context *ctx, struct server_pool *pool, uint8_t *key,
                  uint32_t keylen)
 {
     rstatus_t status;
     struct server *server;
-    struct conn *conn;
 
     status = server_pool_update(pool);
     if (status != NC_OK) {
@@ -890,7 +932,18 @@ server_pool_conn(struct context *ctx, struct server_pool *pool, uint8_t *key,
         return NULL;
     }
 
-    /* pick a connection to a given server */
+    return server_conn_connect(ctx, server);
+}
+
+/*
+ * Pick a connection to a given server and connect it
+ */
+struct conn *
+server_conn_connect(struct context *ctx, struct server *server)
+{
+    rstatus_t status;
+    struct conn *conn;
+
     conn = server_conn(server);
     if (conn == NULL) {
         log_debug(LOG_VERB, "server: failed to pick conn");
@@ -1100,7 +1153,8 @@ server_pool_each_set_gutter(void *elem, void *data)
         pool = array_get(pool_array, pool_index);
 
         if (string_compare(&pool->name, &sp->gutter_name) == 0 &&
-            pool->redis == sp->redis) {
+            pool->redis == sp->redis &&
+            pool->memcache_binary == sp->memcache_binary) {
             sp->gutter = pool;
             return NC_OK;
         }
@@ -1122,7 +1176,8 @@ server_pool_each_set_peer(void *elem, void *data)
         pool = array_get(pool_array, pool_index);
 
         if (string_compare(&pool->name, &sp->peer_name) == 0 &&
-            pool->redis == sp->redis) {
+            pool->redis == sp->redis &&
+            pool->memcache_binary == sp->memcache_binary) {
             sp->peer = pool;
             return NC_OK;
         }
@@ -1146,10 +1201,23 @@ server_pool_each_set_message_queue(void *elem, void *data)
         if (string_compare(&pool->name, &sp->message_queue_name) == 0 &&
             pool->redis) {
             sp->message_queue = pool;
-            return NC_OK;
+            break;
         }
     }
-    return NC_ERROR;
+
+    if (sp->message_queue == NULL) {
+        return NC_ERROR;
+    }
+
+    if (sp->notify_async || !string_empty(&sp->notify_journal)) {
+        sp->notify = notify_create(sp, sp->notify_buffer, &sp->notify_journal,
+                                   sp->notify_journal_size);
+        if (sp->notify == NULL) {
+            return NC_ENOMEM;
+        }
+    }
+
+    return NC_OK;
 }
 
 static rstatus_t
@@ -1192,7 +1260,8 @@ server_pool_each_set_downstreams(void *elem, void *data)
                 return NC_ERROR;
             } 
 
-            if (sp->redis != ds->redis) {
+            if (sp->redis != ds->redis ||
+                sp->memcache_binary != ds->memcache_binary) {
                 log_error("server: downstream '%.*s' has difference protocol type",
                           ds->name.len, ds->name.data);
                 
@@ -1396,6 +1465,12 @@ server_pool_deinit(struct array *server_pool)
             assoc_destroy_table(sp->downstream_table);
         }
 
+        nearcache_destroy(sp->near_cache);
+        warmup_destroy(sp->warmup);
+        notify_destroy(sp->notify);
+        ratelimit_destroy(sp->ratelimit);
+        outlier_destroy(sp->outlier);
+
         server_deinit(&sp->server);
 
         log_debug(LOG_DEBUG, "deinit pool %"PRIu32" '%.*s'", sp->idx,
@@ -1500,21 +1575,11 @@ static rstatus_t
 server_pool_each_update_quota(void *elem, void *data)
 {
     struct server_pool *pool = elem;
-    float delta;
-    
-    if (pool->rate != CONF_DEFAULT_RATE &&
-        pool->burst != CONF_DEFAULT_BURST) {
-        delta = pool->rate * NC_TICK_INTERVAL / 1000;
-        if (pool->count >= delta) {
-            pool->count -= delta;
-        } else {
-            pool->count = 0;
-        }
-    }
+    struct context *ctx = data;
 
-    log_debug(LOG_VVVERB, "ratelimit: %.*s rate: %.2f burst: %.2f count: %.2f",
-              pool->name.len, pool->name.data,
-              pool->rate, pool->burst, pool->count);
+    if (pool->ratelimit != NULL) {
+        ratelimit_drain(ctx, pool->ratelimit);
+    }
 
     return NC_OK;
 }
@@ -1526,21 +1591,205 @@ server_pool_update_quota(struct context *ctx)
 
     pools = &ctx->pool;
 
-    array_each(pools, server_pool_each_update_quota, NULL);
+    array_each(pools, server_pool_each_update_quota, ctx);
+}
+
+/*
+ * Feed the outlier detection of the pool of server with req, a client
+ * request it answered after usec, or failed if error
+ */
+void
+server_outlier_sample(struct server *server, struct msg *req, int64_t usec,
+                      bool error)
+{
+    struct server_pool *pool = server->owner;
+
+    ASSERT(req->request);
+
+    if (pool->outlier == NULL || req->owner == NULL) {
+        return;
+    }
+
+    outlier_sample(pool->outlier, server, usec, error);
+}
+
+static rstatus_t
+server_pool_each_outlier(void *elem, void *data)
+{
+    struct server_pool *pool = elem;
+    struct context *ctx = data;
+
+    if (pool->outlier != NULL) {
+        outlier_detect(ctx, pool->outlier);
+    }
+
+    return NC_OK;
+}
+
+void
+server_pool_outlier(struct context *ctx)
+{
+    struct array *pools;
+
+    pools = &ctx->pool;
+
+    array_each(pools, server_pool_each_outlier, ctx);
+}
+
+/*
+ * Account msg entering (in) or leaving the queues of server toward the
+ * in-flight limits of server and its pool
+ */
+void
+server_inflight(struct context *ctx, struct server *server, struct msg *msg,
+                bool in)
+{
+    struct server_pool *pool = server->owner;
+
+    if (in) {
+        server->inflight++;
+        server->inflight_bytes += msg->mlen;
+        pool->inflight++;
+        pool->inflight_bytes += msg->mlen;
+
+        stats_pool_incr(ctx, pool, inflight);
+        stats_pool_incr_by(ctx, pool, inflight_bytes, msg->mlen);
+        return;
+    }
+
+    ASSERT(server->inflight > 0 && server->inflight_bytes >= msg->mlen);
+    ASSERT(pool->inflight > 0 && pool->inflight_bytes >= msg->mlen);
+
+    server->inflight--;
+    server->inflight_bytes -= msg->mlen;
+    pool->inflight--;
+    pool->inflight_bytes -= msg->mlen;
+
+    stats_pool_decr(ctx, pool, inflight);
+    stats_pool_decr_by(ctx, pool, inflight_bytes, msg->mlen);
 }
 
+/*
+ * Return true if server or its pool has reached one of its in-flight
+ * limits, the high watermark
+ */
 bool
-server_pool_ratelimit(struct server_pool *pool)
+server_congested(struct server *server)
 {
-    if (pool->rate != CONF_DEFAULT_RATE && pool->burst != CONF_DEFAULT_BURST) {
-        /* ratelimit enabled */
-        if (pool->count < pool->burst) {
-            pool->count += 1;
-            return false;
-        } else {
-            return true;
+    struct server_pool *pool = server->owner;
+
+    return (pool->server_max_inflight != 0 &&
+            server->inflight >= pool->server_max_inflight) ||
+           (pool->server_max_inflight_bytes != 0 &&
+            server->inflight_bytes >= pool->server_max_inflight_bytes) ||
+           (pool->max_inflight != 0 &&
+            pool->inflight >= pool->max_inflight) ||
+           (pool->max_inflight_bytes != 0 &&
+            pool->inflight_bytes >= pool->max_inflight_bytes);
+}
+
+/*
+ * Return true if server and its pool are back down to half of each of
+ * their in-flight limits, the low watermark
+ */
+static bool
+server_drained(struct server *server)
+{
+    struct server_pool *pool = server->owner;
+
+    return (pool->server_max_inflight == 0 ||
+            server->inflight <= pool->server_max_inflight / 2) &&
+           (pool->server_max_inflight_bytes == 0 ||
+            server->inflight_bytes <= pool->server_max_inflight_bytes / 2) &&
+           (pool->max_inflight == 0 ||
+            pool->inflight <= pool->max_inflight / 2) &&
+           (pool->max_inflight_bytes == 0 ||
+            pool->inflight_bytes <= pool->max_inflight_bytes / 2);
+}
+
+static rstatus_t
+server_pool_each_backpressure(void *elem, void *data)
+{
+    struct server_pool *pool = elem;
+    struct context *ctx = data;
+    struct conn *conn, *nconn;
+
+    for (conn = TAILQ_FIRST(&pool->c_conn_q);
+         conn != NULL && pool->npaused > 0; conn = nconn) {
+        nconn = TAILQ_NEXT(conn, conn_tqe);
+
+        if (!conn->paused || !server_drained(conn->paused_by)) {
+            continue;
         }
-    } else {
-        return false;
-    }                
+
+        conn->paused = 0;
+        conn->paused_by = NULL;
+        pool->npaused--;
+
+        log_debug(LOG_VERB, "resume c %d", conn->sd);
+
+        core_resume(ctx, conn);
+    }
+
+    return NC_OK;
+}
+
+/*
+ * Resume reading from the clients paused on a backlog that has drained
+ * below its low watermark. Called once every tick
+ */
+void
+server_pool_backpressure(struct context *ctx)
+{
+    struct array *pools;
+
+    pools = &ctx->pool;
+
+    array_each(pools, server_pool_each_backpressure, ctx);
+}
+
+static rstatus_t
+server_pool_each_warmup(void *elem, void *data)
+{
+    struct server_pool *pool = elem;
+    struct context *ctx = data;
+
+    if (pool->warmup != NULL) {
+        warmup_drain(ctx, pool->warmup);
+    }
+
+    return NC_OK;
+}
+
+void
+server_pool_warmup(struct context *ctx)
+{
+    struct array *pools;
+
+    pools = &ctx->pool;
+
+    array_each(pools, server_pool_each_warmup, ctx);
+}
+
+static rstatus_t
+server_pool_each_notify(void *elem, void *data)
+{
+    struct server_pool *pool = elem;
+    struct context *ctx = data;
+
+    if (pool->notify != NULL) {
+        notify_flush(ctx, pool->notify);
+    }
+
+    return NC_OK;
+}
+
+void
+server_pool_notify(struct context *ctx)
+{
+    struct array *pools;
+
+    pools = &ctx->pool;
+
+    array_each(pools, server_pool_each_notify, ctx);
 }
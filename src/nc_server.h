@@ -99,8 +99,12 @@ struct server {
     int              tag_idx;          /* server tag index in pool tags */
 
     int64_t          next_probe;       /* next probe time in usec */
-    
+
+    uint32_t         inflight;         /* # requests queued or sent */
+    size_t           inflight_bytes;   /* bytes of requests in flight */
+
     void            *stats;            /* stats data */
+    unsigned         stale:1;          /* replica too stale for reads? */
 };
 
 struct downstream_pool {
@@ -140,6 +144,7 @@ struct server_pool {
     hash_t             key_hash;             /* key hasher */
     struct string      hash_tag;             /* key hash tag (ref in conf_pool) */
     int                timeout;              /* timeout in msec */
+    unsigned           timeout_close:1;      /* close server conn on timeout? */
     int                backlog;              /* listen backlog */
     uint32_t           client_connections;   /* maximum # client connection */
     uint32_t           server_connections;   /* maximum # server connection */
@@ -153,6 +158,8 @@ struct server_pool {
     unsigned           auto_probe_hosts:1;   /* auto_probe_hosts? */
 
     unsigned           auto_warmup:1;        /* auto_warmup? */
+    unsigned           memcache_meta:1;      /* memcache_meta? */
+    unsigned           memcache_binary:1;    /* memcache_binary? */
 
     struct string      gutter_name;          /* gutter pool name */
     struct server_pool *gutter;              /* gutter pool */
@@ -170,12 +177,36 @@ struct server_pool {
     int                tag_idx;              /* local tag index in pool tags */
     int                fo_tag_idx[MAX_FAILOVER_TAGS];   /* failover tag index in pool tags */
 
-    float              rate;                 /* # of request per second*/
-    float              burst;                /* max bursts of requests */
-    float              count;                /* # of request in the bucket */
+    struct ratelimit   *ratelimit;           /* rate limits, if any */
+
+    uint32_t           max_inflight;         /* max # requests in flight */
+    size_t             max_inflight_bytes;   /* max bytes in flight */
+    uint32_t           server_max_inflight;  /* max # in flight per server */
+    size_t             server_max_inflight_bytes; /* per server */
+    unsigned           backpressure_reject:1; /* fail, not pause? */
+    uint32_t           inflight;             /* # requests in flight */
+    size_t             inflight_bytes;       /* bytes of requests in flight */
+    uint32_t           npaused;              /* # client connections paused */
+
+    struct outlier     *outlier;             /* outlier detection, if any */
 
     struct string      message_queue_name;   /* name of message queue */
     struct server_pool *message_queue;       /* message queue */
+    unsigned           notify_async:1;       /* batch, not waiting for acks? */
+    uint32_t           notify_buffer;        /* max # notify bytes buffered */
+    struct string      notify_journal;       /* notify spill journal path */
+    uint32_t           notify_journal_size;  /* max notify journal size */
+    struct notify      *notify;              /* async or journaled notify */
+
+    struct nearcache   *near_cache;          /* near cache, if any */
+    unsigned           collapse_gets:1;      /* collapse identical gets? */
+
+    uint32_t           hot_key_sample;       /* hot key sample 1 in n or 0 */
+    uint32_t           hot_key_countdown;    /* # requests to next sample */
+
+    struct warmup     *warmup;               /* warmup pipeline, if any */
+
+    uint32_t           replica_max_lag;      /* max replica lag in sec or 0 */
 };
 
 void server_ref(struct conn *conn, void *owner);
@@ -186,10 +217,13 @@ rstatus_t server_init(struct array *server, struct array *conf_server, struct se
 void server_deinit(struct array *server);
 struct conn *server_conn(struct server *server);
 rstatus_t server_connect(struct context *ctx, struct server *server, struct conn *conn);
+struct conn *server_conn_connect(struct context *ctx, struct server *server);
 void server_close(struct context *ctx, struct conn *conn);
 void server_connected(struct context *ctx, struct conn *conn);
 void server_ok(struct context *ctx, struct conn *conn);
 
+bool server_pool_owns(struct server_pool *pool, struct server *server,
+                      uint8_t *key, uint32_t keylen);
 struct conn *server_pool_conn(struct context *ctx, struct server_pool *pool, uint8_t *key, uint32_t keylen);
 rstatus_t server_pool_run(struct server_pool *pool);
 rstatus_t server_pool_preconnect(struct context *ctx);
@@ -199,7 +233,15 @@ void server_pool_deinit(struct array *server_pool);
 
 void server_pool_probe(struct context *ctx);
 void server_pool_update_quota(struct context *ctx);
-bool server_pool_ratelimit(struct server_pool *pool);
+void server_inflight(struct context *ctx, struct server *server,
+                     struct msg *msg, bool in);
+bool server_congested(struct server *server);
+void server_pool_backpressure(struct context *ctx);
+void server_pool_outlier(struct context *ctx);
+void server_outlier_sample(struct server *server, struct msg *req,
+                           int64_t usec, bool error);
+void server_pool_warmup(struct context *ctx);
+void server_pool_notify(struct context *ctx);
 
 static inline
 void use_writable_pool(struct server_pool *pool) {
@@ -17,16 +17,19 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <ctype.h>
 #include <unistd.h>
 
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/resource.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 
 #include <nc_core.h>
 #include <nc_server.h>
+#include <hashkit/nc_hashkit.h>
 
 struct stats_desc {
     char *name; /* stats name */
@@ -53,8 +56,57 @@ static struct stats_desc stats_server_desc[] = {
 };
 #undef DEFINE_ACTION
 
+#define DEFINE_ACTION(_name, _desc) { .name = #_name, .desc = _desc },
+static struct stats_desc stats_command_desc[] = {
+    STATS_COMMAND_CODEC( DEFINE_ACTION )
+};
+#undef DEFINE_ACTION
+
+#define DEFINE_ACTION(_name, _desc) string(#_name),
+static struct string stats_command_codec[] = {
+    STATS_COMMAND_CODEC( DEFINE_ACTION )
+};
+#undef DEFINE_ACTION
+
+#define STATS_COMMAND_SIZE  \
+    (sizeof(int64_t) * MSG_SENTINEL * STATS_COMMAND_NFIELD)
+
+/* # values of a pool, excluding its servers, and of a server in a shard */
+#define STATS_POOL_NVALUE   \
+    (STATS_POOL_NFIELD + MSG_SENTINEL * STATS_COMMAND_NFIELD)
+#define STATS_SERVER_NVALUE (STATS_SERVER_NFIELD + STATS_LATENCY_NBUCKET + 1)
+
+/* server value of total latency in usec, right after latency buckets */
+#define STATS_SERVER_LATENCY_SUM    \
+    (STATS_SERVER_NFIELD + STATS_LATENCY_NBUCKET)
+
+/*
+ * Shard values have a single writer, so relaxed loads and stores are all
+ * it takes for the aggregator to read them untorn; they compile to plain
+ * moves
+ */
+#define stats_load(_p)      __atomic_load_n(_p, __ATOMIC_RELAXED)
+#define stats_store(_p, _v) __atomic_store_n(_p, _v, __ATOMIC_RELAXED)
+
+/* latency percentiles reported per pool and server, in 1/10000 */
+static struct stats_percentile {
+    struct string name; /* stats name */
+    int64_t       rank; /* rank in 1/10000, or 0 for max */
+    char          *desc; /* stats description */
+} stats_latency_pct[] = {
+    { string("latency_p50"),  5000, "50th percentile latency in usec" },
+    { string("latency_p90"),  9000, "90th percentile latency in usec" },
+    { string("latency_p99"),  9900, "99th percentile latency in usec" },
+    { string("latency_p999"), 9990, "99.9th percentile latency in usec" },
+    { string("latency_max"),  0,    "max latency in usec" },
+};
+
 #define STATS_UNSET_NUMERIC -1
 
+#define STATS_METRICS_MIN_SIZE      (64 * 1024) /* initial openmetrics buffer */
+#define STATS_METRICS_REQUEST_SIZE  4096        /* max scraper request read */
+#define STATS_METRICS_TIMEOUT       5000        /* max scraper idle in msec */
+
 void
 stats_describe(void)
 {
@@ -65,6 +117,10 @@ stats_describe(void)
         log_stderr("  %-20s\"%s\"", stats_pool_desc[i].name,
                    stats_pool_desc[i].desc);
     }
+    for (i = 0; i < NELEMS(stats_latency_pct); i++) {
+        log_stderr("  %-20s\"%s\"", (char *)stats_latency_pct[i].name.data,
+                   stats_latency_pct[i].desc);
+    }
 
     log_stderr("");
 
@@ -73,6 +129,18 @@ stats_describe(void)
         log_stderr("  %-20s\"%s\"", stats_server_desc[i].name,
                    stats_server_desc[i].desc);
     }
+    for (i = 0; i < NELEMS(stats_latency_pct); i++) {
+        log_stderr("  %-20s\"%s\"", (char *)stats_latency_pct[i].name.data,
+                   stats_latency_pct[i].desc);
+    }
+
+    log_stderr("");
+
+    log_stderr("command stats (per pool, under \"commands\"):");
+    for (i = 0; i < NELEMS(stats_command_desc); i++) {
+        log_stderr("  %-20s\"%s\"", stats_command_desc[i].name,
+                   stats_command_desc[i].desc);
+    }
 }
 
 static void
@@ -100,21 +168,6 @@ stats_metric_init(struct stats_metric *stm)
     }
 }
 
-static void
-stats_metric_reset(struct array *stats_metric)
-{
-    uint32_t i, nmetric;
-
-    nmetric = array_n(stats_metric);
-    ASSERT(nmetric == STATS_POOL_NFIELD || nmetric == STATS_SERVER_NFIELD);
-
-    for (i = 0; i < nmetric; i++) {
-        struct stats_metric *stm = array_get(stats_metric, i);
-
-        stats_metric_init(stm);
-    }
-}
-
 static rstatus_t
 stats_pool_metric_init(struct array *stats_metric)
 {
@@ -175,6 +228,66 @@ stats_metric_deinit(struct array *metric)
     array_deinit(metric);
 }
 
+static struct stats_hotkey *
+stats_hotkey_create(void)
+{
+    return nc_zalloc(sizeof(struct stats_hotkey) * STATS_HOTKEY_NSLOT);
+}
+
+static void
+stats_hotkey_destroy(struct stats_hotkey *hk)
+{
+    if (hk != NULL) {
+        nc_free(hk);
+    }
+}
+
+/*
+ * Add requests and bytes to the key of len bytes in total, whose leading
+ * bytes are at key, in the sketch hk
+ */
+static void
+stats_hotkey_update(struct stats_hotkey *hk, uint8_t *key, uint32_t len,
+                    uint32_t hash, int64_t requests, int64_t bytes)
+{
+    struct stats_hotkey *slot, *min;
+    uint32_t i, nkey;
+
+    nkey = MIN(len, STATS_HOTKEY_KEYLEN);
+
+    min = NULL;
+    for (i = 0; i < STATS_HOTKEY_NSLOT; i++) {
+        slot = &hk[i];
+
+        if (slot->hash == hash && slot->len == len &&
+            memcmp(slot->key, key, nkey) == 0) {
+            slot->requests += requests;
+            slot->bytes += bytes;
+            return;
+        }
+
+        if (min == NULL || slot->requests < min->requests) {
+            min = slot;
+        }
+    }
+
+    /* bytes of a response whose key was evicted are not worth a slot */
+    if (requests == 0) {
+        return;
+    }
+
+    /*
+     * Space-saving: the new key takes over the slot of the least requested
+     * key along with its count, which bounds the overestimate of any key
+     * to the smallest count in the sketch. Empty slots count as zero
+     */
+    min->hash = hash;
+    min->len = len;
+    nc_memcpy(min->key, key, nkey);
+    min->requests += requests;
+    min->bytes = bytes;
+}
+
 static rstatus_t
 stats_server_init(struct stats_server *sts, struct server *s)
 {
@@ -188,6 +301,22 @@ stats_server_init(struct stats_server *sts, struct server *s)
         return status;
     }
 
+    sts->latency = nc_zalloc(sizeof(*sts->latency));
+    if (sts->latency == NULL) {
+        stats_metric_deinit(&sts->metric);
+        return NC_ENOMEM;
+    }
+
+    sts->hotkey = NULL;
+    if (s->owner->hot_key_sample != 0) {
+        sts->hotkey = stats_hotkey_create();
+        if (sts->hotkey == NULL) {
+            nc_free(sts->latency);
+            stats_metric_deinit(&sts->metric);
+            return NC_ENOMEM;
+        }
+    }
+
     log_debug(LOG_VVVERB, "init stats server '%.*s' with %"PRIu32" metric",
               sts->name.len, sts->name.data, array_n(&sts->metric));
 
@@ -236,6 +365,8 @@ stats_server_unmap(struct array *stats_server)
     for (i = 0; i < nserver; i++) {
         struct stats_server *sts = array_pop(stats_server);
         stats_metric_deinit(&sts->metric);
+        stats_hotkey_destroy(sts->hotkey);
+        nc_free(sts->latency);
     }
     array_deinit(stats_server);
 
@@ -262,6 +393,24 @@ stats_pool_init(struct stats_pool *stp, struct server_pool *sp)
         return status;
     }
 
+    stp->command = nc_zalloc(STATS_COMMAND_SIZE);
+    if (stp->command == NULL) {
+        stats_server_unmap(&stp->server);
+        stats_metric_deinit(&stp->metric);
+        return NC_ENOMEM;
+    }
+
+    stp->hotkey = NULL;
+    if (sp->hot_key_sample != 0) {
+        stp->hotkey = stats_hotkey_create();
+        if (stp->hotkey == NULL) {
+            nc_free(stp->command);
+            stats_server_unmap(&stp->server);
+            stats_metric_deinit(&stp->metric);
+            return NC_ENOMEM;
+        }
+    }
+
     log_debug(LOG_VVVERB, "init stats pool '%.*s' with %"PRIu32" metric and "
               "%"PRIu32" server", stp->name.len, stp->name.data,
               array_n(&stp->metric), array_n(&stp->metric));
@@ -269,27 +418,6 @@ stats_pool_init(struct stats_pool *stp, struct server_pool *sp)
     return NC_OK;
 }
 
-static void
-stats_pool_reset(struct array *stats_pool)
-{
-    uint32_t i, npool;
-
-    npool = array_n(stats_pool);
-
-    for (i = 0; i < npool; i++) {
-        struct stats_pool *stp = array_get(stats_pool, i);
-        uint32_t j, nserver;
-
-        stats_metric_reset(&stp->metric);
-
-        nserver = array_n(&stp->server);
-        for (j = 0; j < nserver; j++) {
-            struct stats_server *sts = array_get(&stp->server, j);
-            stats_metric_reset(&sts->metric);
-        }
-    }
-}
-
 static rstatus_t
 stats_pool_map(struct array *stats_pool, struct array *server_pool)
 {
@@ -330,12 +458,164 @@ stats_pool_unmap(struct array *stats_pool)
         struct stats_pool *stp = array_pop(stats_pool);
         stats_metric_deinit(&stp->metric);
         stats_server_unmap(&stp->server);
+        stats_hotkey_destroy(stp->hotkey);
+        nc_free(stp->command);
     }
     array_deinit(stats_pool);
 
     log_debug(LOG_VVVERB, "unmap %"PRIu32" stats pool", npool);
 }
 
+/*
+ * Lay the values of shards out pool by pool, see struct stats_shard, and
+ * number servers across pools for windows
+ */
+static rstatus_t
+stats_layout(struct stats *st, struct array *server_pool)
+{
+    uint32_t i, npool;
+
+    npool = array_n(server_pool);
+
+    st->pool_value = nc_alloc(sizeof(*st->pool_value) * npool);
+    if (st->pool_value == NULL) {
+        return NC_ENOMEM;
+    }
+
+    st->pool_server = nc_alloc(sizeof(*st->pool_server) * npool);
+    if (st->pool_server == NULL) {
+        return NC_ENOMEM;
+    }
+
+    for (i = 0; i < npool; i++) {
+        struct server_pool *sp = array_get(server_pool, i);
+        uint32_t nserver = array_n(&sp->server);
+
+        st->pool_value[i] = st->nvalue;
+        st->pool_server[i] = st->nserver;
+
+        st->nvalue += STATS_POOL_NVALUE + nserver * STATS_SERVER_NVALUE;
+        st->nserver += nserver;
+
+        if (sp->hot_key_sample != 0) {
+            st->hotkey = true;
+        }
+    }
+    st->npool = npool;
+
+    return NC_OK;
+}
+
+/*
+ * Memory written by the owner of a shard is padded on both ends, so that
+ * it shares no cache line with memory written by anyone else
+ */
+static void *
+stats_shard_alloc(size_t size)
+{
+    uint8_t *p;
+
+    p = nc_zalloc(size + 2 * STATS_CACHELINE);
+    if (p == NULL) {
+        return NULL;
+    }
+
+    return p + STATS_CACHELINE;
+}
+
+static void
+stats_shard_free(void *p)
+{
+    uint8_t *base;
+
+    if (p != NULL) {
+        base = (uint8_t *)p - STATS_CACHELINE;
+        nc_free(base);
+    }
+}
+
+static void
+stats_shard_destroy(struct stats_shard *shard)
+{
+    uint32_t i;
+
+    for (i = 0; i < NELEMS(shard->window); i++) {
+        stats_shard_free(shard->window[i].hotkey);
+        stats_shard_free(shard->window[i].max);
+    }
+    if (shard->seen != NULL) {
+        nc_free(shard->seen);
+    }
+    stats_shard_free(shard->value);
+    stats_shard_free(shard);
+}
+
+static void
+stats_shard_init_value(int64_t *value, struct stats_metric *codec,
+                       uint32_t nfield)
+{
+    uint32_t i;
+
+    for (i = 0; i < nfield; i++) {
+        if (codec[i].type == STATS_NUMERIC) {
+            value[i] = STATS_UNSET_NUMERIC;
+        }
+    }
+}
+
+static struct stats_shard *
+stats_shard_create(struct stats *st)
+{
+    struct stats_shard *shard;
+    size_t hotkey_size, max_size;
+    uint32_t i, j;
+
+    shard = stats_shard_alloc(sizeof(*shard));
+    if (shard == NULL) {
+        return NULL;
+    }
+
+    hotkey_size = sizeof(struct stats_hotkey) * STATS_HOTKEY_NSLOT *
+                  (st->npool + st->nserver);
+    max_size = sizeof(int64_t) * st->nserver;
+
+    shard->value = stats_shard_alloc(sizeof(int64_t) * st->nvalue);
+    shard->seen = nc_zalloc(sizeof(int64_t) * st->nvalue);
+    for (i = 0; i < NELEMS(shard->window); i++) {
+        shard->window[i].hotkey = st->hotkey ? stats_shard_alloc(hotkey_size) :
+                                  NULL;
+        shard->window[i].max = stats_shard_alloc(max_size);
+    }
+    shard->cur = 0;
+    shard->epoch = 0;
+    shard->ack = 0;
+
+    if (shard->value == NULL || shard->seen == NULL ||
+        shard->window[0].max == NULL || shard->window[1].max == NULL ||
+        (st->hotkey && (shard->window[0].hotkey == NULL ||
+                        shard->window[1].hotkey == NULL))) {
+        stats_shard_destroy(shard);
+        return NULL;
+    }
+
+    for (i = 0; i < array_n(&st->sum); i++) {
+        struct stats_pool *stp = array_get(&st->sum, i);
+        int64_t *value = &shard->value[st->pool_value[i]];
+
+        stats_shard_init_value(value, stats_pool_codec, STATS_POOL_NFIELD);
+
+        value += STATS_POOL_NVALUE;
+        for (j = 0; j < array_n(&stp->server); j++) {
+            stats_shard_init_value(value, stats_server_codec,
+                                   STATS_SERVER_NFIELD);
+            value += STATS_SERVER_NVALUE;
+        }
+    }
+    nc_memcpy(shard->seen, shard->value, sizeof(int64_t) * st->nvalue);
+
+    return shard;
+}
+
 static rstatus_t
 stats_create_buf(struct stats *st)
 {
@@ -344,6 +624,9 @@ stats_create_buf(struct stats *st)
     uint32_t pool_extra = 8;        /* '"pool_name": { ' + ' }' */
     uint32_t server_extra = 8;      /* '"server_name": { ' + ' }' */
     uint32_t used_cpu_max_digits = 6; /* 100.00 */
+    uint32_t hotkey_extra = 40;     /* '{"key":"", "requests":, "bytes":}, ' */
+    uint32_t hotkey_max_len = 6 * STATS_HOTKEY_KEYLEN; /* \u00XX escapes */
+    size_t hotkey_size, latency_size, command_size;
     size_t size = 0;
     uint32_t i;
 
@@ -392,6 +675,35 @@ stats_create_buf(struct stats *st)
     size += int64_max_digits;
     size += key_value_extra;
 
+    /* latency percentiles, for pools and servers alike */
+    latency_size = 0;
+    for (i = 0; i < NELEMS(stats_latency_pct); i++) {
+        latency_size += stats_latency_pct[i].name.len;
+        latency_size += int64_max_digits;
+        latency_size += key_value_extra;
+    }
+
+    /*
+     * '"commands": { ' + '"command": { ' + fields + ' }, ' per request type
+     * + ' }, '
+     */
+    command_size = st->command_str.len + pool_extra;
+    for (i = 0; i < MSG_SENTINEL; i++) {
+        uint32_t j;
+
+        command_size += msg_type_string(i)->len + pool_extra;
+        for (j = 0; j < STATS_COMMAND_NFIELD; j++) {
+            command_size += stats_command_codec[j].len;
+            command_size += int64_max_digits;
+            command_size += key_value_extra;
+        }
+    }
+
+    /* '"hot_keys": [ ' + keys + '], ' */
+    hotkey_size = st->hotkey_str.len + key_value_extra +
+                  STATS_HOTKEY_NTOP * (hotkey_max_len + 2 * int64_max_digits +
+                                       hotkey_extra);
+
     /* server pools */
     for (i = 0; i < array_n(&st->sum); i++) {
         struct stats_pool *stp = array_get(&st->sum, i);
@@ -399,6 +711,12 @@ stats_create_buf(struct stats *st)
 
         size += stp->name.len;
         size += pool_extra;
+        size += latency_size;
+        size += command_size;
+
+        if (stp->hotkey != NULL) {
+            size += hotkey_size;
+        }
 
         for (j = 0; j < array_n(&stp->metric); j++) {
             struct stats_metric *stm = array_get(&stp->metric, j);
@@ -415,6 +733,11 @@ stats_create_buf(struct stats *st)
 
             size += sts->name.len;
             size += server_extra;
+            size += latency_size;
+
+            if (sts->hotkey != NULL) {
+                size += hotkey_size;
+            }
 
             for (k = 0; k < array_n(&sts->metric); k++) {
                 struct stats_metric *stm = array_get(&sts->metric, k);
@@ -452,6 +775,12 @@ stats_destroy_buf(struct stats *st)
         nc_free(st->buf.data);
         st->buf.size = 0;
     }
+
+    if (st->metrics.size != 0) {
+        ASSERT(st->metrics.data != NULL);
+        nc_free(st->metrics.data);
+        st->metrics.size = 0;
+    }
 }
 
 static rstatus_t
@@ -686,6 +1015,69 @@ stats_end_nesting(struct stats *st)
     return NC_OK;
 }
 
+static rstatus_t
+stats_add_hotkey(struct stats *st, struct stats_hotkey *hk)
+{
+    struct stats_buffer *buf;
+    uint8_t *pos, *end;
+    uint32_t i, j, len;
+    size_t room;
+    int n;
+
+    buf = &st->buf;
+
+    n = nc_snprintf(buf->data + buf->len, buf->size - buf->len - 1,
+                    "\"%.*s\": [", st->hotkey_str.len, st->hotkey_str.data);
+    if (n < 0 || n >= (int)(buf->size - buf->len - 1)) {
+        return NC_ERROR;
+    }
+    buf->len += (size_t)n;
+
+    /* sum slots are kept sorted by requests in descending order */
+    for (i = 0; i < STATS_HOTKEY_NTOP && hk[i].requests != 0; i++) {
+        pos = buf->data + buf->len;
+        end = buf->data + buf->size - 1;
+
+        if (end - pos < (ptrdiff_t)(6 * STATS_HOTKEY_KEYLEN + 16)) {
+            return NC_ERROR;
+        }
+
+        pos += nc_snprintf(pos, (size_t)(end - pos), "%s{\"key\":\"",
+                           i == 0 ? "" : ", ");
+
+        /* keys are binary safe; escape whatever json would choke on */
+        len = MIN(hk[i].len, STATS_HOTKEY_KEYLEN);
+        for (j = 0; j < len; j++) {
+            uint8_t ch = hk[i].key[j];
+
+            if (ch < 0x20 || ch >= 0x7f || ch == '"' || ch == '\\') {
+                pos += nc_snprintf(pos, (size_t)(end - pos), "\\u%04x", ch);
+            } else {
+                *pos++ = ch;
+            }
+        }
+
+        buf->len = (size_t)(pos - buf->data);
+        room = buf->size - buf->len - 1;
+
+        n = nc_snprintf(pos, room, "\", \"requests\":%"PRId64", \"bytes\":%"
+                        PRId64"}", hk[i].requests, hk[i].bytes);
+        if (n < 0 || n >= (int)room) {
+            return NC_ERROR;
+        }
+        buf->len += (size_t)n;
+    }
+
+    room = buf->size - buf->len - 1;
+    n = nc_snprintf(buf->data + buf->len, room, "], ");
+    if (n < 0 || n >= (int)room) {
+        return NC_ERROR;
+    }
+    buf->len += (size_t)n;
+
+    return NC_OK;
+}
+
 static rstatus_t
 stats_copy_metric(struct stats *st, struct array *metric)
 {
@@ -704,37 +1096,51 @@ stats_copy_metric(struct stats *st, struct array *metric)
     return NC_OK;
 }
 
-static void
-stats_aggregate_metric(struct array *dst, struct array *src)
+/*
+ * Load the shard value at value and return how much it moved since seen,
+ * which catches up with it
+ */
+static int64_t
+stats_value_delta(int64_t *value, int64_t *seen)
 {
-    uint32_t i;
+    int64_t val, delta;
+
+    val = stats_load(value);
+    delta = val - *seen;
+    *seen = val;
 
-    for (i = 0; i < array_n(src); i++) {
-        struct stats_metric *stm1, *stm2;
+    return delta;
+}
 
-        stm1 = array_get(src, i);
-        stm2 = array_get(dst, i);
+static void
+stats_aggregate_metric(struct array *dst, int64_t *value, int64_t *seen)
+{
+    uint32_t i;
 
-        ASSERT(stm1->type == stm2->type);
+    for (i = 0; i < array_n(dst); i++) {
+        struct stats_metric *stm = array_get(dst, i);
+        int64_t val;
 
-        switch (stm1->type) {
+        switch (stm->type) {
         case STATS_COUNTER:
-            stm2->value.counter += stm1->value.counter;
+            stm->value.counter += stats_value_delta(&value[i], &seen[i]);
             break;
 
         case STATS_GAUGE:
-            stm2->value.counter += stm1->value.counter;
+            stm->value.counter += stats_value_delta(&value[i], &seen[i]);
             break;
 
         case STATS_TIMESTAMP:
-            if (stm1->value.timestamp) {
-                stm2->value.timestamp = stm1->value.timestamp;
+            val = stats_load(&value[i]);
+            if (val) {
+                stm->value.timestamp = val;
             }
             break;
             
         case STATS_NUMERIC:
-            if (stm1->value.numeric != STATS_UNSET_NUMERIC) {
-                stm2->value.numeric = stm1->value.numeric;
+            val = stats_load(&value[i]);
+            if (val != STATS_UNSET_NUMERIC) {
+                stm->value.numeric = val;
             }
             break;
 
@@ -745,99 +1151,1349 @@ stats_aggregate_metric(struct array *dst, struct array *src)
 }
 
 static void
-stats_aggregate(struct stats *st)
+stats_aggregate_command(int64_t *dst, int64_t *value, int64_t *seen)
 {
     uint32_t i;
 
-    if (st->aggregate == 0) {
-        log_debug(LOG_PVERB, "skip aggregate of shadow %p to sum %p as "
-                  "generator is slow", st->shadow.elem, st->sum.elem);
-        return;
+    for (i = 0; i < MSG_SENTINEL * STATS_COMMAND_NFIELD; i++) {
+        dst[i] += stats_value_delta(&value[i], &seen[i]);
     }
+}
 
-    log_debug(LOG_PVERB, "aggregate stats shadow %p to sum %p", st->shadow.elem,
-              st->sum.elem);
-
-    for (i = 0; i < array_n(&st->shadow); i++) {
-        struct stats_pool *stp1, *stp2;
-        uint32_t j;
-
-        stp1 = array_get(&st->shadow, i);
-        stp2 = array_get(&st->sum, i);
-        stats_aggregate_metric(&stp2->metric, &stp1->metric);
+/*
+ * Request types go by their lower case command name, e.g. REQ_REDIS_HGETALL
+ * by "hgetall"
+ */
+static void
+stats_command_name(msg_type_t type, struct string *name, uint8_t *buf,
+                   size_t size)
+{
+    struct string *str;
+    uint32_t i, nsep;
 
-        for (j = 0; j < array_n(&stp1->server); j++) {
-            struct stats_server *sts1, *sts2;
+    str = msg_type_string(type);
 
-            sts1 = array_get(&stp1->server, j);
-            sts2 = array_get(&stp2->server, j);
-            stats_aggregate_metric(&sts2->metric, &sts1->metric);
+    for (i = 0, nsep = 0; i < str->len && nsep < 2; i++) {
+        if (str->data[i] == '_') {
+            nsep++;
         }
     }
+    if (nsep < 2) {
+        i = 0;
+    }
 
-    st->aggregate = 0;
+    name->data = buf;
+    name->len = 0;
+    for (; i < str->len && name->len < size; i++) {
+        buf[name->len++] = (uint8_t)tolower(str->data[i]);
+    }
 }
 
 static rstatus_t
-stats_make_rsp(struct stats *st)
+stats_add_command(struct stats *st, int64_t *command)
 {
     rstatus_t status;
-    uint32_t i;
+    struct string name;
+    uint8_t buf[64];
+    int64_t *stc;
+    uint32_t i, j;
+    bool nesting;
 
-    status = stats_add_header(st);
-    if (status != NC_OK) {
-        return status;
-    }
-
-    for (i = 0; i < array_n(&st->sum); i++) {
-        struct stats_pool *stp = array_get(&st->sum, i);
-        uint32_t j;
+    nesting = false;
 
-        status = stats_begin_nesting(st, &stp->name);
-        if (status != NC_OK) {
-            return status;
-        }
+    for (i = 0; i < MSG_SENTINEL; i++) {
+        stc = &command[i * STATS_COMMAND_NFIELD];
 
-        /* copy pool metric from sum(c) to buffer */
-        status = stats_copy_metric(st, &stp->metric);
-        if (status != NC_OK) {
-            return status;
+        /* only commands seen go out */
+        if (stc[STATS_COMMAND_requests] == 0 &&
+            stc[STATS_COMMAND_errors] == 0) {
+            continue;
         }
 
+        if (!nesting) {
+            status = stats_begin_nesting(st, &st->command_str);
+            if (status != NC_OK) {
+                return status;
+            }
+            nesting = true;
+        }
+
+        stats_command_name(i, &name, buf, sizeof(buf));
+
+        status = stats_begin_nesting(st, &name);
+        if (status != NC_OK) {
+            return status;
+        }
+
+        for (j = 0; j < STATS_COMMAND_NFIELD; j++) {
+            status = stats_add_num(st, &stats_command_codec[j], stc[j]);
+            if (status != NC_OK) {
+                return status;
+            }
+        }
+
+        status = stats_end_nesting(st);
+        if (status != NC_OK) {
+            return status;
+        }
+    }
+
+    if (nesting) {
+        status = stats_end_nesting(st);
+        if (status != NC_OK) {
+            return status;
+        }
+    }
+
+    return NC_OK;
+}
+
+static uint32_t
+stats_latency_bucket(int64_t usec)
+{
+    uint32_t msb, shift;
+
+    if (usec < STATS_LATENCY_SUB) {
+        return usec < 0 ? 0 : (uint32_t)usec;
+    }
+
+    if (usec >= (1LL << STATS_LATENCY_MAX_BITS)) {
+        return STATS_LATENCY_NBUCKET - 1;
+    }
+
+    msb = 31 - (uint32_t)__builtin_clz((uint32_t)usec);
+    shift = msb - STATS_LATENCY_SUB_BITS;
+
+    return (shift + 1) * STATS_LATENCY_SUB +
+           ((uint32_t)usec >> shift) - STATS_LATENCY_SUB;
+}
+
+/*
+ * Highest latency in usec that falls in bucket idx
+ */
+static int64_t
+stats_latency_value(uint32_t idx)
+{
+    uint32_t shift;
+
+    if (idx < STATS_LATENCY_SUB) {
+        return idx;
+    }
+
+    shift = idx / STATS_LATENCY_SUB - 1;
+
+    return ((int64_t)(STATS_LATENCY_SUB + idx % STATS_LATENCY_SUB + 1) <<
+            shift) - 1;
+}
+
+/*
+ * Like hot keys, latencies in sum decay by shift halvings before shards are
+ * merged in, so that percentiles follow the latest intervals instead of the
+ * lifetime of the proxy
+ */
+static void
+stats_decay_latency(struct stats_latency *stl, uint32_t shift)
+{
+    uint32_t i, top;
+
+    top = 0;
+    for (i = 0; i < STATS_LATENCY_NBUCKET; i++) {
+        stl->bucket[i] >>= shift;
+        if (stl->bucket[i] != 0) {
+            top = i;
+        }
+    }
+
+    /* max decays with the bucket that holds it */
+    if (stl->max > stats_latency_value(top)) {
+        stl->max = stats_latency_value(top);
+    }
+}
+
+static void
+stats_aggregate_latency(struct stats_latency *dst, int64_t *value,
+                        int64_t *seen)
+{
+    uint32_t i;
+    int64_t delta;
+
+    for (i = 0; i < STATS_LATENCY_NBUCKET; i++) {
+        delta = stats_value_delta(&value[i], &seen[i]);
+        dst->bucket[i] += delta;
+        dst->group[i / STATS_LATENCY_SUB] += delta;
+    }
+
+    i = STATS_SERVER_LATENCY_SUM - STATS_SERVER_NFIELD;
+    dst->sum += stats_value_delta(&value[i], &seen[i]);
+}
+
+static void
+stats_merge_latency(struct stats_latency *dst, struct stats_latency *src)
+{
+    uint32_t i;
+
+    for (i = 0; i < STATS_LATENCY_NBUCKET; i++) {
+        dst->bucket[i] += src->bucket[i];
+    }
+    dst->max = MAX(dst->max, src->max);
+}
+
+static rstatus_t
+stats_add_latency(struct stats *st, struct stats_latency *stl)
+{
+    rstatus_t status;
+    int64_t total, count, val;
+    uint32_t i, idx;
+
+    total = 0;
+    for (idx = 0; idx < STATS_LATENCY_NBUCKET; idx++) {
+        total += stl->bucket[idx];
+    }
+
+    for (i = 0; i < NELEMS(stats_latency_pct); i++) {
+        struct stats_percentile *pct = &stats_latency_pct[i];
+
+        val = stl->max;
+        if (pct->rank != 0 && total != 0) {
+            count = 0;
+            for (idx = 0; idx < STATS_LATENCY_NBUCKET; idx++) {
+                count += stl->bucket[idx];
+                if (count * 10000 >= total * pct->rank) {
+                    break;
+                }
+            }
+            val = MIN(stats_latency_value(idx), stl->max);
+        }
+
+        status = stats_add_num(st, &pct->name, val);
+        if (status != NC_OK) {
+            return status;
+        }
+    }
+
+    return NC_OK;
+}
+
+static int
+stats_hotkey_cmp(const void *t1, const void *t2)
+{
+    const struct stats_hotkey *hk1 = t1, *hk2 = t2;
+
+    if (hk1->requests == hk2->requests) {
+        return 0;
+    }
+
+    return hk1->requests > hk2->requests ? -1 : 1;
+}
+
+/*
+ * Unlike metrics, hot keys are not accumulated over the lifetime of the
+ * proxy: counts in sum decay by shift halvings before shards are merged in,
+ * so that keys which cooled down fade out of the sketch
+ */
+static void
+stats_decay_hotkey(struct stats_hotkey *hk, uint32_t shift)
+{
+    uint32_t i;
+
+    if (hk == NULL) {
+        return;
+    }
+
+    for (i = 0; i < STATS_HOTKEY_NSLOT; i++) {
+        hk[i].requests >>= shift;
+        hk[i].bytes >>= shift;
+        if (hk[i].requests == 0) {
+            memset(&hk[i], 0, sizeof(hk[i]));
+        }
+    }
+}
+
+static void
+stats_aggregate_hotkey(struct stats_hotkey *dst, struct stats_hotkey *src)
+{
+    uint32_t i;
+
+    if (dst == NULL) {
+        return;
+    }
+
+    for (i = 0; i < STATS_HOTKEY_NSLOT; i++) {
+        if (src[i].requests == 0) {
+            continue;
+        }
+        stats_hotkey_update(dst, src[i].key, src[i].len, src[i].hash,
+                            src[i].requests, src[i].bytes);
+    }
+}
+
+/*
+ * Number of halvings that decaying stats in sum are due, one per
+ * aggregation interval elapsed, whatever the rate stats are polled at
+ */
+static uint32_t
+stats_decay_shift(struct stats *st)
+{
+    int64_t now, n;
+
+    now = nc_msec_now();
+    n = (now - st->decay_ts) / st->interval;
+    st->decay_ts += n * st->interval;
+
+    return (uint32_t)MIN(n, 63);
+}
+
+/*
+ * Drain the window of shard that the aggregator owns into sum and hand it
+ * back, if the owner loop took the last one handed over
+ */
+static void
+stats_aggregate_window(struct stats *st, struct stats_shard *shard)
+{
+    struct stats_window *win;
+    uint32_t i, j, epoch;
+
+    epoch = stats_load(&shard->epoch);
+    if (__atomic_load_n(&shard->ack, __ATOMIC_ACQUIRE) != epoch) {
+        log_debug(LOG_PVERB, "skip window of shard %p as owner is busy",
+                  shard);
+        return;
+    }
+
+    win = &shard->window[(epoch + 1) & 1];
+
+    for (i = 0; i < array_n(&st->sum); i++) {
+        struct stats_pool *stp = array_get(&st->sum, i);
+
+        if (win->hotkey != NULL) {
+            stats_aggregate_hotkey(stp->hotkey,
+                                   &win->hotkey[i * STATS_HOTKEY_NSLOT]);
+        }
+
+        for (j = 0; j < array_n(&stp->server); j++) {
+            struct stats_server *sts = array_get(&stp->server, j);
+            uint32_t sidx = st->pool_server[i] + j;
+
+            if (win->hotkey != NULL) {
+                stats_aggregate_hotkey(sts->hotkey,
+                    &win->hotkey[(st->npool + sidx) * STATS_HOTKEY_NSLOT]);
+            }
+            sts->latency->max = MAX(sts->latency->max, win->max[sidx]);
+        }
+    }
+
+    if (win->hotkey != NULL) {
+        memset(win->hotkey, 0, sizeof(struct stats_hotkey) *
+               STATS_HOTKEY_NSLOT * (st->npool + st->nserver));
+    }
+    memset(win->max, 0, sizeof(int64_t) * st->nserver);
+
+    __atomic_store_n(&shard->epoch, epoch + 1, __ATOMIC_RELEASE);
+}
+
+static void
+stats_aggregate_shard(struct stats *st, struct stats_shard *shard)
+{
+    uint32_t i, j;
+
+    for (i = 0; i < array_n(&st->sum); i++) {
+        struct stats_pool *stp = array_get(&st->sum, i);
+        int64_t *value = &shard->value[st->pool_value[i]];
+        int64_t *seen = &shard->seen[st->pool_value[i]];
+
+        stats_aggregate_metric(&stp->metric, value, seen);
+        stats_aggregate_command(stp->command, value + STATS_POOL_NFIELD,
+                                seen + STATS_POOL_NFIELD);
+
+        value += STATS_POOL_NVALUE;
+        seen += STATS_POOL_NVALUE;
+
+        for (j = 0; j < array_n(&stp->server); j++) {
+            struct stats_server *sts = array_get(&stp->server, j);
+
+            stats_aggregate_metric(&sts->metric, value, seen);
+            stats_aggregate_latency(sts->latency, value + STATS_SERVER_NFIELD,
+                                    seen + STATS_SERVER_NFIELD);
+
+            value += STATS_SERVER_NVALUE;
+            seen += STATS_SERVER_NVALUE;
+        }
+    }
+
+    stats_aggregate_window(st, shard);
+}
+
+static void
+stats_aggregate(struct stats *st)
+{
+    uint32_t i, j, nshard, shift;
+
+    st->aggregate_ts = nc_msec_now();
+
+    shift = stats_decay_shift(st);
+
+    for (i = 0; i < array_n(&st->sum); i++) {
+        struct stats_pool *stp = array_get(&st->sum, i);
+
+        stats_decay_hotkey(stp->hotkey, shift);
+
+        for (j = 0; j < array_n(&stp->server); j++) {
+            struct stats_server *sts = array_get(&stp->server, j);
+
+            stats_decay_latency(sts->latency, shift);
+            stats_decay_hotkey(sts->hotkey, shift);
+        }
+    }
+
+    nshard = __atomic_load_n(&st->nshard, __ATOMIC_ACQUIRE);
+
+    log_debug(LOG_PVERB, "aggregate stats of %"PRIu32" shards to sum %p",
+              nshard, st->sum.elem);
+
+    for (i = 0; i < nshard; i++) {
+        stats_aggregate_shard(st, st->shard[i]);
+    }
+
+    for (i = 0; i < array_n(&st->sum); i++) {
+        struct stats_pool *stp = array_get(&st->sum, i);
+
+        if (stp->hotkey != NULL) {
+            qsort(stp->hotkey, STATS_HOTKEY_NSLOT, sizeof(*stp->hotkey),
+                  stats_hotkey_cmp);
+        }
+
+        for (j = 0; j < array_n(&stp->server); j++) {
+            struct stats_server *sts = array_get(&stp->server, j);
+
+            if (sts->hotkey != NULL) {
+                qsort(sts->hotkey, STATS_HOTKEY_NSLOT, sizeof(*sts->hotkey),
+                      stats_hotkey_cmp);
+            }
+        }
+    }
+}
+
+static rstatus_t
+stats_make_rsp(struct stats *st)
+{
+    rstatus_t status;
+    uint32_t i;
+
+    status = stats_add_header(st);
+    if (status != NC_OK) {
+        return status;
+    }
+
+    for (i = 0; i < array_n(&st->sum); i++) {
+        struct stats_pool *stp = array_get(&st->sum, i);
+        uint32_t j;
+
+        status = stats_begin_nesting(st, &stp->name);
+        if (status != NC_OK) {
+            return status;
+        }
+
+        /* copy pool metric from sum to buffer */
+        status = stats_copy_metric(st, &stp->metric);
+        if (status != NC_OK) {
+            return status;
+        }
+
+        /* pool latency is that of its servers merged */
+        memset(&st->latency, 0, sizeof(st->latency));
+        for (j = 0; j < array_n(&stp->server); j++) {
+            struct stats_server *sts = array_get(&stp->server, j);
+            stats_merge_latency(&st->latency, sts->latency);
+        }
+
+        status = stats_add_latency(st, &st->latency);
+        if (status != NC_OK) {
+            return status;
+        }
+
+        status = stats_add_command(st, stp->command);
+        if (status != NC_OK) {
+            return status;
+        }
+
+        if (stp->hotkey != NULL) {
+            status = stats_add_hotkey(st, stp->hotkey);
+            if (status != NC_OK) {
+                return status;
+            }
+        }
+
+        for (j = 0; j < array_n(&stp->server); j++) {
+            struct stats_server *sts = array_get(&stp->server, j);
+
+            status = stats_begin_nesting(st, &sts->name);
+            if (status != NC_OK) {
+                return status;
+            }
+
+            /* copy server metric from sum to buffer */
+            status = stats_copy_metric(st, &sts->metric);
+            if (status != NC_OK) {
+                return status;
+            }
+
+            status = stats_add_latency(st, sts->latency);
+            if (status != NC_OK) {
+                return status;
+            }
+
+            if (sts->hotkey != NULL) {
+                status = stats_add_hotkey(st, sts->hotkey);
+                if (status != NC_OK) {
+                    return status;
+                }
+            }
+
+            status = stats_end_nesting(st);
+            if (status != NC_OK) {
+                return status;
+            }
+        }
+
+        status = stats_end_nesting(st);
+        if (status != NC_OK) {
+            return status;
+        }
+    }
+
+    status = stats_add_footer(st);
+    if (status != NC_OK) {
+        return status;
+    }
+
+    return NC_OK;
+}
+
+/*
+ * OpenMetrics exposition of sum, for scrapers that would rather not parse
+ * the json above. Unlike the json buffer, sized up front, the metrics
+ * buffer grows as needed, and is rendered at most once an interval
+ */
+static rstatus_t
+stats_metrics_reserve(struct stats *st, size_t n)
+{
+    struct stats_buffer *buf;
+    uint8_t *data;
+    size_t size;
+
+    buf = &st->metrics;
+    if (buf->size - buf->len > n) {
+        return NC_OK;
+    }
+
+    size = MAX(2 * buf->size, buf->len + n + 1);
+    size = MAX(size, STATS_METRICS_MIN_SIZE);
+
+    data = nc_realloc(buf->data, size);
+    if (data == NULL) {
+        return NC_ENOMEM;
+    }
+    buf->data = data;
+    buf->size = size;
+
+    return NC_OK;
+}
+
+static rstatus_t
+stats_metrics_printf(struct stats *st, const char *fmt, ...)
+{
+    struct stats_buffer *buf;
+    rstatus_t status;
+    va_list args;
+    size_t room;
+    int n;
+
+    buf = &st->metrics;
+
+    for (;;) {
+        room = buf->size - buf->len;
+
+        va_start(args, fmt);
+        n = vsnprintf((char *)buf->data + buf->len, room, fmt, args);
+        va_end(args);
+        if (n < 0) {
+            return NC_ERROR;
+        }
+
+        if ((size_t)n < room) {
+            buf->len += (size_t)n;
+            return NC_OK;
+        }
+
+        status = stats_metrics_reserve(st, (size_t)n);
+        if (status != NC_OK) {
+            return status;
+        }
+    }
+}
+
+/*
+ * Append data as a label value: backslash, double quote and newline are
+ * escaped, bytes other than printable ascii go as '?'
+ */
+static rstatus_t
+stats_metrics_escape(struct stats *st, uint8_t *data, uint32_t len)
+{
+    rstatus_t status;
+    uint8_t *p, c;
+    uint32_t i;
+
+    status = stats_metrics_reserve(st, 2 * (size_t)len);
+    if (status != NC_OK) {
+        return status;
+    }
+
+    p = st->metrics.data + st->metrics.len;
+    for (i = 0; i < len; i++) {
+        c = data[i];
+        if (c == '\\' || c == '"') {
+            *p++ = '\\';
+            *p++ = c;
+        } else if (c == '\n') {
+            *p++ = '\\';
+            *p++ = 'n';
+        } else if (c < 0x20 || c > 0x7e) {
+            *p++ = '?';
+        } else {
+            *p++ = c;
+        }
+    }
+    st->metrics.len = (size_t)(p - st->metrics.data);
+
+    return NC_OK;
+}
+
+static rstatus_t
+stats_metrics_label(struct stats *st, const char *name, uint8_t *data,
+                    uint32_t len)
+{
+    rstatus_t status;
+
+    status = stats_metrics_printf(st, ",%s=\"", name);
+    if (status != NC_OK) {
+        return status;
+    }
+
+    status = stats_metrics_escape(st, data, len);
+    if (status != NC_OK) {
+        return status;
+    }
+
+    return stats_metrics_printf(st, "\"");
+}
+
+static rstatus_t
+stats_metrics_family(struct stats *st, const char *prefix, struct string *name,
+                     const char *type, const char *help)
+{
+    return stats_metrics_printf(st, "# TYPE %s%.*s %s\n# HELP %s%.*s %s\n",
+                                prefix, name->len, name->data, type,
+                                prefix, name->len, name->data, help);
+}
+
+/*
+ * Open a sample of the family prefix + name, labelled with the tag and the
+ * pool, plus the server unless NULL. The caller adds labels of its own and
+ * closes the sample
+ */
+static rstatus_t
+stats_metrics_sample(struct stats *st, const char *prefix, struct string *name,
+                     const char *suffix, struct string *pool,
+                     struct string *server)
+{
+    rstatus_t status;
+
+    status = stats_metrics_printf(st, "%s%.*s%s{tag=\"", prefix, name->len,
+                                  name->data, suffix);
+    if (status != NC_OK) {
+        return status;
+    }
+
+    status = stats_metrics_escape(st, st->tag.data, st->tag.len);
+    if (status != NC_OK) {
+        return status;
+    }
+
+    status = stats_metrics_printf(st, "\"");
+    if (status != NC_OK) {
+        return status;
+    }
+
+    status = stats_metrics_label(st, "pool", pool->data, pool->len);
+    if (status != NC_OK) {
+        return status;
+    }
+
+    if (server != NULL) {
+        status = stats_metrics_label(st, "server", server->data, server->len);
+        if (status != NC_OK) {
+            return status;
+        }
+    }
+
+    return NC_OK;
+}
+
+static rstatus_t
+stats_metrics_end(struct stats *st, int64_t val)
+{
+    return stats_metrics_printf(st, "} %"PRId64"\n", val);
+}
+
+/* usec go out as seconds, with all their digits */
+static rstatus_t
+stats_metrics_end_usec(struct stats *st, int64_t usec)
+{
+    return stats_metrics_printf(st, "} %"PRId64".%06"PRId64"\n",
+                                usec / 1000000, usec % 1000000);
+}
+
+static rstatus_t
+stats_metrics_metric(struct stats *st, const char *prefix, uint32_t fidx,
+                     struct stats_metric *codec, struct stats_desc *desc,
+                     bool server)
+{
+    rstatus_t status;
+    struct stats_metric *stm = &codec[fidx];
+    const char *type, *suffix;
+    uint32_t i, j;
+
+    if (stm->type == STATS_COUNTER) {
+        type = "counter";
+        suffix = "_total";
+    } else {
+        type = "gauge";
+        suffix = "";
+    }
+
+    status = stats_metrics_family(st, prefix, &stm->name, type,
+                                  desc[fidx].desc);
+    if (status != NC_OK) {
+        return status;
+    }
+
+    for (i = 0; i < array_n(&st->sum); i++) {
+        struct stats_pool *stp = array_get(&st->sum, i);
+        struct stats_metric *m;
+
+        if (!server) {
+            m = array_get(&stp->metric, fidx);
+
+            status = stats_metrics_sample(st, prefix, &stm->name, suffix,
+                                          &stp->name, NULL);
+            if (status != NC_OK) {
+                return status;
+            }
+
+            status = stats_metrics_end(st, m->value.counter);
+            if (status != NC_OK) {
+                return status;
+            }
+
+            continue;
+        }
+
+        for (j = 0; j < array_n(&stp->server); j++) {
+            struct stats_server *sts = array_get(&stp->server, j);
+
+            m = array_get(&sts->metric, fidx);
+
+            status = stats_metrics_sample(st, prefix, &stm->name, suffix,
+                                          &stp->name, &sts->name);
+            if (status != NC_OK) {
+                return status;
+            }
+
+            status = stats_metrics_end(st, m->value.counter);
+            if (status != NC_OK) {
+                return status;
+            }
+        }
+    }
+
+    return NC_OK;
+}
+
+static rstatus_t
+stats_metrics_command(struct stats *st, uint32_t fidx)
+{
+    rstatus_t status;
+    struct string *name = &stats_command_codec[fidx];
+    struct string cmd;
+    uint8_t buf[64];
+    uint32_t i, type;
+
+    status = stats_metrics_family(st, "nutcracker_command_", name, "counter",
+                                  stats_command_desc[fidx].desc);
+    if (status != NC_OK) {
+        return status;
+    }
+
+    for (i = 0; i < array_n(&st->sum); i++) {
+        struct stats_pool *stp = array_get(&st->sum, i);
+
+        for (type = 0; type < MSG_SENTINEL; type++) {
+            int64_t *stc = &stp->command[type * STATS_COMMAND_NFIELD];
+
+            if (stc[STATS_COMMAND_requests] == 0 &&
+                stc[STATS_COMMAND_errors] == 0) {
+                continue;
+            }
+
+            stats_command_name(type, &cmd, buf, sizeof(buf));
+
+            status = stats_metrics_sample(st, "nutcracker_command_", name,
+                                          "_total", &stp->name, NULL);
+            if (status != NC_OK) {
+                return status;
+            }
+
+            status = stats_metrics_label(st, "command", cmd.data, cmd.len);
+            if (status != NC_OK) {
+                return status;
+            }
+
+            status = stats_metrics_end(st, stc[fidx]);
+            if (status != NC_OK) {
+                return status;
+            }
+        }
+    }
+
+    return NC_OK;
+}
+
+/*
+ * Server latencies go out as histograms of their lifetime counts, with a
+ * bucket per power of two of usec up to the highest one seen
+ */
+static rstatus_t
+stats_metrics_latency(struct stats *st)
+{
+    rstatus_t status;
+    struct string name = string("latency_seconds");
+    int64_t count, le;
+    uint32_t i, j, g, top;
+
+    status = stats_metrics_family(st, "nutcracker_server_", &name, "histogram",
+                                  "response latency");
+    if (status != NC_OK) {
+        return status;
+    }
+
+    for (i = 0; i < array_n(&st->sum); i++) {
+        struct stats_pool *stp = array_get(&st->sum, i);
+
         for (j = 0; j < array_n(&stp->server); j++) {
             struct stats_server *sts = array_get(&stp->server, j);
+            struct stats_latency *stl = sts->latency;
+
+            top = 0;
+            for (g = 0; g < STATS_LATENCY_NGROUP - 1; g++) {
+                if (stl->group[g] != 0) {
+                    top = g;
+                }
+            }
+
+            count = 0;
+            for (g = 0; g < STATS_LATENCY_NGROUP; g++) {
+                count += stl->group[g];
+                if (g > top) {
+                    continue;
+                }
+
+                le = stats_latency_value(g * STATS_LATENCY_SUB +
+                                         STATS_LATENCY_SUB - 1);
+
+                status = stats_metrics_sample(st, "nutcracker_server_", &name,
+                                              "_bucket", &stp->name,
+                                              &sts->name);
+                if (status != NC_OK) {
+                    return status;
+                }
+
+                status = stats_metrics_printf(st, ",le=\"%"PRId64".%06"PRId64
+                                              "\"} %"PRId64"\n", le / 1000000,
+                                              le % 1000000, count);
+                if (status != NC_OK) {
+                    return status;
+                }
+            }
+
+            status = stats_metrics_sample(st, "nutcracker_server_", &name,
+                                          "_bucket", &stp->name, &sts->name);
+            if (status != NC_OK) {
+                return status;
+            }
+
+            status = stats_metrics_printf(st, ",le=\"+Inf\"} %"PRId64"\n",
+                                          count);
+            if (status != NC_OK) {
+                return status;
+            }
+
+            status = stats_metrics_sample(st, "nutcracker_server_", &name,
+                                          "_count", &stp->name, &sts->name);
+            if (status != NC_OK) {
+                return status;
+            }
+
+            status = stats_metrics_end(st, count);
+            if (status != NC_OK) {
+                return status;
+            }
+
+            status = stats_metrics_sample(st, "nutcracker_server_", &name,
+                                          "_sum", &stp->name, &sts->name);
+            if (status != NC_OK) {
+                return status;
+            }
+
+            status = stats_metrics_end_usec(st, stl->sum);
+            if (status != NC_OK) {
+                return status;
+            }
+        }
+    }
+
+    return NC_OK;
+}
+
+static rstatus_t
+stats_metrics_hotkey_sample(struct stats *st, const char *prefix,
+                            struct string *name, struct string *pool,
+                            struct string *server, struct stats_hotkey *hk,
+                            int64_t val)
+{
+    rstatus_t status;
+
+    status = stats_metrics_sample(st, prefix, name, "", pool, server);
+    if (status != NC_OK) {
+        return status;
+    }
+
+    status = stats_metrics_label(st, "key", hk->key,
+                                 MIN(hk->len, STATS_HOTKEY_KEYLEN));
+    if (status != NC_OK) {
+        return status;
+    }
+
+    return stats_metrics_end(st, val);
+}
+
+/*
+ * Hot keys go out as two gauge families, estimated requests then bytes,
+ * for pools or for servers
+ */
+static rstatus_t
+stats_metrics_hotkey(struct stats *st, const char *prefix, bool server)
+{
+    rstatus_t status;
+    struct string name[] = { string("hot_key_requests"),
+                             string("hot_key_bytes") };
+    uint32_t n, i, j, k;
+
+    if (!st->hotkey) {
+        return NC_OK;
+    }
+
+    for (n = 0; n < NELEMS(name); n++) {
+        status = stats_metrics_family(st, prefix, &name[n], "gauge", n == 0 ?
+                                      "estimated # requests of a hot key" :
+                                      "estimated response bytes of a hot key");
+        if (status != NC_OK) {
+            return status;
+        }
+
+        for (i = 0; i < array_n(&st->sum); i++) {
+            struct stats_pool *stp = array_get(&st->sum, i);
+
+            if (stp->hotkey == NULL) {
+                continue;
+            }
+
+            for (j = 0; j < (server ? array_n(&stp->server) : 1); j++) {
+                struct stats_server *sts;
+                struct stats_hotkey *hk;
+
+                sts = server ? array_get(&stp->server, j) : NULL;
+                hk = server ? sts->hotkey : stp->hotkey;
+
+                for (k = 0; k < STATS_HOTKEY_NTOP; k++) {
+                    if (hk[k].requests == 0) {
+                        break;
+                    }
+
+                    status = stats_metrics_hotkey_sample(st, prefix, &name[n],
+                                 &stp->name, server ? &sts->name : NULL,
+                                 &hk[k], n == 0 ? hk[k].requests : hk[k].bytes);
+                    if (status != NC_OK) {
+                        return status;
+                    }
+                }
+            }
+        }
+    }
+
+    return NC_OK;
+}
+
+static rstatus_t
+stats_make_metrics(struct stats *st)
+{
+    rstatus_t status;
+    uint32_t i;
+
+    st->metrics.len = 0;
+
+    status = stats_metrics_printf(st, "# TYPE nutcracker info\n"
+                                  "# HELP nutcracker nutcracker build\n"
+                                  "nutcracker_info{tag=\"");
+    if (status != NC_OK) {
+        return status;
+    }
+
+    status = stats_metrics_escape(st, st->tag.data, st->tag.len);
+    if (status != NC_OK) {
+        return status;
+    }
+
+    status = stats_metrics_printf(st, "\"");
+    if (status != NC_OK) {
+        return status;
+    }
+
+    status = stats_metrics_label(st, "version", st->version.data,
+                                 st->version.len);
+    if (status != NC_OK) {
+        return status;
+    }
+
+    status = stats_metrics_label(st, "source", st->source.data,
+                                 st->source.len);
+    if (status != NC_OK) {
+        return status;
+    }
+
+    status = stats_metrics_printf(st, "} 1\n"
+                                  "# TYPE nutcracker_uptime_seconds gauge\n"
+                                  "# HELP nutcracker_uptime_seconds seconds "
+                                  "since nutcracker started\n"
+                                  "nutcracker_uptime_seconds %"PRId64"\n",
+                                  (int64_t)time(NULL) - st->start_ts);
+    if (status != NC_OK) {
+        return status;
+    }
+
+    for (i = 0; i < STATS_POOL_NFIELD; i++) {
+        status = stats_metrics_metric(st, "nutcracker_pool_", i,
+                                      stats_pool_codec, stats_pool_desc, false);
+        if (status != NC_OK) {
+            return status;
+        }
+    }
+
+    for (i = 0; i < STATS_COMMAND_NFIELD; i++) {
+        status = stats_metrics_command(st, i);
+        if (status != NC_OK) {
+            return status;
+        }
+    }
+
+    status = stats_metrics_hotkey(st, "nutcracker_pool_", false);
+    if (status != NC_OK) {
+        return status;
+    }
+
+    for (i = 0; i < STATS_SERVER_NFIELD; i++) {
+        status = stats_metrics_metric(st, "nutcracker_server_", i,
+                                      stats_server_codec, stats_server_desc,
+                                      true);
+        if (status != NC_OK) {
+            return status;
+        }
+    }
+
+    status = stats_metrics_latency(st);
+    if (status != NC_OK) {
+        return status;
+    }
+
+    status = stats_metrics_hotkey(st, "nutcracker_server_", true);
+    if (status != NC_OK) {
+        return status;
+    }
+
+    return stats_metrics_printf(st, "# EOF\n");
+}
+
+/*
+ * Write the http response header for the metrics buffer in hdr, of size
+ * bytes, and return its length
+ */
+static size_t
+stats_metrics_hdr(struct stats *st, char *hdr, size_t size)
+{
+    return (size_t)nc_snprintf(hdr, size, "HTTP/1.1 200 OK" CRLF
+                               "Content-Type: application/openmetrics-text; "
+                               "version=1.0.0; charset=utf-8" CRLF
+                               "Content-Length: %zu" CRLF
+                               "Connection: close" CRLF CRLF,
+                               st->metrics.len);
+}
 
-            status = stats_begin_nesting(st, &sts->name);
-            if (status != NC_OK) {
-                return status;
+static void
+stats_scraper_close(struct stats *st, struct stats_scraper *sc)
+{
+    ASSERT(sc->sd >= 0);
+    ASSERT(st->nscraper > 0);
+
+    log_debug(LOG_VERB, "close scraper sd %d", sc->sd);
+
+    event_del_st(st->st_evb, sc->sd);
+    close(sc->sd);
+    sc->sd = -1;
+    st->nscraper--;
+
+    if (sc->sending) {
+        ASSERT(st->nsending > 0);
+        sc->sending = 0;
+        st->nsending--;
+    }
+}
+
+/*
+ * Accept the scrapers waiting on the metrics port into free scraper slots,
+ * closing the ones beyond STATS_METRICS_NSCRAPER at once
+ */
+static void
+stats_metrics_accept(struct stats *st)
+{
+    struct stats_scraper *sc;
+    int sd;
+
+    for (;;) {
+        sd = accept(st->metrics_sd, NULL, NULL);
+        if (sd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                log_error("accept on m %d failed: %s", st->metrics_sd,
+                          strerror(errno));
             }
+            return;
+        }
 
-            /* copy server metric from sum(c) to buffer */
-            status = stats_copy_metric(st, &sts->metric);
-            if (status != NC_OK) {
-                return status;
+        if (st->nscraper == STATS_METRICS_NSCRAPER) {
+            log_warn("close scraper sd %d, %d scrapers served already", sd,
+                     STATS_METRICS_NSCRAPER);
+            close(sd);
+            continue;
+        }
+
+        if (nc_set_nonblocking(sd) < 0 || event_add_st(st->st_evb, sd) < 0) {
+            log_error("set up scraper sd %d failed: %s", sd, strerror(errno));
+            close(sd);
+            continue;
+        }
+
+        for (sc = st->scraper; sc->sd >= 0; sc++) {
+            ASSERT(sc < st->scraper + STATS_METRICS_NSCRAPER - 1);
+        }
+
+        sc->sd = sd;
+        sc->active_ts = nc_msec_now();
+        sc->nrecv = 0;
+        sc->nmatch = 0;
+        sc->nsent = 0;
+        sc->sending = 0;
+        st->nscraper++;
+
+        log_debug(LOG_VERB, "accept scraper sd %d", sd);
+    }
+}
+
+/*
+ * Read and drop the http request of a scraper, up to the end of its header.
+ * Return NC_OK once it is read, or the scraper is done sending, and
+ * NC_EAGAIN while more is to come
+ */
+static rstatus_t
+stats_scraper_recv(struct stats_scraper *sc)
+{
+    static const char end[] = CRLF CRLF;
+    char buf[STATS_METRICS_REQUEST_SIZE];
+    ssize_t i, n;
+
+    for (;;) {
+        n = nc_read(sc->sd, buf, sizeof(buf));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
             }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return NC_EAGAIN;
+            }
+            log_error("recv scraper request on sd %d failed: %s", sc->sd,
+                      strerror(errno));
+            return NC_ERROR;
+        }
 
-            status = stats_end_nesting(st);
-            if (status != NC_OK) {
-                return status;
+        if (n == 0) {
+            return NC_OK;
+        }
+
+        sc->active_ts = nc_msec_now();
+        sc->nrecv += (size_t)n;
+
+        for (i = 0; i < n && sc->nmatch < sizeof(end) - 1; i++) {
+            if (buf[i] == end[sc->nmatch]) {
+                sc->nmatch++;
+            } else {
+                sc->nmatch = buf[i] == end[0] ? 1 : 0;
             }
         }
 
-        status = stats_end_nesting(st);
+        if (sc->nmatch == sizeof(end) - 1 ||
+            sc->nrecv >= STATS_METRICS_REQUEST_SIZE) {
+            return NC_OK;
+        }
+    }
+}
+
+/*
+ * Start sending the metrics to a scraper whose request was read. The
+ * metrics are rendered again if they are older than the stats interval,
+ * unless another scraper is still sending them
+ */
+static rstatus_t
+stats_scraper_start(struct stats *st, struct stats_scraper *sc)
+{
+    rstatus_t status;
+    int64_t now;
+
+    now = nc_msec_now();
+    if (st->nsending == 0 &&
+        (st->metrics_ts == 0 || now - st->metrics_ts >= st->interval)) {
+        stats_aggregate(st);
+
+        status = stats_make_metrics(st);
         if (status != NC_OK) {
+            log_error("render metrics failed: %d", status);
+            st->metrics_ts = 0;
             return status;
         }
+        st->metrics_ts = now;
     }
 
-    status = stats_add_footer(st);
-    if (status != NC_OK) {
-        return status;
+    if (event_add_st_out(st->st_evb, sc->sd) < 0) {
+        return NC_ERROR;
+    }
+
+    sc->sending = 1;
+    st->nsending++;
+
+    return NC_OK;
+}
+
+/*
+ * Send to a scraper as much of the metrics response as it takes. Return
+ * NC_OK once it is all sent and NC_EAGAIN while more is left
+ */
+static rstatus_t
+stats_scraper_send(struct stats *st, struct stats_scraper *sc)
+{
+    char hdr[256];
+    struct iovec iov[2];
+    size_t len, size;
+    ssize_t n;
+
+    len = stats_metrics_hdr(st, hdr, sizeof(hdr));
+    size = len + st->metrics.len;
+
+    while (sc->nsent < size) {
+        if (sc->nsent < len) {
+            iov[0].iov_base = hdr + sc->nsent;
+            iov[0].iov_len = len - sc->nsent;
+            iov[1].iov_base = st->metrics.data;
+            iov[1].iov_len = st->metrics.len;
+            n = nc_writev(sc->sd, iov, 2);
+        } else {
+            n = nc_write(sc->sd, st->metrics.data + (sc->nsent - len),
+                         size - sc->nsent);
+        }
+
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return NC_EAGAIN;
+            }
+            log_error("send metrics on sd %d failed after %zu of %zu "
+                      "bytes: %s", sc->sd, sc->nsent, size, strerror(errno));
+            return NC_ERROR;
+        }
+
+        sc->active_ts = nc_msec_now();
+        sc->nsent += (size_t)n;
     }
 
+    log_debug(LOG_VERB, "send metrics on sd %d %zu bytes", sc->sd, size);
+
     return NC_OK;
 }
 
+/*
+ * Serve the openmetrics scrapers: accept new ones, and move each along as
+ * far as it goes without blocking. A scraper is only dropped when it is
+ * done, fails, or makes no progress for STATS_METRICS_TIMEOUT msec, so a
+ * slow one neither stalls the aggregator nor the other scrapers
+ */
+static void
+stats_serve_metrics(struct stats *st)
+{
+    struct stats_scraper *sc;
+    rstatus_t status;
+    uint32_t i;
+
+    stats_metrics_accept(st);
+
+    for (i = 0; i < STATS_METRICS_NSCRAPER; i++) {
+        sc = &st->scraper[i];
+        if (sc->sd < 0) {
+            continue;
+        }
+
+        status = NC_OK;
+        if (!sc->sending) {
+            status = stats_scraper_recv(sc);
+            if (status == NC_OK) {
+                status = stats_scraper_start(st, sc);
+            }
+        }
+        if (status == NC_OK) {
+            status = stats_scraper_send(st, sc);
+        }
+
+        if (status == NC_EAGAIN) {
+            if (nc_msec_now() - sc->active_ts < STATS_METRICS_TIMEOUT) {
+                continue;
+            }
+            log_warn("drop scraper sd %d idle for %d msec after %zu bytes "
+                     "sent", sc->sd, STATS_METRICS_TIMEOUT, sc->nsent);
+        }
+
+        stats_scraper_close(st, sc);
+    }
+}
+
 static rstatus_t
 stats_send_rsp(struct stats *st)
 {
@@ -845,17 +2501,26 @@ stats_send_rsp(struct stats *st)
     ssize_t n;
     int sd;
 
-    status = stats_make_rsp(st);
-    if (status != NC_OK) {
-        return status;
-    }
-
     sd = accept(st->sd, NULL, NULL);
     if (sd < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return NC_OK;
+        }
         log_error("accept on m %d failed: %s", st->sd, strerror(errno));
         return NC_ERROR;
     }
 
+    nc_set_blocking(sd);
+
+    /* aggregate stats from shards -> sum */
+    stats_aggregate(st);
+
+    status = stats_make_rsp(st);
+    if (status != NC_OK) {
+        close(sd);
+        return status;
+    }
+
     log_debug(LOG_VERB, "send stats on sd %d %d bytes", sd, st->buf.len);
 
     n = nc_sendn(sd, st->buf.data, st->buf.len);
@@ -874,63 +2539,90 @@ static void *
 stats_loop(void *arg)
 {
     struct stats *st = arg;
+    int64_t timeout;
     int n;
 
     for (;;) {
-        n = event_wait(st->st_evb, st->interval);
+        /* wake up for the next aggregation, and to drop idle scrapers */
+        timeout = MAX(st->aggregate_ts + st->interval - nc_msec_now(), 0);
+        if (st->nscraper != 0) {
+            timeout = MIN(timeout, STATS_METRICS_TIMEOUT);
+        }
 
-        /* aggregate stats from shadow (b) -> sum (c) */
-        stats_aggregate(st);
+        n = event_wait(st->st_evb, (int)timeout);
+
+        /* aggregate stats from shards -> sum, once every interval */
+        if (nc_msec_now() - st->aggregate_ts >= st->interval) {
+            stats_aggregate(st);
+        }
+
+        /* move the scrapers along, idle ones are dropped even without io */
+        if (st->metrics_sd >= 0) {
+            stats_serve_metrics(st);
+        }
 
         if (n == 0) {
             continue;
         }
 
-        /* send aggregate stats sum (c) to collector */
+        /* send aggregate stats sum to collector */
         stats_send_rsp(st);
     }
 
     return NULL;
 }
 
+/*
+ * Listen on port of the stats addr, with the descriptor returned in psd
+ */
 static rstatus_t
-stats_listen(struct stats *st)
+stats_listen(struct stats *st, uint16_t port, int *psd)
 {
     rstatus_t status;
     struct sockinfo si;
+    int sd;
 
-    status = nc_resolve(&st->addr, st->port, &si);
+    status = nc_resolve(&st->addr, port, &si);
     if (status < 0) {
         return status;
     }
 
-    st->sd = socket(si.family, SOCK_STREAM, 0);
-    if (st->sd < 0) {
+    sd = socket(si.family, SOCK_STREAM, 0);
+    if (sd < 0) {
         log_error("socket failed: %s", strerror(errno));
         return NC_ERROR;
     }
 
-    status = nc_set_reuseaddr(st->sd);
+    status = nc_set_reuseaddr(sd);
+    if (status < 0) {
+        log_error("set reuseaddr on m %d failed: %s", sd, strerror(errno));
+        return NC_ERROR;
+    }
+
+    status = bind(sd, (struct sockaddr *)&si.addr, si.addrlen);
     if (status < 0) {
-        log_error("set reuseaddr on m %d failed: %s", st->sd, strerror(errno));
+        log_error("bind on m %d to addr '%.*s:%u' failed: %s", sd,
+                  st->addr.len, st->addr.data, port, strerror(errno));
         return NC_ERROR;
     }
 
-    status = bind(st->sd, (struct sockaddr *)&si.addr, si.addrlen);
+    status = listen(sd, SOMAXCONN);
     if (status < 0) {
-        log_error("bind on m %d to addr '%.*s:%u' failed: %s", st->sd,
-                  st->addr.len, st->addr.data, st->port, strerror(errno));
+        log_error("listen on m %d failed: %s", sd, strerror(errno));
         return NC_ERROR;
     }
 
-    status = listen(st->sd, SOMAXCONN);
+    /* several descriptors share the aggregator, none may block it */
+    status = nc_set_nonblocking(sd);
     if (status < 0) {
-        log_error("listen on m %d failed: %s", st->sd, strerror(errno));
+        log_error("set nonblock on m %d failed: %s", sd, strerror(errno));
         return NC_ERROR;
     }
 
-    log_debug(LOG_NOTICE, "m %d listening on '%.*s:%u'", st->sd,
-              st->addr.len, st->addr.data, st->port);
+    *psd = sd;
+
+    log_debug(LOG_NOTICE, "m %d listening on '%.*s:%u'", sd,
+              st->addr.len, st->addr.data, port);
 
     return NC_OK;
 }
@@ -944,12 +2636,19 @@ stats_start_aggregator(struct stats *st)
         return NC_OK;
     }
 
-    status = stats_listen(st);
+    status = stats_listen(st, st->port, &st->sd);
     if (status != NC_OK) {
         return status;
     }
 
-    st->st_evb = evbase_create(1, NULL);
+    if (st->metrics_port != 0) {
+        status = stats_listen(st, st->metrics_port, &st->metrics_sd);
+        if (status != NC_OK) {
+            return status;
+        }
+    }
+
+    st->st_evb = evbase_create(2 + STATS_METRICS_NSCRAPER, NULL);
     if (st->st_evb == NULL) {
         log_error("stats aggregator create failed: %s", strerror(errno));
         return NC_ERROR;
@@ -959,6 +2658,9 @@ stats_start_aggregator(struct stats *st)
     ASSERT(st->sd >= 0);
 
     status = event_add_st(st->st_evb, st->sd);
+    if (status == 0 && st->metrics_sd >= 0) {
+        status = event_add_st(st->st_evb, st->metrics_sd);
+    }
     if (status < 0) {
         log_error("stats aggregator create failed: %s", strerror(errno));
         evbase_destroy(st->st_evb);
@@ -980,21 +2682,33 @@ stats_start_aggregator(struct stats *st)
 static void
 stats_stop_aggregator(struct stats *st)
 {
+    uint32_t i;
+
     if (!stats_enabled) {
         return;
     }
 
     close(st->sd);
+    if (st->metrics_sd >= 0) {
+        close(st->metrics_sd);
+    }
+    for (i = 0; i < STATS_METRICS_NSCRAPER; i++) {
+        if (st->scraper[i].sd >= 0) {
+            stats_scraper_close(st, &st->scraper[i]);
+        }
+    }
     evbase_destroy(st->st_evb);
     st->st_evb = NULL;
 }
 
 struct stats *
-stats_create(uint16_t stats_port, char *stats_ip, int stats_interval, char *local_tag,
-             char *source, struct array *server_pool)
+stats_create(uint16_t stats_port, char *stats_ip, int stats_interval,
+             uint16_t metrics_port, char *local_tag, char *source,
+             struct array *server_pool)
 {
     rstatus_t status;
     struct stats *st;
+    uint32_t i;
 
     st = nc_alloc(sizeof(*st));
     if (st == NULL) {
@@ -1002,22 +2716,44 @@ stats_create(uint16_t stats_port, char *stats_ip, int stats_interval, char *loca
     }
 
     st->port = stats_port;
+    st->metrics_port = metrics_port;
     st->interval = stats_interval;
     string_set_raw(&st->addr, stats_ip);
 
     st->start_ts = (int64_t)time(NULL);
+    st->decay_ts = nc_msec_now();
 
     st->buf.len = 0;
     st->buf.data = NULL;
     st->buf.size = 0;
 
-    array_null(&st->current);
-    array_null(&st->shadow);
+    st->aggregate_ts = 0;
+
+    st->metrics.len = 0;
+    st->metrics.data = NULL;
+    st->metrics.size = 0;
+    st->metrics_ts = 0;
+    for (i = 0; i < STATS_METRICS_NSCRAPER; i++) {
+        st->scraper[i].sd = -1;
+        st->scraper[i].sending = 0;
+    }
+    st->nscraper = 0;
+    st->nsending = 0;
+
     array_null(&st->sum);
 
+    st->npool = 0;
+    st->nserver = 0;
+    st->nvalue = 0;
+    st->pool_value = NULL;
+    st->pool_server = NULL;
+    st->hotkey = false;
+    st->nshard = 0;
+
     st->tid = (pthread_t) -1;
     st->st_evb = NULL;
     st->sd = -1;
+    st->metrics_sd = -1;
 
     string_set_text(&st->service_str, "service");
     string_set_text(&st->service, "nutcracker");
@@ -1029,7 +2765,7 @@ stats_create(uint16_t stats_port, char *stats_ip, int stats_interval, char *loca
     string_set_text(&st->version, NC_VERSION_STRING);
 
     string_set_text(&st->tag_str, "tag");
-    string_set_text(&st->tag, local_tag);
+    string_set_raw(&st->tag, local_tag);
 
     string_set_text(&st->uptime_str, "uptime");
     string_set_text(&st->timestamp_str, "timestamp");
@@ -1038,23 +2774,17 @@ stats_create(uint16_t stats_port, char *stats_ip, int stats_interval, char *loca
     string_set_text(&st->used_cpu_sys_str, "used_cpu_sys");
     string_set_text(&st->voluntary_switches_str, "voluntary_switches");
     string_set_text(&st->involuntary_switches_str, "involuntary_swithces");
-    
-    st->updated = 0;
-    st->aggregate = 0;
+    string_set_text(&st->hotkey_str, "hot_keys");
+    string_set_text(&st->command_str, "commands");
 
-    /* map server pool to current (a), shadow (b) and sum (c) */
-
-    status = stats_pool_map(&st->current, server_pool);
-    if (status != NC_OK) {
-        goto error;
-    }
+    /* map server pool to sum and lay shards out after it */
 
-    status = stats_pool_map(&st->shadow, server_pool);
+    status = stats_pool_map(&st->sum, server_pool);
     if (status != NC_OK) {
         goto error;
     }
 
-    status = stats_pool_map(&st->sum, server_pool);
+    status = stats_layout(st, server_pool);
     if (status != NC_OK) {
         goto error;
     }
@@ -1079,73 +2809,111 @@ error:
 void
 stats_destroy(struct stats *st)
 {
+    uint32_t i;
+
     stats_stop_aggregator(st);
+    for (i = 0; i < st->nshard; i++) {
+        stats_shard_destroy(st->shard[i]);
+    }
+    if (st->pool_value != NULL) {
+        nc_free(st->pool_value);
+    }
+    if (st->pool_server != NULL) {
+        nc_free(st->pool_server);
+    }
     stats_pool_unmap(&st->sum);
-    stats_pool_unmap(&st->shadow);
-    stats_pool_unmap(&st->current);
     stats_destroy_buf(st);
     nc_free(st);
 }
 
-void
-stats_swap(struct stats *st)
+/*
+ * Add a shard for a new event loop to write stats to. Shards are only added
+ * by the thread setting event loops up, one at a time, but the aggregator
+ * may be running already
+ */
+struct stats_shard *
+stats_add_shard(struct stats *st)
 {
-    if (!stats_enabled) {
-        return;
+    struct stats_shard *shard;
+
+    if (st->nshard == STATS_MAX_SHARD) {
+        log_error("stats shards are limited to %d event loops",
+                  STATS_MAX_SHARD);
+        return NULL;
     }
 
-    if (st == NULL) {
+    shard = stats_shard_create(st);
+    if (shard == NULL) {
+        return NULL;
+    }
+
+    st->shard[st->nshard] = shard;
+    __atomic_store_n(&st->nshard, st->nshard + 1, __ATOMIC_RELEASE);
+
+    log_debug(LOG_VERB, "add stats shard %p of %"PRIu32" values",
+              shard, st->nvalue);
+
+    return shard;
+}
+
+/*
+ * Take the window the aggregator handed over, if any. This is all the
+ * owner loop does to publish its stats
+ */
+void
+stats_swap(struct stats_shard *shard)
+{
+    uint32_t epoch;
+
+    if (!stats_enabled) {
         return;
     }
 
-    if (st->aggregate == 1) {
-        log_debug(LOG_PVERB, "skip swap of current %p shadow %p as aggregator "
-                  "is busy", st->current.elem, st->shadow.elem);
+    if (shard == NULL) {
         return;
     }
 
-    if (st->updated == 0) {
-        log_debug(LOG_PVERB, "skip swap of current %p shadow %p as there is "
-                  "nothing new", st->current.elem, st->shadow.elem);
+    epoch = __atomic_load_n(&shard->epoch, __ATOMIC_ACQUIRE);
+    if (epoch == shard->ack) {
         return;
     }
 
-    log_debug(LOG_PVERB, "swap stats current %p shadow %p", st->current.elem,
-              st->shadow.elem);
+    log_debug(LOG_PVERB, "swap stats shard %p to window %"PRIu32"", shard,
+              epoch & 1);
 
-    array_swap(&st->current, &st->shadow);
+    shard->cur = epoch & 1;
+    __atomic_store_n(&shard->ack, epoch, __ATOMIC_RELEASE);
+}
 
-    /*
-     * Reset current (a) stats before giving it back to generator to keep
-     * stats addition idempotent
-     */
-    stats_pool_reset(&st->current);
-    st->updated = 0;
+/*
+ * Add val to the value at value, which only the calling loop writes
+ */
+static int64_t
+stats_value_add(int64_t *value, int64_t val)
+{
+    val += stats_load(value);
+    stats_store(value, val);
 
-    st->aggregate = 1;
+    return val;
 }
 
-static struct stats_metric *
-stats_pool_to_metric(struct context *ctx, struct server_pool *pool,
-                     stats_pool_field_t fidx)
+static int64_t *
+stats_pool_to_value(struct context *ctx, struct server_pool *pool,
+                    stats_pool_field_t fidx)
 {
     struct stats *st;
-    struct stats_pool *stp;
     struct stats_metric *stm;
     uint32_t pidx;
 
     pidx = pool->idx;
 
     st = ctx->stats;
-    stp = array_get(&st->current, pidx);
-    stm = array_get(&stp->metric, fidx);
-
-    st->updated = 1;
+    stm = &stats_pool_codec[fidx];
 
     log_debug(LOG_VVVERB, "metric '%.*s' in pool %"PRIu32"", stm->name.len,
               stm->name.data, pidx);
 
-    return stm;
+    return &ctx->stats_shard->value[st->pool_value[pidx] + fidx];
 }
 
 void
@@ -1153,14 +2921,15 @@ _stats_pool_incr(struct context *ctx, struct server_pool *pool,
                  stats_pool_field_t fidx)
 {
     struct stats_metric *stm;
+    int64_t counter;
 
-    stm = stats_pool_to_metric(ctx, pool, fidx);
+    stm = &stats_pool_codec[fidx];
 
     ASSERT(stm->type == STATS_COUNTER || stm->type == STATS_GAUGE);
-    stm->value.counter++;
+    counter = stats_value_add(stats_pool_to_value(ctx, pool, fidx), 1);
 
     log_debug(LOG_VVVERB, "incr field '%.*s' to %"PRId64"", stm->name.len,
-              stm->name.data, stm->value.counter);
+              stm->name.data, counter);
 }
 
 void
@@ -1168,14 +2937,15 @@ _stats_pool_decr(struct context *ctx, struct server_pool *pool,
                  stats_pool_field_t fidx)
 {
     struct stats_metric *stm;
+    int64_t counter;
 
-    stm = stats_pool_to_metric(ctx, pool, fidx);
+    stm = &stats_pool_codec[fidx];
 
     ASSERT(stm->type == STATS_GAUGE);
-    stm->value.counter--;
+    counter = stats_value_add(stats_pool_to_value(ctx, pool, fidx), -1);
 
     log_debug(LOG_VVVERB, "decr field '%.*s' to %"PRId64"", stm->name.len,
-              stm->name.data, stm->value.counter);
+              stm->name.data, counter);
 }
 
 void
@@ -1183,14 +2953,15 @@ _stats_pool_incr_by(struct context *ctx, struct server_pool *pool,
                     stats_pool_field_t fidx, int64_t val)
 {
     struct stats_metric *stm;
+    int64_t counter;
 
-    stm = stats_pool_to_metric(ctx, pool, fidx);
+    stm = &stats_pool_codec[fidx];
 
     ASSERT(stm->type == STATS_COUNTER || stm->type == STATS_GAUGE);
-    stm->value.counter += val;
+    counter = stats_value_add(stats_pool_to_value(ctx, pool, fidx), val);
 
     log_debug(LOG_VVVERB, "incr by field '%.*s' to %"PRId64"", stm->name.len,
-              stm->name.data, stm->value.counter);
+              stm->name.data, counter);
 }
 
 void
@@ -1198,14 +2969,15 @@ _stats_pool_decr_by(struct context *ctx, struct server_pool *pool,
                     stats_pool_field_t fidx, int64_t val)
 {
     struct stats_metric *stm;
+    int64_t counter;
 
-    stm = stats_pool_to_metric(ctx, pool, fidx);
+    stm = &stats_pool_codec[fidx];
 
     ASSERT(stm->type == STATS_GAUGE);
-    stm->value.counter -= val;
+    counter = stats_value_add(stats_pool_to_value(ctx, pool, fidx), -val);
 
     log_debug(LOG_VVVERB, "decr by field '%.*s' to %"PRId64"", stm->name.len,
-              stm->name.data, stm->value.counter);
+              stm->name.data, counter);
 }
 
 void
@@ -1214,39 +2986,43 @@ _stats_pool_set(struct context *ctx, struct server_pool *pool,
 {
     struct stats_metric *stm;
 
-    stm = stats_pool_to_metric(ctx, pool, fidx);
-    
+    stm = &stats_pool_codec[fidx];
+
     ASSERT(stm->type == STATS_NUMERIC);
-    stm->value.numeric = val;
+    stats_store(stats_pool_to_value(ctx, pool, fidx), val);
 
     log_debug(LOG_VVVERB, "set field '%.*s' to %"PRId64"", stm->name.len,
-              stm->name.data, stm->value.numeric);
+              stm->name.data, val);
 }
 
-static struct stats_metric *
-stats_server_to_metric(struct context *ctx, struct server *server,
-                       stats_server_field_t fidx)
+static int64_t *
+stats_server_value(struct context *ctx, struct server *server,
+                      uint32_t idx)
 {
     struct stats *st;
-    struct stats_pool *stp;
-    struct stats_server *sts;
-    struct stats_metric *stm;
     uint32_t pidx, sidx;
 
     sidx = server->idx;
     pidx = server->owner->idx;
 
     st = ctx->stats;
-    stp = array_get(&st->current, pidx);
-    sts = array_get(&stp->server, sidx);
-    stm = array_get(&sts->metric, fidx);
 
-    st->updated = 1;
+    return &ctx->stats_shard->value[st->pool_value[pidx] + STATS_POOL_NVALUE +
+                                    sidx * STATS_SERVER_NVALUE + idx];
+}
+
+static int64_t *
+stats_server_to_value(struct context *ctx, struct server *server,
+                       stats_server_field_t fidx)
+{
+    struct stats_metric *stm;
+
+    stm = &stats_server_codec[fidx];
 
     log_debug(LOG_VVVERB, "metric '%.*s' in pool %"PRIu32" server %"PRIu32"",
-              stm->name.len, stm->name.data, pidx, sidx);
+              stm->name.len, stm->name.data, server->owner->idx, server->idx);
 
-    return stm;
+    return stats_server_value(ctx, server, fidx);
 }
 
 void
@@ -1254,14 +3030,15 @@ _stats_server_incr(struct context *ctx, struct server *server,
                    stats_server_field_t fidx)
 {
     struct stats_metric *stm;
+    int64_t counter;
 
-    stm = stats_server_to_metric(ctx, server, fidx);
+    stm = &stats_server_codec[fidx];
 
     ASSERT(stm->type == STATS_COUNTER || stm->type == STATS_GAUGE);
-    stm->value.counter++;
+    counter = stats_value_add(stats_server_to_value(ctx, server, fidx), 1);
 
     log_debug(LOG_VVVERB, "incr field '%.*s' to %"PRId64"", stm->name.len,
-              stm->name.data, stm->value.counter);
+              stm->name.data, counter);
 }
 
 void
@@ -1269,14 +3046,15 @@ _stats_server_decr(struct context *ctx, struct server *server,
                    stats_server_field_t fidx)
 {
     struct stats_metric *stm;
+    int64_t counter;
 
-    stm = stats_server_to_metric(ctx, server, fidx);
+    stm = &stats_server_codec[fidx];
 
     ASSERT(stm->type == STATS_GAUGE);
-    stm->value.counter--;
+    counter = stats_value_add(stats_server_to_value(ctx, server, fidx), -1);
 
     log_debug(LOG_VVVERB, "decr field '%.*s' to %"PRId64"", stm->name.len,
-              stm->name.data, stm->value.counter);
+              stm->name.data, counter);
 }
 
 void
@@ -1284,14 +3062,15 @@ _stats_server_incr_by(struct context *ctx, struct server *server,
                       stats_server_field_t fidx, int64_t val)
 {
     struct stats_metric *stm;
+    int64_t counter;
 
-    stm = stats_server_to_metric(ctx, server, fidx);
+    stm = &stats_server_codec[fidx];
 
     ASSERT(stm->type == STATS_COUNTER || stm->type == STATS_GAUGE);
-    stm->value.counter += val;
+    counter = stats_value_add(stats_server_to_value(ctx, server, fidx), val);
 
     log_debug(LOG_VVVERB, "incr by field '%.*s' to %"PRId64"", stm->name.len,
-              stm->name.data, stm->value.counter);
+              stm->name.data, counter);
 }
 
 void
@@ -1299,14 +3078,15 @@ _stats_server_decr_by(struct context *ctx, struct server *server,
                       stats_server_field_t fidx, int64_t val)
 {
     struct stats_metric *stm;
+    int64_t counter;
 
-    stm = stats_server_to_metric(ctx, server, fidx);
+    stm = &stats_server_codec[fidx];
 
     ASSERT(stm->type == STATS_GAUGE);
-    stm->value.counter -= val;
+    counter = stats_value_add(stats_server_to_value(ctx, server, fidx), -val);
 
     log_debug(LOG_VVVERB, "decr by field '%.*s' to %"PRId64"", stm->name.len,
-              stm->name.data, stm->value.counter);
+              stm->name.data, counter);
 }
 
 void
@@ -1315,11 +3095,110 @@ _stats_server_set(struct context *ctx, struct server *server,
 {
     struct stats_metric *stm;
 
-    stm = stats_server_to_metric(ctx, server, fidx);
-    
+    stm = &stats_server_codec[fidx];
+
     ASSERT(stm->type == STATS_NUMERIC);
-    stm->value.numeric = val;
+    stats_store(stats_server_to_value(ctx, server, fidx), val);
 
     log_debug(LOG_VVVERB, "set field '%.*s' to %"PRId64"", stm->name.len,
-              stm->name.data, stm->value.numeric);
+              stm->name.data, val);
+}
+
+/*
+ * Account a sampled request (requests != 0) or the response bytes to one
+ * (requests == 0) to the hot key sketch of server and its pool, under the
+ * routing key of req
+ */
+void
+_stats_server_hotkey(struct context *ctx, struct server *server,
+                     struct msg *req, int64_t requests, int64_t bytes)
+{
+    struct stats *st;
+    struct stats_window *win;
+    struct stats_hotkey *phk, *shk;
+    struct string key;
+    uint32_t pidx, sidx, hash;
+
+    ASSERT(req->request);
+
+    if (server->owner->hot_key_sample == 0) {
+        return;
+    }
+
+    if (req->key_start == NULL || req->key_end <= req->key_start) {
+        return;
+    }
+
+    key = req_build_key(&server->owner->hash_tag, req);
+
+    sidx = server->idx;
+    pidx = server->owner->idx;
+
+    st = ctx->stats;
+    win = &ctx->stats_shard->window[ctx->stats_shard->cur];
+    phk = &win->hotkey[pidx * STATS_HOTKEY_NSLOT];
+    shk = &win->hotkey[(st->npool + st->pool_server[pidx] + sidx) *
+                       STATS_HOTKEY_NSLOT];
+
+    hash = hash_fnv1a_32((char *)key.data, key.len);
+
+    stats_hotkey_update(phk, key.data, key.len, hash, requests, bytes);
+    stats_hotkey_update(shk, key.data, key.len, hash, requests, bytes);
+
+    log_debug(LOG_VVVERB, "hot key '%.*s' in pool %"PRIu32" server %"PRIu32
+              " requests %"PRId64" bytes %"PRId64"", key.len, key.data,
+              pidx, sidx, requests, bytes);
+}
+
+/*
+ * Account usec, the latency of the response to req which server just
+ * returned, to the server histogram and to the command of req
+ */
+void
+_stats_server_latency(struct context *ctx, struct server *server,
+                      struct msg *req, int64_t usec)
+{
+    struct stats *st;
+    struct stats_shard *shard;
+    int64_t *max;
+    uint32_t pidx;
+
+    ASSERT(req->request);
+
+    pidx = server->owner->idx;
+
+    st = ctx->stats;
+    shard = ctx->stats_shard;
+
+    stats_value_add(stats_server_value(ctx, server, STATS_SERVER_NFIELD +
+                                       stats_latency_bucket(usec)), 1);
+    stats_value_add(stats_server_value(ctx, server, STATS_SERVER_LATENCY_SUM),
+                    usec);
+
+    max = &shard->window[shard->cur].max[st->pool_server[pidx] + server->idx];
+    if (usec > *max) {
+        *max = usec;
+    }
+
+    stats_value_add(&shard->value[st->pool_value[pidx] + STATS_POOL_NFIELD +
+                                  req->type * STATS_COMMAND_NFIELD +
+                                  STATS_COMMAND_latency], usec);
+}
+
+void
+_stats_pool_command_incr_by(struct context *ctx, struct server_pool *pool,
+                            struct msg *req, stats_command_field_t fidx,
+                            int64_t val)
+{
+    struct stats *st;
+
+    ASSERT(req->request);
+    ASSERT(req->type < MSG_SENTINEL && fidx < STATS_COMMAND_NFIELD);
+
+    st = ctx->stats;
+
+    stats_value_add(&ctx->stats_shard->value[st->pool_value[pool->idx] +
+                                             STATS_POOL_NFIELD +
+                                             req->type * STATS_COMMAND_NFIELD +
+                                             fidx], val);
 }
@@ -30,6 +30,28 @@
     /* forwarder behavior */                                                                           \
     ACTION( forward_error,      STATS_COUNTER,      "# times we encountered a forwarding error")       \
     ACTION( fragments,          STATS_COUNTER,      "# fragments created from a multi-vector request") \
+    /* near cache behavior */                                                                          \
+    ACTION( near_cache_hits,    STATS_COUNTER,      "# requests served from near cache")               \
+    ACTION( near_cache_misses,  STATS_COUNTER,      "# cacheable requests missing near cache")         \
+    ACTION( collapsed,          STATS_COUNTER,      "# gets waiting on an identical one in flight")    \
+    /* notify behavior */                                                                              \
+    ACTION( notify_queued,      STATS_GAUGE,        "# delete notifies buffered for next tick")        \
+    ACTION( notify_sent,        STATS_COUNTER,      "# delete notifies acked by message queue")        \
+    ACTION( notify_batches,     STATS_COUNTER,      "# batched lpush sent to message queue")           \
+    ACTION( notify_dropped,     STATS_COUNTER,      "# delete notifies dropped when full or lost")     \
+    ACTION( notify_spilled,     STATS_COUNTER,      "# delete notifies written to the journal")        \
+    ACTION( notify_replayed,    STATS_COUNTER,      "# delete notifies replayed from the journal")     \
+    ACTION( notify_journal,     STATS_NUMERIC,      "current bytes of notifies in the journal")        \
+    /* rate limit behavior */                                                                          \
+    ACTION( ratelimit_rejected, STATS_COUNTER,      "# requests rejected or shed over rate limits")    \
+    ACTION( ratelimit_delayed,  STATS_COUNTER,      "# requests delayed for rate limit credit")        \
+    ACTION( ratelimit_queue,    STATS_GAUGE,        "# requests waiting for rate limit credit")        \
+    /* backpressure behavior */                                                                        \
+    ACTION( inflight,           STATS_GAUGE,        "# requests queued or sent to servers")            \
+    ACTION( inflight_bytes,     STATS_GAUGE,        "current request bytes queued or sent to servers") \
+    ACTION( inflight_paused,    STATS_COUNTER,      "# client reads paused over inflight limits")      \
+    ACTION( inflight_denied,    STATS_COUNTER,      "# requests rejected over inflight limits")        \
+    ACTION( outlier_ejects,     STATS_COUNTER,      "# times servers were ejected as outliers")        \
 
 #define STATS_SERVER_CODEC(ACTION)                                                                     \
     /* server behavior */                                                                              \
@@ -42,17 +64,68 @@
     ACTION( request_bytes,      STATS_COUNTER,      "total request bytes")                             \
     ACTION( responses,          STATS_COUNTER,      "# respones")                                      \
     ACTION( response_bytes,     STATS_COUNTER,      "total response bytes")                            \
+    ACTION( request_shed,       STATS_COUNTER,      "# requests dropped unsent past their deadline")   \
+    ACTION( request_timedout,   STATS_COUNTER,      "# requests failed on timeout, conn kept open")    \
     ACTION( in_queue,           STATS_GAUGE,        "# requests in incoming queue")                    \
     ACTION( in_queue_bytes,     STATS_GAUGE,        "current request bytes in incoming queue")         \
     ACTION( out_queue,          STATS_GAUGE,        "# requests in outgoing queue")                    \
     ACTION( out_queue_bytes,    STATS_GAUGE,        "current request bytes in outgoing queue")         \
+    /* warmup behavior */                                                                              \
+    ACTION( warmups,            STATS_COUNTER,      "# warmups sent to the server")                    \
+    ACTION( warmup_bytes,       STATS_COUNTER,      "total warmup bytes sent to the server")           \
+    ACTION( warmup_queue,       STATS_GAUGE,        "# warmups queued waiting for warmup_rate")        \
+    ACTION( warmup_dropped,     STATS_COUNTER,      "# warmups dropped on a full queue or an error")   \
+    ACTION( warmup_deduped,     STATS_COUNTER,      "# warmups skipped as the key was just warmed")    \
+    ACTION( warmup_fetches,     STATS_COUNTER,      "# keys fetched from the peer for bulk warmup")    \
     /* backend status */                                                                               \
     ACTION( cold,               STATS_NUMERIC,      "current cold status of backend server")           \
+    ACTION( loading,            STATS_NUMERIC,      "1 if loading its dataset, from redis info")       \
+    ACTION( master,             STATS_NUMERIC,      "1 if master, 0 if replica, from redis info")      \
+    ACTION( master_link_up,     STATS_NUMERIC,      "1 if the replica link is up, from redis info")    \
+    ACTION( repl_offset,        STATS_NUMERIC,      "replication offset, from redis info")             \
+    ACTION( repl_lag,           STATS_NUMERIC,      "sec since last io from master, from redis info")  \
+    ACTION( used_memory,        STATS_NUMERIC,      "used memory in bytes, from redis info")           \
+    ACTION( ops_per_sec,        STATS_NUMERIC,      "instantaneous ops per sec, from redis info")      \
+    ACTION( connected_clients,  STATS_NUMERIC,      "# connected clients, from redis info")            \
+    ACTION( stale,              STATS_NUMERIC,      "1 if reads skip the replica as too stale")        \
+    /* outlier detection */                                                                            \
+    ACTION( outlier_ejects,     STATS_COUNTER,      "# times ejected as an outlier")                   \
+    ACTION( ewma_latency,       STATS_NUMERIC,      "ewma of response latency in usec")                \
+    ACTION( ewma_errors,        STATS_NUMERIC,      "ewma of per-mille of requests failed")            \
             
+#define STATS_COMMAND_CODEC(ACTION)                                                                    \
+    ACTION( requests,           "# requests")                                                          \
+    ACTION( request_bytes,      "total request bytes")                                                 \
+    ACTION( response_bytes,     "total response bytes")                                                \
+    ACTION( errors,             "# error responses, from server or proxy")                             \
+    ACTION( latency,            "total response latency in usec")                                      \
+
     
 #define STATS_ADDR      "0.0.0.0"
 #define STATS_PORT      22222
 #define STATS_INTERVAL  (30 * 1000) /* in msec */
+#define STATS_METRICS_PORT 0        /* openmetrics off */
+
+#define STATS_METRICS_NSCRAPER  16 /* # openmetrics scrapers served at once */
+
+#define STATS_MAX_SHARD     64 /* # event loops that may write stats */
+#define STATS_CACHELINE     64 /* padding between data of distinct writers */
+
+#define STATS_HOTKEY_NSLOT  16 /* # keys tracked by a hot key sketch */
+#define STATS_HOTKEY_NTOP   8  /* # keys reported from a hot key sketch */
+#define STATS_HOTKEY_KEYLEN 64 /* # leading key bytes kept for reporting */
+
+/*
+ * Latency histograms are log-linear: each power of two range of usec is
+ * split in 16 linear buckets, so a bucket is at most 1/16 of its value
+ * wide. Latencies from 2^27 usec (~134 sec) up share the last bucket
+ */
+#define STATS_LATENCY_SUB_BITS  4
+#define STATS_LATENCY_SUB       (1 << STATS_LATENCY_SUB_BITS)
+#define STATS_LATENCY_MAX_BITS  27
+#define STATS_LATENCY_NGROUP    \
+    (STATS_LATENCY_MAX_BITS - STATS_LATENCY_SUB_BITS + 1)
+#define STATS_LATENCY_NBUCKET   (STATS_LATENCY_NGROUP * STATS_LATENCY_SUB)
 
 typedef enum stats_type {
     STATS_INVALID,
@@ -73,15 +146,72 @@ struct stats_metric {
     } value;
 };
 
+/*
+ * A slot of the space-saving sketch of hot keys. Counts are estimated
+ * from sampled requests, scaled by the sampling rate
+ */
+struct stats_hotkey {
+    uint32_t hash;                     /* hash of the full key */
+    uint32_t len;                      /* full key length */
+    int64_t  requests;                 /* estimated # requests */
+    int64_t  bytes;                    /* estimated response bytes */
+    uint8_t  key[STATS_HOTKEY_KEYLEN]; /* leading key bytes */
+};
+
+/*
+ * Buckets and max decay with time; sum and group, which coarsen buckets to
+ * one per power of two, count over the lifetime of the proxy
+ */
+struct stats_latency {
+    int64_t max;                            /* max latency in usec */
+    int64_t bucket[STATS_LATENCY_NBUCKET];  /* # responses per latency bucket */
+    int64_t sum;                            /* total latency in usec */
+    int64_t group[STATS_LATENCY_NGROUP];    /* # responses per bucket group */
+};
+
 struct stats_server {
-    struct string name;   /* server name (ref) */
-    struct array  metric; /* stats_metric[] for server codec */
+    struct string        name;     /* server name (ref) */
+    struct array         metric;   /* stats_metric[] for server codec */
+    struct stats_hotkey  *hotkey;  /* stats_hotkey[] sketch, if sampled */
+    struct stats_latency *latency; /* response latency histogram */
 };
 
 struct stats_pool {
-    struct string name;   /* pool name (ref) */
-    struct array  metric; /* stats_metric[] for pool codec */
-    struct array  server; /* stats_server[] */
+    struct string       name;     /* pool name (ref) */
+    struct array        metric;   /* stats_metric[] for pool codec */
+    struct array        server;   /* stats_server[] */
+    struct stats_hotkey *hotkey;  /* stats_hotkey[] sketch, if sampled */
+    int64_t             *command; /* command codec counters per msg_type_t */
+};
+
+/*
+ * Stats written by one event loop. Values are laid out flat, pool by pool:
+ * the pool codec, the command codec of each msg_type_t, then for each server
+ * the server codec and its latency buckets. The owner loop is their single
+ * writer and stores them with relaxed atomics; the aggregator loads them
+ * the same way and keeps what it has seen so far, so neither side ever
+ * copies or resets them.
+ *
+ * Hot key sketches and latency maxima do not add up, so they go into one
+ * of two windows instead. The owner loop writes window[cur]; the aggregator
+ * owns the other one, drains it and hands it over by bumping epoch, which
+ * the owner takes from stats_swap by acking it.
+ */
+struct stats_window {
+    struct stats_hotkey *hotkey;   /* sketches of pools then servers, or NULL */
+    int64_t             *max;      /* max latency of servers in usec */
+};
+
+struct stats_shard {
+    int64_t             *value;                /* values, written by owner */
+    struct stats_window window[2];             /* windows */
+    uint32_t            cur;                   /* window written by owner */
+    uint8_t             pad1[STATS_CACHELINE];
+    uint32_t            epoch;                 /* window flips, by aggregator */
+    int64_t             *seen;                 /* values aggregated so far */
+    uint8_t             pad2[STATS_CACHELINE];
+    uint32_t            ack;                   /* last flip taken by owner */
+    uint8_t             pad3[STATS_CACHELINE];
 };
 
 struct stats_buffer {
@@ -90,20 +220,50 @@ struct stats_buffer {
     size_t   size;  /* buffer alloc size */
 };
 
+/*
+ * An openmetrics scraper connection, read and written without blocking by
+ * the aggregator: first its request, then the response from the metrics
+ * buffer, which is not rendered again while any scraper is sending it
+ */
+struct stats_scraper {
+    int      sd;        /* scraper descriptor, or -1 if the slot is free */
+    int64_t  active_ts; /* last read or write in msec */
+    size_t   nrecv;     /* # request bytes read */
+    uint32_t nmatch;    /* # bytes of the request end CRLF CRLF matched */
+    size_t   nsent;     /* # response bytes sent, header included */
+    unsigned sending:1; /* request read, sending the response? */
+};
+
 struct stats {
     uint16_t            port;           /* stats monitoring port */
+    uint16_t            metrics_port;   /* openmetrics port, or 0 */
     int                 interval;       /* stats aggregation interval */
     struct string       addr;           /* stats monitoring address */
 
     int64_t             start_ts;       /* start timestamp of nutcracker */
+    int64_t             decay_ts;       /* last decay of sum (c) in msec */
     struct stats_buffer buf;            /* output buffer */
-
-    struct array        current;        /* stats_pool[] (a) */
-    struct array        shadow;         /* stats_pool[] (b) */
-    struct array        sum;            /* stats_pool[] (c = a + b) */
+    int64_t             aggregate_ts;   /* last aggregation in msec */
+    struct stats_buffer metrics;        /* openmetrics output */
+    int64_t             metrics_ts;     /* time metrics were rendered in msec */
+    struct stats_scraper scraper[STATS_METRICS_NSCRAPER]; /* scrapers */
+    uint32_t            nscraper;       /* # scrapers connected */
+    uint32_t            nsending;       /* # scrapers sending the metrics */
+
+    struct array        sum;            /* stats_pool[] summed from shards */
+
+    uint32_t            npool;          /* # pools */
+    uint32_t            nserver;        /* # servers across pools */
+    uint32_t            nvalue;         /* # values in a shard */
+    uint32_t            *pool_value;    /* pool offsets in shard values */
+    uint32_t            *pool_server;   /* index of each pool's first server */
+    bool                hotkey;         /* any pool sampling hot keys? */
+    struct stats_shard  *shard[STATS_MAX_SHARD]; /* one per event loop */
+    uint32_t            nshard;         /* # shards */
 
     pthread_t           tid;            /* stats aggregator thread */
     int                 sd;             /* stats descriptor */
+    int                 metrics_sd;     /* openmetrics descriptor */
 
     struct evbase       *st_evb;
 
@@ -121,9 +281,9 @@ struct stats {
     struct string       used_cpu_sys_str;         /* used cpu sys string */
     struct string       voluntary_switches_str;   /* voluntary switches string */
     struct string       involuntary_switches_str; /* involuntary switches */
-    
-    volatile int        aggregate;      /* shadow (b) aggregate? */
-    volatile int        updated;        /* current (a) updated? */
+    struct string       hotkey_str;               /* hot keys string */
+    struct string       command_str;              /* commands string */
+    struct stats_latency latency;                 /* merged from servers */
 };
 
 #define DEFINE_ACTION(_name, _type, _desc) STATS_POOL_##_name,
@@ -140,6 +300,13 @@ typedef enum stats_server_field {
 } stats_server_field_t;
 #undef DEFINE_ACTION
 
+#define DEFINE_ACTION(_name, _desc) STATS_COMMAND_##_name,
+typedef enum stats_command_field {
+    STATS_COMMAND_CODEC(DEFINE_ACTION)
+    STATS_COMMAND_NFIELD
+} stats_command_field_t;
+#undef DEFINE_ACTION
+
 #if defined NC_STATS && NC_STATS == 1
 
 #define stats_pool_incr(_ctx, _pool, _name) do {                        \
@@ -182,6 +349,19 @@ typedef enum stats_server_field {
     _stats_server_set(_ctx, _server, STATS_SERVER_##_name, _val);       \
 } while (0)
 
+#define stats_server_hotkey(_ctx, _server, _req, _requests, _bytes) do {\
+    _stats_server_hotkey(_ctx, _server, _req, _requests, _bytes);       \
+} while (0)
+
+#define stats_server_latency(_ctx, _server, _req, _usec) do {           \
+    _stats_server_latency(_ctx, _server, _req, _usec);                  \
+} while (0)
+
+#define stats_pool_command_incr_by(_ctx, _pool, _req, _name, _val) do {\
+    _stats_pool_command_incr_by(_ctx, _pool, _req,                      \
+                                STATS_COMMAND_##_name, _val);           \
+} while (0)
+
 
 #else
 
@@ -205,6 +385,12 @@ typedef enum stats_server_field {
 
 #define stats_server_set(_ctx, _server, _name, _val)
 
+#define stats_server_hotkey(_ctx, _server, _req, _requests, _bytes)
+
+#define stats_server_latency(_ctx, _server, _req, _usec)
+
+#define stats_pool_command_incr_by(_ctx, _pool, _req, _name, _val)
+
 #endif
 
 #define stats_enabled   NC_STATS
@@ -222,9 +408,20 @@ void _stats_server_decr(struct context *ctx, struct server *server, stats_server
 void _stats_server_incr_by(struct context *ctx, struct server *server, stats_server_field_t fidx, int64_t val);
 void _stats_server_decr_by(struct context *ctx, struct server *server, stats_server_field_t fidx, int64_t val);
 void _stats_server_set(struct context *ctx, struct server *server, stats_server_field_t fidx, int64_t val);
-
-struct stats *stats_create(uint16_t stats_port, char *stats_ip, int stats_interval, char *local_tag, char *source, struct array *server_pool);
+void _stats_server_hotkey(struct context *ctx, struct server *server,
+                          struct msg *req, int64_t requests, int64_t bytes);
+void _stats_server_latency(struct context *ctx, struct server *server,
+                           struct msg *req, int64_t usec);
+void _stats_pool_command_incr_by(struct context *ctx, struct server_pool *pool,
+                                 struct msg *req, stats_command_field_t fidx,
+                                 int64_t val);
+
+struct stats *stats_create(uint16_t stats_port, char *stats_ip,
+                           int stats_interval, uint16_t metrics_port,
+                           char *local_tag, char *source,
+                           struct array *server_pool);
 void stats_destroy(struct stats *stats);
-void stats_swap(struct stats *stats);
+struct stats_shard *stats_add_shard(struct stats *stats);
+void stats_swap(struct stats_shard *shard);
 
 #endif
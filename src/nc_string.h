@@ -76,6 +76,10 @@ int string_compare(const struct string *s1, const struct string *s2);
 #define nc_strchr(_p, _l, _c)           \
     _nc_strchr((uint8_t *)(_p), (uint8_t *)(_l), (uint8_t)(_c))
 
+#define nc_strchr2(_p, _l, _c1, _c2)    \
+    _nc_strchr2((uint8_t *)(_p), (uint8_t *)(_l), (uint8_t)(_c1),   \
+                (uint8_t)(_c2))
+
 #define nc_strrchr(_p, _s, _c)          \
     _nc_strrchr((uint8_t *)(_p),(uint8_t *)(_s), (uint8_t)(_c))
 
@@ -91,6 +95,8 @@ int string_compare(const struct string *s1, const struct string *s2);
 #define nc_vscnprintf(_s, _n, _f, _a)   \
     _vscnprintf((char *)(_s), (size_t)(_n), _f, _a)
 
+uint8_t *_nc_strchr2(uint8_t *p, uint8_t *last, uint8_t c1, uint8_t c2);
+
 /**
   A (very) limited version of snprintf.
   @param   to   Destination buffer.
@@ -454,6 +454,30 @@ nc_msec_now(void)
     return nc_usec_now() / 1000LL;
 }
 
+/*
+ * The cached clock, in milliseconds since Epoch, for the hot paths that can
+ * live with the time the event loop last woke up at
+ */
+static int64_t msec_cached;
+
+/*
+ * Refresh the cached clock and return it; called on every wakeup of the
+ * event loop, before any event is handled
+ */
+int64_t
+nc_msec_update(void)
+{
+    msec_cached = nc_msec_now();
+
+    return msec_cached;
+}
+
+int64_t
+nc_msec_cached(void)
+{
+    return msec_cached;
+}
+
 static int
 nc_resolve_inet(struct string *name, int port, struct sockinfo *si)
 {
@@ -68,6 +68,13 @@
 #define NC_ALIGN_PTR(p, n)  \
     (void *) (((uintptr_t) (p) + ((uintptr_t) n - 1)) & ~((uintptr_t) n - 1))
 
+/*
+ * Compile time assertion; a false condition 'c' declares an array of
+ * negative size and breaks the build. 'n' names the assertion
+ */
+#define NC_STATIC_ASSERT(c, n) \
+    typedef char nc_static_assert_##n[(c) ? 1 : -1]
+
 /*
  * Wrapper to workaround well known, safe, implicit type conversion when
  * invoking system calls.
@@ -191,6 +198,8 @@ int _scnprintf(char *buf, size_t size, const char *fmt, ...);
 int _vscnprintf(char *buf, size_t size, const char *fmt, va_list args);
 int64_t nc_usec_now(void);
 int64_t nc_msec_now(void);
+int64_t nc_msec_update(void);
+int64_t nc_msec_cached(void);
 struct timespec nc_millisec_to_timespec(int millisec);
 
 /*
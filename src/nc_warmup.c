@@ -0,0 +1,433 @@
+/*
+ * twemproxy - A fast and lightweight proxy for memcached protocol.
+ * Copyright (C) 2011 Twitter, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <nc_core.h>
+#include <nc_warmup.h>
+#include <nc_server.h>
+#include <nc_hashkit.h>
+#include <nc_proto.h>
+
+#define WARMUP_MAX_DEDUP        (1 << 20) /* max # slots of the dedup table */
+
+struct warmup *
+warmup_create(struct server_pool *owner, uint32_t rate, uint32_t nqueue,
+              uint32_t nkey, uint32_t bandwidth)
+{
+    struct warmup *wu;
+    uint64_t want;
+    uint32_t ndedup;
+
+    wu = nc_alloc(sizeof(*wu));
+    if (wu == NULL) {
+        return NULL;
+    }
+
+    wu->queue = NULL;
+    if (nqueue > 0) {
+        wu->queue = nc_alloc(sizeof(*wu->queue) * nqueue);
+        if (wu->queue == NULL) {
+            nc_free(wu);
+            return NULL;
+        }
+    }
+
+    /* room for the keys of a dedup window at full rate, or a full queue */
+    want = MIN(2 * (uint64_t)MAX(rate, nqueue), WARMUP_MAX_DEDUP);
+    for (ndedup = WARMUP_MIN_DEDUP; ndedup < want; ndedup <<= 1);
+
+    wu->dedup = nc_zalloc(sizeof(*wu->dedup) * ndedup);
+    if (wu->dedup == NULL) {
+        nc_free(wu->queue);
+        nc_free(wu);
+        return NULL;
+    }
+
+    wu->keys = NULL;
+    wu->nkey = 0;
+    if (nkey > 0) {
+        for (wu->nkey = 1; wu->nkey < nkey; wu->nkey <<= 1);
+
+        wu->keys = nc_zalloc(sizeof(*wu->keys) * wu->nkey);
+        if (wu->keys == NULL) {
+            nc_free(wu->dedup);
+            nc_free(wu->queue);
+            nc_free(wu);
+            return NULL;
+        }
+    }
+
+    wu->owner = owner;
+    wu->rate = rate;
+    wu->burst = (int64_t)rate * WARMUP_TOKEN;
+    wu->credit = wu->burst;
+    wu->nalloc = nqueue;
+    wu->head = 0;
+    wu->nqueue = 0;
+    wu->mask = ndedup - 1;
+    wu->tick = 1;
+    wu->bandwidth = bandwidth;
+    wu->budget = bandwidth;
+    wu->vsize = WARMUP_BULK_VSIZE;
+    TAILQ_INIT(&wu->job_q);
+
+    log_debug(LOG_VERB, "warmup of %"PRIu32" per sec with %"PRIu32" queue "
+              "slots, %"PRIu32" dedup slots and %"PRIu32" key log slots",
+              rate, nqueue, ndedup, wu->nkey);
+
+    return wu;
+}
+
+void
+warmup_destroy(struct warmup *wu)
+{
+    struct warmup_entry *entry;
+    struct warmup_job *job;
+
+    if (wu == NULL) {
+        return;
+    }
+
+    while (!TAILQ_EMPTY(&wu->job_q)) {
+        job = TAILQ_FIRST(&wu->job_q);
+        TAILQ_REMOVE(&wu->job_q, job, tqe);
+        ASSERT(job->nflight == 0);
+        nc_free(job);
+    }
+
+    while (wu->nqueue > 0) {
+        entry = &wu->queue[wu->head];
+        wu->head = (wu->head + 1) % wu->nalloc;
+        wu->nqueue--;
+        req_put(entry->msg);
+    }
+
+    nc_free(wu->keys);
+    nc_free(wu->dedup);
+    nc_free(wu->queue);
+    nc_free(wu);
+}
+
+/*
+ * Return true if the key was not warmed within the dedup window, and
+ * remember it as warmed. Keys colliding on a slot just evict each other,
+ * so the worst a collision does is a redundant warmup
+ */
+bool
+warmup_admit(struct warmup *wu, uint8_t *key, uint32_t keylen)
+{
+    struct warmup_slot *slot;
+    uint32_t hash;
+
+    hash = hash_murmur((char *)key, keylen);
+    slot = &wu->dedup[hash & wu->mask];
+
+    if (slot->expire > wu->tick && slot->hash == hash) {
+        return false;
+    }
+
+    slot->hash = hash;
+    slot->expire = wu->tick + WARMUP_DEDUP_TTL / NC_TICK_INTERVAL;
+
+    return true;
+}
+
+static void
+warmup_forward(struct context *ctx, struct conn *s_conn, struct msg *msg)
+{
+    struct server *server;
+    uint32_t mlen;
+
+    server = s_conn->owner;
+    mlen = msg->mlen;
+
+    if (req_enqueue(ctx, s_conn, msg) != NC_OK) {
+        req_put(msg);
+        stats_server_incr(ctx, server, warmup_dropped);
+        return;
+    }
+
+    stats_server_incr(ctx, server, warmups);
+    stats_server_incr_by(ctx, server, warmup_bytes, mlen);
+}
+
+/*
+ * Send warmup msg to server connection s_conn right away if the bucket
+ * has a token for it and no older warmup is waiting, else queue it for
+ * warmup_drain. A warmup finding the queue full is dropped
+ */
+void
+warmup_send(struct context *ctx, struct warmup *wu, struct conn *s_conn,
+            struct msg *msg)
+{
+    struct server *server;
+    struct warmup_entry *entry;
+
+    ASSERT(msg->request && msg->owner == NULL);
+
+    if (wu->rate == 0) {
+        warmup_forward(ctx, s_conn, msg);
+        return;
+    }
+
+    if (wu->nqueue == 0 && wu->credit >= WARMUP_TOKEN) {
+        wu->credit -= WARMUP_TOKEN;
+        warmup_forward(ctx, s_conn, msg);
+        return;
+    }
+
+    server = s_conn->owner;
+
+    if (wu->nqueue == wu->nalloc) {
+        log_debug(LOG_VERB, "drop warmup %"PRIu64" on full queue", msg->id);
+        req_put(msg);
+        stats_server_incr(ctx, server, warmup_dropped);
+        return;
+    }
+
+    entry = &wu->queue[(wu->head + wu->nqueue) % wu->nalloc];
+    entry->msg = msg;
+    entry->server = server;
+    wu->nqueue++;
+
+    stats_server_incr(ctx, server, warmup_queue);
+}
+
+/*
+ * Remember key as read with a hit. The log is a table indexed by key
+ * hash, so a key read again takes no new slot and a new key evicts the
+ * one it collides with; the log thus holds the keys read most recently
+ */
+void
+warmup_log(struct warmup *wu, uint8_t *key, uint32_t keylen)
+{
+    struct warmup_key *slot;
+    uint32_t hash;
+
+    if (wu->keys == NULL || keylen == 0 || keylen > WARMUP_KEY_LEN) {
+        return;
+    }
+
+    hash = hash_murmur((char *)key, keylen);
+    slot = &wu->keys[hash & (wu->nkey - 1)];
+
+    if (slot->hash == hash && slot->len == keylen &&
+        memcmp(slot->data, key, keylen) == 0) {
+        return;
+    }
+
+    slot->hash = hash;
+    slot->len = (uint8_t)keylen;
+    nc_memcpy(slot->data, key, keylen);
+}
+
+static struct warmup_job *
+warmup_job_find(struct warmup *wu, struct server *server)
+{
+    struct warmup_job *job;
+
+    TAILQ_FOREACH(job, &wu->job_q, tqe) {
+        if (job->server == server) {
+            return job;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Start a bulk warmup of server, which just turned cold, from the key
+ * log. A job still running for the server starts over
+ */
+void
+warmup_start(struct warmup *wu, struct server *server)
+{
+    struct warmup_job *job;
+
+    if (wu->keys == NULL || wu->owner->peer == NULL) {
+        return;
+    }
+
+    job = warmup_job_find(wu, server);
+    if (job == NULL) {
+        job = nc_alloc(sizeof(*job));
+        if (job == NULL) {
+            return;
+        }
+        job->server = server;
+        job->nflight = 0;
+        TAILQ_INSERT_TAIL(&wu->job_q, job, tqe);
+    }
+
+    job->cursor = 0;
+    job->nfetch = 0;
+    job->stop = 0;
+
+    log_warn("bulk warmup of server '%.*s' in pool '%.*s' from %"PRIu32
+             " logged keys", server->pname.len, server->pname.data,
+             wu->owner->name.len, wu->owner->name.data, wu->nkey);
+}
+
+/*
+ * Stop the bulk warmup of server, which is no longer cold
+ */
+void
+warmup_stop(struct warmup *wu, struct server *server)
+{
+    struct warmup_job *job;
+
+    job = warmup_job_find(wu, server);
+    if (job != NULL) {
+        job->stop = 1;
+    }
+}
+
+/*
+ * Send a warmup fetched by job, charging it to the bulk bandwidth budget
+ */
+void
+warmup_bulk_send(struct context *ctx, struct warmup_job *job,
+                 struct conn *s_conn, struct msg *msg)
+{
+    struct warmup *wu = job->server->owner->warmup;
+
+    wu->budget -= msg->mlen;
+    wu->vsize += ((int64_t)msg->mlen - wu->vsize) / 8;
+    warmup_send(ctx, wu, s_conn, msg);
+}
+
+/*
+ * Fetch from the peer pool the logged keys that map to the server of job,
+ * while the job has fetches, the pool bulk bandwidth and the warmup queue
+ * room to spare
+ */
+static void
+warmup_job_run(struct context *ctx, struct warmup *wu, struct warmup_job *job)
+{
+    struct server_pool *pool = wu->owner;
+    struct warmup_key *slot;
+    struct string key;
+    uint32_t nscan;
+
+    for (nscan = 0; !job->stop && job->cursor < wu->nkey &&
+         nscan < WARMUP_BULK_SCAN; nscan++) {
+        if (job->nflight >= WARMUP_BULK_FLIGHT) {
+            break;
+        }
+
+        /* fetches in flight are expected to use up the budget left */
+        if (wu->bandwidth > 0 && wu->budget <= job->nflight * wu->vsize) {
+            break;
+        }
+
+        /* leave half of the queue to the warmups of client reads */
+        if (wu->rate > 0 &&
+            wu->nqueue + job->nflight >= MAX(wu->nalloc / 2, 1)) {
+            break;
+        }
+
+        slot = &wu->keys[job->cursor++];
+        if (slot->len == 0) {
+            continue;
+        }
+
+        key = req_route_key(&pool->hash_tag, slot->data,
+                            slot->data + slot->len);
+        if (!server_pool_owns(pool, job->server, key.data, key.len)) {
+            continue;
+        }
+
+        if (!warmup_admit(wu, slot->data, slot->len)) {
+            stats_server_incr(ctx, job->server, warmup_deduped);
+            continue;
+        }
+
+        if (memcache_warmup_fetch(ctx, pool, job, slot->data,
+                                  slot->len) != NC_OK) {
+            continue;
+        }
+        job->nfetch++;
+    }
+}
+
+static void
+warmup_job_drain(struct context *ctx, struct warmup *wu)
+{
+    struct warmup_job *job, *njob;
+
+    if (wu->bandwidth > 0) {
+        wu->budget = MIN(wu->budget + wu->bandwidth * NC_TICK_INTERVAL / 1000,
+                         wu->bandwidth);
+    }
+
+    for (job = TAILQ_FIRST(&wu->job_q); job != NULL; job = njob) {
+        njob = TAILQ_NEXT(job, tqe);
+
+        warmup_job_run(ctx, wu, job);
+
+        if ((job->stop || job->cursor == wu->nkey) && job->nflight == 0) {
+            log_warn("bulk warmup of server '%.*s' in pool '%.*s' %s after "
+                     "%"PRIu32" fetches", job->server->pname.len,
+                     job->server->pname.data, wu->owner->name.len,
+                     wu->owner->name.data, job->stop ? "stopped" : "done",
+                     job->nfetch);
+            TAILQ_REMOVE(&wu->job_q, job, tqe);
+            nc_free(job);
+        }
+    }
+}
+
+/*
+ * Refill the token bucket and send the queued warmups it has tokens for,
+ * then let the bulk warmup jobs run. Called once every tick
+ */
+void
+warmup_drain(struct context *ctx, struct warmup *wu)
+{
+    struct warmup_entry *entry;
+    struct conn *s_conn;
+
+    wu->tick++;
+
+    if (!TAILQ_EMPTY(&wu->job_q)) {
+        warmup_job_drain(ctx, wu);
+    }
+
+    if (wu->rate == 0) {
+        return;
+    }
+
+    wu->credit = MIN(wu->credit + (int64_t)wu->rate * NC_TICK_INTERVAL,
+                     wu->burst);
+
+    while (wu->nqueue > 0 && wu->credit >= WARMUP_TOKEN) {
+        entry = &wu->queue[wu->head];
+        wu->head = (wu->head + 1) % wu->nalloc;
+        wu->nqueue--;
+        wu->credit -= WARMUP_TOKEN;
+
+        stats_server_decr(ctx, entry->server, warmup_queue);
+
+        s_conn = server_conn_connect(ctx, entry->server);
+        if (s_conn == NULL) {
+            req_put(entry->msg);
+            stats_server_incr(ctx, entry->server, warmup_dropped);
+            continue;
+        }
+
+        warmup_forward(ctx, s_conn, entry->msg);
+    }
+}
@@ -0,0 +1,107 @@
+/*
+ * twemproxy - A fast and lightweight proxy for memcached protocol.
+ * Copyright (C) 2011 Twitter, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _NC_WARMUP_H_
+#define _NC_WARMUP_H_
+
+#include <nc_core.h>
+
+/*
+ * Warmup pipeline: the per-pool path of the requests that copy values
+ * served by a peer pool into a cold server. Warmups are paced by a token
+ * bucket of warmup_rate per second, wait in a bounded queue when out of
+ * tokens and are dropped once it is full. A key warmed within the last
+ * WARMUP_DEDUP_TTL msec is not warmed again.
+ *
+ * With warmup_keys, the pool also logs the keys of its recent read hits,
+ * and a server turning cold gets a bulk warmup job: the logged keys that
+ * map to the server are fetched from the peer pool and written to it,
+ * within warmup_bandwidth bytes per second.
+ */
+
+#define WARMUP_DEDUP_TTL        1000 /* in msec */
+#define WARMUP_MIN_DEDUP        1024 /* min # slots of the dedup table */
+#define WARMUP_TOKEN            1000 /* token bucket credit of one warmup */
+#define WARMUP_KEY_LEN          250  /* max length of a logged key */
+#define WARMUP_BULK_FLIGHT      64   /* max # fetches in flight per job */
+#define WARMUP_BULK_SCAN        4096 /* max # logged keys scanned per tick */
+#define WARMUP_BULK_VSIZE       512  /* initial guess of a bulk warmup size */
+
+struct warmup_entry {
+    struct msg    *msg;     /* warmup request */
+    struct server *server;  /* target server */
+};
+
+struct warmup_slot {
+    uint32_t hash;          /* key hash */
+    uint32_t expire;        /* expiry tick, 0 if empty */
+};
+
+struct warmup_key {
+    uint32_t hash;                  /* key hash */
+    uint8_t  len;                   /* key length, 0 if empty */
+    uint8_t  data[WARMUP_KEY_LEN];  /* key */
+};
+
+struct warmup_job {
+    TAILQ_ENTRY(warmup_job) tqe;    /* link in job q */
+    struct server           *server;/* cold server */
+    uint32_t                cursor; /* next key log slot to scan */
+    uint32_t                nflight;/* # fetches in flight */
+    uint32_t                nfetch; /* # fetches sent */
+    unsigned                stop:1; /* server no longer cold? */
+};
+
+TAILQ_HEAD(warmup_job_tqh, warmup_job);
+
+struct warmup {
+    struct server_pool    *owner;   /* owner pool */
+    uint32_t              rate;     /* # warmups per sec, 0 if unlimited */
+    int64_t               credit;   /* token bucket credit */
+    int64_t               burst;    /* max credit */
+    struct warmup_entry   *queue;   /* queue ring */
+    uint32_t              nalloc;   /* # queue slots */
+    uint32_t              head;     /* index of the oldest warmup */
+    uint32_t              nqueue;   /* # queued warmups */
+    struct warmup_slot    *dedup;   /* recently warmed keys */
+    uint32_t              mask;     /* dedup mask */
+    uint32_t              tick;     /* # ticks so far */
+    struct warmup_key     *keys;    /* key log, or NULL */
+    uint32_t              nkey;     /* # key log slots, power of 2 */
+    int64_t               bandwidth;/* bulk bytes per sec, 0 if unlimited */
+    int64_t               budget;   /* bulk bytes left to write */
+    int64_t               vsize;    /* moving average of bulk warmup size */
+    struct warmup_job_tqh job_q;    /* bulk warmup jobs */
+};
+
+struct warmup *warmup_create(struct server_pool *owner, uint32_t rate,
+                             uint32_t nqueue, uint32_t nkey,
+                             uint32_t bandwidth);
+void warmup_destroy(struct warmup *wu);
+
+bool warmup_admit(struct warmup *wu, uint8_t *key, uint32_t keylen);
+void warmup_send(struct context *ctx, struct warmup *wu, struct conn *s_conn,
+                 struct msg *msg);
+void warmup_drain(struct context *ctx, struct warmup *wu);
+
+void warmup_log(struct warmup *wu, uint8_t *key, uint32_t keylen);
+void warmup_start(struct warmup *wu, struct server *server);
+void warmup_stop(struct warmup *wu, struct server *server);
+void warmup_bulk_send(struct context *ctx, struct warmup_job *job,
+                      struct conn *s_conn, struct msg *msg);
+
+#endif
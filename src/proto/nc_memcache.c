@@ -34,6 +34,7 @@
 #define MEMCACHE_MAX_KEY_LENGTH 250
 
 #define MEMCACHE_PROBE_MESSAGE "stats\r\n"
+#define MEMCACHE_MN_MESSAGE "MN\r\n"
 
 #define STATS_OK (void *) NULL
 
@@ -259,8 +260,62 @@ memcache_arithmetic(struct msg *r)
 static bool
 memcache_delete(struct msg *r)
 {
-    if (r->type == MSG_REQ_MC_DELETE) {
+    switch (r->type) {
+    case MSG_REQ_MC_DELETE:
+    case MSG_REQ_MC_MD:
+        return true;
+
+    default:
+        break;
+    }
+
+    return false;
+}
+
+/*
+ * Return true, if the memcache command is a keyed meta command (mg, ms
+ * or md), otherwise return false
+ */
+static bool
+memcache_meta(struct msg *r)
+{
+    switch (r->type) {
+    case MSG_REQ_MC_MG:
+    case MSG_REQ_MC_MS:
+    case MSG_REQ_MC_MD:
         return true;
+
+    default:
+        break;
+    }
+
+    return false;
+}
+
+/*
+ * Return true, if the response to the quiet mode meta request is one
+ * that memcached would have suppressed, otherwise return false.
+ *
+ * From the meta protocol: in quiet mode mg omits EN, ms omits HD, and
+ * md omits HD and NF. Failures are always returned.
+ */
+static bool
+memcache_quiet_rsp(struct msg *req, struct msg *rsp)
+{
+    ASSERT(req->quiet);
+
+    switch (req->type) {
+    case MSG_REQ_MC_MG:
+        return rsp->type == MSG_RSP_MC_EN;
+
+    case MSG_REQ_MC_MS:
+        return rsp->type == MSG_RSP_MC_HD;
+
+    case MSG_REQ_MC_MD:
+        return rsp->type == MSG_RSP_MC_HD || rsp->type == MSG_RSP_MC_NF;
+
+    default:
+        break;
     }
 
     return false;
@@ -294,6 +349,8 @@ memcache_parse_req(struct msg *r)
         SW_CRLF,
         SW_NOREPLY,
         SW_AFTER_NOREPLY,
+        SW_META_FLAGS,
+        SW_META_FLAG,
         SW_ALMOST_DONE,
         SW_SENTINEL
     } state;
@@ -340,6 +397,31 @@ memcache_parse_req(struct msg *r)
 
                 switch (p - m) {
 
+                case 2:
+                    if (m[0] != 'm') {
+                        break;
+                    }
+
+                    switch (m[1]) {
+                    case 'g':
+                        r->type = MSG_REQ_MC_MG;
+                        break;
+
+                    case 's':
+                        r->type = MSG_REQ_MC_MS;
+                        break;
+
+                    case 'd':
+                        r->type = MSG_REQ_MC_MD;
+                        break;
+
+                    case 'n':
+                        r->type = MSG_REQ_MC_MN;
+                        break;
+                    }
+
+                    break;
+
                 case 3:
                     if (str4cmp(m, 'g', 'e', 't', ' ')) {
                         r->type = MSG_REQ_MC_GET;
@@ -433,6 +515,9 @@ memcache_parse_req(struct msg *r)
                 case MSG_REQ_MC_PREPEND:
                 case MSG_REQ_MC_INCR:
                 case MSG_REQ_MC_DECR:
+                case MSG_REQ_MC_MG:
+                case MSG_REQ_MC_MS:
+                case MSG_REQ_MC_MD:
                     if (ch == CR) {
                         goto error;
                     }
@@ -444,6 +529,17 @@ memcache_parse_req(struct msg *r)
                     state = SW_CRLF;
                     break;
 
+                case MSG_REQ_MC_MN:
+                    /*
+                     * mn only marks the end of a pipeline of quiet
+                     * requests; since responses go back in request order,
+                     * the proxy answers it without a server round trip
+                     */
+                    r->noforward = 1;
+                    p = p - 1; /* go back by 1 byte */
+                    state = SW_CRLF;
+                    break;
+
                 case MSG_UNKNOWN:
                     goto error;
 
@@ -467,6 +563,16 @@ memcache_parse_req(struct msg *r)
             break;
 
         case SW_KEY:
+            if (ch != ' ' && ch != CR) {
+                /* run over the rest of the key a vector at a time */
+                m = nc_strchr2(p + 1, b->last, ' ', CR);
+                if (m == NULL) {
+                    p = b->last - 1;
+                    break;
+                }
+                p = m;
+                ch = *p;
+            }
             if (ch == ' ' || ch == CR) {
                 if ((p - r->key_start) > MEMCACHE_MAX_KEY_LENGTH) {
                     log_error("parsed bad req %"PRIu64" of type %d with key "
@@ -479,7 +585,13 @@ memcache_parse_req(struct msg *r)
                 r->token = NULL;
 
                 /* get next state */
-                if (memcache_storage(r)) {
+                if (memcache_meta(r)) {
+                    if (r->type == MSG_REQ_MC_MS) {
+                        state = SW_SPACES_BEFORE_VLEN;
+                    } else {
+                        state = SW_META_FLAGS;
+                    }
+                } else if (memcache_storage(r)) {
                     state = SW_SPACES_BEFORE_FLAGS;
                 } else if (memcache_arithmetic(r)) {
                     state = SW_SPACES_BEFORE_NUM;
@@ -492,7 +604,8 @@ memcache_parse_req(struct msg *r)
                 }
 
                 if (ch == CR) {
-                    if (memcache_storage(r) || memcache_arithmetic(r)) {
+                    if (memcache_storage(r) || memcache_arithmetic(r) ||
+                        r->type == MSG_REQ_MC_MS) {
                         goto error;
                     }
                     p = p - 1; /* go back by 1 byte */
@@ -598,7 +711,11 @@ memcache_parse_req(struct msg *r)
                 /* vlen_end <- p - 1 */
                 p = p - 1; /* go back by 1 byte */
                 r->token = NULL;
-                state = SW_RUNTO_CRLF;
+                if (r->type == MSG_REQ_MC_MS) {
+                    state = SW_META_FLAGS;
+                } else {
+                    state = SW_RUNTO_CRLF;
+                }
             } else {
                 goto error;
             }
@@ -637,6 +754,7 @@ memcache_parse_req(struct msg *r)
             switch (ch) {
             case LF:
                 /* val_start <- p + 1 */
+                r->rlen = r->vlen;
                 state = SW_VAL;
                 break;
 
@@ -647,18 +765,25 @@ memcache_parse_req(struct msg *r)
             break;
 
         case SW_VAL:
-            m = p + r->vlen;
+            /*
+             * Jump over the data block by its declared length; rlen counts
+             * down the bytes still to skip when the block spans mbufs, so
+             * each mbuf costs O(1) no matter how large the value is, and
+             * vlen keeps the full length for later consumers.
+             */
+            m = p + r->rlen;
             if (m >= b->last) {
-                ASSERT(r->vlen >= (uint32_t)(b->last - p));
-                r->vlen -= (uint32_t)(b->last - p);
+                ASSERT(r->rlen >= (uint32_t)(b->last - p));
+                r->rlen -= (uint32_t)(b->last - p);
                 m = b->last - 1;
-                p = m; /* move forward by vlen bytes */
+                p = m; /* move forward by rlen bytes */
                 break;
             }
             switch (*m) {
             case CR:
-                /* val_end <- p - 1 */
-                p = m; /* move forward by vlen bytes */
+                /* val_end <- m */
+                p = m; /* move forward by rlen bytes */
+                r->rlen = 0;
                 state = SW_ALMOST_DONE;
                 break;
 
@@ -764,6 +889,52 @@ memcache_parse_req(struct msg *r)
 
             break;
 
+        case SW_META_FLAGS:
+            ASSERT(memcache_meta(r));
+            switch (ch) {
+            case ' ':
+                break;
+
+            case CR:
+                if (r->type == MSG_REQ_MC_MS) {
+                    state = SW_RUNTO_VAL;
+                } else {
+                    state = SW_ALMOST_DONE;
+                }
+                break;
+
+            default:
+                /* flag_start <- p */
+                r->token = p;
+                state = SW_META_FLAG;
+            }
+
+            break;
+
+        case SW_META_FLAG:
+            if (ch == ' ' || ch == CR) {
+                /* flag_end <- p - 1 */
+                m = r->token;
+                r->token = NULL;
+
+                /*
+                 * Strip the quiet flag before forwarding, so that the
+                 * server answers every request and responses stay paired
+                 * with requests on the server connection. The responses
+                 * a quiet server would have omitted are dropped on the way
+                 * back to the client instead.
+                 */
+                if ((p - m) == 1 && *m == 'q') {
+                    *m = ' ';
+                    r->quiet = 1;
+                }
+
+                p = p - 1; /* go back by 1 byte */
+                state = SW_META_FLAGS;
+            }
+
+            break;
+
         case SW_CRLF:
             switch (ch) {
             case ' ':
@@ -870,6 +1041,7 @@ memcache_parse_rsp(struct msg *r)
     struct mbuf *b;
     uint8_t *p, *m;
     uint8_t ch;
+    int num;
     struct string *key, *val;
     enum {
         SW_START,
@@ -894,6 +1066,8 @@ memcache_parse_rsp(struct msg *r)
         SW_ALMOST_DONE,
         SW_SPACES_BEFORE_INLINE_VAL,        
         SW_INLINE_VAL,
+        SW_META_FLAGS,
+        SW_META_FLAG,
         SW_SENTINEL
     } state;
 
@@ -958,6 +1132,44 @@ memcache_parse_rsp(struct msg *r)
                 r->type = MSG_UNKNOWN;
 
                 switch (p - m) {
+                case 2:
+                    if (m[0] == 'V' && m[1] == 'A') {
+                        r->type = MSG_RSP_MC_VA;
+                        break;
+                    }
+
+                    if (m[0] == 'H' && m[1] == 'D') {
+                        r->type = MSG_RSP_MC_HD;
+                        break;
+                    }
+
+                    if (m[0] == 'E' && m[1] == 'N') {
+                        r->type = MSG_RSP_MC_EN;
+                        break;
+                    }
+
+                    if (m[0] == 'N' && m[1] == 'F') {
+                        r->type = MSG_RSP_MC_NF;
+                        break;
+                    }
+
+                    if (m[0] == 'N' && m[1] == 'S') {
+                        r->type = MSG_RSP_MC_NS;
+                        break;
+                    }
+
+                    if (m[0] == 'E' && m[1] == 'X') {
+                        r->type = MSG_RSP_MC_EX;
+                        break;
+                    }
+
+                    if (m[0] == 'M' && m[1] == 'N') {
+                        r->type = MSG_RSP_MC_MN;
+                        break;
+                    }
+
+                    break;
+
                 case 3:
                     if (str4cmp(m, 'E', 'N', 'D', '\r')) {
                         r->type = MSG_RSP_MC_END;
@@ -1074,6 +1286,22 @@ memcache_parse_rsp(struct msg *r)
                     state = SW_RUNTO_CRLF;
                     break;
 
+                case MSG_RSP_MC_VA:
+                    state = SW_SPACES_BEFORE_VLEN;
+                    break;
+
+                case MSG_RSP_MC_HD:
+                case MSG_RSP_MC_NF:
+                case MSG_RSP_MC_NS:
+                case MSG_RSP_MC_EX:
+                    state = SW_META_FLAGS;
+                    break;
+
+                case MSG_RSP_MC_EN:
+                case MSG_RSP_MC_MN:
+                    state = SW_CRLF;
+                    break;
+
                 default:
                     NOT_REACHED();
                 }
@@ -1097,6 +1325,16 @@ memcache_parse_rsp(struct msg *r)
                 r->key_start = p;
             }
 
+            if (ch != ' ') {
+                m = nc_strchr2(p + 1, b->last, ' ', ' ');
+                if (m == NULL) {
+                    p = b->last - 1;
+                    break;
+                }
+                p = m;
+                ch = *p;
+            }
+
             if (ch == ' ') {
                 if ((p - r->key_start) > MEMCACHE_MAX_KEY_LENGTH) {
                     log_error("parsed bad req %"PRIu64" of type %d with key "
@@ -1110,7 +1348,13 @@ memcache_parse_rsp(struct msg *r)
                 if (r->type != MSG_RSP_MC_STATS) {
                     state = SW_SPACES_BEFORE_FLAGS;
                 } else {
-                    key = array_push(&r->keys);
+                    if (msg_kv_get(r) == NULL) {
+                        goto enomem;
+                    }
+                    key = array_push(&r->kv->keys);
+                    if (key == NULL) {
+                        goto enomem;
+                    }
                     key->len = r->key_end - r->key_start;
                     key->data = r->key_start;
 
@@ -1124,12 +1368,28 @@ memcache_parse_rsp(struct msg *r)
                 r->token = p;
                 r->val_start = p;
             }
-            
+
+            if (ch != CR) {
+                m = nc_strchr2(p + 1, b->last, CR, CR);
+                if (m == NULL) {
+                    p = b->last - 1;
+                    break;
+                }
+                p = m;
+                ch = *p;
+            }
+
             if (ch == CR) {
                 r->val_end = p;
                 r->token = NULL;
 
-                val = array_push(&r->vals);
+                if (msg_kv_get(r) == NULL) {
+                    goto enomem;
+                }
+                val = array_push(&r->kv->vals);
+                if (val == NULL) {
+                    goto enomem;
+                }
                 val->len = r->val_end - r->val_start;
                 val->data = r->val_start;
 
@@ -1199,7 +1459,9 @@ memcache_parse_rsp(struct msg *r)
                 /* vlen_end <- p - 1 */
                 p = p - 1; /* go back by 1 byte */
                 r->token = NULL;
-                if (ch == ' ') {
+                if (r->type == MSG_RSP_MC_VA) {
+                    state = SW_META_FLAGS;
+                } else if (ch == ' ') {
                     state = SW_SPACES_BEFORE_CAS;
                 } else {
                     state = SW_RUNTO_CRLF;
@@ -1277,6 +1539,7 @@ memcache_parse_rsp(struct msg *r)
             switch (ch) {
             case LF:
                 /* val_start <- p + 1 */
+                r->rlen = r->vlen;
                 state = SW_VAL;
                 break;
 
@@ -1290,19 +1553,23 @@ memcache_parse_rsp(struct msg *r)
             if (r->val_start == NULL) {
                 r->val_start = p;
             }
-            m = p + r->vlen;
+            /* length-jump over the data block, see memcache_parse_req */
+            m = p + r->rlen;
             if (m >= b->last) {
-                ASSERT(r->vlen >= (uint32_t)(b->last - p));
-                r->vlen -= (uint32_t)(b->last - p);
+                ASSERT(r->rlen >= (uint32_t)(b->last - p));
+                r->rlen -= (uint32_t)(b->last - p);
                 m = b->last - 1;
-                p = m; /* move forward by vlen bytes */
+                p = m; /* move forward by rlen bytes */
                 break;
             }
             switch (*m) {
             case CR:
-                /* val_end <- p - 1 */
-                r->val_end = p - 1;
-                p = m; /* move forward by vlen bytes */
+                /* val_end <- m */
+                if (r->val_end == NULL) {
+                    r->val_end = m;
+                }
+                p = m; /* move forward by rlen bytes */
+                r->rlen = 0;
                 state = SW_VAL_LF;
                 break;
 
@@ -1315,7 +1582,10 @@ memcache_parse_rsp(struct msg *r)
         case SW_VAL_LF:
             switch (ch) {
             case LF:
-                if (r->type != MSG_RSP_MC_STATS) {
+                if (r->type == MSG_RSP_MC_VA) {
+                    /* meta value carries no END marker */
+                    goto done;
+                } else if (r->type != MSG_RSP_MC_STATS) {
                     state = SW_END;
                 } else {
                     state = SW_RSP_STR;
@@ -1356,6 +1626,16 @@ memcache_parse_rsp(struct msg *r)
             break;
 
         case SW_RUNTO_CRLF:
+            if (ch != CR) {
+                m = nc_strchr2(p + 1, b->last, CR, CR);
+                if (m == NULL) {
+                    p = b->last - 1;
+                    break;
+                }
+                p = m;
+                ch = *p;
+            }
+
             switch (ch) {
             case CR:
                 if (r->type == MSG_RSP_MC_VALUE) {
@@ -1372,6 +1652,57 @@ memcache_parse_rsp(struct msg *r)
 
             break;
 
+        case SW_META_FLAGS:
+            switch (ch) {
+            case ' ':
+                break;
+
+            case CR:
+                if (r->type == MSG_RSP_MC_VA) {
+                    state = SW_RUNTO_VAL;
+                } else {
+                    state = SW_ALMOST_DONE;
+                }
+                break;
+
+            default:
+                /* flag_start <- p */
+                r->token = p;
+                state = SW_META_FLAG;
+            }
+
+            break;
+
+        case SW_META_FLAG:
+            if (ch == ' ' || ch == CR) {
+                /* flag_end <- p - 1 */
+                m = r->token;
+                r->token = NULL;
+
+                /* remember client flags and ttl, a warmup needs both */
+                switch (*m) {
+                case 'f':
+                    r->flags_start = m + 1;
+                    r->flags_end = p;
+                    break;
+
+                case 't':
+                    /* 't-1' means the item never expires */
+                    num = nc_atoi(m + 1, (p - m - 1));
+                    r->expire = num > 0 ? (uint32_t)num : 0;
+                    r->ttl = 1;
+                    break;
+
+                default:
+                    break;
+                }
+
+                p = p - 1; /* go back by 1 byte */
+                state = SW_META_FLAGS;
+            }
+
+            break;
+
         case SW_CRLF:
             switch (ch) {
             case ' ':
@@ -1437,6 +1768,15 @@ done:
                 r->state, r->pos - b->pos, b->last - b->pos);
     return;
 
+enomem:
+    r->result = MSG_PARSE_ERROR;
+    r->state = state;
+    errno = ENOMEM;
+
+    log_error("parsed rsp %"PRIu64" of type %d: %s", r->id, r->type,
+              strerror(errno));
+    return;
+
 error:
     r->result = MSG_PARSE_ERROR;
     r->state = state;
@@ -1609,6 +1949,72 @@ memcache_build_probe(struct msg *r)
     return NC_OK;
 }
 
+/*
+ * Build the local reply to a request that is never forwarded. The only
+ * such request is the meta no-op 'mn', which memcached answers with 'MN'
+ * once every reply queued before it has been sent; replies on a client
+ * connection already go out in request order, so answering it right away
+ * keeps that guarantee.
+ */
+rstatus_t
+memcache_reply(struct msg *r)
+{
+    struct msg *response = r->peer;
+    struct mbuf *mbuf;
+    size_t msglen;
+
+    ASSERT(r->type == MSG_REQ_MC_MN);
+    ASSERT(response != NULL && STAILQ_EMPTY(&response->mhdr));
+
+    mbuf = mbuf_get();
+    if (mbuf == NULL) {
+        return NC_ENOMEM;
+    }
+    mbuf_insert(&response->mhdr, mbuf);
+
+    msglen = sizeof(MEMCACHE_MN_MESSAGE) - 1;
+    ASSERT(mbuf_size(mbuf) >= msglen);
+
+    mbuf_copy(mbuf, (uint8_t *)MEMCACHE_MN_MESSAGE, msglen);
+    response->mlen += (uint32_t)msglen;
+    response->type = MSG_RSP_MC_MN;
+
+    return NC_OK;
+}
+
+/*
+ * Role of r with respect to the near cache: single key retrievals and the
+ * values they return can be cached, writes invalidate their key. 'gets'
+ * and 'mg' are left out, as their responses vary with the server state
+ * (cas unique) or the request flags
+ */
+msg_cache_t
+memcache_cacheable(struct msg *r)
+{
+    switch (r->type) {
+    case MSG_REQ_MC_GET:
+    case MSG_REQ_MC_GETEX:
+    case MSG_RSP_MC_VALUE:
+        return MSG_CACHE_READ;
+
+    case MSG_REQ_MC_SET:
+    case MSG_REQ_MC_ADD:
+    case MSG_REQ_MC_REPLACE:
+    case MSG_REQ_MC_APPEND:
+    case MSG_REQ_MC_PREPEND:
+    case MSG_REQ_MC_CAS:
+    case MSG_REQ_MC_DELETE:
+    case MSG_REQ_MC_INCR:
+    case MSG_REQ_MC_DECR:
+    case MSG_REQ_MC_MS:
+    case MSG_REQ_MC_MD:
+        return MSG_CACHE_WRITE;
+
+    default:
+        return MSG_CACHE_NONE;
+    }
+}
+
 static void
 memcache_handle_probe(struct msg *req, struct msg *rsp)
 {
@@ -1617,22 +2023,38 @@ memcache_handle_probe(struct msg *req, struct msg *rsp)
     struct array *keys, *vals;
     struct server *server;
     struct memcache_stats *stats;
-    uint32_t i, nkey;
+    struct warmup *wu;
+    uint32_t i, nkey, cold;
 
-    ASSERT(array_n(&rsp->keys) == array_n(&rsp->vals));
     ASSERT(rsp->owner->owner != NULL);
-    
-    keys = &rsp->keys;
-    vals = &rsp->vals;
-    nkey = array_n(&rsp->keys);
+
+    if (rsp->kv == NULL) {
+        return;
+    }
+
+    keys = &rsp->kv->keys;
+    vals = &rsp->kv->vals;
+    ASSERT(array_n(keys) == array_n(vals));
+    nkey = array_n(keys);
     server = rsp->owner->owner;
     stats = server->stats;
+    cold = stats->cold;
 
     for (i = 0; i < nkey; i++) {
         key = array_get(keys, i);
         val = array_get(vals, i);
         status = memcache_update_stat(stats, key, val);
     }
+
+    /* A server turning cold is warmed up in bulk from the key log */
+    wu = server->owner->warmup;
+    if (wu != NULL && stats->cold != cold) {
+        if (stats->cold) {
+            warmup_start(wu, server);
+        } else {
+            warmup_stop(wu, server);
+        }
+    }
 }       
 
 struct memcache_stats *
@@ -1674,6 +2096,12 @@ memcache_need_warmup(struct msg *req, struct msg *rsp)
         return true;
     }
 
+    /* mg hit that returned both client flags and ttl ('mg <key> f t v') */
+    if (req->type == MSG_REQ_MC_MG && rsp->type == MSG_RSP_MC_VA &&
+        rsp->flags_start != NULL && rsp->ttl) {
+        return true;
+    }
+
     return false;
 }
 
@@ -1686,27 +2114,35 @@ memcache_need_warmup(struct msg *req, struct msg *rsp)
    <data block>\r\n
    END\r\n
 
+   Warmup request, which never overwrites a value written since:
+   add <key> <flags> <exptime> <bytes> noreply\r\n
+   <data block>\r\n
+
+   For a pool with memcache_meta, the request is 'mg <key> f t v' and:
+
+   Response:
+   VA <bytes> f<flags> t<ttl>\r\n
+   <data block>\r\n
+
    Warmup request:
-   set <key> <flags> <exptime> <bytes> noreply\r\n
+   ms <key> <bytes> F<flags> T<exptime> ME\r\n
    <data block>\r\n
  */
 static struct msg *
-memcache_build_warmup(struct msg *req, struct msg *rsp)
+memcache_build_warmup(struct server_pool *pool, struct msg *req,
+                      struct msg *rsp)
 {
     struct msg *msg;
-    struct conn *conn;
     struct mbuf *src, *dst;
     int n;
     uint32_t remain, length, msize, mlen;
     uint8_t *pos;
     
-    ASSERT(rsp->key_start && rsp->key_end);
+    ASSERT(req->key_start && req->key_end);
     ASSERT(rsp->flags_start && rsp->flags_end);
     ASSERT(rsp->vlen > 0);
-    
-    conn = req->owner;
 
-    msg = msg_get(NULL, true, conn->redis);
+    msg = msg_get(NULL, true, false);
     if (msg == NULL) {
         return NULL;
     }
@@ -1720,53 +2156,187 @@ memcache_build_warmup(struct msg *req, struct msg *rsp)
 
     msize = mbuf_size(dst);
     /* Write command line */
-    n = nc_scnprintf(dst->last, msize, "set %.*s %.*s %d %d noreply\r\n",
-                     (int)(rsp->key_end - rsp->key_start), rsp->key_start,
-                     (int)(rsp->flags_end - rsp->flags_start), rsp->flags_start,
-                     rsp->expire,
-                     rsp->vlen);
+    if (pool->memcache_meta) {
+        n = nc_scnprintf(dst->last, msize, "ms %.*s %d F%.*s T%d ME\r\n",
+                         (int)(req->key_end - req->key_start), req->key_start,
+                         rsp->vlen,
+                         (int)(rsp->flags_end - rsp->flags_start),
+                         rsp->flags_start,
+                         rsp->expire);
+    } else {
+        n = nc_scnprintf(dst->last, msize, "add %.*s %.*s %d %d noreply\r\n",
+                         (int)(req->key_end - req->key_start), req->key_start,
+                         (int)(rsp->flags_end - rsp->flags_start),
+                         rsp->flags_start,
+                         rsp->expire,
+                         rsp->vlen);
+    }
     dst->last += n;
     ASSERT(dst->last <= dst->end);
     mlen = n;
     
     remain = rsp->vlen + 2;     /* <data block>\r\n */
+    pos = NULL;
     STAILQ_FOREACH(src, &rsp->mhdr, next) {
-        /* Copy value from each source mbuf */
-        if (rsp->val_start >= src->pos && rsp->val_start < src->last) {
+        /* Share value from each source mbuf, starting at the one holding
+         * val_start; earlier mbufs only carry the VALUE header */
+        if (pos == NULL) {
+            if (rsp->val_start < src->pos || rsp->val_start >= src->last) {
+                continue;
+            }
             pos = rsp->val_start;
         } else {
             pos = src->pos;
         }
-        length = (uint32_t)(src->last - pos);
-        mlen += length;
-        while (length > 0 && remain > 0) {
-            if (mbuf_full(dst)) {
-                dst = mbuf_get();
-                if (dst == NULL) {
-                    msg_put(msg);
-                    return NULL;
-                }
-                mbuf_insert(&msg->mhdr, dst);
-            }
+        length = MIN((uint32_t)(src->last - pos), remain);
+        if (length == 0) {
+            continue;
+        }
 
-            n = MIN(MIN(length, mbuf_size(dst)), remain);
-            mbuf_copy(dst, pos, n);
-            pos += n;
-            length -= n;
-            remain -= n;
+        if (mbuf_share(&msg->mhdr, src, pos, length) == NULL) {
+            msg_put(msg);
+            return NULL;
+        }
+        remain -= length;
+        mlen += length;
+        if (remain == 0) {
+            break;
         }
     }
     msg->mlen = mlen;
-    msg->noreply = 1;
-    
+
+    /*
+     * A quiet ms still gets its failures back, so ask for every reply and
+     * swallow it rather than have a stray one desync the connection
+     */
+    if (pool->memcache_meta) {
+        msg->type = MSG_REQ_MC_MS;
+        msg->swallow = 1;
+    } else {
+        msg->type = MSG_REQ_MC_ADD;
+        msg->noreply = 1;
+    }
+
     return msg;
 }
 
+static rstatus_t
+memcache_fetch_pre_swallow(struct context *ctx, struct conn *conn,
+                           struct msg *rsp)
+{
+    struct msg *req, *msg;
+    struct warmup_job *job;
+    struct conn *s_conn;
+
+    req = rsp->peer;
+    job = req->warmup_job;
+
+    ASSERT(req->owner == NULL && job != NULL);
+
+    if (job->stop || !memcache_need_warmup(req, rsp)) {
+        return NC_OK;
+    }
+
+    s_conn = server_conn_connect(ctx, job->server);
+    if (s_conn == NULL) {
+        return NC_OK;
+    }
+
+    msg = memcache_build_warmup(job->server->owner, req, rsp);
+    if (msg == NULL) {
+        return NC_OK;
+    }
+
+    warmup_bulk_send(ctx, job, s_conn, msg);
+
+    return NC_OK;
+}
+
+static void
+memcache_fetch_pre_req_put(struct msg *msg)
+{
+    /* Only handle the bulk warmup fetch request */
+    ASSERT(msg->owner == NULL && msg->warmup_job != NULL);
+    ASSERT(msg->warmup_job->nflight > 0);
+
+    msg->warmup_job->nflight--;
+}
+
+static const struct msg_hooks memcache_fetch_hooks = {
+    memcache_fetch_pre_swallow, /* pre_swallow */
+    memcache_fetch_pre_req_put, /* pre_req_put */
+};
+
+/*
+ * Fetch key from the peer pool of pool with a getex, so that the bulk
+ * warmup job can write its value to the cold server of the job
+ */
+rstatus_t
+memcache_warmup_fetch(struct context *ctx, struct server_pool *pool,
+                      struct warmup_job *job, uint8_t *key, uint32_t keylen)
+{
+    rstatus_t status;
+    struct server_pool *peer;
+    struct string rkey;
+    struct conn *conn;
+    struct msg *msg;
+    struct mbuf *mbuf;
+    int n;
+
+    peer = pool->peer;
+    ASSERT(peer != NULL);
+    ASSERT(keylen <= MEMCACHE_MAX_KEY_LENGTH);
+
+    rkey = req_route_key(&peer->hash_tag, key, key + keylen);
+    conn = server_pool_conn(ctx, peer, rkey.data, rkey.len);
+    if (conn == NULL || memcache_cold(conn)) {
+        return NC_ERROR;
+    }
+
+    msg = msg_get(NULL, true, false);
+    if (msg == NULL) {
+        return NC_ENOMEM;
+    }
+
+    mbuf = mbuf_get();
+    if (mbuf == NULL) {
+        msg_put(msg);
+        return NC_ENOMEM;
+    }
+    mbuf_insert(&msg->mhdr, mbuf);
+
+    n = nc_scnprintf(mbuf->last, mbuf_size(mbuf), "getex %.*s\r\n",
+                     (int)keylen, key);
+    msg->key_start = mbuf->last + sizeof("getex ") - 1;
+    msg->key_end = msg->key_start + keylen;
+    mbuf->last += n;
+    msg->mlen = (uint32_t)n;
+    msg->type = MSG_REQ_MC_GETEX;
+
+    /* Write the value to the cold server and swallow the response */
+    msg->owner = NULL;          /* Special message */
+    msg->warmup_job = job;
+    msg->hooks = &memcache_fetch_hooks;
+    msg->swallow = 1;
+    job->nflight++;
+
+    status = req_enqueue(ctx, conn, msg);
+    if (status != NC_OK) {
+        req_put(msg);
+        return status;
+    }
+
+    stats_server_incr(ctx, job->server, warmup_fetches);
+
+    return NC_OK;
+}
+
 static char *
 memcache_type_string(msg_type_t type)
 {
     switch (type) {
     case MSG_REQ_MC_DELETE:
+    case MSG_REQ_MC_MD:
         return "delete";
     default:
         return NULL;
@@ -1782,8 +2352,8 @@ memcache_build_notify(struct msg *req)
     struct mbuf *mbuf;
     char *cmd;
     int n;
-    int64_t now;
-    char time_buffer[21];
+    uint8_t list[NOTIFY_MAX_LEN], value[NOTIFY_MAX_LEN];
+    uint32_t nlist, nvalue;
 
     c_conn = req->owner;
     pool = c_conn->owner;
@@ -1791,6 +2361,16 @@ memcache_build_notify(struct msg *req)
 
     ASSERT(c_conn != NULL && pool != NULL && cmd != NULL);
 
+    /* queue ns->ns regular todo */
+    nlist = notify_list(pool, list, sizeof(list));
+    /* timestamp from cmd req_key */
+    nvalue = notify_value(pool, cmd, req->key_start,
+                          (uint32_t)(req->key_end - req->key_start),
+                          value, sizeof(value));
+    if (nlist == 0 || nvalue == 0) {
+        return NULL;
+    }
+
     msg = msg_get(NULL, true, c_conn->redis);
     if (msg == NULL) {
         return NULL;
@@ -1803,28 +2383,19 @@ memcache_build_notify(struct msg *req)
     }
     mbuf_insert(&msg->mhdr, mbuf);
 
-    now = nc_msec_now() / 1000;
-    n = nc_scnprintf(time_buffer, sizeof(time_buffer), "%lld", now);
-    ASSERT(n < sizeof(time_buffer));
-
-    const char MQ_PREFIX[] = "queue";
-    const char MQ_KIND[] = "regular";
-    const char MQ_STATE[] = "todo";
-    n = nc_scnprintf(mbuf->last, mbuf_size(mbuf), 
+    n = nc_scnprintf(mbuf->last, mbuf_size(mbuf),
                      "*3\r\n"
                      "$5\r\n"
                      "LPUSH\r\n"
-                     "$%d\r\n"
-                     "%s %.*s->%.*s %s %s\r\n" /* queue ns->ns regular todo */
-                     "$%d\r\n"
-                     "%s %.*s %s %.*s\r\n", /* "timestamp from cmd req_key" */
-                     sizeof(MQ_PREFIX) + pool->namespace.len * 2 + 2 + sizeof(MQ_KIND) + sizeof(MQ_STATE),
-                     MQ_PREFIX, pool->namespace.len, pool->namespace.data, pool->namespace.len, pool->namespace.data, MQ_KIND, MQ_STATE,
-                     n + 1 + pool->name.len + 1 + strlen(cmd) + 1 + (req->key_end - req->key_start),
-                     time_buffer,
-                     pool->name.len, pool->name.data,
-                     cmd, 
-                     req->key_end - req->key_start, req->key_start);
+                     "$%"PRIu32"\r\n"
+                     "%.*s\r\n"
+                     "$%"PRIu32"\r\n"
+                     "%.*s\r\n",
+                     nlist, nlist, list, nvalue, nvalue, value);
+    if ((size_t)n >= mbuf_size(mbuf) - 1) {
+        msg_put(msg);
+        return NULL;
+    }
     log_debug(LOG_VERB, "notify: %.*s", n, mbuf->last);
     mbuf->last += n;
     ASSERT(mbuf->last <= mbuf->end);
@@ -1838,6 +2409,7 @@ memcache_pre_swallow(struct context *ctx, struct conn *s_conn, struct msg *rsp)
     rstatus_t status;
     struct msg *req, *owner;
     struct conn *conn;
+    struct server_pool *pool;
     
     req = rsp->peer;
     
@@ -1849,10 +2421,19 @@ memcache_pre_swallow(struct context *ctx, struct conn *s_conn, struct msg *rsp)
     ASSERT(owner && owner->waiting);
 
     conn = owner->owner;
+    pool = conn->owner;
 
     /* Clear the waiting status */
     owner->waiting = 0;
 
+    /* A queue that refused the push lost the notification, spill it too */
+    if (rsp->type == MSG_RSP_REDIS_ERROR && pool->notify != NULL &&
+        pool->notify->journal != NULL) {
+        notify_spill(ctx, pool->notify, memcache_type_string(owner->type),
+                     owner->key_start,
+                     (uint32_t)(owner->key_end - owner->key_start));
+    }
+
     if (req_done(conn, TAILQ_FIRST(&conn->omsg_q))) {
         status = event_add_out(ctx->evb, conn);
         if (status != NC_OK) {
@@ -1881,21 +2462,38 @@ memcache_pre_req_put(struct msg *msg)
     pool = conn->owner;
 
     owner->waiting = 0;
-    owner->error = msg->error;
-    owner->err = msg->err;
+
+    /* Spill the lost notification rather than fail the delete */
+    if (pool->notify != NULL && pool->notify->journal != NULL) {
+        notify_spill(pool->ctx, pool->notify,
+                     memcache_type_string(owner->type), owner->key_start,
+                     (uint32_t)(owner->key_end - owner->key_start));
+    } else {
+        owner->error = msg->error;
+        owner->err = msg->err;
+    }
 
     if (req_done(conn, TAILQ_FIRST(&conn->omsg_q))) {
         event_add_out(pool->ctx->evb, conn);
     }
 }
 
+static const struct msg_hooks memcache_notify_hooks = {
+    memcache_pre_swallow,       /* pre_swallow */
+    memcache_pre_req_put,       /* pre_req_put */
+};
+
 rstatus_t
 memcache_pre_req_forward(struct context *ctx, struct conn *c_conn, struct msg *msg)
 {
     rstatus_t status;
     struct server_pool *pool, *mq;
+    struct notify *nt;
     struct msg *n_msg;
     struct conn *conn;
+    char *cmd;
+    uint8_t *key;
+    uint32_t keylen;
 
     ASSERT(c_conn->client && !c_conn->proxy);
 
@@ -1910,13 +2508,34 @@ memcache_pre_req_forward(struct context *ctx, struct conn *c_conn, struct msg *m
         return NC_OK;
     }
 
-    conn = server_pool_conn(ctx, mq, msg->key_start,
-                            (uint32_t)(msg->key_end - msg->key_start));
+    nt = pool->notify;
+    cmd = memcache_type_string(msg->type);
+    key = msg->key_start;
+    keylen = (uint32_t)(msg->key_end - msg->key_start);
+
+    /* Queue up behind the notifications spilled to the journal */
+    if (nt != NULL && nt->journal != NULL && !journal_empty(nt->journal)) {
+        notify_spill(ctx, nt, cmd, key, keylen);
+        return NC_OK;
+    }
+
+    use_writable_pool(mq);
+    conn = server_pool_conn(ctx, mq, key, keylen);
     if (conn == NULL) {
+        if (nt != NULL && nt->journal != NULL) {
+            notify_spill(ctx, nt, cmd, key, keylen);
+            return NC_OK;
+        }
         log_error("failed to fetch mq connection for \"%.*s\"", 
                   pool->name.len, pool->name.data);
         return NC_ERROR;
     }
+
+    /* Batch the notification for the next tick, not waiting for it */
+    if (pool->notify_async) {
+        notify_add(ctx, nt, conn->owner, cmd, key, keylen);
+        return NC_OK;
+    }
     
     n_msg = memcache_build_notify(msg);
     if (n_msg == NULL) {
@@ -1931,8 +2550,7 @@ memcache_pre_req_forward(struct context *ctx, struct conn *c_conn, struct msg *m
     /* Handle the notification response and swallow it */
     n_msg->owner = NULL;        /* Special message */
     n_msg->notify_owner = msg;
-    n_msg->pre_swallow = memcache_pre_swallow;
-    n_msg->pre_req_put = memcache_pre_req_put;
+    n_msg->hooks = &memcache_notify_hooks;
     n_msg->swallow = 1;
 
     status = req_enqueue(ctx, conn, n_msg);
@@ -2027,7 +2645,8 @@ memcache_pre_rsp_forward(struct context *ctx, struct conn *s_conn, struct msg *m
     rstatus_t status;
     struct msg *pmsg;
     struct conn *c_conn;
-    struct server_pool *warmup_pool;
+    struct mbuf *mbuf;
+    struct server_pool *pool, *warmup_pool;
     struct string key;
     
     pmsg = msg->peer;           /* request */
@@ -2041,6 +2660,27 @@ memcache_pre_rsp_forward(struct context *ctx, struct conn *s_conn, struct msg *m
         req_put(pmsg);
         return NC_ERROR;
     }
+
+    /* The 'q' flag was stripped off the quiet request, so the server
+     * replied; drop what memcached itself would not have sent */
+    if (pmsg->quiet && memcache_quiet_rsp(pmsg, msg)) {
+        while (!STAILQ_EMPTY(&msg->mhdr)) {
+            mbuf = STAILQ_FIRST(&msg->mhdr);
+            mbuf_remove(&msg->mhdr, mbuf);
+            mbuf_put(mbuf);
+        }
+        msg->mlen = 0;
+        return NC_OK;
+    }
+
+    /* Log the keys of single key read hits for bulk warmups */
+    pool = c_conn->owner;
+    if (pool->warmup != NULL && pmsg->frag_id == 0 &&
+        pmsg->key_start != NULL &&
+        (memcache_value(msg) || msg->type == MSG_RSP_MC_VA)) {
+        warmup_log(pool->warmup, pmsg->key_start,
+                   (uint32_t)(pmsg->key_end - pmsg->key_start));
+    }
     
     /* If the request and response belong to different pools, either
      * we have a connection to be warmup up, or the response came from a
@@ -2055,15 +2695,30 @@ memcache_pre_rsp_forward(struct context *ctx, struct conn *s_conn, struct msg *m
         return NC_OK;
     }
 
-    msg = memcache_build_warmup(pmsg, msg);
-    if (msg == NULL) {
-        return NC_OK;
-    }
-
     /* pick a new connection */
     warmup_pool = c_conn->owner;
     key = req_build_key(&warmup_pool->hash_tag, pmsg);
     s_conn = server_pool_conn(ctx, warmup_pool, key.data, key.len);
+    if (s_conn == NULL) {
+        return NC_OK;
+    }
+
+    if (warmup_pool->warmup != NULL &&
+        !warmup_admit(warmup_pool->warmup, pmsg->key_start,
+                      (uint32_t)(pmsg->key_end - pmsg->key_start))) {
+        stats_server_incr(ctx, s_conn->owner, warmup_deduped);
+        return NC_OK;
+    }
+
+    msg = memcache_build_warmup(warmup_pool, pmsg, msg);
+    if (msg == NULL) {
+        return NC_OK;
+    }
+
+    if (warmup_pool->warmup != NULL) {
+        warmup_send(ctx, warmup_pool->warmup, s_conn, msg);
+        return NC_OK;
+    }
 
     status = req_enqueue(ctx, s_conn, msg);
     if (status != NC_OK) {
@@ -0,0 +1,710 @@
+/*
+ * twemproxy - A fast and lightweight proxy for memcached protocol.
+ * Copyright (C) 2011 Twitter, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <nc_core.h>
+#include <nc_proto.h>
+
+/*
+ * memcache binary protocol
+ *
+ * Every request and response is a fixed 24 byte header followed by a
+ * body of <extras><key><value>:
+ *
+ *   Byte/     0       |       1       |       2       |       3       |
+ *      /              |               |               |               |
+ *     |0 1 2 3 4 5 6 7|0 1 2 3 4 5 6 7|0 1 2 3 4 5 6 7|0 1 2 3 4 5 6 7|
+ *     +---------------+---------------+---------------+---------------+
+ *    0| Magic         | Opcode        | Key length                    |
+ *     +---------------+---------------+---------------+---------------+
+ *    4| Extras length | Data type     | vbucket id / status           |
+ *     +---------------+---------------+---------------+---------------+
+ *    8| Total body length                                             |
+ *     +---------------+---------------+---------------+---------------+
+ *   12| Opaque                                                        |
+ *     +---------------+---------------+---------------+---------------+
+ *   16| CAS                                                           |
+ *     |                                                               |
+ *     +---------------+---------------+---------------+---------------+
+ *
+ * The proxy never looks past the key: the header gives the body length,
+ * so the value is skipped in one step however many mbufs it spans.
+ *
+ * Quiet commands are sent upstream as their non-quiet twins, so every
+ * request forwarded to a server still gets exactly one response and the
+ * server in_q / out_q pairing holds. The responses a quiet command
+ * would not have produced are dropped on the way back. A run of quiet
+ * gets (GETQ / GETKQ) and the NOOP that closes it are parsed as the
+ * fragments of one request vector, and NOOP is answered by the proxy.
+ *
+ * The opaque of a forwarded request is replaced with the request id, so
+ * every response is checked against the request it is paired with, and
+ * the client's own opaque is put back before the response goes out.
+ */
+
+#define MEMCACHE_BINARY_HEADER_LEN  24
+#define MEMCACHE_BINARY_MAX_KEYLEN  250
+#define MEMCACHE_BINARY_MAX_EXTLEN  32
+
+#define MEMCACHE_BINARY_REQ_MAGIC   0x80
+#define MEMCACHE_BINARY_RSP_MAGIC   0x81
+
+#define MEMCACHE_BINARY_GET         0x00
+#define MEMCACHE_BINARY_SET         0x01
+#define MEMCACHE_BINARY_ADD         0x02
+#define MEMCACHE_BINARY_REPLACE     0x03
+#define MEMCACHE_BINARY_DELETE      0x04
+#define MEMCACHE_BINARY_INCREMENT   0x05
+#define MEMCACHE_BINARY_DECREMENT   0x06
+#define MEMCACHE_BINARY_QUIT        0x07
+#define MEMCACHE_BINARY_GETQ        0x09
+#define MEMCACHE_BINARY_NOOP        0x0a
+#define MEMCACHE_BINARY_GETK        0x0c
+#define MEMCACHE_BINARY_GETKQ       0x0d
+#define MEMCACHE_BINARY_APPEND      0x0e
+#define MEMCACHE_BINARY_PREPEND     0x0f
+#define MEMCACHE_BINARY_SETQ        0x11
+#define MEMCACHE_BINARY_ADDQ        0x12
+#define MEMCACHE_BINARY_REPLACEQ    0x13
+#define MEMCACHE_BINARY_DELETEQ     0x14
+#define MEMCACHE_BINARY_INCREMENTQ  0x15
+#define MEMCACHE_BINARY_DECREMENTQ  0x16
+#define MEMCACHE_BINARY_QUITQ       0x17
+#define MEMCACHE_BINARY_APPENDQ     0x19
+#define MEMCACHE_BINARY_PREPENDQ    0x1a
+
+#define MEMCACHE_BINARY_SUCCESS     0x0000
+#define MEMCACHE_BINARY_KEY_ENOENT  0x0001
+#define MEMCACHE_BINARY_KEY_EEXISTS 0x0002
+#define MEMCACHE_BINARY_NOT_STORED  0x0005
+#define MEMCACHE_BINARY_UNKNOWN_CMD 0x0081
+#define MEMCACHE_BINARY_ENOMEM      0x0082
+#define MEMCACHE_BINARY_TMPFAIL     0x0086
+
+#define memcache_binary_get16(_p)                                           \
+    (uint16_t)(((uint16_t)(_p)[0] << 8) | (uint16_t)(_p)[1])
+
+#define memcache_binary_get32(_p)                                           \
+    (((uint32_t)(_p)[0] << 24) | ((uint32_t)(_p)[1] << 16) |                \
+     ((uint32_t)(_p)[2] << 8) | (uint32_t)(_p)[3])
+
+/*
+ * Classify the request opcode. Return false for the opcodes the proxy
+ * does not support (flush, version, stat, ...), which are keyless and
+ * have no single server to go to.
+ */
+static bool
+memcache_binary_opcode(struct msg *r, uint8_t opcode, uint8_t *twin)
+{
+    uint8_t loud;
+
+    loud = opcode;
+
+    switch (opcode) {
+    case MEMCACHE_BINARY_GETQ:
+        loud = MEMCACHE_BINARY_GET;
+        /* fall through */
+    case MEMCACHE_BINARY_GET:
+        r->type = MSG_REQ_MC_GET;
+        break;
+
+    case MEMCACHE_BINARY_GETKQ:
+        loud = MEMCACHE_BINARY_GETK;
+        /* fall through */
+    case MEMCACHE_BINARY_GETK:
+        r->type = MSG_REQ_MC_GET;
+        break;
+
+    case MEMCACHE_BINARY_SETQ:
+        loud = MEMCACHE_BINARY_SET;
+        /* fall through */
+    case MEMCACHE_BINARY_SET:
+        r->type = MSG_REQ_MC_SET;
+        break;
+
+    case MEMCACHE_BINARY_ADDQ:
+        loud = MEMCACHE_BINARY_ADD;
+        /* fall through */
+    case MEMCACHE_BINARY_ADD:
+        r->type = MSG_REQ_MC_ADD;
+        break;
+
+    case MEMCACHE_BINARY_REPLACEQ:
+        loud = MEMCACHE_BINARY_REPLACE;
+        /* fall through */
+    case MEMCACHE_BINARY_REPLACE:
+        r->type = MSG_REQ_MC_REPLACE;
+        break;
+
+    case MEMCACHE_BINARY_APPENDQ:
+        loud = MEMCACHE_BINARY_APPEND;
+        /* fall through */
+    case MEMCACHE_BINARY_APPEND:
+        r->type = MSG_REQ_MC_APPEND;
+        break;
+
+    case MEMCACHE_BINARY_PREPENDQ:
+        loud = MEMCACHE_BINARY_PREPEND;
+        /* fall through */
+    case MEMCACHE_BINARY_PREPEND:
+        r->type = MSG_REQ_MC_PREPEND;
+        break;
+
+    case MEMCACHE_BINARY_DELETEQ:
+        loud = MEMCACHE_BINARY_DELETE;
+        /* fall through */
+    case MEMCACHE_BINARY_DELETE:
+        r->type = MSG_REQ_MC_DELETE;
+        break;
+
+    case MEMCACHE_BINARY_INCREMENTQ:
+        loud = MEMCACHE_BINARY_INCREMENT;
+        /* fall through */
+    case MEMCACHE_BINARY_INCREMENT:
+        r->type = MSG_REQ_MC_INCR;
+        break;
+
+    case MEMCACHE_BINARY_DECREMENTQ:
+        loud = MEMCACHE_BINARY_DECREMENT;
+        /* fall through */
+    case MEMCACHE_BINARY_DECREMENT:
+        r->type = MSG_REQ_MC_DECR;
+        break;
+
+    case MEMCACHE_BINARY_QUITQ:
+    case MEMCACHE_BINARY_QUIT:
+        /* passive close, never forwarded */
+        r->type = MSG_REQ_MC_QUIT;
+        r->quit = 1;
+        r->opcode = opcode;
+        *twin = opcode;
+        return true;
+
+    case MEMCACHE_BINARY_NOOP:
+        r->type = MSG_REQ_MC_MN;
+        r->noforward = 1;
+        break;
+
+    default:
+        return false;
+    }
+
+    r->opcode = opcode;
+    r->quiet = (loud != opcode) ? 1 : 0;
+    *twin = loud;
+
+    return true;
+}
+
+/*
+ * Return true, if the request header starting at p may continue a quiet
+ * multiget vector
+ */
+static bool
+memcache_binary_batched(uint8_t *p)
+{
+    if (p[0] != MEMCACHE_BINARY_REQ_MAGIC) {
+        return false;
+    }
+
+    switch (p[1]) {
+    case MEMCACHE_BINARY_GETQ:
+    case MEMCACHE_BINARY_GETKQ:
+    case MEMCACHE_BINARY_NOOP:
+        return true;
+
+    default:
+        break;
+    }
+
+    return false;
+}
+
+static void
+memcache_binary_write_header(uint8_t *p, uint8_t opcode, uint16_t status,
+                             uint32_t bodylen, uint32_t opaque)
+{
+    memset(p, 0, MEMCACHE_BINARY_HEADER_LEN);
+
+    p[0] = MEMCACHE_BINARY_RSP_MAGIC;
+    p[1] = opcode;
+    p[6] = (uint8_t)(status >> 8);
+    p[7] = (uint8_t)status;
+    p[8] = (uint8_t)(bodylen >> 24);
+    p[9] = (uint8_t)(bodylen >> 16);
+    p[10] = (uint8_t)(bodylen >> 8);
+    p[11] = (uint8_t)bodylen;
+    nc_memcpy(p + 12, &opaque, sizeof(opaque));
+}
+
+void
+memcache_binary_parse_req(struct msg *r)
+{
+    struct mbuf *b;
+    uint8_t *p;
+    uint32_t keylen, extlen, bodylen, id, n;
+    uint8_t loud;
+    enum {
+        SW_START,
+        SW_BODY,
+        SW_SENTINEL
+    } state;
+
+    state = r->state;
+    b = STAILQ_LAST(&r->mhdr, mbuf, next);
+
+    ASSERT(r->request);
+    ASSERT(!r->redis);
+    ASSERT(state >= SW_START && state < SW_SENTINEL);
+    ASSERT(b != NULL);
+    ASSERT(b->pos <= b->last);
+
+    /* validate the parsing marker */
+    ASSERT(r->pos != NULL);
+    ASSERT(r->pos >= b->pos && r->pos <= b->last);
+
+    p = r->pos;
+
+    switch (state) {
+    case SW_START:
+        if (b->last - p < MEMCACHE_BINARY_HEADER_LEN) {
+            goto again;
+        }
+
+        if (p[0] != MEMCACHE_BINARY_REQ_MAGIC) {
+            goto error;
+        }
+
+        keylen = memcache_binary_get16(p + 2);
+        extlen = p[4];
+        bodylen = memcache_binary_get32(p + 8);
+
+        if (keylen > MEMCACHE_BINARY_MAX_KEYLEN ||
+            extlen > MEMCACHE_BINARY_MAX_EXTLEN ||
+            keylen + extlen > bodylen) {
+            goto error;
+        }
+
+        /* extras and key must be in one piece for routing */
+        if (b->last - p < MEMCACHE_BINARY_HEADER_LEN + extlen + keylen) {
+            goto again;
+        }
+
+        if (!memcache_binary_opcode(r, p[1], &loud)) {
+            goto error;
+        }
+
+        if (keylen == 0 && !r->quit && !r->noforward) {
+            goto error;
+        }
+
+        r->key_start = p + MEMCACHE_BINARY_HEADER_LEN + extlen;
+        r->key_end = r->key_start + keylen;
+        r->vlen = bodylen - extlen - keylen;
+
+        /* upstream sees the non-quiet twin carrying our request id */
+        nc_memcpy(&r->opaque, p + 12, sizeof(r->opaque));
+        id = (uint32_t)r->id;
+        nc_memcpy(p + 12, &id, sizeof(id));
+        p[1] = loud;
+
+        p += MEMCACHE_BINARY_HEADER_LEN;
+        r->rlen = bodylen;
+        state = SW_BODY;
+
+        /* fall through */
+
+    case SW_BODY:
+        n = MIN(r->rlen, (uint32_t)(b->last - p));
+        p += n;
+        r->rlen -= n;
+        if (r->rlen > 0) {
+            goto again;
+        }
+
+        goto done;
+
+    default:
+        NOT_REACHED();
+        break;
+    }
+
+again:
+    r->pos = p;
+    r->state = state;
+
+    if (state == SW_START && b->last == b->end) {
+        r->result = MSG_PARSE_REPAIR;
+    } else {
+        r->result = MSG_PARSE_AGAIN;
+    }
+
+    log_hexdump(LOG_VERB, b->pos, mbuf_length(b), "parsed req %"PRIu64" res %d "
+                "type %d state %d rpos %d of %d", r->id, r->result, r->type,
+                r->state, r->pos - b->pos, b->last - b->pos);
+    return;
+
+done:
+    ASSERT(r->type > MSG_UNKNOWN && r->type < MSG_SENTINEL);
+    r->pos = p;
+    r->state = SW_START;
+
+    /*
+     * A quiet get followed by more of the same (or the closing NOOP) in
+     * the same read is a multiget vector; split it into fragments
+     */
+    if (r->quiet && r->type == MSG_REQ_MC_GET && b->last - p >= 2 &&
+        memcache_binary_batched(p)) {
+        r->result = MSG_PARSE_FRAGMENT;
+    } else {
+        r->result = MSG_PARSE_OK;
+    }
+
+    log_hexdump(LOG_VERB, b->pos, mbuf_length(b), "parsed req %"PRIu64" res %d "
+                "type %d state %d rpos %d of %d", r->id, r->result, r->type,
+                r->state, r->pos - b->pos, b->last - b->pos);
+    return;
+
+error:
+    r->result = MSG_PARSE_ERROR;
+    r->state = state;
+    errno = EINVAL;
+
+    log_hexdump(LOG_INFO, b->pos, mbuf_length(b), "parsed bad req %"PRIu64" "
+                "res %d type %d state %d", r->id, r->result, r->type,
+                r->state);
+}
+
+static msg_type_t
+memcache_binary_rsp_type(uint8_t opcode, uint16_t status)
+{
+    switch (status) {
+    case MEMCACHE_BINARY_SUCCESS:
+        break;
+
+    case MEMCACHE_BINARY_KEY_ENOENT:
+        if (opcode == MEMCACHE_BINARY_GET || opcode == MEMCACHE_BINARY_GETK) {
+            return MSG_RSP_MC_END;
+        }
+        return MSG_RSP_MC_NOT_FOUND;
+
+    case MEMCACHE_BINARY_KEY_EEXISTS:
+        return MSG_RSP_MC_EXISTS;
+
+    case MEMCACHE_BINARY_NOT_STORED:
+        return MSG_RSP_MC_NOT_STORED;
+
+    case MEMCACHE_BINARY_UNKNOWN_CMD:
+        return MSG_RSP_MC_ERROR;
+
+    default:
+        return status < 0x0080 ? MSG_RSP_MC_CLIENT_ERROR :
+                                 MSG_RSP_MC_SERVER_ERROR;
+    }
+
+    switch (opcode) {
+    case MEMCACHE_BINARY_GET:
+    case MEMCACHE_BINARY_GETK:
+        return MSG_RSP_MC_VALUE;
+
+    case MEMCACHE_BINARY_DELETE:
+        return MSG_RSP_MC_DELETED;
+
+    case MEMCACHE_BINARY_INCREMENT:
+    case MEMCACHE_BINARY_DECREMENT:
+        return MSG_RSP_MC_NUM;
+
+    default:
+        break;
+    }
+
+    return MSG_RSP_MC_STORED;
+}
+
+void
+memcache_binary_parse_rsp(struct msg *r)
+{
+    struct mbuf *b;
+    uint8_t *p;
+    uint32_t n;
+    enum {
+        SW_START,
+        SW_BODY,
+        SW_SENTINEL
+    } state;
+
+    state = r->state;
+    b = STAILQ_LAST(&r->mhdr, mbuf, next);
+
+    ASSERT(!r->request);
+    ASSERT(!r->redis);
+    ASSERT(state >= SW_START && state < SW_SENTINEL);
+    ASSERT(b != NULL);
+    ASSERT(b->pos <= b->last);
+
+    /* validate the parsing marker */
+    ASSERT(r->pos != NULL);
+    ASSERT(r->pos >= b->pos && r->pos <= b->last);
+
+    p = r->pos;
+
+    switch (state) {
+    case SW_START:
+        if (b->last - p < MEMCACHE_BINARY_HEADER_LEN) {
+            goto again;
+        }
+
+        if (p[0] != MEMCACHE_BINARY_RSP_MAGIC) {
+            goto error;
+        }
+
+        r->opcode = p[1];
+        r->type = memcache_binary_rsp_type(p[1], memcache_binary_get16(p + 6));
+        nc_memcpy(&r->opaque, p + 12, sizeof(r->opaque));
+        r->rlen = memcache_binary_get32(p + 8);
+        r->vlen = r->rlen;
+
+        p += MEMCACHE_BINARY_HEADER_LEN;
+        state = SW_BODY;
+
+        /* fall through */
+
+    case SW_BODY:
+        n = MIN(r->rlen, (uint32_t)(b->last - p));
+        p += n;
+        r->rlen -= n;
+        if (r->rlen > 0) {
+            goto again;
+        }
+
+        goto done;
+
+    default:
+        NOT_REACHED();
+        break;
+    }
+
+again:
+    r->pos = p;
+    r->state = state;
+
+    if (state == SW_START && b->last == b->end) {
+        r->result = MSG_PARSE_REPAIR;
+    } else {
+        r->result = MSG_PARSE_AGAIN;
+    }
+
+    log_hexdump(LOG_VERB, b->pos, mbuf_length(b), "parsed rsp %"PRIu64" res %d "
+                "type %d state %d rpos %d of %d", r->id, r->result, r->type,
+                r->state, r->pos - b->pos, b->last - b->pos);
+    return;
+
+done:
+    r->pos = p;
+    r->state = SW_START;
+    r->result = MSG_PARSE_OK;
+
+    log_hexdump(LOG_VERB, b->pos, mbuf_length(b), "parsed rsp %"PRIu64" res %d "
+                "type %d state %d rpos %d of %d", r->id, r->result, r->type,
+                r->state, r->pos - b->pos, b->last - b->pos);
+    return;
+
+error:
+    r->result = MSG_PARSE_ERROR;
+    r->state = state;
+    errno = EINVAL;
+
+    log_hexdump(LOG_INFO, b->pos, mbuf_length(b), "parsed bad rsp %"PRIu64" "
+                "res %d type %d state %d", r->id, r->result, r->type,
+                r->state);
+}
+
+/*
+ * Fragments of a binary multiget are whole packets, so there is nothing
+ * to patch up when splitting them
+ */
+rstatus_t
+memcache_binary_post_splitcopy(struct msg *r)
+{
+    return NC_OK;
+}
+
+/*
+ * Return true, if the response to the quiet request is one the server
+ * would not have sent: a miss for a quiet get, a success otherwise
+ */
+static bool
+memcache_binary_quiet_rsp(struct msg *req, struct msg *rsp)
+{
+    ASSERT(req->quiet);
+
+    switch (rsp->type) {
+    case MSG_RSP_MC_END:
+        return req->type == MSG_REQ_MC_GET;
+
+    case MSG_RSP_MC_STORED:
+    case MSG_RSP_MC_DELETED:
+    case MSG_RSP_MC_NUM:
+        return true;
+
+    default:
+        break;
+    }
+
+    return false;
+}
+
+/*
+ * Pre-coalesce handler is invoked for every binary response, fragment
+ * of a quiet multiget or not. It pairs the response with its request
+ * through the opaque, drops the responses a quiet request must not see
+ * and hands the client back its own opcode and opaque.
+ */
+void
+memcache_binary_pre_coalesce(struct msg *r)
+{
+    struct msg *pr = r->peer; /* peer request */
+    struct mbuf *mbuf, *hdr;
+
+    ASSERT(!r->request);
+    ASSERT(pr->request);
+
+    mbuf = STAILQ_FIRST(&r->mhdr);
+
+    if (r->opaque != (uint32_t)pr->id) {
+        log_hexdump(LOG_ERR, mbuf->pos, mbuf_length(mbuf), "rsp %"PRIu64" "
+                    "opaque does not match req %"PRIu64"", r->id, pr->id);
+        pr->error = 1;
+        pr->err = EINVAL;
+        return;
+    }
+
+    if (pr->quiet && memcache_binary_quiet_rsp(pr, r)) {
+        while (!STAILQ_EMPTY(&r->mhdr)) {
+            mbuf = STAILQ_FIRST(&r->mhdr);
+            mbuf_remove(&r->mhdr, mbuf);
+            mbuf_put(mbuf);
+        }
+        r->mlen = 0;
+        return;
+    }
+
+    ASSERT(mbuf_length(mbuf) >= MEMCACHE_BINARY_HEADER_LEN);
+
+    /*
+     * The header may be shared with the other copies of a collapsed
+     * response; rewrite a private copy of it then
+     */
+    if (mbuf->shared != NULL || mbuf->refcount > 1) {
+        hdr = mbuf_get();
+        if (hdr == NULL) {
+            pr->error = 1;
+            pr->err = ENOMEM;
+            return;
+        }
+        mbuf_copy(hdr, mbuf->pos, MEMCACHE_BINARY_HEADER_LEN);
+
+        mbuf->pos += MEMCACHE_BINARY_HEADER_LEN;
+        if (mbuf_empty(mbuf)) {
+            mbuf_remove(&r->mhdr, mbuf);
+            mbuf_put(mbuf);
+        }
+        STAILQ_INSERT_HEAD(&r->mhdr, hdr, next);
+        mbuf = hdr;
+    }
+
+    mbuf->pos[1] = pr->opcode;
+    nc_memcpy(mbuf->pos + 12, &pr->opaque, sizeof(pr->opaque));
+}
+
+void
+memcache_binary_post_coalesce(struct msg *r)
+{
+}
+
+/*
+ * Build the local reply to NOOP, which closes a quiet multiget. Replies
+ * on a client connection go out in request order, so by the time this
+ * one is sent every response to the gets before it has been sent
+ */
+rstatus_t
+memcache_binary_reply(struct msg *r)
+{
+    struct msg *response = r->peer;
+    struct mbuf *mbuf;
+
+    ASSERT(r->type == MSG_REQ_MC_MN);
+    ASSERT(response != NULL && STAILQ_EMPTY(&response->mhdr));
+
+    mbuf = mbuf_get();
+    if (mbuf == NULL) {
+        return NC_ENOMEM;
+    }
+    mbuf_insert(&response->mhdr, mbuf);
+
+    ASSERT(mbuf_size(mbuf) >= MEMCACHE_BINARY_HEADER_LEN);
+
+    memcache_binary_write_header(mbuf->last, r->opcode,
+                                 MEMCACHE_BINARY_SUCCESS, 0, r->opaque);
+    mbuf->last += MEMCACHE_BINARY_HEADER_LEN;
+    response->mlen = MEMCACHE_BINARY_HEADER_LEN;
+    response->type = MSG_RSP_MC_MN;
+
+    return NC_OK;
+}
+
+/*
+ * Build the error response to a binary request: the header echoes the
+ * client's opcode and opaque and the body carries the error string
+ */
+struct msg *
+memcache_binary_error(struct msg *req, err_t err)
+{
+    struct msg *msg;
+    struct mbuf *mbuf;
+    char *errstr = nc_strerror(err);
+    uint32_t n;
+    uint16_t status;
+
+    msg = msg_get(NULL, false, false);
+    if (msg == NULL) {
+        return NULL;
+    }
+
+    msg->type = MSG_RSP_MC_SERVER_ERROR;
+
+    mbuf = mbuf_get();
+    if (mbuf == NULL) {
+        msg_put(msg);
+        return NULL;
+    }
+    mbuf_insert(&msg->mhdr, mbuf);
+
+    n = (uint32_t)MIN(strlen(errstr),
+                      mbuf_size(mbuf) - MEMCACHE_BINARY_HEADER_LEN);
+    status = (err == ENOMEM) ? MEMCACHE_BINARY_ENOMEM : MEMCACHE_BINARY_TMPFAIL;
+
+    memcache_binary_write_header(mbuf->last, req->opcode, status, n,
+                                 req->opaque);
+    mbuf->last += MEMCACHE_BINARY_HEADER_LEN;
+    mbuf_copy(mbuf, (uint8_t *)errstr, n);
+    msg->mlen = MEMCACHE_BINARY_HEADER_LEN + n;
+
+    log_debug(LOG_VVERB, "get msg %p id %"PRIu64" len %"PRIu32" error '%s'",
+              msg, msg->id, msg->mlen, errstr);
+
+    return msg;
+}
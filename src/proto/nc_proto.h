@@ -156,12 +156,25 @@ rstatus_t memcache_pre_req_forward(struct context *, struct conn *, struct msg *
 rstatus_t memcache_pre_rsp_forward(struct context *, struct conn *, struct msg *);
 
 rstatus_t memcache_build_probe(struct msg *r);
+rstatus_t memcache_reply(struct msg *r);
+msg_cache_t memcache_cacheable(struct msg *r);
 
 struct memcache_stats *memcache_create_stats();
 void memcache_destroy_stats(struct memcache_stats *stats);
 
 struct conn *memcache_routing(struct context *ctx, struct server_pool *pool, struct msg *msg, struct string *key);
 rstatus_t memcache_post_routing(struct context *ctx, struct conn *conn, struct msg *msg);
+rstatus_t memcache_warmup_fetch(struct context *ctx, struct server_pool *pool,
+                                struct warmup_job *job, uint8_t *key,
+                                uint32_t keylen);
+
+void memcache_binary_parse_req(struct msg *r);
+void memcache_binary_parse_rsp(struct msg *r);
+rstatus_t memcache_binary_post_splitcopy(struct msg *r);
+void memcache_binary_pre_coalesce(struct msg *r);
+void memcache_binary_post_coalesce(struct msg *r);
+rstatus_t memcache_binary_reply(struct msg *r);
+struct msg *memcache_binary_error(struct msg *req, err_t err);
 
 void redis_parse_req(struct msg *r);
 void redis_parse_rsp(struct msg *r);
@@ -23,9 +23,33 @@
 #include <nc_server.h>
 
 #define REDIS_PROBE_MESSAGE "*1\r\n$4\r\ninfo\r\n"
+#define REDIS_INFO_LINE     64  /* max length of a parsed info line */
+#define REDIS_WARMUP_HDR_LEN 64 /* room for a warmup command line, less key */
 
+#define STATS_OK (void *) NULL
+
+/*
+ * Server state from the 'info' probe; numbers are int64_t, as
+ * redis_info_set_num assumes
+ */
 struct redis_stats {
-    struct string role;
+    int64_t master;             /* role:master? */
+    int64_t link_up;            /* master_link_status:up? */
+    int64_t repl_lag;           /* master_last_io_seconds_ago, -1 if none */
+    int64_t repl_offset;        /* master_repl_offset */
+    int64_t loading;            /* loading the dataset from disk? */
+    int64_t cold;               /* cold, as reported by a patched server? */
+    int64_t used_memory;        /* used_memory in bytes */
+    int64_t ops_per_sec;        /* instantaneous_ops_per_sec */
+    int64_t clients;            /* connected_clients */
+};
+
+struct redis_info_field {
+    struct string name;
+    char          *(*set)(struct redis_stats *s, struct redis_info_field *field,
+                          uint8_t *val, uint32_t len);
+    int           offset;
+    struct string match;        /* value setting the field to 1, if any */
 };
 
 /*
@@ -1651,6 +1675,17 @@ redis_parse_rsp(struct msg *r)
             break;
 
         case SW_RUNTO_CRLF:
+            if (ch != CR) {
+                /* status and error text; run over it a vector at a time */
+                m = nc_strchr2(p + 1, b->last, CR, CR);
+                if (m == NULL) {
+                    p = b->last - 1;
+                    break;
+                }
+                p = m;
+                ch = *p;
+            }
+
             switch (ch) {
             case CR:
                 state = SW_ALMOST_DONE;
@@ -2161,11 +2196,236 @@ redis_build_probe(struct msg *r)
     return NC_OK;    
 }
 
+static bool
+redis_info_num(uint8_t *p, uint32_t len, int64_t *num)
+{
+    uint8_t *end;
+    bool neg;
+    int64_t n;
+
+    end = p + len;
+    neg = (p < end && *p == '-');
+    if (neg) {
+        p++;
+    }
+    if (p == end) {
+        return false;
+    }
+
+    for (n = 0; p < end; p++) {
+        if (!isdigit(*p)) {
+            return false;
+        }
+        n = n * 10 + (*p - '0');
+    }
+
+    *num = neg ? -n : n;
+    return true;
+}
+
+static char *
+redis_info_set_num(struct redis_stats *s, struct redis_info_field *field,
+                   uint8_t *val, uint32_t len)
+{
+    int64_t *np;
+
+    np = (int64_t *)((uint8_t *)s + field->offset);
+
+    if (!redis_info_num(val, len, np)) {
+        return "is not a number";
+    }
+
+    return STATS_OK;
+}
+
+static char *
+redis_info_set_match(struct redis_stats *s, struct redis_info_field *field,
+                     uint8_t *val, uint32_t len)
+{
+    int64_t *np;
+
+    np = (int64_t *)((uint8_t *)s + field->offset);
+
+    *np = (len == field->match.len &&
+           nc_strncmp(val, field->match.data, len) == 0) ? 1 : 0;
+
+    return STATS_OK;
+}
+
+#define null_redis_info_field { null_string, NULL, 0, null_string }
+
+static struct redis_info_field redis_info_fields[] = {
+    { string("role"),
+      redis_info_set_match,
+      offsetof(struct redis_stats, master),
+      string("master") },
+
+    { string("master_link_status"),
+      redis_info_set_match,
+      offsetof(struct redis_stats, link_up),
+      string("up") },
+
+    { string("master_last_io_seconds_ago"),
+      redis_info_set_num,
+      offsetof(struct redis_stats, repl_lag),
+      null_string },
+
+    { string("master_repl_offset"),
+      redis_info_set_num,
+      offsetof(struct redis_stats, repl_offset),
+      null_string },
+
+    { string("loading"),
+      redis_info_set_num,
+      offsetof(struct redis_stats, loading),
+      null_string },
+
+    { string("cold"),
+      redis_info_set_num,
+      offsetof(struct redis_stats, cold),
+      null_string },
+
+    { string("used_memory"),
+      redis_info_set_num,
+      offsetof(struct redis_stats, used_memory),
+      null_string },
+
+    { string("instantaneous_ops_per_sec"),
+      redis_info_set_num,
+      offsetof(struct redis_stats, ops_per_sec),
+      null_string },
+
+    { string("connected_clients"),
+      redis_info_set_num,
+      offsetof(struct redis_stats, clients),
+      null_string },
+
+    null_redis_info_field
+};
+
+/*
+ * Update s from the "<field>:<value>" info line of len bytes; fields
+ * missing from redis_info_fields are ignored
+ */
 static void
-redis_handle_probe(struct msg *req, struct msg *rsp)
+redis_update_stat(struct redis_stats *s, uint8_t *line, uint32_t len)
 {
-    
-    
+    struct redis_info_field *field;
+    uint8_t *sep;
+    uint32_t nlen;
+    char *rv;
+
+    sep = nc_strchr(line, line + len, ':');
+    if (sep == NULL) {
+        return;
+    }
+    nlen = (uint32_t)(sep - line);
+
+    for (field = redis_info_fields; field->name.len != 0; field++) {
+        if (field->name.len != nlen ||
+            nc_strncmp(line, field->name.data, nlen) != 0) {
+            continue;
+        }
+
+        rv = field->set(s, field, sep + 1, len - nlen - 1);
+        if (rv != STATS_OK) {
+            log_warn("info: \"%.*s\" %s", nlen, line, rv);
+        }
+        return;
+    }
+}
+
+/*
+ * Update the server state from the 'info' bulk reply of a probe, one
+ * "<field>:<value>\r\n" line at a time. Lines are scanned in place, and
+ * only copied when they straddle two mbufs.
+ *
+ * A server is cold while it is loading its dataset, or when it reports
+ * 'cold:1' as a patched server would. With replica_max_lag, a replica is
+ * stale, and skipped by reads, while it is loading, its link to the
+ * master is down or it heard from the master over replica_max_lag sec ago
+ */
+static void
+redis_handle_probe(struct context *ctx, struct msg *req, struct msg *rsp)
+{
+    struct server *server;
+    struct server_pool *pool;
+    struct redis_stats *s;
+    struct mbuf *mbuf;
+    uint8_t line[REDIS_INFO_LINE], *p, *q;
+    uint32_t len, n;
+    bool stale;
+
+    ASSERT(rsp->owner->owner != NULL);
+
+    server = rsp->owner->owner;
+    pool = server->owner;
+    s = server->stats;
+
+    if (rsp->type != MSG_RSP_REDIS_BULK) {
+        return;
+    }
+
+    /* fields only a replica reports */
+    s->link_up = 0;
+    s->repl_lag = -1;
+
+    len = 0;
+    STAILQ_FOREACH(mbuf, &rsp->mhdr, next) {
+        for (p = mbuf->pos; p < mbuf->last; p = q + 1) {
+            q = nc_strchr(p, mbuf->last, LF);
+            if (q == NULL) {
+                /* carry the partial line over to the next mbuf */
+                n = (uint32_t)(mbuf->last - p);
+                if (len + n <= REDIS_INFO_LINE) {
+                    nc_memcpy(line + len, p, n);
+                }
+                len += n;
+                break;
+            }
+
+            n = (uint32_t)(q - p);
+            if (len == 0) {
+                if (n > 0 && p[n - 1] == CR) {
+                    redis_update_stat(s, p, n - 1);
+                }
+                continue;
+            }
+
+            /* longer lines carry no field we care about */
+            if (len + n <= REDIS_INFO_LINE) {
+                nc_memcpy(line + len, p, n);
+                len += n;
+                if (line[len - 1] == CR) {
+                    redis_update_stat(s, line, len - 1);
+                }
+            }
+            len = 0;
+        }
+    }
+
+    stale = false;
+    if (pool->replica_max_lag > 0 && !s->master) {
+        stale = s->loading || !s->link_up ||
+                s->repl_lag > (int64_t)pool->replica_max_lag;
+    }
+
+    if (stale != (server->stale == 1)) {
+        log_warn("replica '%.*s' in pool '%.*s' %s", server->pname.len,
+                 server->pname.data, pool->name.len, pool->name.data,
+                 stale ? "is stale, skipped by reads" : "is no longer stale");
+        server->stale = stale ? 1 : 0;
+    }
+
+    stats_server_set(ctx, server, loading, s->loading);
+    stats_server_set(ctx, server, master, s->master);
+    stats_server_set(ctx, server, master_link_up, s->link_up);
+    stats_server_set(ctx, server, repl_offset, s->repl_offset);
+    stats_server_set(ctx, server, repl_lag, s->repl_lag);
+    stats_server_set(ctx, server, used_memory, s->used_memory);
+    stats_server_set(ctx, server, ops_per_sec, s->ops_per_sec);
+    stats_server_set(ctx, server, connected_clients, s->clients);
+    stats_server_set(ctx, server, stale, server->stale);
 }
 
 struct redis_stats *
@@ -2187,38 +2447,415 @@ redis_destroy_stats(struct redis_stats *stats)
     nc_free(stats);
 }
 
+static bool
+redis_cold(struct conn *conn)
+{
+    struct server *server;
+    struct redis_stats *stats;
+
+    server = conn->owner;
+    stats = server->stats;
+
+    return stats->loading == 1 || stats->cold == 1;
+}
+
+/*
+ * Return true if a cold server can take warmups; one still loading its
+ * dataset rejects writes
+ */
+static bool
+redis_warmable(struct conn *conn)
+{
+    struct server *server;
+    struct redis_stats *stats;
+
+    server = conn->owner;
+    stats = server->stats;
+
+    return stats->loading == 0 && stats->cold == 1;
+}
+
+/*
+ * Return the number following the type byte of the integer or bulk
+ * length reply rsp, e.g. -2 for ":-2\r\n" or 5 for "$5\r\nhello\r\n"
+ */
+static bool
+redis_rsp_number(struct msg *rsp, int64_t *num)
+{
+    struct mbuf *mbuf;
+    uint8_t *p;
+    bool neg;
+    int64_t n;
+
+    mbuf = STAILQ_FIRST(&rsp->mhdr);
+    if (mbuf == NULL || mbuf_length(mbuf) < 4) {
+        return false;
+    }
+
+    p = mbuf->pos + 1;
+    neg = (*p == '-');
+    if (neg) {
+        p++;
+    }
+
+    for (n = 0; p < mbuf->last && isdigit(*p); p++) {
+        n = n * 10 + (*p - '0');
+    }
+    if (p == mbuf->last || *p != CR) {
+        return false;
+    }
+
+    *num = neg ? -n : n;
+    return true;
+}
+
+/*
+   Request:
+   *2\r\n$3\r\nget\r\n$<klen>\r\n<key>\r\n
+
+   Response:
+   $<vlen>\r\n<value>\r\n
+
+   Warmup request, completed by redis_warmup_ttl with [PX <pttl>] NX, so
+   that it never overwrites a value written since:
+   *6\r\n$3\r\nSET\r\n$<klen>\r\n<key>\r\n$<vlen>\r\n<value>\r\n
+ */
+static struct msg *
+redis_build_warmup(struct msg *req, struct msg *rsp)
+{
+    struct msg *msg;
+    struct mbuf *src, *dst;
+    int64_t vlen;
+    uint32_t klen, skip, remain, length;
+    uint8_t *pos;
+    int n;
+
+    ASSERT(req->key_start != NULL && req->key_end != NULL);
+
+    if (!redis_rsp_number(rsp, &vlen) || vlen < 0) {
+        return NULL;
+    }
+
+    klen = (uint32_t)(req->key_end - req->key_start);
+
+    msg = msg_get(NULL, true, true);
+    if (msg == NULL) {
+        return NULL;
+    }
+
+    dst = mbuf_get();
+    if (dst == NULL) {
+        msg_put(msg);
+        return NULL;
+    }
+    mbuf_insert(&msg->mhdr, dst);
+
+    /* the command line, key included, has to fit in one mbuf */
+    if (klen + REDIS_WARMUP_HDR_LEN > mbuf_size(dst)) {
+        msg_put(msg);
+        return NULL;
+    }
+
+    n = nc_scnprintf(dst->last, mbuf_size(dst), "*6\r\n$3\r\nSET\r\n$%d\r\n",
+                     klen);
+    dst->last += n;
+    msg->key_start = dst->last;
+    msg->key_end = msg->key_start + klen;
+    msg->mlen = (uint32_t)n;
+
+    n = nc_scnprintf(dst->last, mbuf_size(dst), "%.*s\r\n$%"PRId64"\r\n",
+                     klen, req->key_start, vlen);
+    dst->last += n;
+    msg->mlen += (uint32_t)n;
+
+    /* Share <value>\r\n, the tail of the response, from its mbufs */
+    remain = (uint32_t)vlen + 2;
+    skip = rsp->mlen - remain;
+    STAILQ_FOREACH(src, &rsp->mhdr, next) {
+        length = mbuf_length(src);
+        if (skip >= length) {
+            skip -= length;
+            continue;
+        }
+        pos = src->pos + skip;
+        length = MIN(length - skip, remain);
+        skip = 0;
+
+        if (mbuf_share(&msg->mhdr, src, pos, length) == NULL) {
+            msg_put(msg);
+            return NULL;
+        }
+        remain -= length;
+        msg->mlen += length;
+        if (remain == 0) {
+            break;
+        }
+    }
+
+    msg->type = MSG_REQ_REDIS_SET;
+    msg->swallow = 1;
+
+    return msg;
+}
+
+/*
+ * Complete the warmup msg with the pttl of its key on the peer: keys
+ * with no expire are set as such, others expire after the same pttl
+ */
+static rstatus_t
+redis_warmup_ttl(struct msg *msg, int64_t pttl)
+{
+    struct mbuf *mbuf;
+    char ttl[NC_UINT64_MAXLEN];
+    int n, len;
+
+    ASSERT(pttl == -1 || pttl > 0);
+
+    mbuf = STAILQ_LAST(&msg->mhdr, mbuf, next);
+    if (mbuf_size(mbuf) < REDIS_WARMUP_HDR_LEN) {
+        mbuf = mbuf_get();
+        if (mbuf == NULL) {
+            return NC_ENOMEM;
+        }
+        mbuf_insert(&msg->mhdr, mbuf);
+    }
+
+    if (pttl == -1) {
+        n = nc_scnprintf(mbuf->last, mbuf_size(mbuf), "$2\r\nNX\r\n");
+        mbuf->last += n;
+        msg->mlen += (uint32_t)n;
+
+        mbuf = STAILQ_FIRST(&msg->mhdr);
+        ASSERT(mbuf->pos[0] == '*' && mbuf->pos[1] == '6');
+        mbuf->pos[1] = '4';
+        return NC_OK;
+    }
+
+    len = nc_scnprintf(ttl, sizeof(ttl), "%"PRId64, pttl);
+    n = nc_scnprintf(mbuf->last, mbuf_size(mbuf), "$2\r\nPX\r\n$%d\r\n"
+                     "%.*s\r\n$2\r\nNX\r\n", len, len, ttl);
+    mbuf->last += n;
+    msg->mlen += (uint32_t)n;
+
+    return NC_OK;
+}
+
+static rstatus_t
+redis_ttl_pre_swallow(struct context *ctx, struct conn *conn, struct msg *rsp)
+{
+    struct msg *req, *msg;
+    struct server_pool *pool;
+    struct string key;
+    struct conn *s_conn;
+    int64_t pttl;
+
+    req = rsp->peer;
+    msg = req->warmup_set;
+
+    ASSERT(req->owner == NULL && msg != NULL);
+
+    /* no key, or no ttl reply, leaves nothing to warm up */
+    if (rsp->type != MSG_RSP_REDIS_INTEGER || !redis_rsp_number(rsp, &pttl) ||
+        pttl == 0 || pttl < -1) {
+        return NC_OK;
+    }
+
+    pool = msg->warmup_pool;
+    key = req_build_key(&pool->hash_tag, msg);
+    use_writable_pool(pool);
+    s_conn = server_pool_conn(ctx, pool, key.data, key.len);
+    if (s_conn == NULL || !redis_warmable(s_conn)) {
+        return NC_OK;
+    }
+
+    if (redis_warmup_ttl(msg, pttl) != NC_OK) {
+        return NC_OK;
+    }
+
+    req->warmup_set = NULL;
+    msg->warmup_pool = NULL;
+
+    if (pool->warmup == NULL) {
+        if (req_enqueue(ctx, s_conn, msg) != NC_OK) {
+            req_put(msg);
+        }
+        return NC_OK;
+    }
+
+    warmup_send(ctx, pool->warmup, s_conn, msg);
+
+    return NC_OK;
+}
+
+static void
+redis_ttl_pre_req_put(struct msg *msg)
+{
+    /* Only handle the ttl request of a warmup */
+    ASSERT(msg->owner == NULL);
+
+    if (msg->warmup_set != NULL) {
+        req_put(msg->warmup_set);
+        msg->warmup_set = NULL;
+    }
+}
+
+static const struct msg_hooks redis_ttl_hooks = {
+    redis_ttl_pre_swallow,      /* pre_swallow */
+    redis_ttl_pre_req_put,      /* pre_req_put */
+};
+
+/*
+ * Warm up pool with the value of key read from the peer pool on s_conn:
+ * send a pttl for the key on s_conn, and the set built from rsp once
+ * the pttl reply tells the expire to set with it
+ */
+static void
+redis_warmup(struct context *ctx, struct server_pool *pool,
+             struct conn *s_conn, struct msg *req, struct msg *rsp)
+{
+    struct msg *msg, *set;
+    struct mbuf *mbuf;
+    uint32_t klen;
+    int n;
+
+    set = redis_build_warmup(req, rsp);
+    if (set == NULL) {
+        return;
+    }
+    set->warmup_pool = pool;
+
+    msg = msg_get(NULL, true, true);
+    if (msg == NULL) {
+        req_put(set);
+        return;
+    }
+
+    mbuf = mbuf_get();
+    if (mbuf == NULL) {
+        req_put(set);
+        msg_put(msg);
+        return;
+    }
+    mbuf_insert(&msg->mhdr, mbuf);
+
+    klen = (uint32_t)(set->key_end - set->key_start);
+    n = nc_scnprintf(mbuf->last, mbuf_size(mbuf),
+                     "*2\r\n$4\r\nPTTL\r\n$%d\r\n%.*s\r\n", klen, klen,
+                     set->key_start);
+    mbuf->last += n;
+    msg->mlen = (uint32_t)n;
+    msg->type = MSG_REQ_REDIS_PTTL;
+
+    /* Send the set once the ttl is known and swallow the response */
+    msg->owner = NULL;          /* Special message */
+    msg->warmup_set = set;
+    msg->hooks = &redis_ttl_hooks;
+    msg->swallow = 1;
+
+    if (req_enqueue(ctx, s_conn, msg) != NC_OK) {
+        req_put(msg);
+    }
+}
+
 struct conn *
 redis_routing(struct context *ctx, struct server_pool *pool, struct msg *msg,
               struct string *key)
 {
-    struct conn *s_conn;
+    struct conn *s_conn, *f_conn;
+    struct server_pool *gutter, *peer;
+    bool write;
+
+    write = msg->type < MSG_REQ_REDIS_READREQ_START;
 
-    if (msg->type < MSG_REQ_REDIS_READREQ_START) {
+    if (write) {
         use_writable_pool(pool);         /* write req */
     } else {
         use_readable_pool(pool);         /* read req */
     }
     s_conn = server_pool_conn(ctx, pool, key->data, key->len);
 
-    return s_conn;
-} 
+    /* Automatic failover logic */
+    if (s_conn == NULL) {
+        gutter = pool->gutter;
+        /* Fallback to the gutter pool */
+        if (gutter != NULL) {
+            if (write) {
+                use_writable_pool(gutter);
+            } else {
+                use_readable_pool(gutter);
+            }
+            f_conn = server_pool_conn(ctx, gutter, key->data, key->len);
+            if (f_conn != NULL) {
+                log_debug(LOG_VERB, "fallback to gutter connection");
+                return f_conn;
+            }
+        }
+
+        return NULL;
+    }
 
+    /* Automatic warmup logic, for reads of string keys */
+    if (msg->type == MSG_REQ_REDIS_GET && redis_cold(s_conn)) {
+        peer = pool->peer;
+        /* Fallback to the peer pool if possible */
+        if (peer != NULL) {
+            use_readable_pool(peer);
+            f_conn = server_pool_conn(ctx, peer, key->data, key->len);
+            if (f_conn != NULL && !redis_cold(f_conn)) {
+                /* Record the original target */
+                msg->origin = s_conn;
+                log_debug(LOG_VERB, "fallback to peer connection");
+                return f_conn;
+            }
+        }
+    }
+
+    return s_conn;
+}
 
 rstatus_t
 redis_pre_rsp_forward(struct context *ctx, struct conn *s_conn, struct msg *msg)
 {
     struct msg *pmsg;
     struct conn *c_conn;
+    struct server_pool *pool;
+    struct string key;
+    struct conn *conn;
 
     pmsg = msg->peer;
     c_conn = pmsg->owner;
 
     /* Handle probe response */
     if (c_conn == NULL) {
-        redis_handle_probe(pmsg, msg);
+        redis_handle_probe(ctx, pmsg, msg);
+        stats_server_set(ctx, s_conn->owner, cold,
+                         redis_cold(s_conn) ? 1 : 0);
         req_put(pmsg);
         return NC_ERROR;
     }
 
+    /* Warm up the cold server of a read the peer pool served with a hit */
+    pool = c_conn->owner;
+    if (pmsg->origin == NULL || pool == s_conn->owner ||
+        msg->type != MSG_RSP_REDIS_BULK) {
+        return NC_OK;
+    }
+
+    key = req_build_key(&pool->hash_tag, pmsg);
+    use_writable_pool(pool);
+    conn = server_pool_conn(ctx, pool, key.data, key.len);
+    if (conn == NULL || !redis_warmable(conn)) {
+        return NC_OK;
+    }
+
+    if (pool->warmup != NULL &&
+        !warmup_admit(pool->warmup, pmsg->key_start,
+                      (uint32_t)(pmsg->key_end - pmsg->key_start))) {
+        stats_server_incr(ctx, conn->owner, warmup_deduped);
+        return NC_OK;
+    }
+
+    redis_warmup(ctx, pool, s_conn, pmsg, msg);
+
     return NC_OK;
 }
@@ -65,6 +65,27 @@ def killall_mock_mcd():
     print ' '.join(command)
     subprocess.call(command)
     
+def start_mock_redis(port, additional_args=[]):
+    command = [
+        './mock_redis.py',
+        '-p',
+        str(port)
+    ]
+    command.extend(additional_args)
+    print ' '.join(command)
+    return subprocess.Popen(command)
+
+def killall_mock_redis():
+    p = subprocess.Popen(['pgrep', '-f', 'mock_redis'], stdout=subprocess.PIPE)
+    out, err = p.communicate()
+    pids = out.split()
+    if len(pids) == 0:
+        return
+    command = ['kill']
+    command.extend(out.split())
+    print ' '.join(command)
+    subprocess.call(command)
+
 def start_proxy(filename, additional_args=[]):
     command = [
         'nutcracker',
@@ -105,6 +126,7 @@ def start_cluster(filename):
 def stop_cluster():
     killall_mcd()
     killall_mock_mcd()
+    killall_mock_redis()
     killall_redis()
     killall_proxy()
 
@@ -1,17 +1,29 @@
 #!/usr/bin/env python
 
+import copy
 import errno
 from optparse import OptionError, OptionParser
 import socket
+import struct
+import threading
 import time
 
+# binary protocol
+REQ_MAGIC = 0x80
+RSP_MAGIC = 0x81
+HEADER = struct.Struct('>BBHBBHIIQ')
+OP_GET, OP_SET, OP_ADD, OP_DELETE = 0x00, 0x01, 0x02, 0x04
+OP_GETQ, OP_NOOP, OP_GETK, OP_GETKQ = 0x09, 0x0a, 0x0c, 0x0d
+OP_SETQ, OP_ADDQ, OP_DELETEQ = 0x11, 0x12, 0x14
+STATUS_OK, STATUS_NOT_FOUND, STATUS_EXISTS = 0x00, 0x01, 0x02
+
 class SocketClosedException(Exception):
 
     def __init__(self):
         super(SocketClosedException, self).__init__('socket closed unexpectedly')
 
 class MockMemcached(object):
-    def __init__(self, host, port, accept_connections, get_delay):
+    def __init__(self, host, port, accept_connections, get_delay, log, cold):
         self._addr = (host, port)
         self._accept_connections = accept_connections
         self._get_delay = get_delay
@@ -19,7 +31,8 @@ class MockMemcached(object):
         self._root_socket = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
         self._root_socket.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
         self._root_socket.bind(self._addr)
-        self._cold = '0'
+        self._cold = ['1' if cold else '0'] # shared by all connections
+        self._log = open(log, 'a', 0) if log else None # request lines
 
         # buffer needed since we always ask for 4096 bytes at a time
         # and thus might read more than the current expected response
@@ -53,79 +66,227 @@ class MockMemcached(object):
                     self._buffer += tmp
         return result
 
-    def _handle_get(self, key):
-        # req  - get <key>\r\n
+    def _handle_get(self, command, keys):
+        # req  - get|getex <key>*\r\n
         # resp - VALUE <key> <flags> <bytes> [<cas unique>]\r\n
-        #        <data block>\r\n (if exists)
+        #        <data block>\r\n (for each key that exists)
         #        END\r\n
+        # getex adds a cas token and the expire time to each VALUE line,
+        # items here never expire
         if self._get_delay > 0:
             time.sleep(self._get_delay)
-        if key in self._dict:
-            val = self._dict[key]
-            command = 'VALUE %s 0 %d\r\n%s\r\n' % (key, len(val), val)
-            self._socket.sendall(command)
+        for key in keys:
+            if key in self._dict:
+                flags, val = self._dict[key]
+                if command == 'getex':
+                    line = 'VALUE %s %d %d 0 0\r\n' % (key, flags, len(val))
+                else:
+                    line = 'VALUE %s %d %d\r\n' % (key, flags, len(val))
+                self._socket.sendall(line + val + '\r\n')
         self._socket.sendall('END\r\n')
-        
-    def _handle_delele(self, args):
+
+    def _handle_delete(self, args):
+        # req  - delete <key> [noreply]\r\n
+        # resp - DELETED\r\n or NOT_FOUND\r\n
         key = args[0]
         if key in self._dict:
             del self._dict[key]
-            self._socket.sendall('DELETED\r\n')
+            rsp = 'DELETED\r\n'
         else:
-            self._socket.sendall('NOT_FOUND\r\n')
+            rsp = 'NOT_FOUND\r\n'
+        if 'noreply' not in args:
+            self._socket.sendall(rsp)
 
-    def _handle_set(self, key, length):
-        # req  - set <key> <flags> <exptime> <bytes> [noreply]\r\n
+    def _handle_set(self, command, args):
+        # req  - set|add <key> <flags> <exptime> <bytes> [noreply]\r\n
         #        <data block>\r\n
         # resp - STORED\r\n (or others)
+        key, flags, length = args[0], int(args[1]), int(args[3])
         val = self._read(length+2)[:-2] # read \r\n then chop it off
-        self._dict[key] = val
-        self._socket.sendall('STORED\r\n')
+        if command == 'add' and key in self._dict:
+            rsp = 'NOT_STORED\r\n'
+        else:
+            self._dict[key] = (flags, val)
+            rsp = 'STORED\r\n'
+        if 'noreply' not in args:
+            self._socket.sendall(rsp)
+
+    def _handle_mg(self, args):
+        # req  - mg <key> <flag>*\r\n
+        # resp - VA <bytes> <flag>*\r\n<data block>\r\n, HD <flag>*\r\n
+        #        or EN\r\n
+        if self._get_delay > 0:
+            time.sleep(self._get_delay)
+        key, flags = args[0], args[1:]
+        if key not in self._dict:
+            if 'q' not in flags:
+                self._socket.sendall('EN\r\n')
+            return
+        client_flags, val = self._dict[key]
+        ret = []
+        for flag in flags:
+            if flag == 'f':
+                ret.append('f%d' % client_flags)
+            elif flag == 't':
+                ret.append('t-1')
+            elif flag == 'k':
+                ret.append('k%s' % key)
+            elif flag[0] == 'O':
+                ret.append(flag)
+        if 'v' in flags:
+            self._socket.sendall('VA %s\r\n%s\r\n' % (' '.join([str(len(val))] + ret), val))
+        else:
+            self._socket.sendall('HD%s\r\n' % ''.join(' ' + x for x in ret))
+
+    def _handle_ms(self, args):
+        # req  - ms <key> <bytes> <flag>*\r\n<data block>\r\n
+        # resp - HD\r\n, or NS\r\n if the key exists in ME (add) mode
+        key, length, flags = args[0], int(args[1]), args[2:]
+        val = self._read(length+2)[:-2]
+        client_flags = 0
+        for flag in flags:
+            if flag[0] == 'F':
+                client_flags = int(flag[1:])
+        if 'ME' in flags and key in self._dict:
+            self._socket.sendall('NS\r\n')
+            return
+        self._dict[key] = (client_flags, val)
+        if 'q' not in flags:
+            self._socket.sendall('HD\r\n')
+
+    def _handle_md(self, args):
+        # req  - md <key> <flag>*\r\n
+        # resp - HD\r\n or NF\r\n
+        key, flags = args[0], args[1:]
+        if key in self._dict:
+            del self._dict[key]
+            rsp = 'HD\r\n'
+        else:
+            rsp = 'NF\r\n'
+        if 'q' not in flags:
+            self._socket.sendall(rsp)
+
+    def _send_binary(self, opcode, opaque, status=STATUS_OK, key='',
+                     extras='', val=''):
+        body = extras + key + val
+        self._socket.sendall(HEADER.pack(RSP_MAGIC, opcode, len(key),
+                                         len(extras), 0, status, len(body),
+                                         opaque, 0) + body)
+
+    def _handle_binary(self):
+        # req  - 24 byte header, then extras, key and value
+        # resp - 24 byte header with the status, then extras, key and value
+        (magic, opcode, keylen, extlen, datatype, vbucket, bodylen, opaque,
+         cas) = HEADER.unpack(self._read(HEADER.size))
+        body = self._read(bodylen) if bodylen > 0 else ''
+        extras, key = body[:extlen], body[extlen:extlen+keylen]
+        val = body[extlen+keylen:]
+        quiet = opcode in (OP_GETQ, OP_GETKQ, OP_SETQ, OP_ADDQ, OP_DELETEQ)
+
+        if opcode in (OP_GET, OP_GETQ, OP_GETK, OP_GETKQ):
+            if self._get_delay > 0:
+                time.sleep(self._get_delay)
+            if key not in self._dict:
+                if not quiet:
+                    self._send_binary(opcode, opaque, STATUS_NOT_FOUND,
+                                      val='Not found')
+                return
+            flags, val = self._dict[key]
+            if opcode not in (OP_GETK, OP_GETKQ):
+                key = ''
+            self._send_binary(opcode, opaque, key=key,
+                              extras=struct.pack('>I', flags), val=val)
+        elif opcode in (OP_SET, OP_SETQ, OP_ADD, OP_ADDQ):
+            if opcode in (OP_ADD, OP_ADDQ) and key in self._dict:
+                self._send_binary(opcode, opaque, STATUS_EXISTS,
+                                  val='Data exists for key.')
+                return
+            self._dict[key] = (struct.unpack('>I', extras[:4])[0], val)
+            if not quiet:
+                self._send_binary(opcode, opaque)
+        elif opcode in (OP_DELETE, OP_DELETEQ):
+            if key not in self._dict:
+                self._send_binary(opcode, opaque, STATUS_NOT_FOUND,
+                                  val='Not found')
+                return
+            del self._dict[key]
+            if not quiet:
+                self._send_binary(opcode, opaque)
+        elif opcode == OP_NOOP:
+            self._send_binary(opcode, opaque)
+        else:
+            raise SocketClosedException
 
     def _handle_stats(self):
-        self._socket.sendall('STAT cold %s\r\n' % self._cold)
+        self._socket.sendall('STAT cold %s\r\n' % self._cold[0])
         self._socket.sendall('END\r\n')
 
     def _handle_cold(self, cold):
-        self._cold = cold
+        # a server turning cold loses its items
+        self._cold[0] = cold
+        if cold == '1':
+            self._dict.clear()
         self._socket.sendall('OK\r\n')
 
-    def run(self):
-        self._root_socket.listen(1)
+    def _serve(self):
+        request = None
         while True:
-            if self._accept_connections:
-                self._socket, addr = self._root_socket.accept()
-            else:
-                while True: # spin until killed
-                    time.sleep(1)
-
-            while True:
-                try:
-                    request = self._read()
-                    terms = request.split()
-                    if len(terms) == 2 and terms[0] == 'get':
-                        self._handle_get(terms[1])
-                    elif len(terms) == 5 and terms[0] == 'set':
-                        self._handle_set(terms[1], int(terms[4]))
-                    elif terms[0] == 'delete':
-                        self._handle_del(terms[1:])
-                    elif terms[0] == 'stats':
-                        self._handle_stats()
-                    elif len(terms) == 2 and terms[0] == 'cold':
-                        self._handle_cold()
-                    else:
-                        print 'unknown command', repr(request)
-                        break
-                except SocketClosedException:
-                    print 'socket closed', repr(request)
-                    break
+            try:
+                if not self._buffer:
+                    self._buffer = self._socket.recv(4096)
+                    if not self._buffer:
+                        raise SocketClosedException
+                if ord(self._buffer[0]) == REQ_MAGIC:
+                    self._handle_binary()
+                    continue
 
+                request = self._read()
+                if self._log:
+                    self._log.write(request)
+                terms = request.split()
+                if len(terms) >= 2 and terms[0] in ('get', 'getex'):
+                    self._handle_get(terms[0], terms[1:])
+                elif len(terms) >= 5 and terms[0] in ('set', 'add'):
+                    self._handle_set(terms[0], terms[1:])
+                elif terms[0] == 'delete':
+                    self._handle_delete(terms[1:])
+                elif len(terms) >= 2 and terms[0] == 'mg':
+                    self._handle_mg(terms[1:])
+                elif len(terms) >= 3 and terms[0] == 'ms':
+                    self._handle_ms(terms[1:])
+                elif len(terms) >= 2 and terms[0] == 'md':
+                    self._handle_md(terms[1:])
+                elif terms[0] == 'mn':
+                    self._socket.sendall('MN\r\n')
+                elif terms[0] == 'stats':
+                    self._handle_stats()
+                elif len(terms) == 2 and terms[0] == 'cold':
+                    self._handle_cold(terms[1])
+                else:
+                    print 'unknown command', repr(request)
+                    break
+            except SocketClosedException:
+                print 'socket closed', repr(request)
+                break
+            except socket.error:
+                print 'socket error', repr(request)
+                break
         self._socket.close()
-        self._root_socket.close()
 
-        # spin until killed - this simplifies cleanup code for the unit tests
+    def run(self):
+        self._root_socket.listen(16)
+        if not self._accept_connections:
+            while True: # spin until killed
+                time.sleep(1)
+
+        # a thread per connection, all of them share the items
         while True:
-            time.sleep(1)
+            conn = copy.copy(self)
+            conn._socket, addr = self._root_socket.accept()
+            conn._buffer = ''
+            t = threading.Thread(target=conn._serve)
+            t.daemon = True
+            t.start()
 
 if __name__ == '__main__':
     usage = 'usage: %prog [options]'
@@ -144,9 +305,23 @@ if __name__ == '__main__':
         default=0,
         dest='get_delay',
         metavar='GET_DELAY',
-        type='int',
+        type='float',
         help='delay get command by GET_DELAY seconds',
     )
+    parser.add_option(
+        '--log',
+        default=None,
+        dest='log',
+        metavar='FILE',
+        help='append the command line of each request to FILE',
+    )
+    parser.add_option(
+        '--cold',
+        default=False,
+        dest='cold',
+        action='store_true',
+        help='start as a cold server',
+    )
     parser.add_option(
         '-p', '--port',
         default=11212,
@@ -162,5 +337,7 @@ if __name__ == '__main__':
     server = MockMemcached('127.0.0.1',
                            options.port,
                            options.accept_connections,
-                           options.get_delay)
+                           options.get_delay,
+                           options.log,
+                           options.cold)
     server.run()
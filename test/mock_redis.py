@@ -0,0 +1,222 @@
+#!/usr/bin/env python
+
+import copy
+from optparse import OptionError, OptionParser
+import socket
+import threading
+import time
+
+class SocketClosedException(Exception):
+
+    def __init__(self):
+        super(SocketClosedException, self).__init__('socket closed unexpectedly')
+
+class MockRedis(object):
+    def __init__(self, host, port, log, cold):
+        self._addr = (host, port)
+        self._dict = {} # stores the key-val pairs
+        self._expire = {} # absolute expire time of keys with a ttl
+        self._lists = {}
+        self._root_socket = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        self._root_socket.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        self._root_socket.bind(self._addr)
+        self._log = open(log, 'a', 0) if log else None # request commands
+
+        # what INFO reports, shared by all connections and changed by the
+        # set<field> control commands
+        self._info = {'cold': 1 if cold else 0, 'loading': 0,
+                      'role': 'master', 'link': 'up', 'lag': 0, 'oom': 0}
+
+        self._buffer = ''
+        # self._socket set after accept
+
+    def _read(self, length=None):
+        '''
+        Return the next length bytes from client
+        Or, when length is None, the next line including \r\n
+        '''
+        result = None
+        while result is None:
+            if length:
+                if len(self._buffer) >= length:
+                    result = self._buffer[:length]
+                    self._buffer = self._buffer[length:]
+            else:
+                delim_index = self._buffer.find('\r\n')
+                if delim_index != -1:
+                    result = self._buffer[:delim_index+2]
+                    self._buffer = self._buffer[delim_index+2:]
+
+            if result is None:
+                tmp = self._socket.recv(4096)
+                if not tmp:
+                    raise SocketClosedException
+                else:
+                    self._buffer += tmp
+        return result
+
+    def _read_command(self):
+        # req  - *<n>\r\n followed by n times $<len>\r\n<arg>\r\n
+        line = self._read()
+        if line[0] != '*':
+            return line.split()
+        args = []
+        for i in range(int(line[1:])):
+            length = int(self._read()[1:])
+            args.append(self._read(length+2)[:-2])
+        return args
+
+    def _bulk(self, val):
+        if val is None:
+            return '$-1\r\n'
+        return '$%d\r\n%s\r\n' % (len(val), val)
+
+    def _handle_get(self, key):
+        if self._info['loading']:
+            return '-LOADING Redis is loading the dataset in memory\r\n'
+        return self._bulk(self._dict.get(key))
+
+    def _handle_set(self, args):
+        # req  - SET <key> <val> [PX <msec>] [NX]
+        key, val, opts = args[0], args[1], [x.upper() for x in args[2:]]
+        if 'NX' in opts and key in self._dict:
+            return '$-1\r\n'
+        self._dict[key] = val
+        self._expire.pop(key, None)
+        if 'PX' in opts:
+            msec = int(args[2 + opts.index('PX') + 1])
+            self._expire[key] = time.time() + msec / 1000.0
+        return '+OK\r\n'
+
+    def _handle_pttl(self, key):
+        if key not in self._dict:
+            return ':-2\r\n'
+        if key not in self._expire:
+            return ':-1\r\n'
+        return ':%d\r\n' % int((self._expire[key] - time.time()) * 1000)
+
+    def _handle_lpush(self, key, vals):
+        if self._info['oom']:
+            return "-OOM command not allowed when used memory > 'maxmemory'\r\n"
+        l = self._lists.setdefault(key, [])
+        l[0:0] = reversed(vals)
+        return ':%d\r\n' % len(l)
+
+    def _handle_info(self):
+        info = self._info
+        body = ('# Server\r\nredis_version:3.2.0\r\n'
+                '# Clients\r\nconnected_clients:1\r\n'
+                '# Memory\r\nused_memory:1048576\r\n'
+                '# Persistence\r\nloading:%d\r\n'
+                '# Stats\r\ninstantaneous_ops_per_sec:0\r\n' % info['loading'])
+        body += '# Replication\r\nrole:%s\r\n' % info['role']
+        if info['role'] == 'slave':
+            body += ('master_host:127.0.0.1\r\nmaster_link_status:%s\r\n'
+                     'master_last_io_seconds_ago:%d\r\n' % (info['link'], info['lag']))
+        body += 'master_repl_offset:0\r\n'
+        body += '# Warmup\r\ncold:%d\r\n' % info['cold']
+        return self._bulk(body)
+
+    def _handle_control(self, field, val):
+        # a server turning cold loses its items
+        if field == 'cold' and val == '1':
+            self._dict.clear()
+            self._expire.clear()
+        self._info[field] = int(val) if val.isdigit() else val
+        return '+OK\r\n'
+
+    def _handle(self, args):
+        cmd = args[0].lower()
+        if cmd == 'get' and len(args) == 2:
+            return self._handle_get(args[1])
+        elif cmd == 'set' and len(args) >= 3:
+            return self._handle_set(args[1:])
+        elif cmd == 'del':
+            n = 0
+            for key in args[1:]:
+                if self._dict.pop(key, None) is not None:
+                    self._expire.pop(key, None)
+                    n += 1
+            return ':%d\r\n' % n
+        elif cmd == 'pttl' and len(args) == 2:
+            return self._handle_pttl(args[1])
+        elif cmd == 'lpush' and len(args) >= 3:
+            return self._handle_lpush(args[1], args[2:])
+        elif cmd == 'llen' and len(args) == 2:
+            return ':%d\r\n' % len(self._lists.get(args[1], []))
+        elif cmd == 'lrange' and len(args) == 4:
+            l = self._lists.get(args[1], [])
+            stop = int(args[3])
+            l = l[int(args[2]):] if stop == -1 else l[int(args[2]):stop+1]
+            return '*%d\r\n%s' % (len(l), ''.join(self._bulk(x) for x in l))
+        elif cmd == 'ping':
+            return '+PONG\r\n'
+        elif cmd == 'info':
+            return self._handle_info()
+        elif (cmd in ('setcold', 'setloading', 'setrole', 'setlink', 'setlag',
+                      'setoom') and len(args) == 2):
+            return self._handle_control(cmd[3:], args[1])
+        return "-ERR unknown command '%s'\r\n" % args[0]
+
+    def _serve(self):
+        args = None
+        while True:
+            try:
+                args = self._read_command()
+                if not args:
+                    continue
+                if self._log:
+                    # values are cut short, keys and options stay readable
+                    self._log.write(' '.join(x[:64] for x in args) + '\n')
+                self._socket.sendall(self._handle(args))
+            except SocketClosedException:
+                print 'socket closed', repr(args)
+                break
+            except socket.error:
+                print 'socket error', repr(args)
+                break
+        self._socket.close()
+
+    def run(self):
+        self._root_socket.listen(16)
+
+        # a thread per connection, all of them share the items
+        while True:
+            conn = copy.copy(self)
+            conn._socket, addr = self._root_socket.accept()
+            conn._buffer = ''
+            t = threading.Thread(target=conn._serve)
+            t.daemon = True
+            t.start()
+
+if __name__ == '__main__':
+    usage = 'usage: %prog [options]'
+    parser = OptionParser(usage=usage)
+    parser.add_option(
+        '--log',
+        default=None,
+        dest='log',
+        metavar='FILE',
+        help='append each request command to FILE',
+    )
+    parser.add_option(
+        '--cold',
+        default=False,
+        dest='cold',
+        action='store_true',
+        help='start as a cold server',
+    )
+    parser.add_option(
+        '-p', '--port',
+        default=6380,
+        dest='port',
+        metavar='PORT',
+        type='int',
+        help='listen on PORT',
+    )
+    (options, args) = parser.parse_args()
+    if len(args) > 0:
+        raise OptionError('unrecognized arguments: %s' % ' '.join(args))
+
+    server = MockRedis('127.0.0.1', options.port, options.log, options.cold)
+    server.run()
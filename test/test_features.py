@@ -0,0 +1,1073 @@
+#!/usr/bin/env python
+
+import json
+import os
+import socket
+import struct
+import threading
+import time
+import unittest2 as unittest
+import yaml
+
+import manage
+import redis
+
+CONF = 'features.yml'
+STATS_PORT = 22232
+STATS_INTERVAL = 1000 # msec, decaying stats hold still during a test
+METRICS_PORT = 22233
+
+# extra mock server arguments, by port
+SERVER_ARGS = {
+    12133: ['--get-delay', '0.15'],
+    12135: ['--get-delay', '0.2'],
+    12137: ['--get-delay', '0.02'],
+    12141: ['--cold'],
+    12143: ['--cold'],
+    12147: ['--cold'],
+    12159: ['--get-delay', '0.05'],
+    12160: ['--get-delay', '0.05'],
+    12163: ['--get-delay', '0.02'],
+    12164: ['--cold'],
+    12166: ['--get-delay', '0.2'],
+}
+
+# started by the journal test once its journal has filled
+QUEUE_SERVER = 12155
+
+TOO_MANY = 'CLIENT_ERROR Too Many Requests\r\n'
+UNAVAILABLE = 'CLIENT_ERROR Service Unavailable\r\n'
+
+processes = []
+
+def load_conf(filename):
+    return yaml.load(open(filename).read())
+
+def parse_port(addr):
+    return addr.split(':')[1]
+
+def server_log(port):
+    return 'log/mock.%d.log' % port
+
+def server_requests(port):
+    '''
+    Command lines the mock server on port has received so far
+    '''
+    return open(server_log(port)).read().splitlines()
+
+def setUpModule():
+    if not os.path.isdir('log'):
+        os.mkdir('log')
+    for name in os.listdir('log'):
+        if name.startswith('mock.'):
+            os.remove(os.path.join('log', name))
+    for journal in ('log/features.journal', 'log/features_strict.journal'):
+        if os.path.exists(journal):
+            os.remove(journal)
+
+    conf = load_conf(CONF)
+    for name in conf:
+        for server in conf[name]['servers']:
+            port = int(parse_port(server))
+            if port == QUEUE_SERVER:
+                continue
+            args = ['--log', server_log(port)] + SERVER_ARGS.get(port, [])
+            if conf[name].get('redis'):
+                processes.append(manage.start_mock_redis(port, args))
+                continue
+            processes.append(manage.start_mock_mcd(port, args))
+    time.sleep(0.5)
+
+    processes.append(manage.start_proxy(CONF, ['-l', 'local', '-s', str(STATS_PORT),
+                                               '-i', str(STATS_INTERVAL),
+                                               '-P', str(METRICS_PORT),
+                                               '-f', 'remote']))
+    time.sleep(0.5)
+
+def tearDownModule():
+    for p in processes:
+        p.kill()
+        p.wait()
+
+def pool_port(name):
+    return int(parse_port(load_conf(CONF)[name]['listen']))
+
+def connect(name):
+    s = socket.create_connection(('127.0.0.1', pool_port(name)))
+    s.settimeout(5)
+    return s
+
+def read_until(s, n, delims=('END\r\n', TOO_MANY, UNAVAILABLE)):
+    '''
+    Read from s until the n-th response ending in one of delims
+    '''
+    buf = ''
+    while sum(buf.count(d) for d in delims) < n:
+        tmp = s.recv(65536)
+        if not tmp:
+            raise Exception('connection closed after %r' % buf)
+        buf += tmp
+    return buf
+
+def read_stats():
+    s = socket.create_connection(('127.0.0.1', STATS_PORT))
+    buf = ''
+    while True:
+        tmp = s.recv(65536)
+        if not tmp:
+            break
+        buf += tmp
+    s.close()
+    return json.loads(buf)
+
+def stats(name):
+    '''
+    Stats of pool name, up to date with every request answered so far
+    '''
+    # each read sums what the workers handed over by then, they hand over
+    # once a tick
+    time.sleep(0.1)
+    read_stats()
+    time.sleep(0.2)
+    return read_stats()[name]
+
+def value(key, val, flags=0):
+    return 'VALUE %s %d %d\r\n%s\r\n' % (key, flags, len(val), val)
+
+def redis_server(port):
+    return redis.StrictRedis(host='127.0.0.1', port=port, db=0)
+
+def redis_pool(name):
+    return redis_server(pool_port(name))
+
+
+class TestMeta(unittest.TestCase):
+    def setUp(self):
+        self.client = connect('meta')
+
+    def tearDown(self):
+        self.client.close()
+
+    def rt(self, request, delim='\r\n'):
+        self.client.sendall(request)
+        return read_until(self.client, 1, (delim,))
+
+    def test_set_get(self):
+        val = 'y' * 70000
+        self.assertEqual(self.rt('ms meta_big %d F5 T0\r\n%s\r\n' % (len(val), val)), 'HD\r\n')
+        rsp = self.rt('mg meta_big f v\r\n', val + '\r\n')
+        self.assertEqual(rsp, 'VA %d f5\r\n%s\r\n' % (len(val), val))
+        self.assertEqual(self.rt('mg meta_none v\r\n'), 'EN\r\n')
+
+    def test_quiet(self):
+        rsp = self.rt('mg meta_none v q\r\nms meta_q 2 q\r\nhi\r\n'
+                      'md meta_none q\r\nmg meta_q v q\r\nmn\r\n', 'MN\r\n')
+        self.assertEqual(rsp, 'VA 2\r\nhi\r\nMN\r\n')
+
+    def test_delete(self):
+        self.assertEqual(self.rt('ms meta_del 1\r\nx\r\n'), 'HD\r\n')
+        self.assertEqual(self.rt('md meta_del\r\n'), 'HD\r\n')
+        self.assertEqual(self.rt('md meta_del\r\n'), 'NF\r\n')
+        self.assertEqual(self.rt('mg meta_del v\r\n'), 'EN\r\n')
+
+    def test_warmup(self):
+        # a hit served by the peer for a cold server warms it in ME mode
+        val = 'w' * 100000
+        peer = socket.create_connection(('127.0.0.1', 12165))
+        peer.sendall('set meta_warm 7 0 %d\r\n%s\r\n' % (len(val), val))
+        self.assertEqual(read_until(peer, 1, ('STORED\r\n',)), 'STORED\r\n')
+        peer.close()
+        time.sleep(1)
+
+        client = connect('meta_warm')
+        client.sendall('mg meta_warm f t v\r\n')
+        rsp = read_until(client, 1, (val + '\r\n',))
+        self.assertEqual(rsp, 'VA %d f7 t-1\r\n%s\r\n' % (len(val), val))
+
+        # past the dedup window the same hit warms again, and the NS of
+        # the now existing key is swallowed instead of left on the conn
+        time.sleep(1.2)
+        client.sendall('mg meta_warm f t v\r\nmn\r\n')
+        self.assertEqual(read_until(client, 1, ('MN\r\n',)),
+                         'VA %d f7 t-1\r\n%s\r\nMN\r\n' % (len(val), val))
+        time.sleep(0.3)
+        warmups = [r for r in server_requests(12164) if r.startswith('ms ')]
+        self.assertEqual(len(warmups), 2)
+        for r in warmups:
+            self.assertEqual(r.split()[:4], ['ms', 'meta_warm', str(len(val)), 'F7'])
+            self.assertTrue('ME' in r.split() and 'q' not in r.split())
+        st = stats('meta_warm')['server1']
+        self.assertEqual((st['warmups'], st['server_err'], st['server_eof']), (2, 0, 0))
+
+        cold = socket.create_connection(('127.0.0.1', 12164))
+        cold.sendall('get meta_warm\r\n')
+        self.assertEqual(read_until(cold, 1), value('meta_warm', val, 7) + 'END\r\n')
+        cold.close()
+        client.close()
+
+
+class TestBinary(unittest.TestCase):
+    HEADER = struct.Struct('>BBHBBHIIQ')
+
+    def setUp(self):
+        self.client = connect('binary')
+        self.buffer = ''
+
+    def tearDown(self):
+        self.client.close()
+
+    def request(self, opcode, opaque, key='', extras='', val=''):
+        return self.HEADER.pack(0x80, opcode, len(key), len(extras), 0, 0,
+                                len(extras) + len(key) + len(val), opaque,
+                                0) + extras + key + val
+
+    def response(self):
+        while True:
+            if len(self.buffer) >= self.HEADER.size:
+                header = self.HEADER.unpack(self.buffer[:self.HEADER.size])
+                end = self.HEADER.size + header[6]
+                if len(self.buffer) >= end:
+                    body = self.buffer[self.HEADER.size:end]
+                    self.buffer = self.buffer[end:]
+                    return header, body
+            tmp = self.client.recv(65536)
+            if not tmp:
+                raise Exception('connection closed')
+            self.buffer += tmp
+
+    def test_set_get(self):
+        val = 'z' * 100000
+        self.client.sendall(self.request(0x01, 7, 'bin_big', struct.pack('>II', 9, 0), val))
+        header, body = self.response()
+        self.assertEqual((header[1], header[5], header[7]), (0x01, 0, 7))
+        self.client.sendall(self.request(0x00, 8, 'bin_big'))
+        header, body = self.response()
+        self.assertEqual((header[5], header[7]), (0, 8))
+        self.assertEqual(body, struct.pack('>I', 9) + val)
+        self.client.sendall(self.request(0x00, 9, 'bin_none'))
+        header, body = self.response()
+        self.assertEqual((header[5], header[7]), (1, 9))
+
+    def test_quiet_multiget(self):
+        keys = ['bin_%d' % i for i in range(10)]
+        self.client.sendall(''.join(self.request(0x11, i, k, struct.pack('>II', i, 0), 'v' + k)
+                                    for i, k in enumerate(keys)) + self.request(0x0a, 99))
+        header, body = self.response()
+        self.assertEqual((header[1], header[7]), (0x0a, 99))
+
+        # misses of quiet gets are not answered, the noop closes the batch
+        wanted = keys[::2] + ['bin_none_%d' % i for i in range(3)]
+        self.client.sendall(''.join(self.request(0x0d, 100 + i, k) for i, k in enumerate(wanted)) +
+                            self.request(0x0a, 999))
+        got = {}
+        while True:
+            header, body = self.response()
+            if header[1] == 0x0a:
+                self.assertEqual(header[7], 999)
+                break
+            self.assertEqual((header[1], header[5]), (0x0d, 0))
+            got[header[7]] = body
+        self.assertEqual(len(got), 5)
+        for i, k in enumerate(keys[::2]):
+            self.assertEqual(got[100 + i], struct.pack('>I', keys.index(k)) + k + 'v' + k)
+
+    def test_bad_magic(self):
+        # a quiet get followed by a header with no request magic is an error
+        self.client.sendall(self.request(0x09, 21, 'bin_bad') + '\x00\x09' + '\x00' * 22)
+        while self.client.recv(4096):
+            pass
+
+        self.client = connect('binary')
+        self.client.sendall(self.request(0x00, 22, 'bin_bad'))
+        header, body = self.response()
+        self.assertEqual((header[5], header[7]), (1, 22))
+
+
+class TestDeadline(unittest.TestCase):
+    TIMED_OUT = 'SERVER_ERROR Connection timed out\r\n'
+
+    def setUp(self):
+        self.client = connect('deadline')
+
+    def tearDown(self):
+        self.client.close()
+
+    def test_timeout_keeps_conn(self):
+        before = stats('deadline')['server1']
+        start = time.time()
+        self.client.sendall('get dl_slow\r\n')
+        self.assertEqual(read_until(self.client, 1, ('\r\n',)), self.TIMED_OUT)
+        self.assertTrue(time.time() - start < 0.14)
+
+        # the late reply is swallowed, the next request reuses the conn
+        self.client.sendall('set dl_key 0 0 1\r\nx\r\n')
+        self.assertEqual(read_until(self.client, 1, ('\r\n',)), 'STORED\r\n')
+        after = stats('deadline')['server1']
+        self.assertEqual(after['request_timedout'] - before['request_timedout'], 1)
+        self.assertEqual(after['server_timedout'], before['server_timedout'])
+        self.assertEqual(after['server_connections'], 1)
+
+    def test_shed(self):
+        # a request past its deadline before it is sent never reaches the
+        # server, the deadline counts from its first bytes
+        before = stats('deadline')['server1']
+        self.client.sendall('get dl_sh')
+        time.sleep(0.2)
+        start = time.time()
+        self.client.sendall('ed\r\n')
+        self.assertEqual(read_until(self.client, 1, ('\r\n',)), self.TIMED_OUT)
+        self.assertTrue(time.time() - start < 0.05)
+
+        self.client.sendall('set dl_key 0 0 1\r\ny\r\n')
+        self.assertEqual(read_until(self.client, 1, ('\r\n',)), 'STORED\r\n')
+        after = stats('deadline')['server1']
+        self.assertEqual(after['request_shed'] - before['request_shed'], 1)
+        self.assertFalse('get dl_shed' in server_requests(12133))
+
+
+class TestNearCache(unittest.TestCase):
+    def setUp(self):
+        self.client = connect('near')
+
+    def tearDown(self):
+        self.client.close()
+
+    def rt(self, request, n=1):
+        self.client.sendall(request)
+        return read_until(self.client, n, ('END\r\n', 'STORED\r\n', 'DELETED\r\n', 'NOT_FOUND\r\n'))
+
+    def test_hit(self):
+        self.assertEqual(self.rt('set near_hit 0 0 2\r\nv1\r\n'), 'STORED\r\n')
+        self.assertEqual(self.rt('get near_hit\r\n'), value('near_hit', 'v1') + 'END\r\n')
+        before = stats('near')
+        for i in range(5):
+            self.assertEqual(self.rt('get near_hit\r\n'), value('near_hit', 'v1') + 'END\r\n')
+        after = stats('near')
+        self.assertEqual(after['near_cache_hits'] - before['near_cache_hits'], 5)
+        self.assertEqual(after['server1']['requests'], before['server1']['requests'])
+        self.assertEqual(server_requests(12134).count('get near_hit'), 1)
+
+    def test_invalidate(self):
+        self.assertEqual(self.rt('set near_inv 0 0 2\r\nv1\r\n'), 'STORED\r\n')
+        self.assertEqual(self.rt('get near_inv\r\n'), value('near_inv', 'v1') + 'END\r\n')
+        self.assertEqual(self.rt('set near_inv 0 0 2\r\nv2\r\n'), 'STORED\r\n')
+        self.assertEqual(self.rt('get near_inv\r\n'), value('near_inv', 'v2') + 'END\r\n')
+
+        # noreply writes invalidate as well
+        self.client.sendall('set near_inv 0 0 2 noreply\r\nv3\r\n')
+        self.assertEqual(self.rt('get near_inv\r\n'), value('near_inv', 'v3') + 'END\r\n')
+        self.assertEqual(self.rt('delete near_inv\r\n'), 'DELETED\r\n')
+        self.assertEqual(self.rt('get near_inv\r\n'), 'END\r\n')
+
+
+class TestCollapse(unittest.TestCase):
+    def test_stampede(self):
+        writer = connect('collapse')
+        writer.sendall('set col_key 0 0 3\r\nval\r\n')
+        self.assertEqual(read_until(writer, 1, ('STORED\r\n',)), 'STORED\r\n')
+        before = stats('collapse')
+
+        clients = [connect('collapse') for i in range(10)]
+        for c in clients:
+            c.sendall('get col_key\r\n')
+        for c in clients:
+            self.assertEqual(read_until(c, 1), value('col_key', 'val') + 'END\r\n')
+            c.close()
+
+        after = stats('collapse')
+        self.assertEqual(after['collapsed'] - before['collapsed'], 9)
+        self.assertEqual(after['server1']['requests'] - before['server1']['requests'], 1)
+        self.assertEqual(server_requests(12135).count('get col_key'), 1)
+        writer.close()
+
+    def test_write_detaches(self):
+        a, b, c = connect('collapse'), connect('collapse'), connect('collapse')
+        a.sendall('get col_det\r\n')
+        time.sleep(0.05)
+        b.sendall('set col_det 0 0 3\r\nnew\r\n')
+        c.sendall('get col_det\r\n')
+        self.assertEqual(read_until(a, 1), 'END\r\n')
+        self.assertEqual(read_until(b, 1, ('STORED\r\n',)), 'STORED\r\n')
+        self.assertEqual(read_until(c, 1), value('col_det', 'new') + 'END\r\n')
+        self.assertEqual(server_requests(12135).count('get col_det'), 2)
+        for s in (a, b, c):
+            s.close()
+
+    def test_getex_not_collapsed(self):
+        before = stats('collapse')
+        clients = [connect('collapse') for i in range(3)]
+        for c in clients:
+            c.sendall('getex col_ex\r\n')
+        for c in clients:
+            self.assertEqual(read_until(c, 1), 'END\r\n')
+            c.close()
+        self.assertEqual(stats('collapse')['collapsed'], before['collapsed'])
+        self.assertEqual(server_requests(12135).count('getex col_ex'), 3)
+
+
+class TestHotKeys(unittest.TestCase):
+    def test_hot_keys(self):
+        s = connect('hot')
+        s.sendall('set hot_key 0 0 100\r\n%s\r\n' % ('h' * 100))
+        self.assertEqual(read_until(s, 1, ('STORED\r\n',)), 'STORED\r\n')
+        for i in range(100):
+            s.sendall('get hot_key\r\nget hot_%d\r\n' % (i % 10))
+            read_until(s, 2)
+        s.close()
+
+        # counts decay, the order and bytes per request do not
+        st = stats('hot')
+        for hot in (st['hot_keys'], st['server1']['hot_keys']):
+            self.assertEqual(hot[0]['key'], 'hot_key')
+            self.assertTrue(hot[0]['requests'] > max(k['requests'] for k in hot[1:]))
+            self.assertTrue(hot[0]['bytes'] >= 100 * hot[0]['requests'])
+        self.assertFalse('hot_keys' in stats('meta'))
+
+
+class TestLatency(unittest.TestCase):
+    def test_latency(self):
+        # every get takes 20 msec on the server
+        s = connect('latency')
+        for i in range(20):
+            s.sendall('get lat_%d\r\n' % i)
+            self.assertEqual(read_until(s, 1), 'END\r\n')
+        s.close()
+
+        st = stats('latency')
+        sv = st['server1']
+        self.assertTrue(15000 <= sv['latency_p50'] <= sv['latency_p90'] <= sv['latency_p99']
+                        <= sv['latency_p999'] <= sv['latency_max'] < 200000)
+        for k in ('latency_p50', 'latency_p90', 'latency_p99', 'latency_p999', 'latency_max'):
+            self.assertEqual(st[k], sv[k])
+
+
+class TestCommands(unittest.TestCase):
+    def test_commands(self):
+        s = connect('commands')
+        s.sendall('set cmd_key 0 0 3\r\nabc\r\n')
+        self.assertEqual(read_until(s, 1, ('STORED\r\n',)), 'STORED\r\n')
+        for i in range(7):
+            s.sendall('get cmd_key\r\n')
+            self.assertEqual(read_until(s, 1), value('cmd_key', 'abc') + 'END\r\n')
+        s.sendall('delete cmd_key\r\ndelete cmd_key\r\n')
+        read_until(s, 2, ('DELETED\r\n', 'NOT_FOUND\r\n'))
+        s.close()
+
+        commands = stats('commands')['commands']
+        self.assertEqual(sorted(commands), ['delete', 'get', 'set'])
+        self.assertEqual(commands['get']['requests'], 7)
+        self.assertEqual(commands['get']['request_bytes'], 7 * len('get cmd_key\r\n'))
+        self.assertEqual(commands['get']['response_bytes'],
+                         7 * len(value('cmd_key', 'abc') + 'END\r\n'))
+        self.assertEqual((commands['set']['requests'], commands['set']['errors']), (1, 0))
+        self.assertEqual(commands['delete']['requests'], 2)
+        self.assertTrue(commands['get']['latency'] > 0)
+
+
+class TestShards(unittest.TestCase):
+    def sets(self, n, count):
+        s = connect('shards')
+        for i in range(count):
+            s.sendall('set shard_%d_%d 0 0 1\r\nx\r\n' % (n, i))
+            self.assertEqual(read_until(s, 1, ('STORED\r\n',)), 'STORED\r\n')
+        s.close()
+
+    def test_exact_counts(self):
+        # concurrent clients lose no update
+        threads = [threading.Thread(target=self.sets, args=(n, 50)) for n in range(8)]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+
+        st = stats('shards')
+        self.assertEqual(st['server1']['requests'] + st['server2']['requests'], 400)
+        self.assertEqual(st['server1']['responses'] + st['server2']['responses'], 400)
+        self.assertEqual(st['commands']['set']['requests'], 400)
+        self.assertEqual(len(server_requests(12139)) + len(server_requests(12140)), 400)
+        self.assertEqual(st['client_connections'], 0)
+
+
+class TestMetrics(unittest.TestCase):
+    def scrape(self):
+        s = socket.create_connection(('127.0.0.1', METRICS_PORT))
+        s.settimeout(5)
+        s.sendall('GET /metrics HTTP/1.1\r\nHost: localhost\r\n\r\n')
+        buf = ''
+        while True:
+            tmp = s.recv(65536)
+            if not tmp:
+                break
+            buf += tmp
+        s.close()
+        header, body = buf.split('\r\n\r\n', 1)
+        return header.split('\r\n'), body
+
+    def sample(self, body, name, labels):
+        for line in body.splitlines():
+            if line.startswith(name + '{') and all(l in line for l in labels):
+                return float(line.split()[-1])
+        raise Exception('no sample %s %s' % (name, labels))
+
+    def test_scrape(self):
+        s = connect('commands')
+        for i in range(5):
+            s.sendall('get metrics_%d\r\n' % i)
+            self.assertEqual(read_until(s, 1), 'END\r\n')
+        s.close()
+
+        # the exposition is rendered at most once an interval
+        time.sleep(STATS_INTERVAL / 1000.0 + 0.3)
+        header, body = self.scrape()
+        self.assertEqual(header[0], 'HTTP/1.1 200 OK')
+        self.assertTrue('Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8'
+                        in header)
+        self.assertTrue('Content-Length: %d' % len(body) in header)
+        self.assertTrue(body.endswith('# EOF\n'))
+        self.assertTrue(self.sample(body, 'nutcracker_command_requests_total',
+                                    ['pool="commands"', 'command="get"']) >= 5)
+        self.assertTrue(self.sample(body, 'nutcracker_server_latency_seconds_count',
+                                    ['pool="commands"', 'server="server1"']) >= 5)
+        self.assertEqual(self.sample(body, 'nutcracker_server_requests_total',
+                                     ['pool="commands"', 'server="server1"']),
+                         stats('commands')['server1']['requests'])
+
+    def test_slow_scraper(self):
+        # a scraper that does not read holds its connection, not the others
+        slow = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        # small segments keep the send buffer of nutcracker small as well
+        slow.setsockopt(socket.IPPROTO_TCP, socket.TCP_MAXSEG, 536)
+        slow.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 4096)
+        slow.connect(('127.0.0.1', METRICS_PORT))
+        slow.sendall('GET /metrics HTTP/1.1\r\nHost: localhost\r\n\r\n')
+        idle = socket.create_connection(('127.0.0.1', METRICS_PORT))
+        time.sleep(0.5)
+
+        start = time.time()
+        header, body = self.scrape()
+        self.assertTrue(body.endswith('# EOF\n'))
+        self.assertTrue('commands' in read_stats())
+        self.assertTrue(time.time() - start < 1)
+        # the response does not fit in the socket buffers
+        self.assertTrue(len(body) > 64 * 1024)
+
+        # the slow scraper still gets all of it, a little at a time
+        time.sleep(1)
+        slow.settimeout(5)
+        buf = ''
+        while True:
+            tmp = slow.recv(4096)
+            if not tmp:
+                break
+            buf += tmp
+            time.sleep(0.001)
+        slow.close()
+        header, slow_body = buf.split('\r\n\r\n', 1)
+        self.assertTrue('Content-Length: %d' % len(slow_body)
+                        in header.split('\r\n'))
+        self.assertTrue(slow_body.endswith('# EOF\n'))
+
+        # a scraper that never sends its request is dropped once idle
+        idle.settimeout(10)
+        self.assertEqual(idle.recv(1), '')
+        idle.close()
+
+
+class TestWarmup(unittest.TestCase):
+    def test_big_value(self):
+        # a hit served by the peer for a cold server is written back to it
+        val = ''.join(chr(i) for i in range(256)) * 400
+        peer = socket.create_connection(('127.0.0.1', 12142))
+        peer.sendall('set warm_big 7 0 %d\r\n%s\r\n' % (len(val), val))
+        self.assertEqual(read_until(peer, 1, ('STORED\r\n',)), 'STORED\r\n')
+        peer.close()
+        time.sleep(1)
+
+        s = connect('warm')
+        s.sendall('getex warm_big\r\n')
+        rsp = read_until(s, 1)
+        self.assertEqual(rsp, 'VALUE warm_big 7 %d 0 0\r\n%s\r\nEND\r\n' % (len(val), val))
+        s.close()
+        time.sleep(0.5)
+
+        cold = socket.create_connection(('127.0.0.1', 12141))
+        cold.sendall('get warm_big\r\n')
+        self.assertEqual(read_until(cold, 1), value('warm_big', val, 7) + 'END\r\n')
+        cold.close()
+        warmups = [r.split() for r in server_requests(12141) if r.split()[0] != 'stats']
+        self.assertEqual(warmups, [['getex', 'warm_big'],
+                                   ['add', 'warm_big', '7', '0', str(len(val)), 'noreply'],
+                                   ['get', 'warm_big']])
+
+
+class TestWarmupQueue(unittest.TestCase):
+    def rt(self, s, request, delim='\r\n'):
+        s.sendall(request)
+        return read_until(s, 1, (delim,))
+
+    def test_dedup_drop(self):
+        peer = socket.create_connection(('127.0.0.1', 12144))
+        for i in range(20):
+            self.assertEqual(self.rt(peer, 'set wq_%d 0 0 3\r\nv%02d\r\n' % (i, i)), 'STORED\r\n')
+        time.sleep(1)
+
+        # a second warmup of a key within 1 sec is deduped
+        s = connect('warm_queue')
+        for i in range(10):
+            self.assertEqual(self.rt(s, 'getex wq_0\r\n', 'END\r\n'),
+                             'VALUE wq_0 0 3 0 0\r\nv00\r\nEND\r\n')
+        time.sleep(1.2)
+        st = stats('warm_queue')['server1']
+        self.assertEqual((st['warmups'], st['warmup_deduped']), (1, 9))
+
+        # a burst past the 5 per sec rate waits in the queue of 3, the
+        # rest is dropped
+        s.sendall(''.join('getex wq_%d\r\n' % i for i in range(1, 20)))
+        self.assertEqual(read_until(s, 19).count('VALUE'), 19)
+        time.sleep(1.2)
+        st = stats('warm_queue')['server1']
+        self.assertEqual((st['warmups'], st['warmup_queue'], st['warmup_dropped']), (9, 0, 11))
+
+        writes = [r.split()[1] for r in server_requests(12143) if r.split()[0] in ('set', 'add')]
+        self.assertEqual(len(writes), 9)
+        self.assertEqual(writes[0], 'wq_0')
+        cold = socket.create_connection(('127.0.0.1', 12143))
+        for key in writes:
+            self.assertEqual(self.rt(cold, 'get %s\r\n' % key, 'END\r\n'),
+                             value(key, 'v' + key[3:].zfill(2)) + 'END\r\n')
+        cold.close()
+        s.close()
+        peer.close()
+
+    def test_no_overwrite(self):
+        # a queued warmup never overwrites a value written after it was
+        # queued
+        time.sleep(1.2)
+        peer = socket.create_connection(('127.0.0.1', 12144))
+        for i in range(6):
+            self.assertEqual(self.rt(peer, 'set wq_old_%d 0 0 3\r\nold\r\n' % i), 'STORED\r\n')
+        s = connect('warm_queue')
+        for i in range(6):
+            self.assertTrue('old' in self.rt(s, 'getex wq_old_%d\r\n' % i, 'END\r\n'))
+        cold = socket.create_connection(('127.0.0.1', 12143))
+        self.assertEqual(self.rt(cold, 'set wq_old_5 0 0 3\r\nnew\r\n'), 'STORED\r\n')
+        time.sleep(1.2)
+        self.assertEqual(stats('warm_queue')['server1']['warmup_queue'], 0)
+        self.assertEqual(self.rt(cold, 'get wq_old_5\r\n', 'END\r\n'),
+                         value('wq_old_5', 'new') + 'END\r\n')
+        self.assertTrue('add wq_old_5 0 0 3 noreply' in server_requests(12143))
+        cold.close()
+        s.close()
+        peer.close()
+
+
+class TestBulkWarmup(unittest.TestCase):
+    def rt(self, s, request, delim='\r\n'):
+        s.sendall(request)
+        return read_until(s, 1, (delim,))
+
+    def test_bulk(self):
+        server = socket.create_connection(('127.0.0.1', 12145))
+        peer = socket.create_connection(('127.0.0.1', 12146))
+        vals = ['%03d' % i * 30 for i in range(20)]
+        for i, val in enumerate(vals):
+            for c in (server, peer):
+                self.assertEqual(self.rt(c, 'set bulk_%d %d 0 %d\r\n%s\r\n' % (i, i, len(val), val)),
+                                 'STORED\r\n')
+
+        # read hits are logged, misses are not
+        s = connect('warm_bulk')
+        for i in range(25):
+            rsp = self.rt(s, 'get bulk_%d\r\n' % i, 'END\r\n')
+            self.assertEqual(rsp != 'END\r\n', i < 20)
+        s.close()
+
+        # the server turns cold: the logged keys are fetched from the peer
+        # and written back, paced by warmup_bandwidth
+        self.assertEqual(self.rt(server, 'cold 1\r\n'), 'OK\r\n')
+        time.sleep(1)
+        self.assertTrue(stats('warm_bulk')['server1']['warmups'] < 20)
+        time.sleep(4)
+
+        # keys colliding in the key log evict each other, a few may be gone
+        st = stats('warm_bulk')['server1']
+        self.assertTrue(18 <= st['warmups'] <= 20)
+        self.assertEqual(st['warmup_fetches'], st['warmups'])
+        self.assertTrue(st['warmup_bytes'] > st['warmups'] * 90)
+        fetches = [r for r in server_requests(12146) if r.startswith('getex')]
+        self.assertEqual(len(fetches), st['warmup_fetches'])
+        warmed = 0
+        for i, val in enumerate(vals):
+            rsp = self.rt(server, 'get bulk_%d\r\n' % i, 'END\r\n')
+            if rsp != 'END\r\n':
+                self.assertEqual(rsp, value('bulk_%d' % i, val, i) + 'END\r\n')
+                warmed += 1
+        self.assertEqual(warmed, st['warmups'])
+        self.assertEqual(self.rt(server, 'get bulk_22\r\n', 'END\r\n'), 'END\r\n')
+        server.close()
+        peer.close()
+
+
+class TestRedisWarmup(unittest.TestCase):
+    def test_cold_read_through(self):
+        cold, peer = redis_server(12147), redis_server(12148)
+        val = ''.join(chr(i) for i in range(256)) * 400
+        self.assertTrue(peer.set('rw_1', 'v1', px=60000))
+        self.assertTrue(peer.set('rw_2', 'v2'))
+        self.assertTrue(peer.set('rw_3', val))
+        time.sleep(0.5)
+        self.assertEqual(stats('redis_warm')['server1']['cold'], 1)
+
+        # reads of the cold server go to the peer and warm it with the ttl
+        proxy = redis_pool('redis_warm')
+        self.assertEqual(proxy.get('rw_1'), 'v1')
+        self.assertEqual(proxy.get('rw_2'), 'v2')
+        self.assertEqual(proxy.get('rw_3'), val)
+        self.assertEqual(proxy.get('rw_none'), None)
+        time.sleep(0.3)
+        self.assertTrue(50000 < cold.pttl('rw_1') <= 60000)
+        self.assertEqual(cold.pttl('rw_2'), -1)
+        self.assertEqual(cold.get('rw_3'), val)
+        self.assertEqual(cold.pttl('rw_none'), -2)
+        self.assertEqual(stats('redis_warm')['server1']['warmups'], 3)
+        log = server_requests(12148)
+        self.assertEqual([r for r in log if r.startswith('PTTL')],
+                         ['PTTL rw_1', 'PTTL rw_2', 'PTTL rw_3'])
+        writes = [r.split() for r in server_requests(12147) if r.startswith('SET')]
+        self.assertEqual([w[1] for w in writes], ['rw_1', 'rw_2', 'rw_3'])
+        self.assertEqual((writes[0][3], writes[0][5:], writes[1][3:]), ('PX', ['NX'], ['NX']))
+
+        # a repeat read within the dedup window does not warm again
+        self.assertEqual(proxy.get('rw_1'), 'v1')
+        self.assertEqual(stats('redis_warm')['server1']['warmups'], 3)
+
+        # a loading server is read through the peer but not written
+        self.assertTrue(peer.set('rw_4', 'v4'))
+        cold.execute_command('setloading', 1)
+        time.sleep(0.5)
+        self.assertEqual(proxy.get('rw_4'), 'v4')
+        time.sleep(0.3)
+        self.assertEqual(stats('redis_warm')['server1']['warmups'], 3)
+        self.assertFalse('rw_4' in ' '.join(server_requests(12147)))
+        cold.execute_command('setloading', 0)
+        time.sleep(0.5)
+
+    def test_no_overwrite(self):
+        # a warmup never overwrites a value written to the cold server
+        cold, peer = redis_server(12147), redis_server(12148)
+        self.assertTrue(peer.set('rw_nx', 'old'))
+        self.assertTrue(cold.set('rw_nx', 'new'))
+        self.assertEqual(redis_pool('redis_warm').get('rw_nx'), 'old')
+        time.sleep(0.3)
+        self.assertEqual(cold.get('rw_nx'), 'new')
+        self.assertTrue('SET rw_nx old NX' in server_requests(12147))
+
+
+class TestReplicas(unittest.TestCase):
+    def reads(self, proxy, n=40):
+        return set(proxy.get('rep_key') for i in range(n))
+
+    def test_stale(self):
+        master, r1, r2 = redis_server(12149), redis_server(12150), redis_server(12151)
+        for server, val in ((master, 'master'), (r1, 'replica1'), (r2, 'replica2')):
+            self.assertTrue(server.set('rep_key', val))
+        r1.execute_command('setrole', 'slave')
+        r2.execute_command('setrole', 'slave')
+        time.sleep(0.5)
+        st = stats('replicas')
+        self.assertEqual((st['master']['master'], st['master']['repl_lag']), (1, -1))
+        self.assertEqual((st['replica1']['master'], st['replica1']['master_link_up'],
+                          st['replica1']['repl_lag'], st['replica1']['stale']), (0, 1, 0, 0))
+        proxy = redis_pool('replicas')
+        self.assertEqual(self.reads(proxy), set(['replica1', 'replica2']))
+
+        # a replica lagging past replica_max_lag is skipped by reads
+        r1.execute_command('setlag', 30)
+        time.sleep(0.5)
+        st = stats('replicas')
+        self.assertEqual((st['replica1']['stale'], st['replica1']['repl_lag']), (1, 30))
+        self.assertEqual(self.reads(proxy), set(['replica2']))
+
+        # so is a replica with its link down, or loading
+        r1.execute_command('setlag', 1)
+        r2.execute_command('setlink', 'down')
+        time.sleep(0.5)
+        self.assertEqual(stats('replicas')['replica2']['stale'], 1)
+        self.assertEqual(self.reads(proxy), set(['replica1']))
+        r2.execute_command('setlink', 'up')
+        r1.execute_command('setloading', 1)
+        time.sleep(0.5)
+        self.assertEqual(self.reads(proxy), set(['replica2']))
+
+        # with every replica stale, reads still go to them
+        r1.execute_command('setloading', 0)
+        r1.execute_command('setlag', 30)
+        r2.execute_command('setlag', 30)
+        time.sleep(0.5)
+        self.assertEqual(self.reads(proxy), set(['replica1', 'replica2']))
+
+        # writes go to the master
+        self.assertTrue(proxy.set('rep_write', 'x'))
+        self.assertEqual(master.get('rep_write'), 'x')
+
+    def test_failover(self):
+        master = redis_server(12172)
+        local, remote = redis_server(12173), redis_server(12174)
+        for server, val in ((master, 'master'), (local, 'replica'),
+                            (remote, 'remote_replica')):
+            self.assertTrue(server.set('rep_key', val))
+        local.execute_command('setrole', 'slave')
+        remote.execute_command('setrole', 'slave')
+        time.sleep(0.5)
+        proxy = redis_pool('replicas_failover')
+        self.assertEqual(self.reads(proxy), set(['replica']))
+
+        # a stale local replica, even the only one, gives way to the
+        # replicas of the failover tags
+        local.execute_command('setlag', 30)
+        time.sleep(0.5)
+        self.assertEqual(stats('replicas_failover')['replica']['stale'], 1)
+        self.assertEqual(self.reads(proxy), set(['remote_replica']))
+
+        # with those stale too, reads go back to the local one
+        remote.execute_command('setlag', 30)
+        time.sleep(0.5)
+        self.assertEqual(self.reads(proxy), set(['replica']))
+
+        local.execute_command('setlag', 0)
+        time.sleep(0.5)
+        self.assertEqual(self.reads(proxy), set(['replica']))
+
+
+class TestNotify(unittest.TestCase):
+    QUEUE = 'queue notify->notify regular todo'
+
+    def test_batched(self):
+        # deletes are answered at once, their notifications batched
+        s = connect('notify')
+        s.sendall(''.join('delete nt_%d\r\n' % i for i in range(40)))
+        self.assertEqual(read_until(s, 40, ('NOT_FOUND\r\n',)), 'NOT_FOUND\r\n' * 40)
+        st = stats('notify')
+        mq = redis_server(12153)
+        self.assertEqual(mq.llen(self.QUEUE), 40)
+        self.assertEqual((st['notify_sent'], st['notify_dropped'], st['notify_queued']), (40, 0, 0))
+        pushes = [r for r in server_requests(12153) if r.startswith('LPUSH')]
+        self.assertEqual(len(pushes), st['notify_batches'])
+        self.assertTrue(len(pushes) < 10)
+        self.assertTrue(' notify delete nt_7' in ' '.join(mq.lrange(self.QUEUE, 0, -1)))
+
+        # a burst past notify_buffer drops the excess, and counts it
+        s.sendall(''.join('delete nt_burst_%d\r\n' % i for i in range(300)))
+        self.assertEqual(read_until(s, 300, ('NOT_FOUND\r\n',)), 'NOT_FOUND\r\n' * 300)
+        st = stats('notify')
+        self.assertTrue(st['notify_dropped'] > 0)
+        self.assertEqual(st['notify_sent'] + st['notify_dropped'], 340)
+        self.assertEqual(mq.llen(self.QUEUE), st['notify_sent'])
+        s.close()
+
+
+class TestJournal(unittest.TestCase):
+    QUEUE = 'queue journal->journal regular todo'
+
+    def tearDown(self):
+        if hasattr(self, 'queue'):
+            self.queue.kill()
+            self.queue.wait()
+
+    def test_spill_replay(self):
+        # message queue down: deletes still succeed, notifications spill
+        s = connect('journal')
+        for i in range(5):
+            s.sendall('delete journal_%d\r\n' % i)
+            self.assertEqual(read_until(s, 1, ('NOT_FOUND\r\n',)), 'NOT_FOUND\r\n')
+        st = stats('journal')
+        self.assertEqual(st['notify_spilled'], 5)
+        self.assertTrue(st['notify_journal'] > 0)
+
+        # the queue comes back: the journal is replayed in order, then drained
+        self.queue = manage.start_mock_redis(QUEUE_SERVER, ['--log', server_log(QUEUE_SERVER)])
+        time.sleep(1.5)
+        st = stats('journal')
+        self.assertEqual(st['notify_replayed'], 5)
+        self.assertEqual(st['notify_journal'], 0)
+        pushed = redis_server(QUEUE_SERVER).lrange(self.QUEUE, 0, -1)
+        self.assertEqual([v.split()[-1] for v in reversed(pushed)],
+                         ['journal_%d' % i for i in range(5)])
+        s.close()
+
+    def test_strict_error_spills(self):
+        # a strict LPUSH failed with an error reply spills to the journal
+        mq = redis_server(12171)
+        mq.execute_command('setoom', 1)
+        s = connect('journal_strict')
+        for i in range(3):
+            s.sendall('delete strict_%d\r\n' % i)
+            self.assertEqual(read_until(s, 1, ('NOT_FOUND\r\n',)), 'NOT_FOUND\r\n')
+        st = stats('journal_strict')
+        self.assertEqual((st['notify_spilled'], st['notify_dropped']), (3, 0))
+        self.assertEqual(mq.llen('queue strict->strict regular todo'), 0)
+
+        mq.execute_command('setoom', 0)
+        time.sleep(1.5)
+        st = stats('journal_strict')
+        self.assertEqual((st['notify_replayed'], st['notify_journal']), (3, 0))
+        self.assertEqual(mq.llen('queue strict->strict regular todo'), 3)
+        s.close()
+
+
+class TestRateLimit(unittest.TestCase):
+    def gets(self, name, n):
+        s = connect(name)
+        s.sendall('get rl_key\r\n' * n)
+        rsp = read_until(s, n)
+        s.close()
+        return rsp
+
+    def test_reject(self):
+        rsp = self.gets('ratelimit_reject', 12)
+        self.assertEqual((rsp.count('END\r\n'), rsp.count(TOO_MANY)), (5, 7))
+        self.assertEqual(server_requests(12156).count('get rl_key'), 5)
+        time.sleep(0.6)
+        self.assertEqual(self.gets('ratelimit_reject', 5), 'END\r\n' * 5)
+
+    def test_delay(self):
+        s = connect('ratelimit_delay')
+        start = time.time()
+        s.sendall(''.join('set rl_d%d 0 0 1\r\n%d\r\nget rl_d%d\r\n' % (i, i, i) for i in range(6)))
+        rsp = read_until(s, 6)
+        self.assertTrue(time.time() - start > 0.4)
+        self.assertEqual(rsp, ''.join('STORED\r\n' + value('rl_d%d' % i, str(i)) + 'END\r\n'
+                                      for i in range(6)))
+        s.close()
+        st = stats('ratelimit_delay')
+        self.assertTrue(st['ratelimit_delayed'] >= 10)
+        self.assertEqual(st['ratelimit_queue'], 0)
+
+    def test_shed(self):
+        # reads stop at a quarter of the burst left, writes may drain it
+        s = connect('ratelimit_shed')
+        s.sendall('get rl_key\r\n' * 7)
+        self.assertEqual(read_until(s, 7), 'END\r\n' * 6 + TOO_MANY)
+        s.sendall('set rl_shed 0 0 1\r\nx\r\n' * 3)
+        self.assertEqual(read_until(s, 3, ('STORED\r\n', TOO_MANY)), 'STORED\r\n' * 2 + TOO_MANY)
+        s.close()
+
+    def test_collapsed_gets(self):
+        # a get joining a flight costs a token like any forwarded get
+        clients = [connect('collapse_ratelimit') for i in range(5)]
+        for c in clients:
+            c.sendall('get rl_col\r\n')
+        rsp = ''.join(read_until(c, 1) for c in clients)
+        self.assertEqual((rsp.count('END\r\n'), rsp.count(TOO_MANY)), (1, 4))
+        self.assertEqual(stats('collapse_ratelimit')['collapsed'], 0)
+        self.assertEqual(server_requests(12166).count('get rl_col'), 1)
+        for c in clients:
+            c.close()
+
+
+class TestBackpressure(unittest.TestCase):
+    def test_pause_resume(self):
+        s = connect('backpressure_pause')
+        s.sendall(''.join('get bp_%d\r\n' % i for i in range(8)))
+        time.sleep(0.05)
+        s.sendall(''.join('get bp_%d\r\n' % i for i in range(8, 16)))
+        st = stats('backpressure_pause')
+        self.assertTrue(st['inflight_paused'] >= 1)
+        self.assertTrue(st['inflight'] > 0)
+
+        # resumed once the server catches up, nothing is lost
+        self.assertEqual(read_until(s, 16), 'END\r\n' * 16)
+        st = stats('backpressure_pause')
+        self.assertEqual((st['inflight'], st['inflight_bytes']), (0, 0))
+        self.assertEqual(len(server_requests(12159)), 16)
+        s.close()
+
+    def test_reject(self):
+        s = connect('backpressure_reject')
+        s.sendall(''.join('get bp_%d\r\n' % i for i in range(4)))
+        self.assertEqual(read_until(s, 4), 'END\r\n' * 3 + UNAVAILABLE)
+        s.sendall('get bp_0\r\n')
+        self.assertEqual(read_until(s, 1), 'END\r\n')
+        st = stats('backpressure_reject')
+        self.assertEqual((st['inflight_denied'], st['inflight']), (1, 0))
+        self.assertFalse('get bp_3' in server_requests(12160))
+        s.close()
+
+
+class TestOutlier(unittest.TestCase):
+    def gets(self, offset, n):
+        s = connect('outlier')
+        for i in range(n):
+            s.sendall('get ol_%d\r\n' % (offset + i))
+            self.assertEqual(read_until(s, 1), 'END\r\n')
+        s.close()
+
+    def test_eject(self):
+        threads = [threading.Thread(target=self.gets, args=(j * 1000, 40)) for j in range(8)]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+
+        st = stats('outlier')
+        self.assertEqual(st['outlier_ejects'], 1)
+        self.assertEqual(st['slow']['outlier_ejects'], 1)
+        self.assertEqual(st['fast1']['outlier_ejects'] + st['fast2']['outlier_ejects'], 0)
+
+        # the slow server gets nothing while it is out, late responses
+        # do not let it back in
+        requests = len(server_requests(12163))
+        self.gets(10000, 100)
+        self.assertEqual(len(server_requests(12163)), requests)
+
+    def test_redis_errors(self):
+        # redis error replies count as failures too
+        redis_server(12169).execute_command('setloading', 1)
+        s = socket.create_connection(('127.0.0.1', pool_port('outlier_errors')))
+        s.settimeout(5)
+
+        def gets(n):
+            errors = 0
+            for i in range(n):
+                s.sendall('*2\r\n$3\r\nget\r\n$6\r\nol_err\r\n')
+                rsp = read_until(s, 1, ('\r\n',))
+                self.assertTrue(rsp[0] in '$-')
+                errors += rsp[0] == '-'
+                time.sleep(0.005)
+            return errors
+
+        self.assertTrue(gets(200) > 0)
+        st = stats('outlier_errors')
+        self.assertEqual(st['failing']['outlier_ejects'], 1)
+        self.assertEqual(st['good1']['outlier_ejects'] + st['good2']['outlier_ejects'], 0)
+
+        # no more errors while it is out
+        self.assertEqual(gets(100), 0)
+        s.close()
+
+
+if __name__ == '__main__':
+    suite = unittest.TestSuite([
+        unittest.TestLoader().loadTestsFromTestCase(TestMeta),
+        unittest.TestLoader().loadTestsFromTestCase(TestBinary),
+        unittest.TestLoader().loadTestsFromTestCase(TestDeadline),
+        unittest.TestLoader().loadTestsFromTestCase(TestNearCache),
+        unittest.TestLoader().loadTestsFromTestCase(TestCollapse),
+        unittest.TestLoader().loadTestsFromTestCase(TestHotKeys),
+        unittest.TestLoader().loadTestsFromTestCase(TestLatency),
+        unittest.TestLoader().loadTestsFromTestCase(TestCommands),
+        unittest.TestLoader().loadTestsFromTestCase(TestShards),
+        unittest.TestLoader().loadTestsFromTestCase(TestMetrics),
+        unittest.TestLoader().loadTestsFromTestCase(TestWarmup),
+        unittest.TestLoader().loadTestsFromTestCase(TestWarmupQueue),
+        unittest.TestLoader().loadTestsFromTestCase(TestBulkWarmup),
+        unittest.TestLoader().loadTestsFromTestCase(TestRedisWarmup),
+        unittest.TestLoader().loadTestsFromTestCase(TestReplicas),
+        unittest.TestLoader().loadTestsFromTestCase(TestNotify),
+        unittest.TestLoader().loadTestsFromTestCase(TestJournal),
+        unittest.TestLoader().loadTestsFromTestCase(TestRateLimit),
+        unittest.TestLoader().loadTestsFromTestCase(TestBackpressure),
+        unittest.TestLoader().loadTestsFromTestCase(TestOutlier),
+    ])
+
+    unittest.TextTestRunner(verbosity=2).run(suite)